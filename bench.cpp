@@ -0,0 +1,294 @@
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QVulkanInstance>
+#include <QElapsedTimer>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QFile>
+#include <QDebug>
+#include "headlessdevice.h"
+#include "rt.h"
+#include "qvkrt_revision.h" // generated at build time, see revision.cmake
+#include <algorithm>
+#include <climits>
+
+// Renders parametric scenes (a sphere of N triangles, instanced in a grid)
+// at a given resolution and bounce count, headless, and reports GPU times
+// from Raytracing's timestamps as JSON. Runs on anything HeadlessDevice can
+// use, including software implementations. Every configuration is run with
+// each trace backend, the ray tracing pipeline and ray queries from compute.
+
+struct BenchConfig
+{
+    int triangles;
+    int grid;
+    QSize size;
+    int bounces;
+    int samplesPerFrame;
+    int views;
+    int frames;
+    Raytracing::TraceBackend backend;
+};
+
+static const qint64 RUN_TIMEOUT_MS = 120000;
+
+static QJsonObject runBenchmark(QVulkanInstance *inst, HeadlessDevice *hd, const BenchConfig &config)
+{
+    QJsonObject result;
+    result[QLatin1String("triangles")] = config.triangles;
+    result[QLatin1String("grid")] = config.grid;
+    result[QLatin1String("width")] = config.size.width();
+    result[QLatin1String("height")] = config.size.height();
+    result[QLatin1String("bounces")] = config.bounces;
+    result[QLatin1String("samplesPerFrame")] = config.samplesPerFrame;
+    result[QLatin1String("views")] = config.views;
+    result[QLatin1String("backend")] = config.backend == Raytracing::RayQuery ? QLatin1String("rayQuery") : QLatin1String("pipeline");
+
+    Raytracing raytracing;
+    raytracing.init(hd->physDev, hd->dev, hd->f, hd->df, hd->hostCommandsEnabled);
+    if (config.backend == Raytracing::RayQuery && !raytracing.hasRayQuery()) {
+        qWarning("No ray query support on this device, skipping");
+        raytracing.releaseResources(hd->dev, hd->df);
+        result[QLatin1String("ok")] = true;
+        result[QLatin1String("skipped")] = true;
+        return result;
+    }
+    raytracing.setTraceBackend(config.backend);
+    raytracing.setSamplesPerFrame(config.samplesPerFrame);
+    raytracing.setMaxSamples(INT_MAX); // keep tracing
+    raytracing.setMaxBounces(config.bounces);
+    // all around the scene, traced by one dispatch
+    raytracing.setViewCount(config.views);
+    for (int i = 0; i < config.views; ++i)
+        raytracing.setCameraOrbit(i, i * 360.0f / config.views, 0.0f);
+    if (!raytracing.hasGpuTimings()) {
+        qWarning("No timestamp support on this device");
+        raytracing.releaseResources(hd->dev, hd->df);
+        result[QLatin1String("ok")] = false;
+        return result;
+    }
+
+    Scene scene = Scene::sphere(config.triangles);
+    const uint32_t meshTriangles = uint32_t(scene.meshes[0].indices.size() / 3);
+    scene.replicate(config.grid);
+    const int instanceCount = int(scene.instances().size());
+    result[QLatin1String("meshTriangles")] = int(meshTriangles);
+    result[QLatin1String("instances")] = instanceCount;
+    raytracing.setScene(scene);
+
+    const HeadlessDevice::Image output = hd->createOutputImage(raytracing.memoryAllocator(), config.size, uint32_t(config.views), 0);
+    VkImageLayout outputLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    // The first frames build everything, then there may be host builds,
+    // pipeline compilation and BLAS compaction going on. Once all that is
+    // over the next frames are measured. Timings arrive a few frames later.
+    QElapsedTimer timer;
+    timer.start();
+    double setupTime = 0;
+    double blasTime = -1;
+    double tlasTime = -1;
+    quint64 lastTimingsFrame = 0;
+    quint64 measureFrom = 0;
+    std::vector<double> traceTimes;
+    bool ok = true;
+    for (quint64 frame = 1; int(traceTimes.size()) < config.frames; ++frame) {
+        const uint slot = uint(frame % HeadlessDevice::SLOT_COUNT);
+        VkCommandBuffer cb = hd->beginCommands(slot);
+        outputLayout = raytracing.doIt(inst, hd->physDev, hd->dev, hd->df, hd->f,
+                                       cb, output.image, outputLayout, output.view,
+                                       slot, config.size);
+        hd->submit(slot);
+
+        if (!measureFrom && raytracing.lastFrameTraced() && !raytracing.hasPendingWork()) {
+            measureFrom = frame + 1;
+            setupTime = timer.nsecsElapsed() / 1000000.0;
+        }
+
+        const Raytracing::GpuTimings &timings(raytracing.gpuTimings());
+        if (timings.frame != lastTimingsFrame) {
+            lastTimingsFrame = timings.frame;
+            // the first builds, not the TLAS rebuild after compaction
+            if (blasTime < 0 && (timings.stages & RaytracingContext::BlasStage))
+                blasTime = timings.blas;
+            if (tlasTime < 0 && (timings.stages & RaytracingContext::TlasStage))
+                tlasTime = timings.tlas;
+            if (measureFrom && timings.frame >= measureFrom && timings.traced)
+                traceTimes.push_back(timings.trace);
+        }
+
+        if (timer.elapsed() > RUN_TIMEOUT_MS) {
+            qWarning("Benchmark run timed out");
+            ok = false;
+            break;
+        }
+    }
+    hd->waitIdle();
+
+    hd->destroyImage(raytracing.memoryAllocator(), output);
+    const Raytracing::CompactionStats compaction = raytracing.compactionStats();
+    const double hostBuildTime = raytracing.lastHostBuildTime();
+    raytracing.releaseResources(hd->dev, hd->df);
+
+    result[QLatin1String("ok")] = ok;
+    result[QLatin1String("setupMs")] = setupTime;
+    result[QLatin1String("blasBuildMs")] = qMax(0.0, blasTime);
+    result[QLatin1String("tlasBuildMs")] = qMax(0.0, tlasTime);
+    result[QLatin1String("hostBlasBuildMs")] = hostBuildTime;
+    result[QLatin1String("blasBytes")] = double(compaction.bytesBefore);
+    result[QLatin1String("compactedBlasBytes")] = double(compaction.bytesAfter);
+    result[QLatin1String("compactionRatio")] = compaction.bytesBefore ? double(compaction.bytesAfter) / compaction.bytesBefore : 1.0;
+
+    if (!traceTimes.empty()) {
+        std::sort(traceTimes.begin(), traceTimes.end());
+        double sum = 0;
+        for (double t : traceTimes)
+            sum += t;
+        const double avg = sum / traceTimes.size();
+        QJsonObject trace;
+        trace[QLatin1String("frames")] = int(traceTimes.size());
+        trace[QLatin1String("minMs")] = traceTimes.front();
+        trace[QLatin1String("medianMs")] = traceTimes[traceTimes.size() / 2];
+        trace[QLatin1String("avgMs")] = avg;
+        trace[QLatin1String("maxMs")] = traceTimes.back();
+        result[QLatin1String("trace")] = trace;
+        // camera rays, each path continues with up to maxBounces more
+        const double rays = double(config.size.width()) * config.size.height() * config.samplesPerFrame * config.views;
+        result[QLatin1String("mraysPerSecond")] = avg > 0 ? rays / (avg / 1000.0) / 1000000.0 : 0.0;
+    }
+
+    qDebug() << "run" << QJsonDocument(result).toJson(QJsonDocument::Compact).constData();
+    return result;
+}
+
+static QList<int> intList(const QString &s)
+{
+    QList<int> result;
+    for (const QString &v : s.split(QLatin1Char(','), Qt::SkipEmptyParts))
+        result.append(qMax(1, v.toInt()));
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    QGuiApplication app(argc, argv);
+
+    QCommandLineParser cmdLineParser;
+    cmdLineParser.addHelpOption();
+    QCommandLineOption trianglesOption(QLatin1String("triangles"), QLatin1String("Comma separated triangle counts of the sphere."),
+                                       QLatin1String("list"), QLatin1String("1000,100000,1000000"));
+    cmdLineParser.addOption(trianglesOption);
+    QCommandLineOption gridOption(QLatin1String("grid"), QLatin1String("Comma separated instance grid sizes (N x N instances)."),
+                                  QLatin1String("list"), QLatin1String("1,8"));
+    cmdLineParser.addOption(gridOption);
+    QCommandLineOption sizeOption(QLatin1String("size"), QLatin1String("Comma separated resolutions."),
+                                  QLatin1String("list"), QLatin1String("1280x720,1920x1080"));
+    cmdLineParser.addOption(sizeOption);
+    QCommandLineOption bouncesOption(QLatin1String("bounces"), QLatin1String("Comma separated maximum bounce counts."),
+                                     QLatin1String("list"), QLatin1String("1,4"));
+    cmdLineParser.addOption(bouncesOption);
+    QCommandLineOption sppOption(QLatin1String("spp"), QLatin1String("Samples per pixel per frame."), QLatin1String("N"), QLatin1String("1"));
+    cmdLineParser.addOption(sppOption);
+    QCommandLineOption viewsOption(QLatin1String("views"), QLatin1String("Views traced together per frame, see Raytracing::setViewCount()."),
+                                   QLatin1String("N"), QLatin1String("1"));
+    cmdLineParser.addOption(viewsOption);
+    QCommandLineOption framesOption(QLatin1String("frames"), QLatin1String("Number of frames to measure per run."), QLatin1String("N"), QLatin1String("32"));
+    cmdLineParser.addOption(framesOption);
+    QCommandLineOption backendsOption(QLatin1String("backends"), QLatin1String("Comma separated trace backends, pipeline and/or rayquery."),
+                                      QLatin1String("list"), QLatin1String("pipeline,rayquery"));
+    cmdLineParser.addOption(backendsOption);
+    QCommandLineOption outputOption(QStringList() << QLatin1String("o") << QLatin1String("output"),
+                                    QLatin1String("Write the JSON report to file instead of stdout."), QLatin1String("file"));
+    cmdLineParser.addOption(outputOption);
+    cmdLineParser.process(app);
+
+    QList<QSize> sizes;
+    for (const QString &s : cmdLineParser.value(sizeOption).split(QLatin1Char(','), Qt::SkipEmptyParts)) {
+        const QStringList wh = s.split(QLatin1Char('x'));
+        const QSize size = wh.count() == 2 ? QSize(wh[0].toInt(), wh[1].toInt()) : QSize();
+        if (size.isEmpty()) {
+            qWarning("Invalid size %s", qPrintable(s));
+            return 1;
+        }
+        sizes.append(size);
+    }
+
+    QList<Raytracing::TraceBackend> backends;
+    for (const QString &s : cmdLineParser.value(backendsOption).split(QLatin1Char(','), Qt::SkipEmptyParts)) {
+        if (s == QLatin1String("pipeline")) {
+            backends.append(Raytracing::RayTracingPipeline);
+        } else if (s == QLatin1String("rayquery")) {
+            backends.append(Raytracing::RayQuery);
+        } else {
+            qWarning("Invalid backend %s", qPrintable(s));
+            return 1;
+        }
+    }
+
+    QVulkanInstance inst;
+    inst.setApiVersion({ 1, 2 });
+    if (!inst.create()) {
+        qWarning("Failed to create Vulkan instance");
+        return 1;
+    }
+
+    HeadlessDevice hd;
+    if (!hd.create(&inst))
+        return 1;
+
+    QJsonObject device;
+    device[QLatin1String("name")] = QString::fromUtf8(hd.physDevProps.deviceName);
+    device[QLatin1String("vendorID")] = int(hd.physDevProps.vendorID);
+    device[QLatin1String("deviceID")] = int(hd.physDevProps.deviceID);
+    device[QLatin1String("driverVersion")] = QString::number(hd.physDevProps.driverVersion, 16);
+    device[QLatin1String("apiVersion")] = QString::fromLatin1("%1.%2.%3").arg(VK_VERSION_MAJOR(hd.physDevProps.apiVersion))
+            .arg(VK_VERSION_MINOR(hd.physDevProps.apiVersion)).arg(VK_VERSION_PATCH(hd.physDevProps.apiVersion));
+
+    QJsonObject report;
+    report[QLatin1String("revision")] = QLatin1String(QVKRT_REVISION);
+    report[QLatin1String("date")] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+    report[QLatin1String("device")] = device;
+
+    BenchConfig config;
+    config.samplesPerFrame = qMax(1, cmdLineParser.value(sppOption).toInt());
+    config.views = qBound(1, cmdLineParser.value(viewsOption).toInt(), Raytracing::MAX_VIEWS);
+    config.frames = qMax(1, cmdLineParser.value(framesOption).toInt());
+    QJsonArray runs;
+    bool ok = true;
+    for (int triangles : intList(cmdLineParser.value(trianglesOption))) {
+        for (int grid : intList(cmdLineParser.value(gridOption))) {
+            for (const QSize &size : sizes) {
+                for (int bounces : intList(cmdLineParser.value(bouncesOption))) {
+                    for (Raytracing::TraceBackend backend : backends) {
+                        config.triangles = triangles;
+                        config.grid = grid;
+                        config.size = size;
+                        config.bounces = bounces;
+                        config.backend = backend;
+                        const QJsonObject run = runBenchmark(&inst, &hd, config);
+                        ok &= run[QLatin1String("ok")].toBool();
+                        runs.append(run);
+                    }
+                }
+            }
+        }
+    }
+    report[QLatin1String("runs")] = runs;
+
+    hd.destroy();
+
+    const QByteArray json = QJsonDocument(report).toJson();
+    if (cmdLineParser.isSet(outputOption)) {
+        QFile f(cmdLineParser.value(outputOption));
+        if (!f.open(QIODevice::WriteOnly)) {
+            qWarning("Failed to open %s for writing", qPrintable(f.fileName()));
+            return 1;
+        }
+        f.write(json);
+    } else {
+        fputs(json.constData(), stdout);
+    }
+
+    return ok ? 0 : 1;
+}
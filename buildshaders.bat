@@ -1,3 +1,7 @@
 glslangValidator --target-env vulkan1.2 -V raygen.rgen -o raygen.rgen.spv
 glslangValidator --target-env vulkan1.2 -V miss.rmiss -o miss.rmiss.spv
 glslangValidator --target-env vulkan1.2 -V closesthit.rchit -o closesthit.rchit.spv
+glslangValidator --target-env vulkan1.2 -V rayquery.comp -o rayquery.comp.spv
+glslangValidator --target-env vulkan1.2 -V deform.comp -o deform.comp.spv
+glslangValidator --target-env vulkan1.2 -V denoise_temporal.comp -o denoise_temporal.comp.spv
+glslangValidator --target-env vulkan1.2 -V denoise_atrous.comp -o denoise_atrous.comp.spv
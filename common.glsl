@@ -0,0 +1,90 @@
+// Shared by the ray tracing shaders, these enable GL_EXT_buffer_reference.
+// Must match Raytracing::FrameParams and RaytracingContext::GeometryDesc.
+
+const float PI = 3.14159265;
+const vec3 ALBEDO = vec3(0.75);
+
+// in the format of GeometryDesc::format, read as words to need no 16-bit
+// storage support, see vertexPosition()
+layout(buffer_reference, std430) readonly buffer Vertices {
+    uint v[];
+};
+
+layout(buffer_reference, std430) readonly buffer Indices {
+    uint i[];
+};
+
+// Mesh::VertexFormat | Mesh::IndexFormat
+const uint VERTEX_FLOAT32 = 0u; // xyz
+const uint VERTEX_SNORM16 = 1u; // xyzw
+const uint VERTEX_FLOAT16 = 2u; // xyzw
+const uint VERTEX_FORMAT_MASK = 3u;
+const uint INDEX_UINT16 = 4u;
+
+// one for each geometry of each mesh, the instance custom index is the
+// first entry for the mesh, gl_GeometryIndexEXT selects within that
+struct GeometryDesc {
+    vec4 scale; // xyz, dequantizes the stored positions: p * scale + offset
+    vec4 offset;
+    Vertices vertices;
+    Indices indices;
+    uint firstIndex;
+    uint firstVertex;
+    uint format;
+};
+
+layout(buffer_reference, std430) readonly buffer GeometryTable {
+    GeometryDesc g[];
+};
+
+// the position (object space) of the vertex of the index'th index
+vec3 vertexPosition(GeometryDesc g, uint index)
+{
+    uint i;
+    if ((g.format & INDEX_UINT16) != 0u)
+        i = (g.indices.i[index >> 1] >> ((index & 1u) * 16u)) & 0xFFFFu;
+    else
+        i = g.indices.i[index];
+    i += g.firstVertex;
+
+    vec3 p;
+    const uint vertexFormat = g.format & VERTEX_FORMAT_MASK;
+    if (vertexFormat == VERTEX_SNORM16)
+        p = vec3(unpackSnorm2x16(g.vertices.v[i * 2]), unpackSnorm2x16(g.vertices.v[i * 2 + 1]).x);
+    else if (vertexFormat == VERTEX_FLOAT16)
+        p = vec3(unpackHalf2x16(g.vertices.v[i * 2]), unpackHalf2x16(g.vertices.v[i * 2 + 1]).x);
+    else
+        p = uintBitsToFloat(uvec3(g.vertices.v[i * 3], g.vertices.v[i * 3 + 1], g.vertices.v[i * 3 + 2]));
+    return p * g.scale.xyz + g.offset.xyz;
+}
+
+// one per view, see Raytracing::setViewCount()
+const uint MAX_VIEWS = 16u;
+
+struct Camera {
+    mat4 viewInverse;
+    mat4 prevViewProj; // of the previous traced frame, for the denoiser's motion vectors
+    vec4 prevOrigin; // xyz, the camera position in that frame
+};
+
+layout(binding = 2) uniform FrameParams {
+    mat4 projInverse; // the same for all views
+    Camera cameras[MAX_VIEWS]; // indexed by the layer of the images
+    GeometryTable geometries;
+    uint sampleIndex; // samples accumulated before this frame
+    uint samplesPerFrame;
+    uint maxBounces;
+    uint frameSeed;
+    float rayEpsilon;
+    uint denoise; // write the G-buffer for the denoiser, which writes the output image then
+    uint gbufferIndex;
+    uint interleave; // see pixelFor() in raygen.rgen
+    uint splitPart;
+    uint rowOffset;
+    uint launchHeight; // rows in this frame's part, see rayquery.comp
+} params;
+
+struct HitInfo {
+    vec3 normal; // world space
+    float t; // < 0 when nothing was hit
+};
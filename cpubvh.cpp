@@ -0,0 +1,162 @@
+#include "cpubvh.h"
+#include <algorithm>
+#include <numeric>
+
+void CpuBvh::Bounds::grow(const QVector3D &p)
+{
+    min = QVector3D(qMin(min.x(), p.x()), qMin(min.y(), p.y()), qMin(min.z(), p.z()));
+    max = QVector3D(qMax(max.x(), p.x()), qMax(max.y(), p.y()), qMax(max.z(), p.z()));
+}
+
+void CpuBvh::Bounds::grow(const Bounds &b)
+{
+    grow(b.min);
+    grow(b.max);
+}
+
+float CpuBvh::Bounds::area() const
+{
+    const QVector3D e = max - min;
+    if (e.x() < 0.0f)
+        return 0.0f;
+    return 2.0f * (e.x() * e.y() + e.y() * e.z() + e.z() * e.x());
+}
+
+// relative to intersecting one primitive
+static const float TRAVERSAL_COST = 1.0f;
+
+void CpuBvh::build(const std::vector<Bounds> &primBounds, int maxLeafSize)
+{
+    const uint32_t primCount = uint32_t(primBounds.size());
+    m_nodes.clear();
+    m_primIndices.resize(primCount);
+    std::iota(m_primIndices.begin(), m_primIndices.end(), 0u);
+
+    // a binary tree with one primitive per leaf has 2n - 1 nodes, so the
+    // references below stay valid
+    m_nodes.reserve(qMax(1u, 2 * primCount));
+    m_nodes.push_back({});
+    if (!primCount) {
+        // never entered
+        Node &root(m_nodes[0]);
+        root.bmin[0] = root.bmin[1] = root.bmin[2] = 1.0e30f;
+        root.bmax[0] = root.bmax[1] = root.bmax[2] = -1.0e30f;
+        return;
+    }
+
+    std::vector<QVector3D> centers(primCount);
+    for (uint32_t i = 0; i < primCount; ++i)
+        centers[i] = primBounds[i].center();
+
+    struct Task {
+        uint32_t node;
+        uint32_t first;
+        uint32_t count;
+        int depth;
+    };
+    std::vector<Task> tasks;
+    tasks.push_back({ 0, 0, primCount, 1 });
+    while (!tasks.empty()) {
+        const Task task = tasks.back();
+        tasks.pop_back();
+        uint32_t *prims = m_primIndices.data() + task.first;
+
+        Bounds bounds, centerBounds;
+        for (uint32_t i = 0; i < task.count; ++i) {
+            bounds.grow(primBounds[prims[i]]);
+            centerBounds.grow(centers[prims[i]]);
+        }
+
+        Node &node(m_nodes[task.node]);
+        for (int c = 0; c < 3; ++c) {
+            node.bmin[c] = bounds.min[c];
+            node.bmax[c] = bounds.max[c];
+        }
+        node.first = task.first;
+        node.count = task.count;
+        node.axis = 0;
+        if (task.count <= 1 || task.depth >= MAX_DEPTH)
+            continue;
+
+        // the cheapest split between bins, evaluated on all three axes
+        const float leafCost = float(task.count);
+        float bestCost = 1.0e30f;
+        int bestAxis = -1;
+        int bestBin = 0;
+        for (int axis = 0; axis < 3; ++axis) {
+            const float lo = centerBounds.min[axis];
+            const float extent = centerBounds.max[axis] - lo;
+            if (extent <= 0.0f)
+                continue;
+            const float scale = BIN_COUNT / extent;
+
+            Bounds binBounds[BIN_COUNT];
+            uint32_t binCount[BIN_COUNT] = {};
+            for (uint32_t i = 0; i < task.count; ++i) {
+                const int bin = qMin(BIN_COUNT - 1, int((centers[prims[i]][axis] - lo) * scale));
+                binBounds[bin].grow(primBounds[prims[i]]);
+                binCount[bin] += 1;
+            }
+
+            // left[i]: bins 0..i, right[i]: bins i+1..
+            float leftArea[BIN_COUNT - 1], rightArea[BIN_COUNT - 1];
+            uint32_t leftCount[BIN_COUNT - 1], rightCount[BIN_COUNT - 1];
+            Bounds left, right;
+            uint32_t l = 0, r = 0;
+            for (int i = 0; i < BIN_COUNT - 1; ++i) {
+                left.grow(binBounds[i]);
+                l += binCount[i];
+                leftArea[i] = left.area();
+                leftCount[i] = l;
+                right.grow(binBounds[BIN_COUNT - 1 - i]);
+                r += binCount[BIN_COUNT - 1 - i];
+                rightArea[BIN_COUNT - 2 - i] = right.area();
+                rightCount[BIN_COUNT - 2 - i] = r;
+            }
+
+            const float invArea = 1.0f / qMax(bounds.area(), 1.0e-30f);
+            for (int i = 0; i < BIN_COUNT - 1; ++i) {
+                if (!leftCount[i] || !rightCount[i])
+                    continue;
+                const float cost = TRAVERSAL_COST + (leftArea[i] * leftCount[i] + rightArea[i] * rightCount[i]) * invArea;
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = i;
+                }
+            }
+        }
+
+        if (task.count <= uint32_t(maxLeafSize) && bestCost >= leafCost)
+            continue;
+
+        uint32_t leftCount;
+        if (bestAxis >= 0) {
+            const float lo = centerBounds.min[bestAxis];
+            const float scale = BIN_COUNT / (centerBounds.max[bestAxis] - lo);
+            uint32_t *mid = std::partition(prims, prims + task.count, [&](uint32_t p) {
+                return qMin(BIN_COUNT - 1, int((centers[p][bestAxis] - lo) * scale)) <= bestBin;
+            });
+            leftCount = uint32_t(mid - prims);
+        } else {
+            // all centers in one point, split by count
+            leftCount = 0;
+        }
+        if (!leftCount || leftCount == task.count) {
+            bestAxis = qMax(0, bestAxis);
+            leftCount = task.count / 2;
+            std::nth_element(prims, prims + leftCount, prims + task.count, [&](uint32_t a, uint32_t b) {
+                return centers[a][bestAxis] < centers[b][bestAxis];
+            });
+        }
+
+        const uint32_t child = uint32_t(m_nodes.size());
+        node.first = child;
+        node.count = 0;
+        node.axis = uint32_t(bestAxis);
+        m_nodes.push_back({});
+        m_nodes.push_back({});
+        tasks.push_back({ child, task.first, leftCount, task.depth + 1 });
+        tasks.push_back({ child + 1, task.first + leftCount, task.count - leftCount, task.depth + 1 });
+    }
+}
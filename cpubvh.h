@@ -0,0 +1,131 @@
+#ifndef CPUBVH_H
+#define CPUBVH_H
+
+#include <QVector3D>
+#include <vector>
+#include <cstdint>
+#include "cpusimd.h"
+
+// Bounding volume hierarchy for the CPU tracer, built top down with the
+// surface area heuristic evaluated at BIN_COUNT bins per axis. The same
+// builder makes the per mesh BVHs over triangles and the top level one over
+// instances, like the BLASes and the TLAS on the GPU. Nodes are 32 bytes,
+// the two children of a node are next to each other.
+class CpuBvh
+{
+public:
+    struct Bounds {
+        QVector3D min = QVector3D(1.0e30f, 1.0e30f, 1.0e30f);
+        QVector3D max = QVector3D(-1.0e30f, -1.0e30f, -1.0e30f);
+
+        void grow(const QVector3D &p);
+        void grow(const Bounds &b);
+        QVector3D center() const { return (min + max) * 0.5f; }
+        float area() const;
+    };
+
+    struct Node {
+        float bmin[3];
+        uint32_t first; // left child (the right one is first + 1), or first primitive for leaves
+        float bmax[3];
+        uint32_t count : 30; // primitives in the leaf, 0 for inner nodes
+        uint32_t axis : 2; // split axis, decides which child is visited first
+    };
+
+    static const int BIN_COUNT = 16;
+    static const int MAX_DEPTH = 64; // the traversal stack
+
+    // primBounds[i] are the bounds of primitive i; leaves get at most
+    // maxLeafSize primitives unless splitting does not pay off
+    void build(const std::vector<Bounds> &primBounds, int maxLeafSize);
+
+    const std::vector<Node> &nodes() const { return m_nodes; }
+    // the primitives in the order the leaves reference them
+    const std::vector<uint32_t> &primIndices() const { return m_primIndices; }
+    bool isEmpty() const { return m_primIndices.empty(); }
+
+private:
+    std::vector<Node> m_nodes;
+    std::vector<uint32_t> m_primIndices;
+};
+
+// A packet of FloatPacket::WIDTH rays traversing a BVH together. Lanes that
+// are not active (finished paths, pixels outside the image) are masked off.
+template <class F>
+struct RayPacket
+{
+    F ox, oy, oz;
+    F dx, dy, dz;
+    F idx, idy, idz; // 1 / direction
+    F tMin;
+    F t; // the closest hit so far, or the maximum
+    F active; // mask
+    uint32_t instance[F::WIDTH];
+    uint32_t primitive[F::WIDTH];
+
+    void updateInverseDirection()
+    {
+        idx = F(1.0f) / dx;
+        idy = F(1.0f) / dy;
+        idz = F(1.0f) / dz;
+    }
+};
+
+// the lanes whose ray enters the node before its closest hit so far
+template <class F>
+inline F intersectBox(const CpuBvh::Node &node, const RayPacket<F> &r)
+{
+    const F tx0 = (F(node.bmin[0]) - r.ox) * r.idx;
+    const F tx1 = (F(node.bmax[0]) - r.ox) * r.idx;
+    const F ty0 = (F(node.bmin[1]) - r.oy) * r.idy;
+    const F ty1 = (F(node.bmax[1]) - r.oy) * r.idy;
+    const F tz0 = (F(node.bmin[2]) - r.oz) * r.idz;
+    const F tz1 = (F(node.bmax[2]) - r.oz) * r.idz;
+    const F tNear = vmax(vmax(vmin(tx0, tx1), vmin(ty0, ty1)), vmax(vmin(tz0, tz1), r.tMin));
+    const F tFar = vmin(vmin(vmax(tx0, tx1), vmax(ty0, ty1)), vmin(vmax(tz0, tz1), r.t));
+    return r.active & (tNear <= tFar);
+}
+
+// Visits the nodes any active ray of the packet enters, calling
+// leaf(first, count) for the leaves, which narrows r.t down on hits.
+// Children are visited near to far by the direction of the first active
+// ray, the packets are coherent enough for that to be right for most.
+template <class F, class LeafFunc>
+inline void traverse(const CpuBvh &bvh, RayPacket<F> &r, LeafFunc leaf)
+{
+    if (bvh.isEmpty())
+        return;
+
+    float dir[3][F::WIDTH];
+    r.dx.store(dir[0]);
+    r.dy.store(dir[1]);
+    r.dz.store(dir[2]);
+    const int activeLanes = laneMask(r.active);
+    int lane = 0;
+    while (lane < F::WIDTH - 1 && !(activeLanes & (1 << lane)))
+        ++lane;
+
+    const CpuBvh::Node *nodes = bvh.nodes().data();
+    uint32_t stack[CpuBvh::MAX_DEPTH * 2];
+    int sp = 0;
+    stack[sp++] = 0;
+    while (sp) {
+        const CpuBvh::Node &node(nodes[stack[--sp]]);
+        if (!laneMask(intersectBox(node, r)))
+            continue;
+        if (node.count) {
+            leaf(node.first, uint32_t(node.count));
+            continue;
+        }
+        // the far child goes first, so it is popped last
+        if (dir[node.axis][lane] >= 0.0f) {
+            stack[sp++] = node.first + 1;
+            stack[sp++] = node.first;
+        } else {
+            stack[sp++] = node.first;
+            stack[sp++] = node.first + 1;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef CPUSIMD_H
+#define CPUSIMD_H
+
+#include <cstdint>
+#include <cstring>
+
+// The few float vector operations the CPU tracer's packet traversal needs,
+// for 8 lanes with AVX2, 4 with SSE and 1 elsewhere. Masks are vectors with
+// all bits set in the lanes that are true, as the compare instructions
+// produce them. Which one is used (FloatPacket) is decided at compile time,
+// configuring with -DQVKRT_AVX2=ON (-mavx2, /arch:AVX2) gives 8 wide packets.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+struct Float8
+{
+    static const int WIDTH = 8;
+    __m256 v;
+
+    Float8() = default;
+    Float8(__m256 x) : v(x) { }
+    explicit Float8(float f) : v(_mm256_set1_ps(f)) { }
+
+    static Float8 load(const float *p) { return _mm256_loadu_ps(p); }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+};
+
+inline Float8 operator+(Float8 a, Float8 b) { return _mm256_add_ps(a.v, b.v); }
+inline Float8 operator-(Float8 a, Float8 b) { return _mm256_sub_ps(a.v, b.v); }
+inline Float8 operator*(Float8 a, Float8 b) { return _mm256_mul_ps(a.v, b.v); }
+inline Float8 operator/(Float8 a, Float8 b) { return _mm256_div_ps(a.v, b.v); }
+inline Float8 operator<(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline Float8 operator<=(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline Float8 operator>(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline Float8 operator>=(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline Float8 operator&(Float8 a, Float8 b) { return _mm256_and_ps(a.v, b.v); }
+inline Float8 operator|(Float8 a, Float8 b) { return _mm256_or_ps(a.v, b.v); }
+inline Float8 andNot(Float8 mask, Float8 a) { return _mm256_andnot_ps(mask.v, a.v); } // a & ~mask
+inline Float8 vmin(Float8 a, Float8 b) { return _mm256_min_ps(a.v, b.v); }
+inline Float8 vmax(Float8 a, Float8 b) { return _mm256_max_ps(a.v, b.v); }
+inline Float8 vabs(Float8 a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+inline Float8 select(Float8 mask, Float8 a, Float8 b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+inline int laneMask(Float8 mask) { return _mm256_movemask_ps(mask.v); }
+inline Float8 trueMask() { return _mm256_castsi256_ps(_mm256_set1_epi32(-1)); }
+
+typedef Float8 FloatPacket;
+
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+
+struct Float4
+{
+    static const int WIDTH = 4;
+    __m128 v;
+
+    Float4() = default;
+    Float4(__m128 x) : v(x) { }
+    explicit Float4(float f) : v(_mm_set1_ps(f)) { }
+
+    static Float4 load(const float *p) { return _mm_loadu_ps(p); }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+};
+
+inline Float4 operator+(Float4 a, Float4 b) { return _mm_add_ps(a.v, b.v); }
+inline Float4 operator-(Float4 a, Float4 b) { return _mm_sub_ps(a.v, b.v); }
+inline Float4 operator*(Float4 a, Float4 b) { return _mm_mul_ps(a.v, b.v); }
+inline Float4 operator/(Float4 a, Float4 b) { return _mm_div_ps(a.v, b.v); }
+inline Float4 operator<(Float4 a, Float4 b) { return _mm_cmplt_ps(a.v, b.v); }
+inline Float4 operator<=(Float4 a, Float4 b) { return _mm_cmple_ps(a.v, b.v); }
+inline Float4 operator>(Float4 a, Float4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline Float4 operator>=(Float4 a, Float4 b) { return _mm_cmpge_ps(a.v, b.v); }
+inline Float4 operator&(Float4 a, Float4 b) { return _mm_and_ps(a.v, b.v); }
+inline Float4 operator|(Float4 a, Float4 b) { return _mm_or_ps(a.v, b.v); }
+inline Float4 andNot(Float4 mask, Float4 a) { return _mm_andnot_ps(mask.v, a.v); } // a & ~mask
+inline Float4 vmin(Float4 a, Float4 b) { return _mm_min_ps(a.v, b.v); }
+inline Float4 vmax(Float4 a, Float4 b) { return _mm_max_ps(a.v, b.v); }
+inline Float4 vabs(Float4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+// SSE2 has no blendv
+inline Float4 select(Float4 mask, Float4 a, Float4 b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+inline int laneMask(Float4 mask) { return _mm_movemask_ps(mask.v); }
+inline Float4 trueMask() { return _mm_castsi128_ps(_mm_set1_epi32(-1)); }
+
+typedef Float4 FloatPacket;
+
+#else
+
+struct Float1
+{
+    static const int WIDTH = 1;
+    float v;
+
+    Float1() = default;
+    explicit Float1(float f) : v(f) { }
+
+    static Float1 load(const float *p) { return Float1(*p); }
+    void store(float *p) const { *p = v; }
+
+    static Float1 fromBool(bool b) { Float1 r; const uint32_t bits = b ? ~0u : 0u; memcpy(&r.v, &bits, 4); return r; }
+    uint32_t bits() const { uint32_t b; memcpy(&b, &v, 4); return b; }
+    static Float1 fromBits(uint32_t b) { Float1 r; memcpy(&r.v, &b, 4); return r; }
+};
+
+inline Float1 operator+(Float1 a, Float1 b) { return Float1(a.v + b.v); }
+inline Float1 operator-(Float1 a, Float1 b) { return Float1(a.v - b.v); }
+inline Float1 operator*(Float1 a, Float1 b) { return Float1(a.v * b.v); }
+inline Float1 operator/(Float1 a, Float1 b) { return Float1(a.v / b.v); }
+inline Float1 operator<(Float1 a, Float1 b) { return Float1::fromBool(a.v < b.v); }
+inline Float1 operator<=(Float1 a, Float1 b) { return Float1::fromBool(a.v <= b.v); }
+inline Float1 operator>(Float1 a, Float1 b) { return Float1::fromBool(a.v > b.v); }
+inline Float1 operator>=(Float1 a, Float1 b) { return Float1::fromBool(a.v >= b.v); }
+inline Float1 operator&(Float1 a, Float1 b) { return Float1::fromBits(a.bits() & b.bits()); }
+inline Float1 operator|(Float1 a, Float1 b) { return Float1::fromBits(a.bits() | b.bits()); }
+inline Float1 andNot(Float1 mask, Float1 a) { return Float1::fromBits(a.bits() & ~mask.bits()); }
+inline Float1 vmin(Float1 a, Float1 b) { return Float1(b.v < a.v ? b.v : a.v); }
+inline Float1 vmax(Float1 a, Float1 b) { return Float1(b.v > a.v ? b.v : a.v); }
+inline Float1 vabs(Float1 a) { return Float1(a.v < 0.0f ? -a.v : a.v); }
+inline Float1 select(Float1 mask, Float1 a, Float1 b) { return mask.bits() ? a : b; }
+inline int laneMask(Float1 mask) { return mask.bits() ? 1 : 0; }
+inline Float1 trueMask() { return Float1::fromBool(true); }
+
+typedef Float1 FloatPacket;
+
+#endif
+
+#endif
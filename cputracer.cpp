@@ -0,0 +1,389 @@
+#include "cputracer.h"
+#include <QThreadPool>
+#include <QSemaphore>
+#include <QMutex>
+#include <QVector4D>
+#include <QtMath>
+#include <deque>
+
+// must match common.glsl and raygen.rgen
+static const float ALBEDO = 0.75f;
+static const float T_MAX = 1.0e30f;
+
+// the pixels one packet covers
+static const int PACKET_WIDTH = FloatPacket::WIDTH >= 8 ? 4 : (FloatPacket::WIDTH >= 4 ? 2 : 1);
+static const int PACKET_HEIGHT = FloatPacket::WIDTH / PACKET_WIDTH;
+
+// PCG, see https://www.pcg-random.org
+static inline uint32_t pcg(uint32_t &state)
+{
+    state = state * 747796405u + 2891336453u;
+    const uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+static inline float rnd(uint32_t &state)
+{
+    return float(pcg(state)) / 4294967296.0f;
+}
+
+static QVector3D cosineSampleHemisphere(const QVector3D &n, uint32_t &seed)
+{
+    const float r1 = 2.0f * float(M_PI) * rnd(seed);
+    const float r2 = rnd(seed);
+    const float r2s = qSqrt(r2);
+    const QVector3D w = n;
+    const QVector3D u = QVector3D::crossProduct(qAbs(w.x()) > 0.1f ? QVector3D(0.0f, 1.0f, 0.0f) : QVector3D(1.0f, 0.0f, 0.0f), w).normalized();
+    const QVector3D v = QVector3D::crossProduct(w, u);
+    return (u * qCos(r1) * r2s + v * qSin(r1) * r2s + w * qSqrt(1.0f - r2)).normalized();
+}
+
+static QVector3D sky(const QVector3D &dir)
+{
+    const float t = 0.5f * (dir.y() + 1.0f);
+    return QVector3D(0.1f, 0.1f, 0.2f) * (1.0f - t) + QVector3D(0.9f, 0.95f, 1.0f) * t;
+}
+
+void CpuTracer::setScene(const Scene &scene)
+{
+    m_meshes.clear();
+    m_meshes.resize(scene.meshes.size());
+    for (size_t meshIndex = 0; meshIndex < scene.meshes.size(); ++meshIndex) {
+        const Mesh &mesh(scene.meshes[meshIndex]);
+        const uint32_t vertexCount = mesh.vertexCount();
+        std::vector<Triangle> triangles;
+        std::vector<CpuBvh::Bounds> bounds;
+        for (const Mesh::Geometry &g : mesh.geometries) {
+            for (uint32_t i = 0; i + 2 < g.indexCount; i += 3) {
+                QVector3D p[3];
+                bool valid = true;
+                for (int j = 0; j < 3; ++j) {
+                    const uint32_t v = mesh.indices[g.firstIndex + i + j] + g.firstVertex;
+                    valid = valid && v < vertexCount;
+                    if (valid)
+                        p[j] = QVector3D(mesh.positions[v * 3], mesh.positions[v * 3 + 1], mesh.positions[v * 3 + 2]);
+                }
+                if (!valid)
+                    continue;
+                const QVector3D e1 = p[1] - p[0];
+                const QVector3D e2 = p[2] - p[0];
+                const QVector3D n = QVector3D::crossProduct(e1, e2).normalized();
+                Triangle tri;
+                for (int c = 0; c < 3; ++c) {
+                    tri.v0[c] = p[0][c];
+                    tri.e1[c] = e1[c];
+                    tri.e2[c] = e2[c];
+                    tri.n[c] = n[c];
+                }
+                triangles.push_back(tri);
+                CpuBvh::Bounds b;
+                for (int j = 0; j < 3; ++j)
+                    b.grow(p[j]);
+                bounds.push_back(b);
+            }
+        }
+
+        MeshData &data(m_meshes[meshIndex]);
+        data.bvh.build(bounds, 4);
+        // in leaf order, so that a leaf is a range of triangles
+        data.triangles.resize(triangles.size());
+        for (size_t i = 0; i < triangles.size(); ++i)
+            data.triangles[i] = triangles[data.bvh.primIndices()[i]];
+    }
+    m_instances.clear();
+    m_topLevel.build({}, 1);
+}
+
+void CpuTracer::setInstances(const std::vector<Scene::Instance> &instances)
+{
+    m_instances.clear();
+    std::vector<CpuBvh::Bounds> bounds;
+    for (const Scene::Instance &instance : instances) {
+        if (instance.mesh < 0 || instance.mesh >= int(m_meshes.size()))
+            continue;
+        Instance inst;
+        inst.mesh = instance.mesh;
+        const QMatrix4x4 worldToObject = instance.transform.inverted();
+        for (int row = 0; row < 3; ++row) {
+            for (int col = 0; col < 4; ++col)
+                inst.worldToObject[row * 4 + col] = worldToObject(row, col);
+        }
+        const QMatrix3x3 normalMatrix = instance.transform.normalMatrix();
+        for (int row = 0; row < 3; ++row) {
+            for (int col = 0; col < 3; ++col)
+                inst.normalMatrix[row * 3 + col] = normalMatrix(row, col);
+        }
+        m_instances.push_back(inst);
+
+        // the mesh's bounds in world space
+        CpuBvh::Bounds b;
+        const MeshData &mesh(m_meshes[inst.mesh]);
+        if (!mesh.bvh.isEmpty()) {
+            const CpuBvh::Node &root(mesh.bvh.nodes()[0]);
+            for (int corner = 0; corner < 8; ++corner) {
+                const QVector3D p((corner & 1) ? root.bmax[0] : root.bmin[0],
+                                  (corner & 2) ? root.bmax[1] : root.bmin[1],
+                                  (corner & 4) ? root.bmax[2] : root.bmin[2]);
+                b.grow(instance.transform.map(p));
+            }
+        }
+        bounds.push_back(b);
+    }
+    m_topLevel.build(bounds, 1);
+}
+
+// Moeller-Trumbore, one triangle against the whole packet at a time
+template <class F>
+void CpuTracer::intersectTriangles(const Triangle *triangles, uint32_t first, uint32_t count, uint32_t instance, RayPacket<F> &r)
+{
+    for (uint32_t i = first; i < first + count; ++i) {
+        const Triangle &tri(triangles[i]);
+        const F e1x(tri.e1[0]), e1y(tri.e1[1]), e1z(tri.e1[2]);
+        const F e2x(tri.e2[0]), e2y(tri.e2[1]), e2z(tri.e2[2]);
+        const F px = r.dy * e2z - r.dz * e2y;
+        const F py = r.dz * e2x - r.dx * e2z;
+        const F pz = r.dx * e2y - r.dy * e2x;
+        const F det = e1x * px + e1y * py + e1z * pz;
+        const F invDet = F(1.0f) / det;
+        const F tx = r.ox - F(tri.v0[0]);
+        const F ty = r.oy - F(tri.v0[1]);
+        const F tz = r.oz - F(tri.v0[2]);
+        const F u = (tx * px + ty * py + tz * pz) * invDet;
+        const F qx = ty * e1z - tz * e1y;
+        const F qy = tz * e1x - tx * e1z;
+        const F qz = tx * e1y - ty * e1x;
+        const F v = (r.dx * qx + r.dy * qy + r.dz * qz) * invDet;
+        const F t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+        const F hit = r.active & (vabs(det) > F(1.0e-20f)) & (u >= F(0.0f)) & (v >= F(0.0f))
+                & (u + v <= F(1.0f)) & (t > r.tMin) & (t < r.t);
+        const int lanes = laneMask(hit);
+        if (!lanes)
+            continue;
+        r.t = select(hit, t, r.t);
+        for (int lane = 0; lane < F::WIDTH; ++lane) {
+            if (lanes & (1 << lane)) {
+                r.instance[lane] = instance;
+                r.primitive[lane] = i;
+            }
+        }
+    }
+}
+
+template <class F>
+void CpuTracer::intersect(RayPacket<F> &r) const
+{
+    const std::vector<uint32_t> &instanceIndices(m_topLevel.primIndices());
+    traverse(m_topLevel, r, [this, &r, &instanceIndices](uint32_t first, uint32_t count) {
+        for (uint32_t i = first; i < first + count; ++i) {
+            const uint32_t instanceIndex = instanceIndices[i];
+            const Instance &inst(m_instances[instanceIndex]);
+            const MeshData &mesh(m_meshes[inst.mesh]);
+
+            // into object space; the direction is not normalized so t
+            // stays the same
+            const float *m = inst.worldToObject;
+            RayPacket<F> o = r;
+            o.ox = F(m[0]) * r.ox + F(m[1]) * r.oy + F(m[2]) * r.oz + F(m[3]);
+            o.oy = F(m[4]) * r.ox + F(m[5]) * r.oy + F(m[6]) * r.oz + F(m[7]);
+            o.oz = F(m[8]) * r.ox + F(m[9]) * r.oy + F(m[10]) * r.oz + F(m[11]);
+            o.dx = F(m[0]) * r.dx + F(m[1]) * r.dy + F(m[2]) * r.dz;
+            o.dy = F(m[4]) * r.dx + F(m[5]) * r.dy + F(m[6]) * r.dz;
+            o.dz = F(m[8]) * r.dx + F(m[9]) * r.dy + F(m[10]) * r.dz;
+            o.updateInverseDirection();
+
+            const Triangle *triangles = mesh.triangles.data();
+            traverse(mesh.bvh, o, [triangles, instanceIndex, &o](uint32_t firstTriangle, uint32_t triangleCount) {
+                intersectTriangles(triangles, firstTriangle, triangleCount, instanceIndex, o);
+            });
+
+            r.t = o.t;
+            memcpy(r.instance, o.instance, sizeof(r.instance));
+            memcpy(r.primitive, o.primitive, sizeof(r.primitive));
+        }
+    });
+}
+
+QVector3D CpuTracer::hitNormal(uint32_t instance, uint32_t primitive) const
+{
+    const Instance &inst(m_instances[instance]);
+    const Triangle &tri(m_meshes[inst.mesh].triangles[primitive]);
+    const float *m = inst.normalMatrix;
+    return QVector3D(m[0] * tri.n[0] + m[1] * tri.n[1] + m[2] * tri.n[2],
+                     m[3] * tri.n[0] + m[4] * tri.n[1] + m[5] * tri.n[2],
+                     m[6] * tri.n[0] + m[7] * tri.n[1] + m[8] * tri.n[2]).normalized();
+}
+
+void CpuTracer::renderTile(int tile, const Params &params, const QSize &size, float *accum, uchar *rgba)
+{
+    typedef FloatPacket F;
+    const int w = size.width();
+    const int h = size.height();
+    const int tilesX = (w + TILE_SIZE - 1) / TILE_SIZE;
+    const int tileX = (tile % tilesX) * TILE_SIZE;
+    const int tileY = (tile / tilesX) * TILE_SIZE;
+    const QVector3D cameraOrigin = (params.viewInverse * QVector4D(0.0f, 0.0f, 0.0f, 1.0f)).toVector3D();
+
+    for (int packetY = tileY; packetY < qMin(tileY + TILE_SIZE, h); packetY += PACKET_HEIGHT) {
+        for (int packetX = tileX; packetX < qMin(tileX + TILE_SIZE, w); packetX += PACKET_WIDTH) {
+            int x[F::WIDTH], y[F::WIDTH];
+            bool inside[F::WIDTH];
+            uint32_t seed[F::WIDTH];
+            QVector3D color[F::WIDTH];
+            for (int lane = 0; lane < F::WIDTH; ++lane) {
+                x[lane] = packetX + lane % PACKET_WIDTH;
+                y[lane] = packetY + lane / PACKET_WIDTH;
+                inside[lane] = x[lane] < w && y[lane] < h;
+                seed[lane] = (uint32_t(y[lane]) * uint32_t(w) + uint32_t(x[lane])) * 1973u + params.frameSeed * 9277u;
+            }
+
+            for (uint32_t s = 0; s < params.samplesPerFrame; ++s) {
+                QVector3D origin[F::WIDTH], direction[F::WIDTH], throughput[F::WIDTH];
+                bool alive[F::WIDTH];
+                for (int lane = 0; lane < F::WIDTH; ++lane) {
+                    alive[lane] = inside[lane];
+                    origin[lane] = cameraOrigin;
+                    direction[lane] = QVector3D(0.0f, 0.0f, -1.0f);
+                    throughput[lane] = QVector3D(1.0f, 1.0f, 1.0f);
+                    if (!alive[lane])
+                        continue;
+                    // jitter within the pixel
+                    const float jx = rnd(seed[lane]);
+                    const float jy = rnd(seed[lane]);
+                    const float dx = (x[lane] + jx) / w * 2.0f - 1.0f;
+                    const float dy = (y[lane] + jy) / h * 2.0f - 1.0f;
+                    const QVector4D target = params.projInverse * QVector4D(dx, dy, 1.0f, 1.0f);
+                    direction[lane] = (params.viewInverse * QVector4D(target.toVector3D().normalized(), 0.0f)).toVector3D();
+                }
+
+                for (uint32_t bounce = 0; bounce <= params.maxBounces; ++bounce) {
+                    float ox[F::WIDTH], oy[F::WIDTH], oz[F::WIDTH];
+                    float dx[F::WIDTH], dy[F::WIDTH], dz[F::WIDTH];
+                    float active[F::WIDTH];
+                    bool anyAlive = false;
+                    for (int lane = 0; lane < F::WIDTH; ++lane) {
+                        ox[lane] = origin[lane].x();
+                        oy[lane] = origin[lane].y();
+                        oz[lane] = origin[lane].z();
+                        dx[lane] = direction[lane].x();
+                        dy[lane] = direction[lane].y();
+                        dz[lane] = direction[lane].z();
+                        active[lane] = alive[lane] ? 1.0f : 0.0f;
+                        anyAlive = anyAlive || alive[lane];
+                    }
+                    if (!anyAlive)
+                        break;
+
+                    RayPacket<F> r;
+                    r.ox = F::load(ox);
+                    r.oy = F::load(oy);
+                    r.oz = F::load(oz);
+                    r.dx = F::load(dx);
+                    r.dy = F::load(dy);
+                    r.dz = F::load(dz);
+                    r.updateInverseDirection();
+                    r.tMin = F(params.rayEpsilon);
+                    r.t = F(T_MAX);
+                    r.active = F::load(active) > F(0.0f);
+                    intersect(r);
+
+                    float t[F::WIDTH];
+                    r.t.store(t);
+                    for (int lane = 0; lane < F::WIDTH; ++lane) {
+                        if (!alive[lane])
+                            continue;
+                        if (t[lane] >= T_MAX) {
+                            color[lane] += throughput[lane] * sky(direction[lane]);
+                            alive[lane] = false;
+                            continue;
+                        }
+                        // diffuse grey surfaces, lit only by the sky
+                        QVector3D n = hitNormal(r.instance[lane], r.primitive[lane]);
+                        if (QVector3D::dotProduct(n, direction[lane]) >= 0.0f)
+                            n = -n;
+                        throughput[lane] *= ALBEDO;
+                        origin[lane] += direction[lane] * t[lane] + n * params.rayEpsilon;
+                        direction[lane] = cosineSampleHemisphere(n, seed[lane]);
+                    }
+                }
+            }
+
+            for (int lane = 0; lane < F::WIDTH; ++lane) {
+                if (!inside[lane])
+                    continue;
+                const size_t pixel = size_t(y[lane]) * w + x[lane];
+                float *sum = accum + pixel * 4;
+                if (params.sampleIndex == 0)
+                    sum[0] = sum[1] = sum[2] = sum[3] = 0.0f;
+                for (int c = 0; c < 3; ++c)
+                    sum[c] += color[lane][c];
+                sum[3] += float(params.samplesPerFrame);
+
+                uchar *out = rgba + pixel * 4;
+                for (int c = 0; c < 3; ++c)
+                    out[c] = uchar(qBound(0.0f, qPow(sum[c] / sum[3], 1.0f / 2.2f), 1.0f) * 255.0f + 0.5f);
+                out[3] = 255;
+            }
+        }
+    }
+}
+
+int CpuTracer::threadCount()
+{
+    // the pool's threads include one for the caller, which works along
+    return qMax(1, QThreadPool::globalInstance()->maxThreadCount());
+}
+
+void CpuTracer::render(const Params &params, const QSize &size, float *accum, uchar *rgba)
+{
+    if (size.isEmpty())
+        return;
+
+    const int tilesX = (size.width() + TILE_SIZE - 1) / TILE_SIZE;
+    const int tilesY = (size.height() + TILE_SIZE - 1) / TILE_SIZE;
+    const int tileCount = tilesX * tilesY;
+    const int workerCount = qMin(threadCount(), tileCount);
+
+    // dealt out round robin so that every queue starts with tiles from all
+    // over the image; a worker takes from the front of its own queue and
+    // steals from the back of the others'
+    struct TileQueue {
+        QMutex lock;
+        std::deque<int> tiles;
+    };
+    std::vector<TileQueue> queues(workerCount);
+    for (int i = 0; i < tileCount; ++i)
+        queues[i % workerCount].tiles.push_back(i);
+
+    auto nextTile = [&queues, workerCount](int self, int *tile) {
+        for (int i = 0; i < workerCount; ++i) {
+            TileQueue &q(queues[(self + i) % workerCount]);
+            QMutexLocker locker(&q.lock);
+            if (q.tiles.empty())
+                continue;
+            if (i == 0) {
+                *tile = q.tiles.front();
+                q.tiles.pop_front();
+            } else {
+                *tile = q.tiles.back();
+                q.tiles.pop_back();
+            }
+            return true;
+        }
+        return false;
+    };
+    auto work = [this, &nextTile, &params, &size, accum, rgba](int self) {
+        int tile;
+        while (nextTile(self, &tile))
+            renderTile(tile, params, size, accum, rgba);
+    };
+
+    QSemaphore done;
+    for (int i = 1; i < workerCount; ++i) {
+        QThreadPool::globalInstance()->start([&work, &done, i] {
+            work(i);
+            done.release();
+        });
+    }
+    work(0);
+    done.acquire(workerCount - 1);
+}
@@ -0,0 +1,77 @@
+#ifndef CPUTRACER_H
+#define CPUTRACER_H
+
+#include <QMatrix4x4>
+#include <QSize>
+#include "scene.h"
+#include "cpubvh.h"
+
+// Path tracer on the CPU for devices without VK_KHR_ray_tracing_pipeline,
+// shading like raygen.rgen and closesthit.rchit. Rays are traced in packets
+// of FloatPacket::WIDTH pixels (2x2 with SSE, 4x2 with AVX2) through the
+// BVHs of CpuBvh; the image is cut into tiles which the threads of the
+// global QThreadPool, and the calling one, take from per thread queues,
+// stealing from the others' once their own is empty.
+class CpuTracer
+{
+public:
+    struct Params {
+        QMatrix4x4 viewInverse;
+        QMatrix4x4 projInverse;
+        uint32_t sampleIndex = 0; // 0 restarts the accumulation
+        uint32_t samplesPerFrame = 1;
+        uint32_t maxBounces = 1;
+        uint32_t frameSeed = 0;
+        float rayEpsilon = 1.0e-4f;
+    };
+
+    static const int TILE_SIZE = 16;
+
+    // the mesh BVHs, instances() must be set again after this
+    void setScene(const Scene &scene);
+    // the top level BVH
+    void setInstances(const std::vector<Scene::Instance> &instances);
+
+    // Traces params.samplesPerFrame samples per pixel, adds them to accum
+    // (rgb sum and sample count per pixel, like accumImage, owned by the
+    // caller so that views can share the BVHs) and writes the gamma
+    // corrected average as tightly packed RGBA8 to rgba. Returns once the
+    // whole image is done.
+    void render(const Params &params, const QSize &size, float *accum, uchar *rgba);
+
+    static int threadCount();
+    static int packetWidth() { return FloatPacket::WIDTH; }
+
+private:
+    // v0 and two edges for the intersection, plus the object space normal
+    struct Triangle {
+        float v0[3];
+        float e1[3];
+        float e2[3];
+        float n[3];
+    };
+
+    struct MeshData {
+        CpuBvh bvh;
+        std::vector<Triangle> triangles; // in the order of the BVH leaves
+    };
+
+    struct Instance {
+        int mesh;
+        float worldToObject[12]; // 3x4, row major
+        float normalMatrix[9]; // inverse transpose of the upper 3x3, row major
+    };
+
+    template <class F>
+    static void intersectTriangles(const Triangle *triangles, uint32_t first, uint32_t count, uint32_t instance, RayPacket<F> &r);
+    template <class F>
+    void intersect(RayPacket<F> &r) const;
+    QVector3D hitNormal(uint32_t instance, uint32_t primitive) const;
+    void renderTile(int tile, const Params &params, const QSize &size, float *accum, uchar *rgba);
+
+    std::vector<MeshData> m_meshes;
+    std::vector<Instance> m_instances;
+    CpuBvh m_topLevel;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "deferredop.h"
+#include <QThreadPool>
+#include <QThread>
+
+// the joins of all deferred operations, see the class comment
+Q_GLOBAL_STATIC(QThreadPool, joinPool)
+
+void DeferredOperation::Functions::resolve(VkDevice dev, QVulkanFunctions *f)
+{
+    vkCreateDeferredOperationKHR = reinterpret_cast<PFN_vkCreateDeferredOperationKHR>(f->vkGetDeviceProcAddr(dev, "vkCreateDeferredOperationKHR"));
+    vkDestroyDeferredOperationKHR = reinterpret_cast<PFN_vkDestroyDeferredOperationKHR>(f->vkGetDeviceProcAddr(dev, "vkDestroyDeferredOperationKHR"));
+    vkGetDeferredOperationMaxConcurrencyKHR = reinterpret_cast<PFN_vkGetDeferredOperationMaxConcurrencyKHR>(f->vkGetDeviceProcAddr(dev, "vkGetDeferredOperationMaxConcurrencyKHR"));
+    vkGetDeferredOperationResultKHR = reinterpret_cast<PFN_vkGetDeferredOperationResultKHR>(f->vkGetDeviceProcAddr(dev, "vkGetDeferredOperationResultKHR"));
+    vkDeferredOperationJoinKHR = reinterpret_cast<PFN_vkDeferredOperationJoinKHR>(f->vkGetDeviceProcAddr(dev, "vkDeferredOperationJoinKHR"));
+}
+
+DeferredOperation::DeferredOperation(VkDevice dev, const Functions *funcs)
+    : m_dev(dev),
+      m_funcs(funcs)
+{
+    if (m_funcs->isValid() && m_funcs->vkCreateDeferredOperationKHR(m_dev, nullptr, &m_op) != VK_SUCCESS)
+        m_op = VK_NULL_HANDLE;
+}
+
+DeferredOperation::~DeferredOperation()
+{
+    if (!m_op)
+        return;
+
+    // the operation may not be destroyed while a worker is still in vkDeferredOperationJoinKHR
+    waitForDone();
+
+    m_funcs->vkDestroyDeferredOperationKHR(m_dev, m_op, nullptr);
+}
+
+int DeferredOperation::startJoining()
+{
+    const uint32_t maxConcurrency = m_funcs->vkGetDeferredOperationMaxConcurrencyKHR(m_dev, m_op);
+    const int workerCount = qBound(1, int(maxConcurrency), qMax(1, joinPool()->maxThreadCount()));
+    m_activeWorkers = workerCount;
+    for (int i = 0; i < workerCount; ++i)
+        joinPool()->start([this] { join(0); });
+    return workerCount;
+}
+
+void DeferredOperation::join(int idleRounds) // called on a worker thread
+{
+    // 50 us after the first idle round, doubling up to 1 ms
+    if (idleRounds > 0)
+        QThread::usleep(qMin(1000UL, 50UL << qMin(idleRounds - 1, 5)));
+
+    const VkResult err = m_funcs->vkDeferredOperationJoinKHR(m_dev, m_op);
+    if (err == VK_THREAD_IDLE_KHR) {
+        // more work may become available later, let the other operations'
+        // workers queued meanwhile go first; this one stays active
+        joinPool()->start([this, idleRounds] { join(idleRounds + 1); });
+        return;
+    }
+
+    // VK_SUCCESS, VK_THREAD_DONE_KHR, or an error that the result will report
+    QMutexLocker locker(&m_workersLock);
+    if (m_activeWorkers.fetch_sub(1) == 1)
+        m_workersDone.wakeAll();
+}
+
+bool DeferredOperation::isDone() const
+{
+    if (!m_op)
+        return true;
+    return m_activeWorkers.load() == 0 && m_funcs->vkGetDeferredOperationResultKHR(m_dev, m_op) != VK_NOT_READY;
+}
+
+void DeferredOperation::waitForDone()
+{
+    // with all the workers back the operation is complete, or has failed
+    QMutexLocker locker(&m_workersLock);
+    while (m_activeWorkers.load() > 0)
+        m_workersDone.wait(&m_workersLock);
+}
+
+VkResult DeferredOperation::result() const
+{
+    return m_op ? m_funcs->vkGetDeferredOperationResultKHR(m_dev, m_op) : VK_SUCCESS;
+}
@@ -0,0 +1,58 @@
+#ifndef DEFERREDOP_H
+#define DEFERREDOP_H
+
+#include <QVulkanFunctions>
+#include <QMutex>
+#include <QWaitCondition>
+#include <atomic>
+
+// A VkDeferredOperationKHR that, once the command using it returned
+// VK_OPERATION_DEFERRED_KHR, is joined from worker threads of a QThreadPool
+// of its own, not the global one. The owner polls isDone() and must not
+// destroy the object before that (the destructor waits otherwise). A worker
+// that finds no work (VK_THREAD_IDLE_KHR) is queued again and sleeps a short
+// back-off before the next join, instead of spinning; the sleep holds a
+// thread of that pool only, never one CpuTracer's tiles could use.
+class DeferredOperation
+{
+public:
+    struct Functions {
+        PFN_vkCreateDeferredOperationKHR vkCreateDeferredOperationKHR = nullptr;
+        PFN_vkDestroyDeferredOperationKHR vkDestroyDeferredOperationKHR = nullptr;
+        PFN_vkGetDeferredOperationMaxConcurrencyKHR vkGetDeferredOperationMaxConcurrencyKHR = nullptr;
+        PFN_vkGetDeferredOperationResultKHR vkGetDeferredOperationResultKHR = nullptr;
+        PFN_vkDeferredOperationJoinKHR vkDeferredOperationJoinKHR = nullptr;
+
+        void resolve(VkDevice dev, QVulkanFunctions *f);
+        bool isValid() const { return vkCreateDeferredOperationKHR != nullptr; }
+    };
+
+    DeferredOperation(VkDevice dev, const Functions *funcs);
+    ~DeferredOperation();
+
+    // VK_NULL_HANDLE when deferred operations are not available, the
+    // command then simply runs synchronously
+    VkDeferredOperationKHR handle() const { return m_op; }
+
+    // To be called when the command returned VK_OPERATION_DEFERRED_KHR.
+    // Returns the number of worker threads joining.
+    int startJoining();
+
+    bool isDone() const;
+    void waitForDone(); // blocks until the workers are done
+    VkResult result() const; // once done
+
+private:
+    Q_DISABLE_COPY(DeferredOperation)
+
+    void join(int idleRounds);
+
+    VkDevice m_dev;
+    const Functions *m_funcs;
+    VkDeferredOperationKHR m_op = VK_NULL_HANDLE;
+    std::atomic<int> m_activeWorkers { 0 };
+    QMutex m_workersLock;
+    QWaitCondition m_workersDone;
+};
+
+#endif
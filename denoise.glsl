@@ -0,0 +1,74 @@
+// Shared by the denoiser's compute shaders. Must match Raytracing::DenoiseParams
+// and the denoiser's descriptor set layout.
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+layout(binding = 0, rgba32f) uniform image2DArray accumImage;
+layout(binding = 1, rgba8) uniform image2DArray outputImage;
+// normal (world space) and distance from the camera, < 0 for the sky
+layout(binding = 2, rgba16f) uniform image2DArray gbuffer[2];
+// offset to the pixel in the previous frame, and the distance from its camera
+layout(binding = 3, rgba16f) uniform image2DArray motionImage;
+// temporally integrated color and history length
+layout(binding = 4, rgba16f) uniform image2DArray history[2];
+// color and luminance variance, ping-ponged by the a-trous passes
+layout(binding = 5, rgba16f) uniform image2DArray filterImage[2];
+
+const uint HISTORY_VALID = 1u;
+const uint ACCUMULATING = 2u;
+const uint FINAL_PASS = 4u;
+
+layout(push_constant) uniform DenoiseParams {
+    uint current; // G-buffer and history of this frame, the other ones are the previous frame's
+    uint flags;
+    uint stepSize; // a-trous only
+    uint source; // filter image read by the a-trous pass
+} pc;
+
+// the dispatch has a z per view, the images a layer per view
+ivec3 at(ivec2 p)
+{
+    return ivec3(p, gl_GlobalInvocationID.z);
+}
+
+// the indices are constant in each branch, no dynamic indexing of image arrays
+vec4 loadGBuffer(uint i, ivec2 p)
+{
+    return i == 0u ? imageLoad(gbuffer[0], at(p)) : imageLoad(gbuffer[1], at(p));
+}
+
+vec4 loadHistory(uint i, ivec2 p)
+{
+    return i == 0u ? imageLoad(history[0], at(p)) : imageLoad(history[1], at(p));
+}
+
+void storeHistory(uint i, ivec2 p, vec4 v)
+{
+    if (i == 0u)
+        imageStore(history[0], at(p), v);
+    else
+        imageStore(history[1], at(p), v);
+}
+
+vec4 loadFilter(uint i, ivec2 p)
+{
+    return i == 0u ? imageLoad(filterImage[0], at(p)) : imageLoad(filterImage[1], at(p));
+}
+
+void storeFilter(uint i, ivec2 p, vec4 v)
+{
+    if (i == 0u)
+        imageStore(filterImage[0], at(p), v);
+    else
+        imageStore(filterImage[1], at(p), v);
+}
+
+float luminance(vec3 c)
+{
+    return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+
+void storeOutput(ivec2 p, vec3 color)
+{
+    imageStore(outputImage, at(p), vec4(pow(color, vec3(1.0 / 2.2)), 1.0));
+}
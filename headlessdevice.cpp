@@ -0,0 +1,326 @@
+#include "headlessdevice.h"
+#include <QVector>
+#include <QDebug>
+#include <cstring>
+
+static const char *deviceExtensions[] = {
+    "VK_EXT_descriptor_indexing",
+    "VK_KHR_buffer_device_address",
+    "VK_KHR_deferred_host_operations",
+    "VK_KHR_maintenance3",
+    "VK_KHR_spirv_1_4",
+    "VK_KHR_acceleration_structure",
+    "VK_KHR_ray_tracing_pipeline"
+};
+static const int deviceExtensionCount = sizeof(deviceExtensions) / sizeof(deviceExtensions[0]);
+
+static bool hasExtension(const QVector<VkExtensionProperties> &extProps, const char *name)
+{
+    for (const VkExtensionProperties &p : extProps) {
+        if (!strcmp(p.extensionName, name))
+            return true;
+    }
+    return false;
+}
+
+static QVector<VkExtensionProperties> extensionProperties(QVulkanFunctions *f, VkPhysicalDevice physDev)
+{
+    uint32_t count = 0;
+    f->vkEnumerateDeviceExtensionProperties(physDev, nullptr, &count, nullptr);
+    QVector<VkExtensionProperties> extProps(count);
+    f->vkEnumerateDeviceExtensionProperties(physDev, nullptr, &count, extProps.data());
+    return extProps;
+}
+
+static bool hasExtensions(QVulkanFunctions *f, VkPhysicalDevice physDev)
+{
+    const QVector<VkExtensionProperties> extProps = extensionProperties(f, physDev);
+    for (int i = 0; i < deviceExtensionCount; ++i) {
+        if (!hasExtension(extProps, deviceExtensions[i]))
+            return false;
+    }
+    return true;
+}
+
+bool HeadlessDevice::create(QVulkanInstance *vulkanInstance, bool forQtQuick)
+{
+    inst = vulkanInstance;
+    f = inst->functions();
+
+    uint32_t physDevCount = 0;
+    f->vkEnumeratePhysicalDevices(inst->vkInstance(), &physDevCount, nullptr);
+    QVector<VkPhysicalDevice> physDevs(physDevCount);
+    f->vkEnumeratePhysicalDevices(inst->vkInstance(), &physDevCount, physDevs.data());
+    for (VkPhysicalDevice pd : physDevs) {
+        if (hasExtensions(f, pd)) {
+            physDev = pd;
+            break;
+        }
+    }
+    if (!physDev) {
+        qWarning("No physical device with ray tracing support");
+        return false;
+    }
+    f->vkGetPhysicalDeviceProperties(physDev, &physDevProps);
+    qDebug("Using physical device %s (driver version 0x%x)", physDevProps.deviceName, physDevProps.driverVersion);
+
+    // ray tracing and acceleration structure builds need compute, the
+    // barriers Raytracing records for Qt Quick use the fragment shader stage
+    uint32_t queueFamilyCount = 0;
+    f->vkGetPhysicalDeviceQueueFamilyProperties(physDev, &queueFamilyCount, nullptr);
+    QVector<VkQueueFamilyProperties> queueFamilyProps(queueFamilyCount);
+    f->vkGetPhysicalDeviceQueueFamilyProperties(physDev, &queueFamilyCount, queueFamilyProps.data());
+    bool foundQueue = false;
+    for (uint32_t i = 0; i < queueFamilyCount; ++i) {
+        const VkQueueFlags flags = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT;
+        if ((queueFamilyProps[i].queueFlags & flags) == flags) {
+            queueFamilyIndex = i;
+            foundQueue = true;
+            break;
+        }
+    }
+    if (!foundQueue) {
+        qWarning("No graphics and compute capable queue family");
+        return false;
+    }
+
+    // the async queue: a compute only family runs alongside graphics best,
+    // a second queue of the graphics family will do otherwise
+    hasAsyncQueue = false;
+    if (forQtQuick) {
+        if (VK_VERSION_MINOR(physDevProps.apiVersion) < 2 && VK_VERSION_MAJOR(physDevProps.apiVersion) == 1) {
+            qWarning("Vulkan 1.2 is needed for timeline semaphores, no async queue");
+        } else {
+            for (uint32_t i = 0; i < queueFamilyCount; ++i) {
+                if ((queueFamilyProps[i].queueFlags & VK_QUEUE_COMPUTE_BIT) && !(queueFamilyProps[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+                    asyncQueueFamilyIndex = i;
+                    asyncQueueIndex = 0;
+                    hasAsyncQueue = true;
+                    break;
+                }
+            }
+            if (!hasAsyncQueue && queueFamilyProps[queueFamilyIndex].queueCount > 1) {
+                asyncQueueFamilyIndex = queueFamilyIndex;
+                asyncQueueIndex = 1;
+                hasAsyncQueue = true;
+            }
+            if (!hasAsyncQueue)
+                qWarning("No queue for async tracing");
+        }
+    }
+
+    // enable what Raytracing needs, plus host builds and ray queries when available
+    const bool hasRayQueryExtension = hasExtension(extensionProperties(f, physDev), "VK_KHR_ray_query");
+    VkPhysicalDeviceRayQueryFeaturesKHR supportedRayQueryFeatures = {};
+    supportedRayQueryFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_QUERY_FEATURES_KHR;
+    VkPhysicalDeviceAccelerationStructureFeaturesKHR supportedAsFeatures = {};
+    supportedAsFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
+    if (hasRayQueryExtension)
+        supportedAsFeatures.pNext = &supportedRayQueryFeatures;
+    VkPhysicalDeviceFeatures2 supportedFeatures2 = {};
+    supportedFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supportedFeatures2.pNext = &supportedAsFeatures;
+    f->vkGetPhysicalDeviceFeatures2(physDev, &supportedFeatures2);
+    const bool enableRayQuery = hasRayQueryExtension && supportedRayQueryFeatures.rayQuery;
+
+    VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures = {};
+    timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+    timelineFeatures.timelineSemaphore = VK_TRUE;
+
+    VkPhysicalDeviceBufferDeviceAddressFeatures bdaFeatures = {};
+    bdaFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
+    bdaFeatures.bufferDeviceAddress = VK_TRUE;
+    if (hasAsyncQueue)
+        bdaFeatures.pNext = &timelineFeatures;
+
+    VkPhysicalDeviceRayTracingPipelineFeaturesKHR rtFeatures = {};
+    rtFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR;
+    rtFeatures.rayTracingPipeline = VK_TRUE;
+    rtFeatures.pNext = &bdaFeatures;
+
+    VkPhysicalDeviceRayQueryFeaturesKHR rayQueryFeatures = {};
+    rayQueryFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_QUERY_FEATURES_KHR;
+    rayQueryFeatures.rayQuery = VK_TRUE;
+    if (enableRayQuery) {
+        rayQueryFeatures.pNext = rtFeatures.pNext;
+        rtFeatures.pNext = &rayQueryFeatures;
+    }
+
+    VkPhysicalDeviceAccelerationStructureFeaturesKHR asFeatures = {};
+    asFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
+    asFeatures.accelerationStructure = VK_TRUE;
+    asFeatures.accelerationStructureHostCommands = supportedAsFeatures.accelerationStructureHostCommands;
+    hostCommandsEnabled = asFeatures.accelerationStructureHostCommands;
+    asFeatures.pNext = &rtFeatures;
+
+    VkPhysicalDeviceFeatures2 features2 = {};
+    features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features2.pNext = &asFeatures;
+
+    const float prio[2] = { 1.0f, 1.0f };
+    VkDeviceQueueCreateInfo queueInfo[2] = {};
+    uint32_t queueInfoCount = 1;
+    queueInfo[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queueInfo[0].queueFamilyIndex = queueFamilyIndex;
+    queueInfo[0].queueCount = 1;
+    queueInfo[0].pQueuePriorities = prio;
+    if (hasAsyncQueue) {
+        if (asyncQueueFamilyIndex == queueFamilyIndex) {
+            queueInfo[0].queueCount = 2;
+        } else {
+            queueInfo[1] = queueInfo[0];
+            queueInfo[1].queueFamilyIndex = asyncQueueFamilyIndex;
+            queueInfoCount = 2;
+        }
+    }
+
+    QVector<const char *> extensions(deviceExtensions, deviceExtensions + deviceExtensionCount);
+    if (forQtQuick)
+        extensions.append("VK_KHR_swapchain");
+    if (enableRayQuery)
+        extensions.append("VK_KHR_ray_query");
+
+    VkDeviceCreateInfo devInfo = {};
+    devInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    devInfo.pNext = &features2;
+    devInfo.queueCreateInfoCount = queueInfoCount;
+    devInfo.pQueueCreateInfos = queueInfo;
+    devInfo.enabledExtensionCount = uint32_t(extensions.count());
+    devInfo.ppEnabledExtensionNames = extensions.constData();
+    VkResult err = f->vkCreateDevice(physDev, &devInfo, nullptr, &dev);
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to create device: %d", err);
+        return false;
+    }
+
+    df = inst->deviceFunctions(dev);
+    df->vkGetDeviceQueue(dev, queueFamilyIndex, 0, &queue);
+
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    poolInfo.queueFamilyIndex = queueFamilyIndex;
+    df->vkCreateCommandPool(dev, &poolInfo, nullptr, &m_cmdPool);
+
+    VkCommandBufferAllocateInfo cbInfo = {};
+    cbInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cbInfo.commandPool = m_cmdPool;
+    cbInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cbInfo.commandBufferCount = SLOT_COUNT;
+    df->vkAllocateCommandBuffers(dev, &cbInfo, m_cb);
+
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    for (int i = 0; i < SLOT_COUNT; ++i) {
+        df->vkCreateFence(dev, &fenceInfo, nullptr, &m_fences[i]);
+        m_submitted[i] = false;
+    }
+
+    return true;
+}
+
+void HeadlessDevice::destroy()
+{
+    if (!dev)
+        return;
+
+    df->vkDeviceWaitIdle(dev);
+    for (int i = 0; i < SLOT_COUNT; ++i)
+        df->vkDestroyFence(dev, m_fences[i], nullptr);
+    df->vkDestroyCommandPool(dev, m_cmdPool, nullptr);
+    m_cmdPool = VK_NULL_HANDLE;
+
+    df->vkDestroyDevice(dev, nullptr);
+    inst->resetDeviceFunctions(dev);
+    dev = VK_NULL_HANDLE;
+    df = nullptr;
+}
+
+VkCommandBuffer HeadlessDevice::beginCommands(uint slot)
+{
+    // like Qt Quick: the slot's previous frame must be done before its command buffer is reused
+    wait(slot);
+    df->vkResetCommandBuffer(m_cb[slot], 0);
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    df->vkBeginCommandBuffer(m_cb[slot], &beginInfo);
+    return m_cb[slot];
+}
+
+void HeadlessDevice::submit(uint slot)
+{
+    df->vkEndCommandBuffer(m_cb[slot]);
+
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &m_cb[slot];
+    df->vkResetFences(dev, 1, &m_fences[slot]);
+    VkResult err = df->vkQueueSubmit(queue, 1, &submitInfo, m_fences[slot]);
+    if (err != VK_SUCCESS)
+        qWarning("Failed to submit: %d", err);
+    m_submitted[slot] = err == VK_SUCCESS;
+}
+
+void HeadlessDevice::wait(uint slot)
+{
+    if (!m_submitted[slot])
+        return;
+
+    df->vkWaitForFences(dev, 1, &m_fences[slot], VK_TRUE, UINT64_MAX);
+    m_submitted[slot] = false;
+}
+
+void HeadlessDevice::waitIdle()
+{
+    df->vkDeviceWaitIdle(dev);
+    for (int i = 0; i < SLOT_COUNT; ++i)
+        m_submitted[i] = false;
+}
+
+HeadlessDevice::Image HeadlessDevice::createOutputImage(MemoryAllocator *allocator, const QSize &pixelSize, uint32_t layers, VkImageUsageFlags extraUsage)
+{
+    Image result;
+
+    VkImageCreateInfo imageInfo = {};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+    imageInfo.extent.width = uint32_t(pixelSize.width());
+    imageInfo.extent.height = uint32_t(pixelSize.height());
+    imageInfo.extent.depth = 1;
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = layers;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    // the placeholder is a clear, so always a transfer destination
+    imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | extraUsage;
+    df->vkCreateImage(dev, &imageInfo, nullptr, &result.image);
+
+    VkMemoryRequirements memReq;
+    df->vkGetImageMemoryRequirements(dev, result.image, &memReq);
+    result.alloc = allocator->allocate(memReq, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MemoryAllocator::OptimalResource);
+    df->vkBindImageMemory(dev, result.image, result.alloc.mem, result.alloc.offset);
+
+    VkImageViewCreateInfo viewInfo = {};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = result.image;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+    viewInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.layerCount = layers;
+    df->vkCreateImageView(dev, &viewInfo, nullptr, &result.view);
+
+    return result;
+}
+
+void HeadlessDevice::destroyImage(MemoryAllocator *allocator, const Image &image)
+{
+    df->vkDestroyImageView(dev, image.view, nullptr);
+    df->vkDestroyImage(dev, image.image, nullptr);
+    allocator->free(image.alloc);
+}
@@ -0,0 +1,64 @@
+#ifndef HEADLESSDEVICE_H
+#define HEADLESSDEVICE_H
+
+#include <QVulkanInstance>
+#include <QVulkanFunctions>
+#include <QSize>
+#include "memalloc.h"
+
+// A VkDevice with one queue and the ray tracing extensions and features
+// enabled, for the tools that drive Raytracing without Qt Quick (and so
+// without the patched QRhi creating the device). Picks the first physical
+// device with the extensions, which may well be lavapipe. VK_KHR_ray_query
+// is enabled on top when supported.
+//
+// With forQtQuick the device is for Qt Quick to adopt (qvkrt --async): it
+// also gets VK_KHR_swapchain, timeline semaphores and, when possible, a
+// second queue for Raytracing's async mode, from a compute only family if
+// there is one.
+class HeadlessDevice
+{
+public:
+    ~HeadlessDevice() { destroy(); }
+
+    bool create(QVulkanInstance *inst, bool forQtQuick = false);
+    void destroy();
+
+    VkCommandBuffer beginCommands(uint slot);
+    void submit(uint slot); // ends the command buffer
+    void wait(uint slot); // for the last submit from slot
+    void waitIdle();
+
+    // an RGBA8 storage image like the one CustomTextureNode creates, with
+    // a layer per view of Raytracing and a 2D array view of all of them
+    struct Image {
+        VkImage image = VK_NULL_HANDLE;
+        VkImageView view = VK_NULL_HANDLE;
+        MemoryAllocator::Allocation alloc;
+    };
+    Image createOutputImage(MemoryAllocator *allocator, const QSize &pixelSize, uint32_t layers, VkImageUsageFlags extraUsage);
+    void destroyImage(MemoryAllocator *allocator, const Image &image);
+
+    static const int SLOT_COUNT = 2; // Raytracing expects 2 frames in flight
+
+    QVulkanInstance *inst = nullptr;
+    VkPhysicalDevice physDev = VK_NULL_HANDLE;
+    VkPhysicalDeviceProperties physDevProps;
+    VkDevice dev = VK_NULL_HANDLE;
+    uint32_t queueFamilyIndex = 0;
+    VkQueue queue = VK_NULL_HANDLE;
+    bool hostCommandsEnabled = false; // accelerationStructureHostCommands
+    bool hasAsyncQueue = false;
+    uint32_t asyncQueueFamilyIndex = 0;
+    uint32_t asyncQueueIndex = 0;
+    QVulkanFunctions *f = nullptr;
+    QVulkanDeviceFunctions *df = nullptr;
+
+private:
+    VkCommandPool m_cmdPool = VK_NULL_HANDLE;
+    VkCommandBuffer m_cb[SLOT_COUNT];
+    VkFence m_fences[SLOT_COUNT];
+    bool m_submitted[SLOT_COUNT];
+};
+
+#endif
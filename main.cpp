@@ -1,12 +1,32 @@
 #include <QGuiApplication>
 #include <QQuickView>
 #include <QQuickGraphicsConfiguration>
+#include <QQuickGraphicsDevice>
 #include <QVulkanInstance>
+#include <QCommandLineParser>
+#include <QQmlContext>
+#include "headlessdevice.h"
 
 int main(int argc, char *argv[])
 {
     QGuiApplication app(argc, argv);
 
+    QCommandLineParser cmdLineParser;
+    cmdLineParser.addHelpOption();
+    cmdLineParser.addPositionalArgument(QLatin1String("scene"), QLatin1String("Wavefront OBJ or glTF 2.0 (.gltf, .glb) file to show instead of the triangle."));
+    QCommandLineOption gridOption(QLatin1String("grid"), QLatin1String("Instance the scene N x N times."), QLatin1String("N"), QLatin1String("1"));
+    cmdLineParser.addOption(gridOption);
+    QCommandLineOption deformOption(QLatin1String("deform"), QLatin1String("Animate the vertices of all meshes on the GPU and refit their BLASes."));
+    cmdLineParser.addOption(deformOption);
+    QCommandLineOption traceBudgetOption(QLatin1String("trace-budget"), QLatin1String("Trace only as much of the image per frame as fits in this many milliseconds of GPU time."),
+                                         QLatin1String("ms"), QLatin1String("0"));
+    cmdLineParser.addOption(traceBudgetOption);
+    QCommandLineOption asyncOption(QLatin1String("async"), QLatin1String("Trace on a queue of its own, Qt Quick shows the newest complete frame without waiting for it."));
+    cmdLineParser.addOption(asyncOption);
+    QCommandLineOption rayQueryOption(QLatin1String("ray-query"), QLatin1String("Trace with ray queries from a compute shader instead of the ray tracing pipeline."));
+    cmdLineParser.addOption(rayQueryOption);
+    cmdLineParser.process(app);
+
     QQuickWindow::setGraphicsApi(QSGRendererInterface::Vulkan);
 
     // ### there really should be built-in enablers for this
@@ -17,9 +37,32 @@ int main(int argc, char *argv[])
     inst.setExtensions(QQuickGraphicsConfiguration::preferredInstanceExtensions());
     inst.create();
 
+    // Async mode needs a second queue and timeline semaphores, so the
+    // device is created here and adopted by Qt Quick. Declared before the
+    // view, so it is destroyed after it.
+    HeadlessDevice device;
+    int asyncQueueFamily = -1;
+    int asyncQueueIndex = -1;
+
     QQuickView view;
     view.setVulkanInstance(&inst);
 
+    if (cmdLineParser.isSet(asyncOption)) {
+        // the graphics queue is assumed to be able to present, as on desktop
+        if (device.create(&inst, true)) {
+            view.setGraphicsDevice(QQuickGraphicsDevice::fromDeviceObjects(device.physDev, device.dev,
+                                                                           int(device.queueFamilyIndex)));
+            if (device.hasAsyncQueue) {
+                asyncQueueFamily = int(device.asyncQueueFamilyIndex);
+                asyncQueueIndex = int(device.asyncQueueIndex);
+            }
+        } else {
+            qWarning("Failed to create a device for async mode, using the default one");
+        }
+    }
+
+    // only the supported ones are enabled; without the ray tracing ones
+    // Raytracing falls back to tracing on the CPU
     QQuickGraphicsConfiguration config;
     config.setDeviceExtensions({
             "VK_EXT_descriptor_indexing",
@@ -28,10 +71,21 @@ int main(int argc, char *argv[])
             "VK_KHR_maintenance3",
             "VK_KHR_spirv_1_4",
             "VK_KHR_acceleration_structure",
-            "VK_KHR_ray_tracing_pipeline"
+            "VK_KHR_ray_tracing_pipeline",
+            "VK_KHR_ray_query"
         });
     view.setGraphicsConfiguration(config);
 
+    const QStringList args = cmdLineParser.positionalArguments();
+    view.rootContext()->setContextProperty(QLatin1String("sceneSource"),
+                                           args.isEmpty() ? QUrl() : QUrl::fromLocalFile(args.first()));
+    view.rootContext()->setContextProperty(QLatin1String("sceneGrid"), qMax(1, cmdLineParser.value(gridOption).toInt()));
+    view.rootContext()->setContextProperty(QLatin1String("sceneDeform"), cmdLineParser.isSet(deformOption));
+    view.rootContext()->setContextProperty(QLatin1String("traceBudget"), qMax(0.0, cmdLineParser.value(traceBudgetOption).toDouble()));
+    view.rootContext()->setContextProperty(QLatin1String("traceRayQuery"), cmdLineParser.isSet(rayQueryOption));
+    view.rootContext()->setContextProperty(QLatin1String("traceQueueFamily"), asyncQueueFamily);
+    view.rootContext()->setContextProperty(QLatin1String("traceQueueIndex"), asyncQueueIndex);
+
     view.setColor(Qt::black);
     view.setResizeMode(QQuickView::SizeRootObjectToView);
     view.resize(1280, 720);
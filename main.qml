@@ -11,6 +11,32 @@ Rectangle {
         id: rt
         anchors.fill: parent
         anchors.margins: 64
+        source: sceneSource
+        instanceGrid: sceneGrid
+        // a trace time budget bounds the frame time by itself, no need to scale too
+        dynamicResolution: traceBudget === 0
+        traceTimeBudget: traceBudget
+        interleavedTrace: true
+        rayQuery: traceRayQuery
+        denoise: true
+        // -1 unless started with --async
+        asyncQueueFamily: traceQueueFamily
+        asyncQueueIndex: traceQueueIndex
+
+        // animated instance transforms, exercises the TLAS update path
+        NumberAnimation on instanceRotation {
+            from: 0; to: 360; duration: 8000
+            loops: Animation.Infinite
+            running: sceneGrid > 1
+        }
+
+        // vertex animation in a compute pass, exercises the BLAS refit path
+        deformable: sceneDeform
+        NumberAnimation on deformPhase {
+            from: 0; to: 2 * Math.PI; duration: 2000
+            loops: Animation.Infinite
+            running: sceneDeform
+        }
 
         transform: [
             Rotation { id: rotation; axis.x: 0; axis.z: 0; axis.y: 1; angle: 0; origin.x: rt.width / 2; origin.y: rt.height / 2; },
@@ -20,17 +46,26 @@ Rectangle {
         ]
 
         Text {
-            text: "This is a raytraced triangle with\nClosest hit: hitValue = vec3(1.0f - baryCoord.x - baryCoord.y, baryCoord.x, baryCoord.y);\nMiss: hitValue = vec3(0.0, 0.0, 0.4);"
+            text: (rt.source.toString() === "" ? "This is a path traced triangle" : "This is " + rt.source + " path traced")
+                  + "\nDiffuse grey surfaces lit by a sky gradient, samples accumulated progressively"
+                  + "\n" + rt.sampleCount + " / " + rt.maxSamples + " samples" + (rt.active ? "" : ", idle")
             color: "white"
         }
-    }
 
-    // update the raytraced content ca. every 100 ms (not that it matters much since it's all static for now)
-    Timer {
-        interval: 100
-        repeat: true
-        running: true
-        onTriggered: rt.update()
+        // GPU timing overlay, from the timestamps written around each phase
+        Text {
+            anchors.bottom: parent.bottom
+            color: "white"
+            visible: rt.gpuTimings.frames !== undefined
+            function ms(t) { return t && t.avg !== undefined ? t.avg.toFixed(3) + " / " + t.p99.toFixed(3) : "-" }
+            text: "GPU ms, avg / p99 of " + rt.gpuTimings.frames + " frames"
+                  + "\nBLAS " + ms(rt.gpuTimings.blas)
+                  + "\nTLAS " + ms(rt.gpuTimings.tlas)
+                  + "\ntrace " + ms(rt.gpuTimings.trace) + (rt.gpuTimings.rayQuery ? " (ray query)" : "")
+                  + "\ndenoise " + ms(rt.gpuTimings.denoise)
+                  + "\ntotal " + ms(rt.gpuTimings.total)
+                  + "\nrender scale " + rt.effectiveRenderScale.toFixed(3)
+        }
     }
 
     SequentialAnimation {
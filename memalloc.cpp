@@ -0,0 +1,255 @@
+#include "memalloc.h"
+
+void MemoryAllocator::init(VkPhysicalDevice physDev, VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df,
+                           bool deviceAddresses)
+{
+    m_dev = dev;
+    m_df = df;
+    m_deviceAddresses = deviceAddresses;
+    f->vkGetPhysicalDeviceMemoryProperties(physDev, &m_memProps);
+}
+
+void MemoryAllocator::destroy()
+{
+    for (int i = 0; i < int(m_blocks.size()); ++i)
+        releaseBlock(i);
+    m_blocks.clear();
+}
+
+uint32_t MemoryAllocator::chooseMemoryType(uint32_t memoryTypeBits, VkMemoryPropertyFlags requiredFlags) const
+{
+    for (uint32_t i = 0; i < m_memProps.memoryTypeCount; ++i) {
+        if (!(memoryTypeBits & (1 << i)))
+            continue;
+        if ((m_memProps.memoryTypes[i].propertyFlags & requiredFlags) == requiredFlags)
+            return i;
+    }
+    return UINT_MAX;
+}
+
+VkDeviceSize MemoryAllocator::blockSizeForType(uint32_t memTypeIndex) const
+{
+    // do not let a single block eat a significant portion of a small heap
+    // (e.g. the 256 MB host visible + device local one on some discrete GPUs)
+    const VkDeviceSize heapSize = m_memProps.memoryHeaps[m_memProps.memoryTypes[memTypeIndex].heapIndex].size;
+    return qMin(DEFAULT_BLOCK_SIZE, heapSize / 8);
+}
+
+int MemoryAllocator::createBlock(uint32_t memTypeIndex, ResourceKind kind, VkDeviceSize size)
+{
+    // everything in rt.cpp wants buffer device addresses, unless it traces on
+    // the CPU, so just ask for it on all blocks
+    VkMemoryAllocateFlagsInfo memoryAllocateFlagsInfo = {};
+    memoryAllocateFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
+    memoryAllocateFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR;
+    VkMemoryAllocateInfo memoryAllocateInfo = {};
+    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    if (m_deviceAddresses)
+        memoryAllocateInfo.pNext = &memoryAllocateFlagsInfo;
+    memoryAllocateInfo.allocationSize = size;
+    memoryAllocateInfo.memoryTypeIndex = memTypeIndex;
+
+    Block b;
+    VkResult err = m_df->vkAllocateMemory(m_dev, &memoryAllocateInfo, nullptr, &b.mem);
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to allocate memory block of %llu bytes: %d", (unsigned long long) size, err);
+        return -1;
+    }
+
+    if (m_memProps.memoryTypes[memTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+        m_df->vkMapMemory(m_dev, b.mem, 0, VK_WHOLE_SIZE, 0, &b.p);
+
+    b.size = size;
+    b.memTypeIndex = memTypeIndex;
+    b.kind = kind;
+
+    for (int i = 0; i < int(m_blocks.size()); ++i) {
+        if (!m_blocks[i].mem) {
+            m_blocks[i] = b;
+            return i;
+        }
+    }
+    m_blocks.push_back(b);
+    return int(m_blocks.size()) - 1;
+}
+
+void MemoryAllocator::releaseBlock(int blockIndex)
+{
+    Block &b(m_blocks[blockIndex]);
+    if (!b.mem)
+        return;
+
+    if (b.allocationCount)
+        qWarning("Releasing memory block %d with %d allocations still alive", blockIndex, b.allocationCount);
+
+    if (b.p)
+        m_df->vkUnmapMemory(m_dev, b.mem);
+    m_df->vkFreeMemory(m_dev, b.mem, nullptr);
+
+    b = Block();
+}
+
+bool MemoryAllocator::tryAllocate(Block &b, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize *offset)
+{
+    // first fit from the free list
+    for (auto it = b.freeList.begin(); it != b.freeList.end(); ++it) {
+        const VkDeviceSize start = aligned(it->offset, alignment);
+        const VkDeviceSize end = it->offset + it->size;
+        if (start + size > end)
+            continue;
+        const Range r = *it;
+        it = b.freeList.erase(it);
+        if (start + size < end)
+            it = b.freeList.insert(it, { start + size, end - start - size });
+        if (start > r.offset)
+            b.freeList.insert(it, { r.offset, start - r.offset });
+        *offset = start;
+        return true;
+    }
+
+    // bump
+    const VkDeviceSize start = aligned(b.head, alignment);
+    if (start + size > b.size)
+        return false;
+    if (start > b.head)
+        freeRange(b, b.head, start - b.head);
+    b.head = start + size;
+    *offset = start;
+    return true;
+}
+
+MemoryAllocator::Allocation MemoryAllocator::allocate(const VkMemoryRequirements &memReq, VkMemoryPropertyFlags requiredFlags, ResourceKind kind)
+{
+    Allocation a;
+
+    const uint32_t memTypeIndex = chooseMemoryType(memReq.memoryTypeBits, requiredFlags);
+    if (memTypeIndex == UINT_MAX)
+        qFatal("No suitable memory type");
+
+    VkDeviceSize offset = 0;
+    int blockIndex = -1;
+    for (int i = 0; i < int(m_blocks.size()); ++i) {
+        Block &b(m_blocks[i]);
+        if (!b.mem || b.memTypeIndex != memTypeIndex || b.kind != kind)
+            continue;
+        if (tryAllocate(b, memReq.size, memReq.alignment, &offset)) {
+            blockIndex = i;
+            break;
+        }
+    }
+
+    if (blockIndex < 0) {
+        // large resources get a block of their own
+        const VkDeviceSize blockSize = qMax(blockSizeForType(memTypeIndex), memReq.size);
+        blockIndex = createBlock(memTypeIndex, kind, blockSize);
+        if (blockIndex < 0)
+            return a;
+        tryAllocate(m_blocks[blockIndex], memReq.size, memReq.alignment, &offset);
+    }
+
+    Block &b(m_blocks[blockIndex]);
+    b.bytesInUse += memReq.size;
+    b.allocationCount += 1;
+
+    a.mem = b.mem;
+    a.offset = offset;
+    a.size = memReq.size;
+    if (b.p)
+        a.p = static_cast<char *>(b.p) + offset;
+    a.block = blockIndex;
+    return a;
+}
+
+void MemoryAllocator::free(const Allocation &a)
+{
+    if (a.block < 0)
+        return;
+
+    Block &b(m_blocks[a.block]);
+    Q_ASSERT(b.mem == a.mem);
+    b.bytesInUse -= a.size;
+    b.allocationCount -= 1;
+
+    if (!b.allocationCount) {
+        // keep one empty block per memory type and kind around to avoid churn
+        bool hasOther = false;
+        for (int i = 0; i < int(m_blocks.size()); ++i) {
+            if (i != a.block && m_blocks[i].mem
+                    && m_blocks[i].memTypeIndex == b.memTypeIndex && m_blocks[i].kind == b.kind)
+            {
+                hasOther = true;
+                break;
+            }
+        }
+        if (hasOther) {
+            releaseBlock(a.block);
+        } else {
+            b.head = 0;
+            b.freeList.clear();
+        }
+        return;
+    }
+
+    freeRange(b, a.offset, a.size);
+}
+
+void MemoryAllocator::freeRange(Block &b, VkDeviceSize offset, VkDeviceSize size)
+{
+    auto it = b.freeList.begin();
+    while (it != b.freeList.end() && it->offset < offset)
+        ++it;
+    it = b.freeList.insert(it, { offset, size });
+
+    // coalesce with the next and previous ranges
+    auto next = it + 1;
+    if (next != b.freeList.end() && it->offset + it->size == next->offset) {
+        it->size += next->size;
+        it = b.freeList.erase(next) - 1;
+    }
+    if (it != b.freeList.begin()) {
+        auto prev = it - 1;
+        if (prev->offset + prev->size == it->offset) {
+            prev->size += it->size;
+            it = b.freeList.erase(it) - 1;
+        }
+    }
+
+    // give the tail back to the bump pointer
+    if (it->offset + it->size == b.head) {
+        b.head = it->offset;
+        b.freeList.erase(it);
+    }
+}
+
+MemoryAllocator::Stats MemoryAllocator::stats() const
+{
+    Stats s;
+    VkDeviceSize freeBytes = 0;
+    for (const Block &b : m_blocks) {
+        if (!b.mem)
+            continue;
+        s.blockCount += 1;
+        s.allocationCount += b.allocationCount;
+        s.bytesAllocated += b.size;
+        s.bytesInUse += b.bytesInUse;
+        freeBytes += b.size - b.bytesInUse;
+        s.largestFreeRange = qMax(s.largestFreeRange, b.size - b.head);
+        for (const Range &r : b.freeList)
+            s.largestFreeRange = qMax(s.largestFreeRange, r.size);
+    }
+    if (freeBytes)
+        s.fragmentation = 1.0f - float(s.largestFreeRange) / float(freeBytes);
+    return s;
+}
+
+QDebug operator<<(QDebug dbg, const MemoryAllocator::Stats &s)
+{
+    QDebugStateSaver saver(dbg);
+    dbg.nospace() << "MemoryAllocator::Stats(blocks=" << s.blockCount
+                  << " allocations=" << s.allocationCount
+                  << " bytesAllocated=" << s.bytesAllocated
+                  << " bytesInUse=" << s.bytesInUse
+                  << " largestFreeRange=" << s.largestFreeRange
+                  << " fragmentation=" << s.fragmentation << ')';
+    return dbg;
+}
@@ -0,0 +1,94 @@
+#ifndef MEMALLOC_H
+#define MEMALLOC_H
+
+#include <QVulkanFunctions>
+#include <QDebug>
+#include <vector>
+
+template <class Int>
+inline Int aligned(Int v, Int byteAlign)
+{
+    return (v + byteAlign - 1) & ~(byteAlign - 1);
+}
+
+// Sub-allocates buffers and images from a small number of large
+// VkDeviceMemory blocks, so that the number of vkAllocateMemory calls does
+// not scale with the number of meshes/acceleration structures. Blocks are
+// per memory type and per resource kind (linear vs. optimal tiling, so that
+// bufferImageGranularity never needs to be taken into account). Within a
+// block allocation is a bump pointer plus a sorted, coalescing free list for
+// ranges that were returned below the bump pointer. Host visible blocks are
+// mapped persistently.
+class MemoryAllocator
+{
+public:
+    enum ResourceKind {
+        LinearResource, // buffers
+        OptimalResource // optimal tiling images
+    };
+
+    struct Allocation {
+        VkDeviceMemory mem = VK_NULL_HANDLE;
+        VkDeviceSize offset = 0;
+        VkDeviceSize size = 0;
+        void *p = nullptr; // host visible memory only, already offset
+        int block = -1;
+    };
+
+    struct Stats {
+        int blockCount = 0;
+        int allocationCount = 0;
+        VkDeviceSize bytesAllocated = 0; // sum of all block sizes
+        VkDeviceSize bytesInUse = 0;
+        VkDeviceSize largestFreeRange = 0;
+        float fragmentation = 0.0f; // 1 - largestFreeRange / free bytes
+    };
+
+    // deviceAddresses: allocate all blocks with VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT,
+    // which needs the bufferDeviceAddress feature
+    void init(VkPhysicalDevice physDev, VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df,
+              bool deviceAddresses = true);
+    void destroy();
+
+    Allocation allocate(const VkMemoryRequirements &memReq, VkMemoryPropertyFlags requiredFlags, ResourceKind kind);
+    void free(const Allocation &a);
+
+    Stats stats() const;
+
+private:
+    static const VkDeviceSize DEFAULT_BLOCK_SIZE = 64 * 1024 * 1024;
+
+    struct Range {
+        VkDeviceSize offset;
+        VkDeviceSize size;
+    };
+
+    struct Block {
+        VkDeviceMemory mem = VK_NULL_HANDLE;
+        VkDeviceSize size = 0;
+        VkDeviceSize head = 0; // everything from here to size is free
+        std::vector<Range> freeList; // sorted by offset, everything is below head
+        void *p = nullptr;
+        uint32_t memTypeIndex = 0;
+        ResourceKind kind = LinearResource;
+        VkDeviceSize bytesInUse = 0;
+        int allocationCount = 0;
+    };
+
+    uint32_t chooseMemoryType(uint32_t memoryTypeBits, VkMemoryPropertyFlags requiredFlags) const;
+    VkDeviceSize blockSizeForType(uint32_t memTypeIndex) const;
+    int createBlock(uint32_t memTypeIndex, ResourceKind kind, VkDeviceSize size);
+    void releaseBlock(int blockIndex);
+    bool tryAllocate(Block &b, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize *offset);
+    void freeRange(Block &b, VkDeviceSize offset, VkDeviceSize size);
+
+    VkDevice m_dev = VK_NULL_HANDLE;
+    QVulkanDeviceFunctions *m_df = nullptr;
+    bool m_deviceAddresses = true;
+    VkPhysicalDeviceMemoryProperties m_memProps;
+    std::vector<Block> m_blocks; // released blocks stay as empty slots, indices must be stable
+};
+
+QDebug operator<<(QDebug dbg, const MemoryAllocator::Stats &s);
+
+#endif
@@ -0,0 +1,351 @@
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QVulkanInstance>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QFile>
+#include <QDataStream>
+#include <QImage>
+#include <QDebug>
+#include "headlessdevice.h"
+#include "rt.h"
+#include <cstring>
+
+// Renders a scene without a window: N progressive frames into a storage
+// image on a device of our own, the result read back through a staging
+// buffer and written to PNG (or anything else QImage can write) or, with an
+// .exr suffix, to a 32-bit float OpenEXR file from the accumulation image.
+// With several views they are all traced together and written to files of
+// their own.
+
+struct Readback
+{
+    VkBuffer buf = VK_NULL_HANDLE;
+    MemoryAllocator::Allocation alloc;
+};
+
+static Readback createReadback(HeadlessDevice *hd, MemoryAllocator *allocator, VkDeviceSize size)
+{
+    Readback r;
+    VkBufferCreateInfo bufferCreateInfo = {};
+    bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferCreateInfo.size = size;
+    bufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    hd->df->vkCreateBuffer(hd->dev, &bufferCreateInfo, nullptr, &r.buf);
+
+    VkMemoryRequirements memReq = {};
+    hd->df->vkGetBufferMemoryRequirements(hd->dev, r.buf, &memReq);
+    r.alloc = allocator->allocate(memReq, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                  MemoryAllocator::LinearResource);
+    hd->df->vkBindBufferMemory(hd->dev, r.buf, r.alloc.mem, r.alloc.offset);
+    return r;
+}
+
+// all layers, one after the other
+static void copyToReadback(HeadlessDevice *hd, VkCommandBuffer cb, VkImage image,
+                           VkImageLayout layout, VkAccessFlags access, VkPipelineStageFlags stage,
+                           const QSize &size, uint32_t layers, const Readback &r)
+{
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.layerCount = layers;
+    barrier.oldLayout = layout;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    barrier.srcAccessMask = access;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    barrier.image = image;
+    hd->df->vkCmdPipelineBarrier(cb, stage, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    VkBufferImageCopy copyInfo = {};
+    copyInfo.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    copyInfo.imageSubresource.layerCount = layers;
+    copyInfo.imageExtent.width = uint32_t(size.width());
+    copyInfo.imageExtent.height = uint32_t(size.height());
+    copyInfo.imageExtent.depth = 1;
+    hd->df->vkCmdCopyImageToBuffer(cb, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, r.buf, 1, &copyInfo);
+
+    // back to what the next doIt() expects, after the copy is done reading
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    barrier.newLayout = layout;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    barrier.dstAccessMask = access;
+    hd->df->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, stage,
+                                 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    VkMemoryBarrier hostBarrier = {};
+    hostBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    hd->df->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                                 0, 1, &hostBarrier, 0, nullptr, 0, nullptr);
+}
+
+// Single part scanline OpenEXR, uncompressed, FLOAT B, G, R channels (in the
+// alphabetical order the format wants). The input is the accumulation
+// image, so each pixel is divided by its sample count.
+static bool writeExr(const QString &fileName, const float *sums, const QSize &size)
+{
+    QFile f(fileName);
+    if (!f.open(QIODevice::WriteOnly)) {
+        qWarning("Failed to open %s for writing", qPrintable(fileName));
+        return false;
+    }
+
+    const int w = size.width();
+    const int h = size.height();
+    QDataStream s(&f);
+    s.setByteOrder(QDataStream::LittleEndian);
+    s.setFloatingPointPrecision(QDataStream::SinglePrecision);
+
+    auto attribute = [&s](const char *name, const char *type, qint32 valueSize) {
+        s.writeRawData(name, int(strlen(name)) + 1);
+        s.writeRawData(type, int(strlen(type)) + 1);
+        s << valueSize;
+    };
+
+    qint64 headerSize = 0;
+    s << qint32(20000630) << qint32(2); // magic, version 2 with no flags
+
+    static const char channelNames[3] = { 'B', 'G', 'R' };
+    attribute("channels", "chlist", 3 * 18 + 1);
+    for (char c : channelNames) {
+        const char name[2] = { c, '\0' };
+        s.writeRawData(name, 2);
+        s << qint32(2) << quint8(0) << quint8(0) << quint8(0) << quint8(0) << qint32(1) << qint32(1); // FLOAT, pLinear, reserved, sampling
+    }
+    s << quint8(0);
+    attribute("compression", "compression", 1);
+    s << quint8(0); // NO_COMPRESSION
+    attribute("dataWindow", "box2i", 16);
+    s << qint32(0) << qint32(0) << qint32(w - 1) << qint32(h - 1);
+    attribute("displayWindow", "box2i", 16);
+    s << qint32(0) << qint32(0) << qint32(w - 1) << qint32(h - 1);
+    attribute("lineOrder", "lineOrder", 1);
+    s << quint8(0); // INCREASING_Y
+    attribute("pixelAspectRatio", "float", 4);
+    s << 1.0f;
+    attribute("screenWindowCenter", "v2f", 8);
+    s << 0.0f << 0.0f;
+    attribute("screenWindowWidth", "float", 4);
+    s << 1.0f;
+    s << quint8(0); // end of header
+    headerSize = f.pos();
+
+    // one chunk per scanline: y, data size, then each channel's values
+    const qint32 lineDataSize = 3 * w * qint32(sizeof(float));
+    const qint64 chunkSize = 8 + lineDataSize;
+    const qint64 firstChunk = headerSize + qint64(h) * 8;
+    for (int y = 0; y < h; ++y)
+        s << quint64(firstChunk + y * chunkSize);
+
+    std::vector<float> line(3 * w);
+    for (int y = 0; y < h; ++y) {
+        const float *src = sums + size_t(y) * w * 4;
+        for (int x = 0; x < w; ++x) {
+            const float n = qMax(1.0f, src[x * 4 + 3]);
+            line[x] = src[x * 4 + 2] / n; // B
+            line[w + x] = src[x * 4 + 1] / n; // G
+            line[2 * w + x] = src[x * 4] / n; // R
+        }
+        s << qint32(y) << lineDataSize;
+        s.writeRawData(reinterpret_cast<const char *>(line.data()), lineDataSize);
+    }
+
+    return s.status() == QDataStream::Ok;
+}
+
+static QString frameFileName(const QString &fileName, int frame, bool numbered)
+{
+    if (!numbered)
+        return fileName;
+
+    const QFileInfo fi(fileName);
+    const QString base = fi.path() + QLatin1Char('/') + fi.completeBaseName();
+    return base + QString::fromLatin1("_%1.").arg(frame, 4, 10, QLatin1Char('0')) + fi.suffix();
+}
+
+static QString viewFileName(const QString &fileName, int view, int viewCount)
+{
+    if (viewCount == 1)
+        return fileName;
+
+    const QFileInfo fi(fileName);
+    const QString base = fi.path() + QLatin1Char('/') + fi.completeBaseName();
+    return base + QString::fromLatin1("_view%1.").arg(view) + fi.suffix();
+}
+
+int main(int argc, char *argv[])
+{
+    QGuiApplication app(argc, argv);
+
+    QCommandLineParser cmdLineParser;
+    cmdLineParser.addHelpOption();
+    cmdLineParser.addPositionalArgument(QLatin1String("scene"), QLatin1String("Wavefront OBJ or glTF 2.0 (.gltf, .glb) file to render instead of the triangle."));
+    QCommandLineOption sizeOption(QLatin1String("size"), QLatin1String("Output size."), QLatin1String("WxH"), QLatin1String("1920x1080"));
+    cmdLineParser.addOption(sizeOption);
+    QCommandLineOption framesOption(QLatin1String("frames"), QLatin1String("Number of frames to trace."), QLatin1String("N"), QLatin1String("64"));
+    cmdLineParser.addOption(framesOption);
+    QCommandLineOption sppOption(QLatin1String("spp"), QLatin1String("Samples per pixel per frame."), QLatin1String("N"), QLatin1String("1"));
+    cmdLineParser.addOption(sppOption);
+    QCommandLineOption bouncesOption(QLatin1String("bounces"), QLatin1String("Maximum number of bounces."), QLatin1String("N"), QLatin1String("4"));
+    cmdLineParser.addOption(bouncesOption);
+    QCommandLineOption gridOption(QLatin1String("grid"), QLatin1String("Instance the scene N x N times."), QLatin1String("N"), QLatin1String("1"));
+    cmdLineParser.addOption(gridOption);
+    QCommandLineOption yawOption(QLatin1String("yaw"), QLatin1String("Camera orbit yaw in degrees."), QLatin1String("degrees"), QLatin1String("0"));
+    cmdLineParser.addOption(yawOption);
+    QCommandLineOption pitchOption(QLatin1String("pitch"), QLatin1String("Camera orbit pitch in degrees."), QLatin1String("degrees"), QLatin1String("0"));
+    cmdLineParser.addOption(pitchOption);
+    QCommandLineOption viewsOption(QLatin1String("views"), QLatin1String("Trace N views in one dispatch, orbiting the scene at evenly spaced yaw angles from the given one."),
+                                   QLatin1String("N"), QLatin1String("1"));
+    cmdLineParser.addOption(viewsOption);
+    QCommandLineOption outputOption(QStringList() << QLatin1String("o") << QLatin1String("output"),
+                                    QLatin1String("Output file, .exr for linear float data, anything else goes through QImage."),
+                                    QLatin1String("file"), QLatin1String("qvkrt.png"));
+    cmdLineParser.addOption(outputOption);
+    QCommandLineOption saveEveryOption(QLatin1String("save-every"), QLatin1String("Also write every Nth frame, numbered (0 = only the last one)."),
+                                       QLatin1String("N"), QLatin1String("0"));
+    cmdLineParser.addOption(saveEveryOption);
+    QCommandLineOption denoiseOption(QLatin1String("denoise"), QLatin1String("Denoise the output image (not the accumulation written to .exr)."));
+    cmdLineParser.addOption(denoiseOption);
+    QCommandLineOption rayQueryOption(QLatin1String("ray-query"), QLatin1String("Trace with ray queries from a compute shader instead of the ray tracing pipeline."));
+    cmdLineParser.addOption(rayQueryOption);
+    cmdLineParser.process(app);
+
+    const QStringList sizeStr = cmdLineParser.value(sizeOption).split(QLatin1Char('x'));
+    const QSize pixelSize = sizeStr.count() == 2 ? QSize(sizeStr[0].toInt(), sizeStr[1].toInt()) : QSize();
+    if (pixelSize.isEmpty()) {
+        qWarning("Invalid size %s", qPrintable(cmdLineParser.value(sizeOption)));
+        return 1;
+    }
+    const int frameCount = qMax(1, cmdLineParser.value(framesOption).toInt());
+    const int samplesPerFrame = qMax(1, cmdLineParser.value(sppOption).toInt());
+    const int saveEvery = qMax(0, cmdLineParser.value(saveEveryOption).toInt());
+    const int viewCount = qBound(1, cmdLineParser.value(viewsOption).toInt(), Raytracing::MAX_VIEWS);
+    const QString outputFileName = cmdLineParser.value(outputOption);
+    const bool exr = QFileInfo(outputFileName).suffix().compare(QLatin1String("exr"), Qt::CaseInsensitive) == 0;
+
+    QVulkanInstance inst;
+    inst.setApiVersion({ 1, 2 });
+    if (!inst.create()) {
+        qWarning("Failed to create Vulkan instance");
+        return 1;
+    }
+
+    HeadlessDevice hd;
+    if (!hd.create(&inst))
+        return 1;
+
+    Raytracing raytracing;
+    raytracing.init(hd.physDev, hd.dev, hd.f, hd.df, hd.hostCommandsEnabled);
+    raytracing.setSamplesPerFrame(samplesPerFrame);
+    raytracing.setMaxSamples(frameCount * samplesPerFrame); // never converges before the last frame
+    raytracing.setMaxBounces(cmdLineParser.value(bouncesOption).toInt());
+    raytracing.setViewCount(viewCount);
+    for (int i = 0; i < viewCount; ++i) {
+        raytracing.setCameraOrbit(i, cmdLineParser.value(yawOption).toFloat() + i * 360.0f / viewCount,
+                                  cmdLineParser.value(pitchOption).toFloat());
+    }
+    raytracing.setDenoiserEnabled(cmdLineParser.isSet(denoiseOption));
+    if (cmdLineParser.isSet(rayQueryOption))
+        raytracing.setTraceBackend(Raytracing::RayQuery);
+
+    Scene scene;
+    const QStringList args = cmdLineParser.positionalArguments();
+    if (args.isEmpty() || !Scene::load(args.first(), &scene))
+        scene = Scene::triangle();
+    scene.replicate(qMax(1, cmdLineParser.value(gridOption).toInt()));
+    raytracing.setScene(scene);
+
+    const HeadlessDevice::Image output = hd.createOutputImage(raytracing.memoryAllocator(), pixelSize, uint32_t(viewCount),
+                                                              VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+    VkImageLayout outputLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    const int bytesPerPixel = exr ? 4 * sizeof(float) : 4;
+    const VkDeviceSize layerSize = VkDeviceSize(pixelSize.width()) * pixelSize.height() * bytesPerPixel;
+    const Readback readback = createReadback(&hd, raytracing.memoryAllocator(), layerSize * viewCount);
+
+    // Frames that trace nothing (pipeline still compiling, host BLAS builds
+    // in progress) are not counted, and neither is the time before the first
+    // traced one. Readbacks in between (--save-every) do count.
+    QElapsedTimer timer;
+    QElapsedTimer setupTimer;
+    setupTimer.start();
+    int tracedFrames = 0;
+    bool ok = true;
+    for (quint64 frame = 0; tracedFrames < frameCount; ++frame) {
+        const uint slot = uint(frame % HeadlessDevice::SLOT_COUNT);
+        VkCommandBuffer cb = hd.beginCommands(slot);
+        outputLayout = raytracing.doIt(&inst, hd.physDev, hd.dev, hd.df, hd.f,
+                                       cb, output.image, outputLayout, output.view,
+                                       slot, pixelSize);
+
+        bool save = false;
+        if (raytracing.lastFrameTraced()) {
+            if (tracedFrames == 0)
+                timer.start();
+            tracedFrames += 1;
+            save = tracedFrames == frameCount || (saveEvery && tracedFrames % saveEvery == 0);
+            if (save) {
+                if (exr) {
+                    // written by the ray tracing pipeline or, with --ray-query, a compute shader
+                    copyToReadback(&hd, cb, raytracing.accumulationImage(), VK_IMAGE_LAYOUT_GENERAL,
+                                   VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, RaytracingContext::TRACE_STAGES,
+                                   pixelSize, uint32_t(viewCount), readback);
+                } else {
+                    // doIt() leaves it ready for sampling in a fragment shader
+                    copyToReadback(&hd, cb, output.image, outputLayout,
+                                   VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                                   pixelSize, uint32_t(viewCount), readback);
+                }
+            }
+        } else if (setupTimer.elapsed() > 60000) {
+            qWarning("Nothing traced after 60 seconds, giving up");
+            ok = false;
+        }
+
+        hd.submit(slot);
+        if (!ok)
+            break;
+
+        if (save) {
+            hd.wait(slot);
+            for (int view = 0; view < viewCount; ++view) {
+                const QString fileName = viewFileName(frameFileName(outputFileName, tracedFrames, saveEvery > 0), view, viewCount);
+                const uchar *data = static_cast<const uchar *>(readback.alloc.p) + layerSize * view;
+                bool written;
+                if (exr) {
+                    written = writeExr(fileName, reinterpret_cast<const float *>(data), pixelSize);
+                } else {
+                    const QImage img(data, pixelSize.width(), pixelSize.height(), QImage::Format_RGBA8888);
+                    written = img.save(fileName);
+                }
+                if (written)
+                    qDebug("Wrote %s (%u samples per pixel)", qPrintable(fileName), raytracing.sampleCount());
+                else
+                    qWarning("Failed to write %s", qPrintable(fileName));
+                ok &= written;
+            }
+        }
+    }
+    hd.waitIdle();
+
+    if (tracedFrames) {
+        const double seconds = timer.nsecsElapsed() / 1000000000.0;
+        qDebug("%d frames of %d x %dx%d at %d spp in %.3f s: %.2f frames/s, %.2f Msamples/s",
+               tracedFrames, viewCount, pixelSize.width(), pixelSize.height(), samplesPerFrame, seconds,
+               tracedFrames / seconds,
+               double(tracedFrames) * samplesPerFrame * viewCount * pixelSize.width() * pixelSize.height() / seconds / 1000000.0);
+    }
+
+    // the allocator goes away with the Raytracing resources
+    hd.df->vkDestroyBuffer(hd.dev, readback.buf, nullptr);
+    raytracing.memoryAllocator()->free(readback.alloc);
+    hd.destroyImage(raytracing.memoryAllocator(), output);
+    raytracing.releaseResources(hd.dev, hd.df);
+    hd.destroy();
+
+    return ok ? 0 : 1;
+}
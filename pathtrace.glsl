@@ -0,0 +1,131 @@
+// The path tracing of raygen.rgen and rayquery.comp, which differ only in
+// how a ray is traced: they define traceClosest() and call tracePixel() with
+// their launch or invocation id, z being the view. Both need
+// GL_EXT_buffer_reference and one of GL_EXT_ray_tracing and GL_EXT_ray_query.
+// The images have a layer per view.
+
+layout(binding = 0) uniform accelerationStructureEXT topLevelAS;
+layout(binding = 1, rgba8) uniform image2DArray image;
+layout(binding = 3, rgba32f) uniform image2DArray accumImage;
+// for the denoiser, see denoise.glsl
+layout(binding = 4, rgba16f) uniform image2DArray gbuffer[2];
+layout(binding = 5, rgba16f) uniform image2DArray motionImage;
+
+// the closest hit from origin (from params.rayEpsilon on), t < 0 for none
+HitInfo traceClosest(vec3 origin, vec3 direction);
+
+// PCG, see https://www.pcg-random.org
+uint pcg(inout uint state)
+{
+    state = state * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+float rnd(inout uint state)
+{
+    return float(pcg(state)) / 4294967296.0;
+}
+
+vec3 cosineSampleHemisphere(vec3 n, inout uint seed)
+{
+    float r1 = 2.0 * PI * rnd(seed);
+    float r2 = rnd(seed);
+    float r2s = sqrt(r2);
+    vec3 w = n;
+    vec3 u = normalize(cross(abs(w.x) > 0.1 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0), w));
+    vec3 v = cross(w, u);
+    return normalize(u * cos(r1) * r2s + v * sin(r1) * r2s + w * sqrt(1.0 - r2));
+}
+
+vec3 sky(vec3 dir)
+{
+    float t = 0.5 * (dir.y + 1.0);
+    return mix(vec3(0.1, 0.1, 0.2), vec3(0.9, 0.95, 1.0), t);
+}
+
+// what the first sample's camera ray hit: normal and distance, plus where
+// that point was in the previous frame
+void writeGBuffer(ivec3 pos, Camera camera, vec2 pixelPos, vec2 size, vec3 origin, vec3 direction, HitInfo hit)
+{
+    vec4 g = vec4(0.0, 0.0, 0.0, -1.0);
+    vec3 p = origin + direction * 1.0e6; // the sky moves with the camera rotation only
+    float prevDistance = -1.0;
+    if (hit.t >= 0.0) {
+        g = vec4(hit.normal, hit.t);
+        p = origin + direction * hit.t;
+        prevDistance = distance(p, camera.prevOrigin.xyz);
+    }
+
+    const vec4 clip = camera.prevViewProj * vec4(p, 1.0);
+    vec2 motion = vec2(1.0e4); // behind the previous camera, no history
+    if (clip.w > 0.0)
+        motion = (clip.xy / clip.w * 0.5 + 0.5) * size - pixelPos;
+
+    if (params.gbufferIndex == 0u)
+        imageStore(gbuffer[0], pos, g);
+    else
+        imageStore(gbuffer[1], pos, g);
+    imageStore(motionImage, pos, vec4(motion, prevDistance, 0.0));
+}
+
+// the launch covers only a part of the image when the trace is split over
+// frames: a band of rows, or every interleave'th pixel of each row
+uvec2 pixelFor(uvec2 launchId)
+{
+    if (params.interleave > 1u)
+        return uvec2(launchId.x * params.interleave + (launchId.y + params.splitPart) % params.interleave, launchId.y);
+    return uvec2(launchId.x, launchId.y + params.rowOffset);
+}
+
+void tracePixel(uvec3 launchId)
+{
+    const uvec2 size = uvec2(imageSize(accumImage).xy);
+    const uvec2 pos = pixelFor(launchId.xy);
+    if (pos.x >= size.x)
+        return;
+    const uint view = launchId.z;
+    const ivec3 layerPos = ivec3(pos, view);
+    const Camera camera = params.cameras[view];
+    uint seed = ((view * size.y + pos.y) * size.x + pos.x) * 1973u + params.frameSeed * 9277u;
+
+    vec3 color = vec3(0.0);
+    for (uint s = 0; s < params.samplesPerFrame; ++s) {
+        // jitter within the pixel
+        const vec2 pixelPos = vec2(pos) + vec2(rnd(seed), rnd(seed));
+        const vec2 inUV = pixelPos / vec2(size);
+        vec2 d = inUV * 2.0 - 1.0;
+
+        vec3 origin = (camera.viewInverse * vec4(0.0, 0.0, 0.0, 1.0)).xyz;
+        vec4 target = params.projInverse * vec4(d.x, d.y, 1.0, 1.0);
+        vec3 direction = (camera.viewInverse * vec4(normalize(target.xyz), 0.0)).xyz;
+
+        vec3 throughput = vec3(1.0);
+        for (uint bounce = 0; bounce <= params.maxBounces; ++bounce) {
+            const HitInfo hit = traceClosest(origin, direction);
+            if (params.denoise != 0u && s == 0u && bounce == 0u)
+                writeGBuffer(layerPos, camera, pixelPos, vec2(size), origin, direction, hit);
+            if (hit.t < 0.0) {
+                color += throughput * sky(direction);
+                break;
+            }
+            // diffuse grey surfaces, lit only by the sky
+            const vec3 n = faceforward(hit.normal, direction, hit.normal);
+            throughput *= ALBEDO;
+            origin += direction * hit.t + n * params.rayEpsilon;
+            direction = cosineSampleHemisphere(n, seed);
+        }
+    }
+
+    // rgb is the sum of all samples so far, a is the number of them
+    vec4 sum = vec4(color, float(params.samplesPerFrame));
+    if (params.sampleIndex > 0)
+        sum += imageLoad(accumImage, layerPos);
+    imageStore(accumImage, layerPos, sum);
+
+    if (params.denoise != 0u)
+        return;
+
+    const vec3 average = sum.rgb / sum.a;
+    imageStore(image, layerPos, vec4(pow(average, vec3(1.0 / 2.2)), 1.0));
+}
@@ -0,0 +1,128 @@
+#include "pipelinecompiler.h"
+#include <QDebug>
+
+void PipelineCompiler::init(VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df)
+{
+    m_dev = dev;
+    m_df = df;
+
+    vkCreateRayTracingPipelinesKHR = reinterpret_cast<PFN_vkCreateRayTracingPipelinesKHR>(f->vkGetDeviceProcAddr(dev, "vkCreateRayTracingPipelinesKHR"));
+    m_deferredFuncs.resolve(dev, f);
+}
+
+void PipelineCompiler::destroy()
+{
+    for (auto &job : m_jobs) {
+        if (job->op)
+            job->op->waitForDone();
+        finish(job.get());
+        if (job->pipeline)
+            m_df->vkDestroyPipeline(m_dev, job->pipeline, nullptr);
+    }
+    m_jobs.clear();
+}
+
+int PipelineCompiler::compile(VkPipelineCache cache,
+                              const VkRayTracingPipelineCreateInfoKHR &createInfo,
+                              const std::vector<VkPipelineShaderStageCreateInfo> &stages,
+                              const std::vector<VkRayTracingShaderGroupCreateInfoKHR> &groups,
+                              VkPipelineLayout layout)
+{
+    collectDiscarded();
+
+    // everything the create info points to must stay valid until the operation completes
+    std::unique_ptr<Job> job(new Job);
+    job->id = m_nextId++;
+    job->stages = stages;
+    job->groups = groups;
+    job->createInfo = createInfo;
+    job->createInfo.stageCount = uint32_t(job->stages.size());
+    job->createInfo.pStages = job->stages.data();
+    job->createInfo.groupCount = uint32_t(job->groups.size());
+    job->createInfo.pGroups = job->groups.data();
+    job->createInfo.layout = layout;
+
+    job->op.reset(new DeferredOperation(m_dev, &m_deferredFuncs));
+
+    VkResult err = vkCreateRayTracingPipelinesKHR(m_dev, job->op->handle(), cache, 1, &job->createInfo, nullptr, &job->pipeline);
+    if (err == VK_OPERATION_DEFERRED_KHR) {
+        const int workerCount = job->op->startJoining();
+        qDebug("pipeline job %d deferred, joining from %d threads", job->id, workerCount);
+    } else {
+        // VK_OPERATION_NOT_DEFERRED_KHR, or completed/failed synchronously
+        job->op.reset();
+        job->result = err == VK_OPERATION_NOT_DEFERRED_KHR ? VK_SUCCESS : err;
+    }
+
+    const int id = job->id;
+    m_jobs.push_back(std::move(job));
+    return id;
+}
+
+bool PipelineCompiler::isDone(Job *job) const
+{
+    return !job->op || job->op->isDone();
+}
+
+VkResult PipelineCompiler::finish(Job *job)
+{
+    if (job->op) {
+        job->result = job->op->result();
+        job->op.reset();
+    }
+    for (const VkPipelineShaderStageCreateInfo &stage : job->stages)
+        m_df->vkDestroyShaderModule(m_dev, stage.module, nullptr);
+    job->stages.clear();
+    if (job->result != VK_SUCCESS && job->pipeline) {
+        m_df->vkDestroyPipeline(m_dev, job->pipeline, nullptr);
+        job->pipeline = VK_NULL_HANDLE;
+    }
+    return job->result;
+}
+
+PipelineCompiler::Status PipelineCompiler::take(int id, VkPipeline *pipeline)
+{
+    collectDiscarded();
+
+    for (auto it = m_jobs.begin(); it != m_jobs.end(); ++it) {
+        Job *job = it->get();
+        if (job->id != id)
+            continue;
+        if (!isDone(job))
+            return Pending;
+        const VkResult err = finish(job);
+        *pipeline = job->pipeline;
+        m_jobs.erase(it);
+        if (err != VK_SUCCESS || !*pipeline) {
+            qWarning("Failed to create ray tracing pipeline: %d", err);
+            return Failed;
+        }
+        return Ready;
+    }
+
+    return Failed;
+}
+
+void PipelineCompiler::discard(int id)
+{
+    for (auto &job : m_jobs) {
+        if (job->id == id)
+            job->discarded = true;
+    }
+    collectDiscarded();
+}
+
+void PipelineCompiler::collectDiscarded()
+{
+    for (auto it = m_jobs.begin(); it != m_jobs.end(); ) {
+        Job *job = it->get();
+        if (job->discarded && isDone(job)) {
+            finish(job);
+            if (job->pipeline)
+                m_df->vkDestroyPipeline(m_dev, job->pipeline, nullptr);
+            it = m_jobs.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef PIPELINECOMPILER_H
+#define PIPELINECOMPILER_H
+
+#include "deferredop.h"
+#include <memory>
+#include <vector>
+
+// Creates ray tracing pipelines with VK_KHR_deferred_host_operations. The
+// deferred operation is joined from worker threads (see DeferredOperation),
+// so the thread that asked for the pipeline never blocks on compilation.
+// Any number of pipelines (variants) may be compiling at the same time.
+// When the implementation does not defer, the pipeline is simply ready
+// right away.
+class PipelineCompiler
+{
+public:
+    enum Status {
+        Pending,
+        Ready,
+        Failed
+    };
+
+    void init(VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df);
+    void destroy(); // waits for the jobs in progress
+
+    // Takes ownership of the shader modules. pStages, pGroups and
+    // layout in createInfo are ignored, the rest is used as-is.
+    int compile(VkPipelineCache cache,
+                const VkRayTracingPipelineCreateInfoKHR &createInfo,
+                const std::vector<VkPipelineShaderStageCreateInfo> &stages,
+                const std::vector<VkRayTracingShaderGroupCreateInfoKHR> &groups,
+                VkPipelineLayout layout);
+
+    // The pipeline is handed over on Ready, the job is gone after Ready or Failed.
+    Status take(int job, VkPipeline *pipeline);
+
+    // For a job whose result is not wanted anymore. The pipeline is
+    // destroyed once it is done.
+    void discard(int job);
+
+    int pendingCount() const { return int(m_jobs.size()); }
+
+private:
+    struct Job {
+        int id = 0;
+        bool discarded = false;
+        std::vector<VkPipelineShaderStageCreateInfo> stages;
+        std::vector<VkRayTracingShaderGroupCreateInfoKHR> groups;
+        VkRayTracingPipelineCreateInfoKHR createInfo;
+        std::unique_ptr<DeferredOperation> op; // only while deferred
+        VkResult result = VK_SUCCESS; // when not deferred
+        VkPipeline pipeline = VK_NULL_HANDLE;
+    };
+
+    bool isDone(Job *job) const;
+    VkResult finish(Job *job);
+    void collectDiscarded();
+
+    VkDevice m_dev = VK_NULL_HANDLE;
+    QVulkanDeviceFunctions *m_df = nullptr;
+    PFN_vkCreateRayTracingPipelinesKHR vkCreateRayTracingPipelinesKHR = nullptr;
+    DeferredOperation::Functions m_deferredFuncs;
+
+    int m_nextId = 1;
+    std::vector<std::unique_ptr<Job>> m_jobs;
+};
+
+#endif
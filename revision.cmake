@@ -0,0 +1,26 @@
+# Writes the git revision of the sources to OUTPUT as QVKRT_REVISION. Run
+# on every build by the qvkrt_revision target; the file is only rewritten
+# when the revision changed, so nothing is recompiled otherwise.
+set(revision "unknown")
+if(GIT_EXECUTABLE)
+    execute_process(
+        COMMAND "${GIT_EXECUTABLE}" describe --always --dirty
+        WORKING_DIRECTORY "${SOURCE_DIR}"
+        OUTPUT_VARIABLE described
+        OUTPUT_STRIP_TRAILING_WHITESPACE
+        RESULT_VARIABLE result
+        ERROR_QUIET
+    )
+    if(result EQUAL 0 AND described)
+        set(revision "${described}")
+    endif()
+endif()
+
+set(content "#define QVKRT_REVISION \"${revision}\"\n")
+set(previous "")
+if(EXISTS "${OUTPUT}")
+    file(READ "${OUTPUT}" previous)
+endif()
+if(NOT content STREQUAL previous)
+    file(WRITE "${OUTPUT}" "${content}")
+endif()
@@ -1,118 +1,471 @@
 #include "rt.h"
-#include <QFile>
 #include <QDebug>
+#include <QtMath>
+#include <cstring>
 
-template <class Int>
-inline Int aligned(Int v, Int byteAlign)
+void Raytracing::init(VkPhysicalDevice physDev, VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df,
+                      bool hostCommandsEnabled)
 {
-    return (v + byteAlign - 1) & ~(byteAlign - 1);
+    init(RaytracingContext::create(physDev, dev, f, df, hostCommandsEnabled), dev, df);
 }
 
-void Raytracing::init(VkPhysicalDevice physDev, VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df)
+void Raytracing::init(std::shared_ptr<RaytracingContext> context, VkDevice dev, QVulkanDeviceFunctions *df)
 {
-    VkPhysicalDeviceRayTracingPipelinePropertiesKHR rtProps = {};
-    rtProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR;
-    VkPhysicalDeviceProperties2 deviceProperties2 = {};
-    deviceProperties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
-    deviceProperties2.pNext = &rtProps;
-    f->vkGetPhysicalDeviceProperties2(physDev, &deviceProperties2);
-
-    qDebug() << "shaderGroupHandleSize" << rtProps.shaderGroupHandleSize
-             << "maxRayRecursionDepth" << rtProps.maxRayRecursionDepth
-             << "maxShaderGroupStride" << rtProps.maxShaderGroupStride
-             << "shaderGroupBaseAlignment" << rtProps.shaderGroupBaseAlignment
-             << "maxRayDispatchInvocationCount" << rtProps.maxRayDispatchInvocationCount
-             << "shaderGroupHandleAlignment" << rtProps.shaderGroupHandleAlignment
-             << "maxRayHitAttributeSize" << rtProps.maxRayHitAttributeSize;
-
-    m_rtProps = rtProps;
-
-    VkPhysicalDeviceAccelerationStructureFeaturesKHR asFeatures = {};
-    asFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
-    VkPhysicalDeviceFeatures2 deviceFeatures2 = {};
-    deviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
-    deviceFeatures2.pNext = &asFeatures;
-    f->vkGetPhysicalDeviceFeatures2(physDev, &deviceFeatures2);
-
-    qDebug() << "features: accelerationStructure" << asFeatures.accelerationStructure
-             << "accelerationStructureIndirectBuild" << asFeatures.accelerationStructureIndirectBuild
-             << "accelerationStructureHostCommands" << asFeatures.accelerationStructureHostCommands
-             << "descriptorBindingAccelerationStructureUpdateAfterBind" << asFeatures.descriptorBindingAccelerationStructureUpdateAfterBind;
-
-    m_asFeatures = asFeatures;
-
-    vkGetBufferDeviceAddressKHR = reinterpret_cast<PFN_vkGetBufferDeviceAddressKHR>(f->vkGetDeviceProcAddr(dev, "vkGetBufferDeviceAddressKHR"));
-    vkCmdBuildAccelerationStructuresKHR = reinterpret_cast<PFN_vkCmdBuildAccelerationStructuresKHR>(f->vkGetDeviceProcAddr(dev, "vkCmdBuildAccelerationStructuresKHR"));
-    vkBuildAccelerationStructuresKHR = reinterpret_cast<PFN_vkBuildAccelerationStructuresKHR>(f->vkGetDeviceProcAddr(dev, "vkBuildAccelerationStructuresKHR"));
-    vkCreateAccelerationStructureKHR = reinterpret_cast<PFN_vkCreateAccelerationStructureKHR>(f->vkGetDeviceProcAddr(dev, "vkCreateAccelerationStructureKHR"));
-    vkDestroyAccelerationStructureKHR = reinterpret_cast<PFN_vkDestroyAccelerationStructureKHR>(f->vkGetDeviceProcAddr(dev, "vkDestroyAccelerationStructureKHR"));
-    vkGetAccelerationStructureBuildSizesKHR = reinterpret_cast<PFN_vkGetAccelerationStructureBuildSizesKHR>(f->vkGetDeviceProcAddr(dev, "vkGetAccelerationStructureBuildSizesKHR"));
-    vkGetAccelerationStructureDeviceAddressKHR = reinterpret_cast<PFN_vkGetAccelerationStructureDeviceAddressKHR>(f->vkGetDeviceProcAddr(dev, "vkGetAccelerationStructureDeviceAddressKHR"));
-    vkCmdTraceRaysKHR = reinterpret_cast<PFN_vkCmdTraceRaysKHR>(f->vkGetDeviceProcAddr(dev, "vkCmdTraceRaysKHR"));
-    vkGetRayTracingShaderGroupHandlesKHR = reinterpret_cast<PFN_vkGetRayTracingShaderGroupHandlesKHR>(f->vkGetDeviceProcAddr(dev, "vkGetRayTracingShaderGroupHandlesKHR"));
-    vkCreateRayTracingPipelinesKHR = reinterpret_cast<PFN_vkCreateRayTracingPipelinesKHR>(f->vkGetDeviceProcAddr(dev, "vkCreateRayTracingPipelinesKHR"));
+    m_ctx = std::move(context);
+    m_ctxFrame = 0;
+    m_ctxRevision = m_ctx->revision();
+    m_ctxSceneRevision = m_ctx->sceneRevision();
+    m_dirty = RaytracingContext::CameraStage;
+    m_lastOutputImageView = VK_NULL_HANDLE;
+    m_lastPixelSize = QSize();
+    m_gpuTimings = {};
+    restartAccumulation();
+
+    if (m_ctx->isCpuTracing()) {
+        for (Buffer &b : m_cpuStaging)
+            b = {};
+        return;
+    }
+
+    if (m_traceBackend == RayQuery && !m_ctx->hasRayQuery())
+        qWarning("No ray query support, tracing with the ray tracing pipeline");
+
+    const VkPhysicalDeviceLimits &limits(m_ctx->deviceProperties().limits);
+    if (limits.timestampComputeAndGraphics && limits.timestampPeriod > 0.0f) {
+        VkQueryPoolCreateInfo queryPoolInfo = {};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolInfo.queryCount = FRAMES_IN_FLIGHT * TimestampCount;
+        df->vkCreateQueryPool(dev, &queryPoolInfo, nullptr, &m_timestampPool);
+        m_timestampPeriod = limits.timestampPeriod;
+    }
+    for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
+        m_timestampSlots[i] = {};
+    m_nextTimestamp = TimestampCount;
 
     static const VkDescriptorPoolSize poolSizes[] = {
         { VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, FRAMES_IN_FLIGHT },
-        { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, FRAMES_IN_FLIGHT },
-        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, FRAMES_IN_FLIGHT }
+        { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, (5 + 9) * FRAMES_IN_FLIGHT },
+        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, FRAMES_IN_FLIGHT }
     };
     VkDescriptorPoolCreateInfo poolCreateInfo = {};
     poolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    poolCreateInfo.maxSets = FRAMES_IN_FLIGHT * 1024; // ### so max 1024 resizes for now since we do not really free anything
+    poolCreateInfo.maxSets = 2 * FRAMES_IN_FLIGHT; // allocated once, updated in place afterwards
     poolCreateInfo.poolSizeCount = sizeof(poolSizes) / sizeof(poolSizes[0]);
     poolCreateInfo.pPoolSizes = poolSizes;
     df->vkCreateDescriptorPool(dev, &poolCreateInfo, nullptr, &m_descPool);
 
-    for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
-        m_uniformBuffers[i] = createHostVisibleBuffer(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, physDev, dev, f, df, 2 * 64);
+    // the layouts are the context's, the sets point to this view's images
+    const VkDescriptorSetLayout descSetLayout = m_ctx->descriptorSetLayout();
+    const VkDescriptorSetLayout denoiseDescSetLayout = m_ctx->denoiseDescriptorSetLayout();
+    VkDescriptorSetAllocateInfo descSetAllocInfo = {};
+    descSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descSetAllocInfo.descriptorPool = m_descPool;
+    descSetAllocInfo.descriptorSetCount = 1;
+    descSetAllocInfo.pSetLayouts = &descSetLayout;
+    for (int i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+        df->vkAllocateDescriptorSets(dev, &descSetAllocInfo, &m_descSets[i]);
+        m_descSetState[i] = {};
+    }
+    descSetAllocInfo.pSetLayouts = &denoiseDescSetLayout;
+    for (int i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+        df->vkAllocateDescriptorSets(dev, &descSetAllocInfo, &m_denoiseDescSets[i]);
+        m_denoiseDescSetState[i] = {};
+    }
+    m_denoiseCurrent = 0;
+    m_denoiseHistoryValid = false;
+}
 
-    m_lastOutputImageView = VK_NULL_HANDLE;
+void Raytracing::releaseResources(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    if (!m_ctx)
+        return;
+
+    df->vkDeviceWaitIdle(dev);
+
+    // the context may be shared and live on, its queue releases the images
+    for (Buffer &b : m_cpuStaging) {
+        m_ctx->releaseLater(b);
+        b = {};
+    }
+    m_cpuAccum.clear();
+    m_ctx->releaseLater(m_accumImage);
+    m_accumImage = {};
+    m_accumImageSize = QSize();
+    for (Image &image : m_denoiseImages) {
+        m_ctx->releaseLater(image);
+        image = {};
+    }
+    m_denoiseImageSize = QSize();
+    releaseAsync(dev, df);
+
+    if (m_timestampPool) {
+        df->vkDestroyQueryPool(dev, m_timestampPool, nullptr);
+        m_timestampPool = VK_NULL_HANDLE;
+    }
+
+    if (m_descPool) {
+        df->vkDestroyDescriptorPool(dev, m_descPool, nullptr);
+        m_descPool = VK_NULL_HANDLE;
+    }
+
+    m_ctx.reset();
 }
 
-static const char entryPoint[] = "main";
+void Raytracing::setMaxBounces(int n)
+{
+    const uint32_t v = uint32_t(qMax(0, n));
+    if (m_maxBounces == v)
+        return;
 
-static VkPipelineShaderStageCreateInfo getShader(const QString &name, VkShaderStageFlagBits stage, VkDevice dev, QVulkanDeviceFunctions *df)
+    m_maxBounces = v;
+    restartAccumulation();
+}
+
+void Raytracing::setDenoiserEnabled(bool enable)
 {
-    QFile f(name);
-    if (!f.open(QIODevice::ReadOnly))
-        qFatal("Failed to open %s", qPrintable(name));
-    const QByteArray data = f.readAll();
-
-    VkShaderModuleCreateInfo shaderInfo = {};
-    shaderInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    shaderInfo.codeSize = data.size();
-    shaderInfo.pCode = reinterpret_cast<const quint32 *>(data.constData());
-    VkShaderModule module;
-    df->vkCreateShaderModule(dev, &shaderInfo, nullptr, &module);
-
-    VkPipelineShaderStageCreateInfo info = {};
-    info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    info.stage = stage;
-    info.module = module;
-    info.pName = entryPoint;
-
-    return info;
+    if (m_denoise == enable)
+        return;
+
+    m_denoise = enable;
+    restartAccumulation();
 }
 
-static const uint32_t vertHighestIndex = 3; // ??
-static const uint32_t vertStride = 3 * sizeof(float);
-static const VkFormat vertFormat = VK_FORMAT_R32G32B32_SFLOAT;
-static const float verts[] = {
-    1.0f, 1.0f, 0.0f,
-    -1.0, 1.0f, 0.0f,
-    0.0f, -1.0f, 0.0f
-};
-
-static const uint32_t indices[] = {
-    0, 1, 2
-};
-
-//static const VkTransformMatrixKHR transform = { // 3x4 row major
-//    1.0f, 0.0f, 0.0f, 0.0f,
-//    0.0f, 1.0f, 0.0f, 0.0f,
-//    0.0f, 0.0f, 1.0f, 0.0f
-//};
+void Raytracing::setViewCount(int n)
+{
+    const int v = qBound(1, n, MAX_VIEWS);
+    if (m_viewCount == v)
+        return;
+
+    m_viewCount = v;
+    // the images are recreated with as many layers by the next frame
+    m_lastPixelSize = QSize();
+    m_accumImageSize = QSize();
+    m_denoiseImageSize = QSize();
+    m_dirty |= RaytracingContext::CameraStage;
+}
+
+void Raytracing::setCameraOrbit(int view, float yaw, float pitch)
+{
+    Q_ASSERT(view >= 0 && view < MAX_VIEWS);
+    Camera &camera(m_cameras[view]);
+    if (camera.yaw == yaw && camera.pitch == pitch)
+        return;
+
+    camera.yaw = yaw;
+    camera.pitch = pitch;
+    // the other views restart too, they share the accumulation
+    m_dirty |= RaytracingContext::CameraStage;
+}
+
+void Raytracing::setTraceBackend(TraceBackend backend)
+{
+    if (m_traceBackend == backend)
+        return;
+
+    m_traceBackend = backend;
+    // the same samples either way, so the accumulation goes on, but the
+    // ray budget measured with the other backend does not apply
+    m_measuredRayBudget = 0;
+}
+
+static void computeBarrier(VkCommandBuffer cb, QVulkanDeviceFunctions *df)
+{
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    df->vkCmdPipelineBarrier(cb,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void Raytracing::denoise(VkCommandBuffer cb, uint currentFrameSlot, bool accumulating, const QSize &pixelSize,
+                         VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    const VkPipeline temporalPipeline = m_ctx->denoiseTemporalPipeline(dev, df);
+    const VkPipelineLayout pipelineLayout = m_ctx->denoisePipelineLayout();
+
+    {
+        // the trace wrote the accumulation image and the G-buffer
+        VkMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        df->vkCmdPipelineBarrier(cb,
+                                 RaytracingContext::TRACE_STAGES,
+                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                 0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
+
+    // a-trous passes with doubling step sizes, fewer as the samples add
+    // up since the accumulation averages out the noise by itself
+    int iterations = 0;
+    if (m_sampleCount < DENOISE_LAST_SAMPLES) {
+        const int log2Samples = qFloor(std::log2(double(qMax(1u, m_sampleCount))));
+        iterations = qBound(1, DENOISE_ITERATIONS - log2Samples / 2, DENOISE_ITERATIONS);
+    }
+
+    const uint32_t groupsX = (uint32_t(pixelSize.width()) + DENOISE_WORKGROUP_SIZE - 1) / DENOISE_WORKGROUP_SIZE;
+    const uint32_t groupsY = (uint32_t(pixelSize.height()) + DENOISE_WORKGROUP_SIZE - 1) / DENOISE_WORKGROUP_SIZE;
+
+    df->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1,
+                                &m_denoiseDescSets[currentFrameSlot], 0, nullptr);
+
+    DenoiseParams params = {};
+    params.current = m_denoiseCurrent;
+    if (m_denoiseHistoryValid)
+        params.flags |= RaytracingContext::HistoryValid;
+    if (accumulating)
+        params.flags |= RaytracingContext::Accumulating;
+    if (!iterations)
+        params.flags |= RaytracingContext::FinalPass;
+    df->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, temporalPipeline);
+    df->vkCmdPushConstants(cb, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+    df->vkCmdDispatch(cb, groupsX, groupsY, uint32_t(m_viewCount));
+
+    if (iterations)
+        df->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, m_ctx->denoiseAtrousPipeline());
+    for (int i = 0; i < iterations; ++i) {
+        computeBarrier(cb, df);
+        params.flags = i == iterations - 1 ? RaytracingContext::FinalPass : 0;
+        params.stepSize = 1u << i;
+        params.source = uint32_t(i & 1);
+        df->vkCmdPushConstants(cb, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+        df->vkCmdDispatch(cb, groupsX, groupsY, uint32_t(m_viewCount));
+    }
+
+    m_denoiseCurrent ^= 1;
+    m_denoiseHistoryValid = true;
+}
+
+// In async mode the output image is read on another queue, Qt Quick's
+// reads and the writes here are ordered by the timeline semaphore and by
+// not reusing an image while it may be shown instead of these barriers.
+void Raytracing::clearToPlaceholder(VkCommandBuffer cb, VkImage outputImage, VkImageLayout currentOutputImageLayout,
+                                    QVulkanDeviceFunctions *df)
+{
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+    barrier.oldLayout = currentOutputImageLayout;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcAccessMask = isAsync() ? 0 : VK_ACCESS_SHADER_READ_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.image = outputImage;
+    df->vkCmdPipelineBarrier(cb,
+                             isAsync() ? VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT : VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0, 0, nullptr, 0, nullptr,
+                             1, &barrier);
+
+    VkClearColorValue clearColor = {};
+    clearColor.float32[0] = 0.2f;
+    clearColor.float32[1] = 0.2f;
+    clearColor.float32[2] = 0.2f;
+    clearColor.float32[3] = 1.0f;
+    df->vkCmdClearColorImage(cb, outputImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clearColor, 1, &barrier.subresourceRange);
+
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = isAsync() ? 0 : VK_ACCESS_SHADER_READ_BIT;
+    df->vkCmdPipelineBarrier(cb,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             isAsync() ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT : VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                             0, 0, nullptr, 0, nullptr,
+                             1, &barrier);
+}
+
+void Raytracing::updateCamera(const QSize &pixelSize)
+{
+    m_proj.setToIdentity();
+    const float aspectRatio = float(pixelSize.width()) / pixelSize.height();
+    const QVector3D sceneCenter = m_ctx->sceneCenter();
+    const float sceneRadius = m_ctx->sceneRadius();
+    m_proj.perspective(60.0f, aspectRatio, qMin(0.1f, sceneRadius * 0.01f), qMax(512.0f, sceneRadius * 10.0f));
+
+    m_projInv = m_proj.inverted();
+
+    // look at the scene from the front (rotated by the orbit angles),
+    // fitting its bounding sphere comfortably
+    const float distance = 2.0f * sceneRadius / qTan(qDegreesToRadians(30.0f));
+    for (int i = 0; i < m_viewCount; ++i) {
+        Camera &camera(m_cameras[i]);
+        QMatrix4x4 orbit;
+        orbit.rotate(camera.yaw, 0.0f, 1.0f, 0.0f);
+        orbit.rotate(camera.pitch, 1.0f, 0.0f, 0.0f);
+        const QVector3D eye = sceneCenter + orbit.map(QVector3D(0.0f, 0.0f, distance));
+        const QVector3D up = orbit.mapVector(QVector3D(0.0f, 1.0f, 0.0f));
+        camera.view.setToIdentity();
+        camera.view.lookAt(eye, sceneCenter, up);
+        camera.viewInv = camera.view.inverted();
+    }
+}
+
+void Raytracing::beginPass(const QSize &pixelSize)
+{
+    m_passSamples = m_samplesPerFrame;
+    m_passSplit = m_traceSplit;
+
+    const quint64 passRays = quint64(pixelSize.width()) * pixelSize.height() * m_passSamples * m_viewCount;
+    quint64 budget = m_rayBudget;
+    if (m_traceTimeBudget > 0) // a guess until there are timings
+        budget = m_measuredRayBudget ? m_measuredRayBudget : passRays / 8;
+
+    // at least one row (or one pixel of each row) per part
+    m_passParts = 1;
+    if (budget && !isAsync())
+        m_passParts = uint32_t(qBound(quint64(1), (passRays + budget - 1) / budget, quint64(pixelSize.height())));
+}
+
+void Raytracing::updateDescriptorSet(uint currentFrameSlot, VkImageView outputImageView, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    DescSetState &state(m_descSetState[currentFrameSlot]);
+    const VkDescriptorSet descSet = m_descSets[currentFrameSlot];
+    VkWriteDescriptorSet writeSets[6];
+    uint32_t writeCount = 0;
+
+    const VkAccelerationStructureKHR tlas = m_ctx->tlas();
+    VkWriteDescriptorSetAccelerationStructureKHR descSetAS = {};
+    if (state.tlas != tlas) {
+        descSetAS.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
+        descSetAS.accelerationStructureCount = 1;
+        descSetAS.pAccelerationStructures = &tlas;
+        VkWriteDescriptorSet asWrite = {};
+        asWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        asWrite.pNext = &descSetAS;
+        asWrite.dstSet = descSet;
+        asWrite.dstBinding = 0;
+        asWrite.descriptorCount = 1;
+        asWrite.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+        writeSets[writeCount++] = asWrite;
+        state.tlas = tlas;
+    }
+
+    VkDescriptorImageInfo descOutputImage = {};
+    if (state.outputImageView != outputImageView) {
+        descOutputImage.imageView = outputImageView;
+        descOutputImage.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        VkWriteDescriptorSet imageWrite = {};
+        imageWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        imageWrite.dstSet = descSet;
+        imageWrite.dstBinding = 1;
+        imageWrite.descriptorCount = 1;
+        imageWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        imageWrite.pImageInfo = &descOutputImage;
+        writeSets[writeCount++] = imageWrite;
+        state.outputImageView = outputImageView;
+    }
+
+    const VkBuffer ub = m_ctx->streamBuffer();
+    VkDescriptorBufferInfo descUniformBuffer = {};
+    if (state.ub != ub) {
+        descUniformBuffer.buffer = ub;
+        descUniformBuffer.range = sizeof(FrameParams);
+        VkWriteDescriptorSet ubWrite = {};
+        ubWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        ubWrite.dstSet = descSet;
+        ubWrite.dstBinding = 2;
+        ubWrite.descriptorCount = 1;
+        ubWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        ubWrite.pBufferInfo = &descUniformBuffer;
+        writeSets[writeCount++] = ubWrite;
+        state.ub = ub;
+    }
+
+    VkDescriptorImageInfo descAccumImage = {};
+    if (state.accumImageView != m_accumImage.view) {
+        descAccumImage.imageView = m_accumImage.view;
+        descAccumImage.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        VkWriteDescriptorSet imageWrite = {};
+        imageWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        imageWrite.dstSet = descSet;
+        imageWrite.dstBinding = 3;
+        imageWrite.descriptorCount = 1;
+        imageWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        imageWrite.pImageInfo = &descAccumImage;
+        writeSets[writeCount++] = imageWrite;
+        state.accumImageView = m_accumImage.view;
+    }
+
+    VkDescriptorImageInfo descDenoiseImages[3] = {};
+    if (state.denoiseImageView != m_denoiseImages[0].view) {
+        const DenoiseImage images[3] = { GBufferImage0, GBufferImage1, MotionImage };
+        for (int i = 0; i < 3; ++i) {
+            descDenoiseImages[i].imageView = m_denoiseImages[images[i]].view;
+            descDenoiseImages[i].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        }
+        VkWriteDescriptorSet imageWrite = {};
+        imageWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        imageWrite.dstSet = descSet;
+        imageWrite.dstBinding = 4;
+        imageWrite.descriptorCount = 2;
+        imageWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        imageWrite.pImageInfo = descDenoiseImages;
+        writeSets[writeCount++] = imageWrite;
+        imageWrite.dstBinding = 5;
+        imageWrite.descriptorCount = 1;
+        imageWrite.pImageInfo = &descDenoiseImages[2];
+        writeSets[writeCount++] = imageWrite;
+        state.denoiseImageView = m_denoiseImages[0].view;
+    }
+
+    if (writeCount)
+        df->vkUpdateDescriptorSets(dev, writeCount, writeSets, 0, VK_NULL_HANDLE);
+}
+
+void Raytracing::updateDenoiseDescriptorSet(uint currentFrameSlot, VkImageView outputImageView, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    DescSetState &state(m_denoiseDescSetState[currentFrameSlot]);
+    if (state.outputImageView == outputImageView && state.accumImageView == m_accumImage.view
+            && state.denoiseImageView == m_denoiseImages[0].view)
+    {
+        return;
+    }
+
+    // in the order of the bindings, see denoise.glsl
+    const VkImageView views[9] = {
+        m_accumImage.view,
+        outputImageView,
+        m_denoiseImages[GBufferImage0].view,
+        m_denoiseImages[GBufferImage1].view,
+        m_denoiseImages[MotionImage].view,
+        m_denoiseImages[HistoryImage0].view,
+        m_denoiseImages[HistoryImage1].view,
+        m_denoiseImages[FilterImage0].view,
+        m_denoiseImages[FilterImage1].view
+    };
+    VkDescriptorImageInfo descImages[9] = {};
+    for (int i = 0; i < 9; ++i) {
+        descImages[i].imageView = views[i];
+        descImages[i].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    }
+
+    VkWriteDescriptorSet writeSets[RaytracingContext::DENOISE_BINDING_COUNT];
+    uint32_t first = 0;
+    for (uint32_t binding = 0; binding < RaytracingContext::DENOISE_BINDING_COUNT; ++binding) {
+        VkWriteDescriptorSet imageWrite = {};
+        imageWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        imageWrite.dstSet = m_denoiseDescSets[currentFrameSlot];
+        imageWrite.dstBinding = binding;
+        imageWrite.descriptorCount = RaytracingContext::DENOISE_IMAGE_COUNTS[binding];
+        imageWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        imageWrite.pImageInfo = &descImages[first];
+        writeSets[binding] = imageWrite;
+        first += RaytracingContext::DENOISE_IMAGE_COUNTS[binding];
+    }
+    df->vkUpdateDescriptorSets(dev, RaytracingContext::DENOISE_BINDING_COUNT, writeSets, 0, VK_NULL_HANDLE);
+
+    state.outputImageView = outputImageView;
+    state.accumImageView = m_accumImage.view;
+    state.denoiseImageView = m_denoiseImages[0].view;
+}
 
 VkImageLayout Raytracing::doIt(QVulkanInstance *inst,
                                VkPhysicalDevice physDev,
@@ -126,353 +479,89 @@ VkImageLayout Raytracing::doIt(QVulkanInstance *inst,
                                uint currentFrameSlot,
                                const QSize &pixelSize)
 {
-    if (!m_vertexBuffer.buf || (m_lastOutputImageView && m_lastOutputImageView != outputImageView)) {
-        qDebug("setup");
+    if (m_ctx->isCpuTracing())
+        return doItCpu(dev, df, cb, outputImage, currentOutputImageLayout, currentFrameSlot, pixelSize);
+
+    m_ctx->beginFrame(currentFrameSlot, &m_ctxFrame, dev, df);
+    m_lastFrameTraced = false;
+    m_lastFrameWroteOutput = false;
+
+    // a converged image with nothing to bring up to date records nothing,
+    // not even the timestamps
+    const bool idle = isConverged() && !m_dirty && !m_ctx->isDirty() && !hasPendingWork()
+            && outputImageView == m_lastOutputImageView && pixelSize == m_lastPixelSize
+            && m_ctxRevision == m_ctx->revision() && m_ctxSceneRevision == m_ctx->sceneRevision();
+    if (idle)
+        return currentOutputImageLayout;
+
+    beginTimestamps(cb, currentFrameSlot, dev, df);
+
+    if (outputImageView != m_lastOutputImageView || pixelSize != m_lastPixelSize) {
+        // resize: the descriptor set update below picks up the new view, only the projection changes
+        // a new view of the same size has a handle value of its own, see releaseOutputImage()
+        if (pixelSize != m_lastPixelSize)
+            invalidateDescriptorSets();
         m_lastOutputImageView = outputImageView;
+        m_lastPixelSize = pixelSize;
+        m_dirty |= RaytracingContext::CameraStage;
+        if (m_accumImageSize != pixelSize)
+            createAccumImage(pixelSize, dev, df);
+    }
 
-        // bottom level acceleration structure
-        {
-            m_vertexBuffer = createHostVisibleBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, physDev, dev, f, df, sizeof(verts));
-            updateHostData(m_vertexBuffer, dev, df, verts, sizeof(verts));
-            m_indexBuffer = createHostVisibleBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, physDev, dev, f, df, sizeof(indices));
-            updateHostData(m_indexBuffer, dev, df, indices, sizeof(indices));
-            // no extra transformation on the vertices for now
-//            m_transformBuffer = createHostVisibleBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, physDev, dev, f, df, sizeof(transform));
-//            updateHostData(m_transformBuffer, dev, df, transform.matrix, sizeof(transform.matrix));
-
-            VkDeviceOrHostAddressConstKHR vertexBufferDeviceAddress = {};
-            vertexBufferDeviceAddress.deviceAddress = m_vertexBuffer.addr;
-            VkDeviceOrHostAddressConstKHR indexBufferDeviceAddress = {};
-            indexBufferDeviceAddress.deviceAddress = m_indexBuffer.addr;
-//            VkDeviceOrHostAddressConstKHR transformBufferDeviceAddress = {};
-//            transformBufferDeviceAddress.deviceAddress = m_transformBuffer.addr;
-
-            VkAccelerationStructureGeometryKHR asGeom = {};
-            asGeom.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-            asGeom.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-            asGeom.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
-            asGeom.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
-            asGeom.geometry.triangles.vertexFormat = vertFormat;
-            asGeom.geometry.triangles.vertexData = vertexBufferDeviceAddress;
-            asGeom.geometry.triangles.vertexStride = vertStride;
-            asGeom.geometry.triangles.maxVertex = vertHighestIndex;
-            asGeom.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
-            asGeom.geometry.triangles.indexData = indexBufferDeviceAddress;
-            //asGeom.geometry.triangles.transformData = transformBufferDeviceAddress;
-
-            VkAccelerationStructureBuildGeometryInfoKHR asBuildGeomInfo = {};
-            asBuildGeomInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-            asBuildGeomInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-            asBuildGeomInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-            asBuildGeomInfo.geometryCount = 1;
-            asBuildGeomInfo.pGeometries = &asGeom;
-            const uint32_t primitiveCountPerGeometry = 1; // geometryCount elements
-            VkAccelerationStructureBuildSizesInfoKHR sizeInfo = {};
-            sizeInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-            vkGetAccelerationStructureBuildSizesKHR(dev,
-                                                    VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-                                                    &asBuildGeomInfo,
-                                                    &primitiveCountPerGeometry,
-                                                    &sizeInfo);
-
-            qDebug() << "blas buffer size" << sizeInfo.accelerationStructureSize;
-            m_blasBuffer = createASBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR, physDev, dev, f, df,
-                                          sizeInfo.accelerationStructureSize);
-
-            VkAccelerationStructureCreateInfoKHR asCreateInfo = {};
-            asCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
-            asCreateInfo.buffer = m_blasBuffer.buf;
-            asCreateInfo.size = sizeInfo.accelerationStructureSize;
-            asCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-            vkCreateAccelerationStructureKHR(dev, &asCreateInfo, nullptr, &m_blas);
-
-            qDebug() << "blas scratch buffer size" << sizeInfo.buildScratchSize;
-            Buffer scratch = createASBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, physDev, dev, f, df, sizeInfo.buildScratchSize);
-
-            memset(&asBuildGeomInfo, 0, sizeof(asBuildGeomInfo));
-            asBuildGeomInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-            asBuildGeomInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-            asBuildGeomInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-            asBuildGeomInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-            asBuildGeomInfo.dstAccelerationStructure = m_blas;
-            asBuildGeomInfo.geometryCount = 1;
-            asBuildGeomInfo.pGeometries = &asGeom;
-            asBuildGeomInfo.scratchData.deviceAddress = scratch.addr;
-
-            VkAccelerationStructureBuildRangeInfoKHR asBuildRangeInfo = {};
-            asBuildRangeInfo.primitiveCount = primitiveCountPerGeometry;
-            asBuildRangeInfo.primitiveOffset = 0;
-            asBuildRangeInfo.firstVertex = 0;
-            asBuildRangeInfo.transformOffset = 0;
-
-            VkAccelerationStructureBuildRangeInfoKHR *rangeInfo = &asBuildRangeInfo;
-
-            // do not nother with host stuff, NVIDIA reports accelerationStructureHostCommands == false, record on command buffer instead
-            vkCmdBuildAccelerationStructuresKHR(cb, 1, &asBuildGeomInfo, &rangeInfo);
-
-            VkAccelerationStructureDeviceAddressInfoKHR asAddrInfo = {};
-            asAddrInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
-            asAddrInfo.accelerationStructure = m_blas;
-            m_blasAddr = vkGetAccelerationStructureDeviceAddressKHR(dev, &asAddrInfo);
-
-            freeBuffer(scratch, dev, df);
-        }
-
-        {
-            VkMemoryBarrier memoryBarrier = {};
-            memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
-            const VkAccessFlags accelAccess = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
-            memoryBarrier.srcAccessMask = accelAccess;
-            memoryBarrier.dstAccessMask = accelAccess;
-            df->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
-                                     0, 1, &memoryBarrier, 0, 0, 0, 0);
-        }
-
-        // top level acceleration structure
-        {
-
-            VkAccelerationStructureInstanceKHR instance = {};
-
-            QMatrix4x4 instanceTransform; // identity
-            // what we need is a 3x4 row major matrix
-            instanceTransform = instanceTransform.transposed();
-            memcpy(instance.transform.matrix, instanceTransform.constData(), 12 * sizeof(float));
-
-            instance.instanceCustomIndex = 0;
-            instance.mask = 0xFF;
-            instance.instanceShaderBindingTableRecordOffset = 0;
-            instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
-            instance.accelerationStructureReference = m_blasAddr;
-
-            qDebug() << "VkAccelerationStructureInstanceKHR size is" << sizeof(instance);
-            m_instanceBuffer = createHostVisibleBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, physDev, dev, f, df, sizeof(instance));
-            updateHostData(m_instanceBuffer, dev, df, &instance, sizeof(instance));
-
-            VkDeviceOrHostAddressConstKHR instanceDataDeviceAddress = {};
-            instanceDataDeviceAddress.deviceAddress = m_instanceBuffer.addr;
-
-            VkAccelerationStructureGeometryKHR asGeom = {};
-            asGeom.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-            asGeom.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
-            asGeom.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-            asGeom.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
-            asGeom.geometry.instances.arrayOfPointers = VK_FALSE;
-            asGeom.geometry.instances.data = instanceDataDeviceAddress;
-
-            VkAccelerationStructureBuildGeometryInfoKHR asBuildGeomInfo = {};
-            asBuildGeomInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-            asBuildGeomInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-            asBuildGeomInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-            asBuildGeomInfo.geometryCount = 1;
-            asBuildGeomInfo.pGeometries = &asGeom;
-            const uint32_t primitiveCountPerGeometry = 1; // geometryCount elements
-            VkAccelerationStructureBuildSizesInfoKHR sizeInfo = {};
-            sizeInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-            vkGetAccelerationStructureBuildSizesKHR(dev,
-                                                    VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-                                                    &asBuildGeomInfo,
-                                                    &primitiveCountPerGeometry,
-                                                    &sizeInfo);
-
-            qDebug() << "tlas buffer size" << sizeInfo.accelerationStructureSize;
-            m_tlasBuffer = createASBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR, physDev, dev, f, df,
-                                          sizeInfo.accelerationStructureSize);
-
-            VkAccelerationStructureCreateInfoKHR asCreateInfo = {};
-            asCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
-            asCreateInfo.buffer = m_tlasBuffer.buf;
-            asCreateInfo.size = sizeInfo.accelerationStructureSize;
-            asCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-            vkCreateAccelerationStructureKHR(dev, &asCreateInfo, nullptr, &m_tlas);
-
-            qDebug() << "tlas scratch buffer size" << sizeInfo.buildScratchSize;
-            Buffer scratch = createASBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, physDev, dev, f, df, sizeInfo.buildScratchSize);
-
-            memset(&asBuildGeomInfo, 0, sizeof(asBuildGeomInfo));
-            asBuildGeomInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-            asBuildGeomInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-            asBuildGeomInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-            asBuildGeomInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-            asBuildGeomInfo.dstAccelerationStructure = m_tlas;
-            asBuildGeomInfo.geometryCount = 1;
-            asBuildGeomInfo.pGeometries = &asGeom;
-            asBuildGeomInfo.scratchData.deviceAddress = scratch.addr;
-
-            VkAccelerationStructureBuildRangeInfoKHR asBuildRangeInfo = {};
-            asBuildRangeInfo.primitiveCount = 1;
-            asBuildRangeInfo.primitiveOffset = 0;
-            asBuildRangeInfo.firstVertex = 0;
-            asBuildRangeInfo.transformOffset = 0;
-
-            VkAccelerationStructureBuildRangeInfoKHR *rangeInfo = &asBuildRangeInfo;
-
-            vkCmdBuildAccelerationStructuresKHR(cb, 1, &asBuildGeomInfo, &rangeInfo);
-
-            VkAccelerationStructureDeviceAddressInfoKHR asAddrInfo = {};
-            asAddrInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
-            asAddrInfo.accelerationStructure = m_tlas;
-            m_tlasAddr = vkGetAccelerationStructureDeviceAddressKHR(dev, &asAddrInfo);
-
-            freeBuffer(scratch, dev, df);
-        }
+    const QSize denoiseImageSize = m_denoise ? pixelSize : QSize(1, 1);
+    if (m_denoiseImageSize != denoiseImageSize)
+        createDenoiseImages(denoiseImageSize, dev, df);
+
+    // the first view rendering in a frame brings the context up to date,
+    // for the others (with a shared context) there is nothing left to do
+    m_ctx->updateBlas(cb, dev, df);
+    writeTimestamp(cb, BlasDoneTimestamp, df);
+    m_ctx->updateTlas(cb, dev, df);
+    writeTimestamp(cb, TlasDoneTimestamp, df);
+    const int stages = m_ctx->updatePipelines(dev, df);
+
+    // a new scene has nothing to do with what was seen or denoised before
+    if (m_ctxSceneRevision != m_ctx->sceneRevision()) {
+        m_ctxSceneRevision = m_ctx->sceneRevision();
+        m_dirty |= RaytracingContext::CameraStage;
+        m_denoiseHistoryValid = false;
+    }
 
-        // pipeline
-        {
-            VkDescriptorSetLayoutBinding asLayoutBinding = {};
-            asLayoutBinding.binding = 0;
-            asLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
-            asLayoutBinding.descriptorCount = 1;
-            asLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
-
-            VkDescriptorSetLayoutBinding outputLayoutBinding = {};
-            outputLayoutBinding.binding = 1;
-            outputLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-            outputLayoutBinding.descriptorCount = 1;
-            outputLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
-
-            VkDescriptorSetLayoutBinding ubLayoutBinding = {};
-            ubLayoutBinding.binding = 2;
-            ubLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-            ubLayoutBinding.descriptorCount = 1;
-            ubLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
-
-            const VkDescriptorSetLayoutBinding bindings[3] = {
-                asLayoutBinding,
-                outputLayoutBinding,
-                ubLayoutBinding
-            };
+    // anything that changes the image restarts the accumulation
+    if (m_dirty || m_ctxRevision != m_ctx->revision()) {
+        m_ctxRevision = m_ctx->revision();
+        restartAccumulation();
+    }
 
-            VkDescriptorSetLayoutCreateInfo descSetLayoutCreateInfo = {};
-            descSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-            descSetLayoutCreateInfo.bindingCount = 3;
-            descSetLayoutCreateInfo.pBindings = bindings;
-            df->vkCreateDescriptorSetLayout(dev, &descSetLayoutCreateInfo, nullptr, &m_descSetLayout);
-
-            VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {};
-            pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-            pipelineLayoutCreateInfo.setLayoutCount = 1;
-            pipelineLayoutCreateInfo.pSetLayouts = &m_descSetLayout;
-            df->vkCreatePipelineLayout(dev, &pipelineLayoutCreateInfo, nullptr, &m_pipelineLayout);
-
-            VkPipelineShaderStageCreateInfo stages[3] = {
-                getShader(":/raygen.rgen.spv", VK_SHADER_STAGE_RAYGEN_BIT_KHR, dev, df),
-                getShader(":/miss.rmiss.spv", VK_SHADER_STAGE_MISS_BIT_KHR, dev, df),
-                getShader(":/closesthit.rchit.spv", VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, dev, df)
-            };
+    if (m_dirty & RaytracingContext::CameraStage)
+        updateCamera(pixelSize);
 
-            VkRayTracingShaderGroupCreateInfoKHR shaderGroups[3];
-
-            VkRayTracingShaderGroupCreateInfoKHR shaderGroupCreateInfo = {};
-            shaderGroupCreateInfo.sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
-
-            shaderGroupCreateInfo.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
-            shaderGroupCreateInfo.generalShader = 0; // index in stages
-            shaderGroupCreateInfo.closestHitShader = VK_SHADER_UNUSED_KHR;
-            shaderGroupCreateInfo.anyHitShader = VK_SHADER_UNUSED_KHR;
-            shaderGroupCreateInfo.intersectionShader = VK_SHADER_UNUSED_KHR;
-            shaderGroups[0] = shaderGroupCreateInfo;
-
-            shaderGroupCreateInfo.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
-            shaderGroupCreateInfo.generalShader = 1; // index in stages
-            shaderGroupCreateInfo.closestHitShader = VK_SHADER_UNUSED_KHR;
-            shaderGroups[1] = shaderGroupCreateInfo;
-
-            shaderGroupCreateInfo.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR;
-            shaderGroupCreateInfo.generalShader = VK_SHADER_UNUSED_KHR;
-            shaderGroupCreateInfo.closestHitShader = 2; // index in stages
-            shaderGroups[2] = shaderGroupCreateInfo;
-
-            VkRayTracingPipelineCreateInfoKHR pipelineCreateInfo = {};
-            pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR;
-            pipelineCreateInfo.stageCount = 3;
-            pipelineCreateInfo.pStages = stages;
-            pipelineCreateInfo.groupCount = 3;
-            pipelineCreateInfo.pGroups = shaderGroups;
-            pipelineCreateInfo.maxPipelineRayRecursionDepth = 1;
-            pipelineCreateInfo.layout = m_pipelineLayout;
-            vkCreateRayTracingPipelinesKHR(dev, VK_NULL_HANDLE, VK_NULL_HANDLE, 1, &pipelineCreateInfo, nullptr, &m_pipeline);
-        }
+    m_timestampSlots[currentFrameSlot].stages = stages | m_dirty;
+    m_dirty = 0;
 
-        // shader binding tables
-        {
-            const uint32_t handleSize = m_rtProps.shaderGroupHandleSize;
-            const uint32_t handleSizeAligned = aligned(handleSize, m_rtProps.shaderGroupHandleAlignment);
-            const uint32_t groupSize = 3; // shaderGroups elem count
-            const uint32_t handleListByteSize = groupSize * handleSize;
-
-            std::vector<uint8_t> handles(handleListByteSize);
-            vkGetRayTracingShaderGroupHandlesKHR(dev, m_pipeline, 0, groupSize, handleListByteSize, handles.data());
-
-            // with NVIDIA handleSize == handleSizeAligned == 32 but the baseAlignment is 64, take both alignments into account
-            const uint32_t sbtBufferEntrySize = aligned(handleSizeAligned, m_rtProps.shaderGroupBaseAlignment);
-            const uint32_t sbtBufferSize = groupSize * sbtBufferEntrySize;
-            m_sbt = createHostVisibleBuffer(VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR, physDev, dev, f, df, sbtBufferSize);
-            std::vector<uint8_t> sbtBufData(sbtBufferSize);
-            for (uint32_t i = 0; i < groupSize; ++i)
-                memcpy(sbtBufData.data() + i * sbtBufferEntrySize, handles.data() + i * handleSize, handleSize);
-            updateHostData(m_sbt, dev, df, sbtBufData.data(), sbtBufferSize);
-        }
+    const bool rayQuery = usesRayQuery();
+    const VkPipeline pipeline = rayQuery ? m_ctx->rayQueryPipeline(dev, df) : m_ctx->pipeline();
+    const VkPipelineStageFlags traceStage = rayQuery ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+                                                     : VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
 
-        // descriptor sets
-        {
-            VkDescriptorSetAllocateInfo descSetAllocInfo = {};
-            descSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-            descSetAllocInfo.descriptorPool = m_descPool;
-            descSetAllocInfo.descriptorSetCount = 1;
-            descSetAllocInfo.pSetLayouts = &m_descSetLayout;
-            for (int i = 0; i < FRAMES_IN_FLIGHT; ++i) {
-                df->vkAllocateDescriptorSets(dev, &descSetAllocInfo, &m_descSets[i]);
-
-                VkWriteDescriptorSetAccelerationStructureKHR descSetAS = {};
-                descSetAS.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
-                descSetAS.accelerationStructureCount = 1;
-                descSetAS.pAccelerationStructures = &m_tlas;
-                VkWriteDescriptorSet asWrite = {};
-                asWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-                asWrite.pNext = &descSetAS;
-                asWrite.dstSet = m_descSets[i];
-                asWrite.dstBinding = 0;
-                asWrite.descriptorCount = 1;
-                asWrite.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
-
-                VkDescriptorImageInfo descOutputImage = {};
-                descOutputImage.imageView = outputImageView;
-                descOutputImage.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-                VkWriteDescriptorSet imageWrite = {};
-                imageWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-                imageWrite.dstSet = m_descSets[i];
-                imageWrite.dstBinding = 1;
-                imageWrite.descriptorCount = 1;
-                imageWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-                imageWrite.pImageInfo = &descOutputImage;
-
-                VkDescriptorBufferInfo descUniformBuffer = {};
-                descUniformBuffer.buffer = m_uniformBuffers[i].buf;
-                descUniformBuffer.range = VK_WHOLE_SIZE;
-                VkWriteDescriptorSet ubWrite = {};
-                ubWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-                ubWrite.dstSet = m_descSets[i];
-                ubWrite.dstBinding = 2;
-                ubWrite.descriptorCount = 1;
-                ubWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-                ubWrite.pBufferInfo = &descUniformBuffer;
-
-                VkWriteDescriptorSet writeSets[] = {
-                    asWrite,
-                    imageWrite,
-                    ubWrite
-                };
-                df->vkUpdateDescriptorSets(dev, 3, writeSets, 0, VK_NULL_HANDLE);
-            }
-        }
+    // until there is a pipeline and a TLAS, show something instead of garbage
+    if (!pipeline || !m_ctx->tlas()) {
+        clearToPlaceholder(cb, outputImage, currentOutputImageLayout, df);
+        writeTimestamp(cb, DenoiseDoneTimestamp, df);
+        m_lastFrameWroteOutput = true;
+        return VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    }
 
-        m_proj.setToIdentity();
-        const float aspectRatio = float(pixelSize.width()) / pixelSize.height();
-        m_proj.perspective(60.0f, aspectRatio, 0.1f, 512.0f);
-        m_view.setToIdentity();
-        m_view.translate(0, 0, -5);
+    // the output image has the final result already, leave it as it is
+    if (isConverged()) {
+        writeTimestamp(cb, DenoiseDoneTimestamp, df);
+        return currentOutputImageLayout;
     }
 
+    updateDescriptorSet(currentFrameSlot, outputImageView, dev, df);
+    if (m_denoise)
+        updateDenoiseDescriptorSet(currentFrameSlot, outputImageView, dev, df);
+
     {
         VkImageMemoryBarrier barrier = {};
         barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
@@ -480,56 +569,150 @@ VkImageLayout Raytracing::doIt(QVulkanInstance *inst,
         barrier.subresourceRange.baseMipLevel = 0;
         barrier.subresourceRange.levelCount = 1;
         barrier.subresourceRange.baseArrayLayer = 0;
-        barrier.subresourceRange.layerCount = 1;
+        barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
         barrier.oldLayout = currentOutputImageLayout;
         barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-        barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        barrier.srcAccessMask = isAsync() ? 0 : VK_ACCESS_SHADER_READ_BIT;
         barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
         barrier.image = outputImage;
         df->vkCmdPipelineBarrier(cb,
-                                 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-                                 VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                                 isAsync() ? VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT : VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                                 traceStage,
                                  0, 0, nullptr, 0, nullptr,
                                  1, &barrier);
     }
 
-    m_projInv = m_proj.inverted();
-    m_viewInv = m_view.inverted();
-    uchar ubData[128];
-    memcpy(ubData, m_projInv.constData(), 64);
-    memcpy(ubData + 64, m_viewInv.constData(), 64);
-    updateHostData(m_uniformBuffers[currentFrameSlot], dev, df, ubData, 128);
-
-    const uint32_t handleSize = m_rtProps.shaderGroupHandleSize;
-    const uint32_t handleSizeAligned = aligned(handleSize, m_rtProps.shaderGroupHandleAlignment);
-    const uint32_t sbtBufferEntrySize = aligned(handleSizeAligned, m_rtProps.shaderGroupBaseAlignment);
-
-    VkStridedDeviceAddressRegionKHR raygenShaderSbtEntry = {};
-    raygenShaderSbtEntry.deviceAddress = m_sbt.addr;
-    raygenShaderSbtEntry.stride = handleSizeAligned;
-    raygenShaderSbtEntry.size = handleSize;
-
-    VkStridedDeviceAddressRegionKHR missShaderSbtEntry = {};
-    missShaderSbtEntry.deviceAddress = m_sbt.addr + sbtBufferEntrySize;
-    missShaderSbtEntry.stride = handleSizeAligned;
-    missShaderSbtEntry.size = handleSize;
-
-    VkStridedDeviceAddressRegionKHR hitShaderSbtEntry = {};
-    hitShaderSbtEntry.deviceAddress = m_sbt.addr + sbtBufferEntrySize * 2;
-    hitShaderSbtEntry.stride = handleSizeAligned;
-    hitShaderSbtEntry.size = handleSize;
-
-    VkStridedDeviceAddressRegionKHR callableShaderSbtEntry = {};
-
-    df->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, m_pipeline);
-    df->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, m_pipelineLayout, 0, 1, &m_descSets[currentFrameSlot], 0, 0);
-
-    vkCmdTraceRaysKHR(cb,
-                      &raygenShaderSbtEntry,
-                      &missShaderSbtEntry,
-                      &hitShaderSbtEntry,
-                      &callableShaderSbtEntry,
-                      pixelSize.width(), pixelSize.height(), 1);
+    {
+        // the previous trace's sums are read and written again
+        VkImageMemoryBarrier barrier = {};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.baseMipLevel = 0;
+        barrier.subresourceRange.levelCount = 1;
+        barrier.subresourceRange.baseArrayLayer = 0;
+        barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+        barrier.oldLayout = m_accumImage.layout;
+        barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.image = m_accumImage.image;
+        df->vkCmdPipelineBarrier(cb,
+                                 RaytracingContext::TRACE_STAGES,
+                                 traceStage,
+                                 0, 0, nullptr, 0, nullptr,
+                                 1, &barrier);
+        m_accumImage.layout = VK_IMAGE_LAYOUT_GENERAL;
+    }
+
+    // the placeholders used while the denoiser is disabled are only transitioned
+    if (m_denoise || m_denoiseImages[0].layout != VK_IMAGE_LAYOUT_GENERAL) {
+        // the previous frame's denoiser passes are done with the G-buffer
+        // and the motion vectors before they are written again
+        VkImageMemoryBarrier barriers[DenoiseImageCount];
+        for (int i = 0; i < DenoiseImageCount; ++i) {
+            VkImageMemoryBarrier &barrier(barriers[i]);
+            barrier = {};
+            barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            barrier.subresourceRange.baseMipLevel = 0;
+            barrier.subresourceRange.levelCount = 1;
+            barrier.subresourceRange.baseArrayLayer = 0;
+            barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+            barrier.oldLayout = m_denoiseImages[i].layout;
+            barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+            barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+            barrier.image = m_denoiseImages[i].image;
+            m_denoiseImages[i].layout = VK_IMAGE_LAYOUT_GENERAL;
+        }
+        df->vkCmdPipelineBarrier(cb,
+                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                 RaytracingContext::TRACE_STAGES,
+                                 0, 0, nullptr, 0, nullptr,
+                                 DenoiseImageCount, barriers);
+    }
+
+    // the part of the image traced in this frame, see setRayBudget()
+    if (m_passPart == 0)
+        beginPass(pixelSize);
+    const bool lastPart = m_passPart + 1 == m_passParts;
+    uint32_t launchWidth = uint32_t(pixelSize.width());
+    uint32_t launchHeight = uint32_t(pixelSize.height());
+    uint32_t interleave = 1;
+    uint32_t rowOffset = 0;
+    if (m_passSplit == Interleaved) {
+        interleave = m_passParts;
+        launchWidth = (launchWidth + interleave - 1) / interleave;
+    } else {
+        rowOffset = m_passPart * launchHeight / m_passParts;
+        launchHeight = (m_passPart + 1) * launchHeight / m_passParts - rowOffset;
+    }
+
+    const StreamAlloc ub = m_ctx->streamAllocate(sizeof(FrameParams));
+    FrameParams *frameParams = static_cast<FrameParams *>(ub.p);
+    memcpy(frameParams->projInverse, m_projInv.constData(), 64);
+    for (int i = 0; i < m_viewCount; ++i) {
+        const Camera &camera(m_cameras[i]);
+        CameraParams &cameraParams(frameParams->cameras[i]);
+        memcpy(cameraParams.viewInverse, camera.viewInv.constData(), 64);
+        memcpy(cameraParams.prevViewProj, camera.prevViewProj.constData(), 64);
+        cameraParams.prevOrigin[0] = camera.prevPos.x();
+        cameraParams.prevOrigin[1] = camera.prevPos.y();
+        cameraParams.prevOrigin[2] = camera.prevPos.z();
+        cameraParams.prevOrigin[3] = 1.0f;
+    }
+    frameParams->geometries = m_ctx->geometryTable();
+    frameParams->sampleIndex = m_sampleCount;
+    frameParams->samplesPerFrame = m_passSamples;
+    frameParams->maxBounces = m_maxBounces;
+    frameParams->frameSeed = uint32_t(m_ctxFrame);
+    frameParams->rayEpsilon = m_ctx->sceneRadius() * 1.0e-4f;
+    frameParams->denoise = m_denoise ? 1 : 0;
+    frameParams->gbufferIndex = m_denoiseCurrent;
+    frameParams->interleave = interleave;
+    frameParams->splitPart = m_passPart;
+    frameParams->rowOffset = rowOffset;
+    frameParams->launchHeight = launchHeight;
+    const uint32_t ubOffset = uint32_t(ub.offset);
+    const bool accumulating = m_sampleCount > 0;
+    if (lastPart) {
+        m_sampleCount += m_passSamples;
+        for (int i = 0; i < m_viewCount; ++i) {
+            Camera &camera(m_cameras[i]);
+            camera.prevViewProj = m_proj * camera.view;
+            camera.prevPos = camera.viewInv.column(3).toVector3D();
+        }
+        m_passPart = 0;
+    } else {
+        m_passPart += 1;
+    }
+    m_lastFrameTraced = true;
+    m_timestampSlots[currentFrameSlot].traced = true;
+    m_timestampSlots[currentFrameSlot].rays = quint64(launchWidth) * launchHeight * m_passSamples * m_viewCount;
+
+    writeTimestamp(cb, TraceStartTimestamp, df);
+
+    if (rayQuery) {
+        df->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+        df->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE, m_ctx->pipelineLayout(), 0, 1, &m_descSets[currentFrameSlot], 1, &ubOffset);
+        df->vkCmdDispatch(cb,
+                          (launchWidth + RAYQUERY_WORKGROUP_SIZE - 1) / RAYQUERY_WORKGROUP_SIZE,
+                          (launchHeight + RAYQUERY_WORKGROUP_SIZE - 1) / RAYQUERY_WORKGROUP_SIZE,
+                          uint32_t(m_viewCount));
+    } else {
+        df->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipeline);
+        df->vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, m_ctx->pipelineLayout(), 0, 1, &m_descSets[currentFrameSlot], 1, &ubOffset);
+        m_ctx->traceRays(cb, launchWidth, launchHeight, uint32_t(m_viewCount));
+    }
+
+    writeTimestamp(cb, TraceDoneTimestamp, df);
+
+    // the G-buffer is complete once all parts of the pass are traced
+    const bool denoised = m_denoise && lastPart;
+    if (denoised)
+        denoise(cb, currentFrameSlot, accumulating, pixelSize, dev, df);
+
+    writeTimestamp(cb, DenoiseDoneTimestamp, df);
 
     {
         VkImageMemoryBarrier barrier = {};
@@ -538,129 +721,511 @@ VkImageLayout Raytracing::doIt(QVulkanInstance *inst,
         barrier.subresourceRange.baseMipLevel = 0;
         barrier.subresourceRange.levelCount = 1;
         barrier.subresourceRange.baseArrayLayer = 0;
-        barrier.subresourceRange.layerCount = 1;
+        barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
         barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
         barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
         barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        barrier.dstAccessMask = isAsync() ? 0 : VK_ACCESS_SHADER_READ_BIT;
         barrier.image = outputImage;
         df->vkCmdPipelineBarrier(cb,
-                                 VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
-                                 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                                 denoised ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT : traceStage,
+                                 isAsync() ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT : VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
                                  0, 0, nullptr, 0, nullptr,
                                  1, &barrier);
     }
+    // the image is complete with the last part of a pass
+    m_lastFrameWroteOutput = lastPart;
     return VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 }
 
-Raytracing::Buffer Raytracing::createASBuffer(int usage, VkPhysicalDevice physDev, VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df, uint32_t size)
+bool Raytracing::initAsync(uint32_t queueFamilyIndex, uint32_t queueIndex, uint32_t graphicsQueueFamilyIndex,
+                           VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df)
 {
-    // usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT or VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR
-    VkBufferCreateInfo bufferCreateInfo = {};
-    bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    bufferCreateInfo.size = size;
-    bufferCreateInfo.usage = usage | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
-    VkBuffer buf = VK_NULL_HANDLE;
-    df->vkCreateBuffer(dev, &bufferCreateInfo, nullptr, &buf);
-
-    VkMemoryRequirements memReq = {};
-    df->vkGetBufferMemoryRequirements(dev, buf, &memReq);
-    VkMemoryAllocateFlagsInfo memoryAllocateFlagsInfo = {};
-    memoryAllocateFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
-    memoryAllocateFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR;
-    VkMemoryAllocateInfo memoryAllocateInfo = {};
-    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    memoryAllocateInfo.pNext = &memoryAllocateFlagsInfo;
-    memoryAllocateInfo.allocationSize = memReq.size;
-
-    quint32 memIndex = UINT_MAX;
-    VkPhysicalDeviceMemoryProperties physDevMemProps;
-    f->vkGetPhysicalDeviceMemoryProperties(physDev, &physDevMemProps);
-    for (uint32_t i = 0; i < physDevMemProps.memoryTypeCount; ++i) {
-        if (!(memReq.memoryTypeBits & (1 << i)))
-            continue;
-        if (physDevMemProps.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) {
-            memIndex = i;
-            break;
-        }
+    if (m_ctx->isCpuTracing()) {
+        qWarning("Tracing on the CPU, not using async mode");
+        return false;
+    }
+    if (m_ctx.use_count() > 1) {
+        qWarning("The raytracing context is shared, not using async mode");
+        return false;
+    }
+
+    AsyncState &a(m_async);
+    a.vkGetSemaphoreCounterValue = reinterpret_cast<PFN_vkGetSemaphoreCounterValue>(f->vkGetDeviceProcAddr(dev, "vkGetSemaphoreCounterValue"));
+    if (!a.vkGetSemaphoreCounterValue) {
+        qWarning("No timeline semaphores, not using async mode");
+        return false;
+    }
+
+    VkSemaphoreTypeCreateInfo semaphoreTypeInfo = {};
+    semaphoreTypeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    semaphoreTypeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    semaphoreTypeInfo.initialValue = 0;
+    VkSemaphoreCreateInfo semaphoreInfo = {};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphoreInfo.pNext = &semaphoreTypeInfo;
+    VkResult err = df->vkCreateSemaphore(dev, &semaphoreInfo, nullptr, &a.timeline);
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to create timeline semaphore: %d, not using async mode", err);
+        return false;
     }
-    if (memIndex == UINT_MAX)
-        qFatal("No suitable memory type");
+    a.lastValue = 0;
+
+    // a pool per frame slot, reset as a whole when the slot comes around
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    poolInfo.queueFamilyIndex = queueFamilyIndex;
+    VkCommandBufferAllocateInfo cbInfo = {};
+    cbInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cbInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cbInfo.commandBufferCount = 1;
+    for (int i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+        df->vkCreateCommandPool(dev, &poolInfo, nullptr, &a.cmdPools[i]);
+        cbInfo.commandPool = a.cmdPools[i];
+        df->vkAllocateCommandBuffers(dev, &cbInfo, &a.cbs[i]);
+        a.slotValues[i] = 0;
+    }
+    df->vkCreateCommandPool(dev, &poolInfo, nullptr, &a.setupCmdPool);
+    a.submitCount = 0;
+
+    a.concurrent = queueFamilyIndex != graphicsQueueFamilyIndex;
+    a.queueFamilyIndices[0] = queueFamilyIndex;
+    a.queueFamilyIndices[1] = graphicsQueueFamilyIndex;
+    a.uiFrame = 0;
+    a.shownImage = VK_NULL_HANDLE;
+    a.shownSize = QSize();
+    a.shownValue = 0;
+    a.graphicsWaitValue = 0;
+
+    df->vkGetDeviceQueue(dev, queueFamilyIndex, queueIndex, &a.queue);
+    qDebug("async mode: queue family %u index %u (Qt Quick's family %u)",
+           queueFamilyIndex, queueIndex, graphicsQueueFamilyIndex);
+    return true;
+}
 
-    memoryAllocateInfo.memoryTypeIndex = memIndex;
-    VkDeviceMemory bufMem = VK_NULL_HANDLE;
-    df->vkAllocateMemory(dev, &memoryAllocateInfo, nullptr, &bufMem);
-    df->vkBindBufferMemory(dev, buf, bufMem, 0);
+void Raytracing::releaseAsync(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    AsyncState &a(m_async);
+    if (!a.queue)
+        return;
+
+    // the device is idle, see releaseResources()
+    for (const AsyncImage &image : a.images)
+        destroyAsyncImage(image, dev, df);
+    for (const AsyncImage &image : a.retired)
+        destroyAsyncImage(image, dev, df);
+    for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
+        df->vkDestroyCommandPool(dev, a.cmdPools[i], nullptr);
+    df->vkDestroyCommandPool(dev, a.setupCmdPool, nullptr);
+    df->vkDestroySemaphore(dev, a.timeline, nullptr);
+    a = {};
+}
 
-    Buffer result { buf, bufMem, 0, size };
-    result.addr = getBufferDeviceAddress(dev, result);
-    return result;
+void Raytracing::destroyAsyncImage(const AsyncImage &image, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    if (!image.image.image)
+        return;
+    df->vkDestroyImageView(dev, image.image.view, nullptr);
+    df->vkDestroyImage(dev, image.image.image, nullptr);
+    m_ctx->memoryAllocator()->free(image.image.alloc);
+    invalidateDescriptorSets();
+}
+
+bool Raytracing::isAsyncImageFree(const AsyncImage &image, quint64 completedValue) const
+{
+    // Qt Quick waits for the fence of a frame before reusing its slot, so
+    // FRAMES_IN_FLIGHT UI frames after an image stopped being shown it is
+    // not read anymore
+    return !image.shown
+            && (!image.shownUntil || image.shownUntil + FRAMES_IN_FLIGHT < m_async.uiFrame)
+            && image.busyValue <= completedValue;
+}
+
+bool Raytracing::hasAsyncFramesPending() const
+{
+    for (const AsyncImage &image : m_async.images) {
+        if (image.contentValue > m_async.shownValue)
+            return true;
+    }
+    return false;
 }
 
-Raytracing::Buffer Raytracing::createHostVisibleBuffer(int usage, VkPhysicalDevice physDev, VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df, uint32_t size)
+bool Raytracing::submitAsync(VkCommandBuffer cb, quint64 value, QVulkanDeviceFunctions *df)
 {
-    // usage = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR or VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR or VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT
-    VkBufferCreateInfo bufferCreateInfo = {};
-    bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    bufferCreateInfo.size = size;
-    bufferCreateInfo.usage = usage | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
-    VkBuffer buf = VK_NULL_HANDLE;
-    df->vkCreateBuffer(dev, &bufferCreateInfo, nullptr, &buf);
-
-    VkMemoryRequirements memReq = {};
-    df->vkGetBufferMemoryRequirements(dev, buf, &memReq);
-    VkMemoryAllocateFlagsInfo memoryAllocateFlagsInfo = {};
-    memoryAllocateFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
-    memoryAllocateFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR;
-    VkMemoryAllocateInfo memoryAllocateInfo = {};
-    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    memoryAllocateInfo.pNext = &memoryAllocateFlagsInfo;
-    memoryAllocateInfo.allocationSize = memReq.size;
-
-    quint32 memIndex = UINT_MAX;
-    VkPhysicalDeviceMemoryProperties physDevMemProps;
-    f->vkGetPhysicalDeviceMemoryProperties(physDev, &physDevMemProps);
-    for (uint32_t i = 0; i < physDevMemProps.memoryTypeCount; ++i) {
-        if (!(memReq.memoryTypeBits & (1 << i)))
-            continue;
-        if ((physDevMemProps.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
-                && (physDevMemProps.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineInfo.signalSemaphoreValueCount = 1;
+    timelineInfo.pSignalSemaphoreValues = &value;
+
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = &timelineInfo;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &cb;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &m_async.timeline;
+    VkResult err = df->vkQueueSubmit(m_async.queue, 1, &submitInfo, VK_NULL_HANDLE);
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to submit to the async queue: %d", err);
+        return false;
+    }
+    m_async.lastValue = value;
+    return true;
+}
+
+void Raytracing::createAsyncImages(const QSize &pixelSize, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    AsyncState &a(m_async);
+    qDebug() << "new async output images of size" << pixelSize;
+
+    for (AsyncImage &image : a.images) {
+        if (image.image.image)
+            a.retired.push_back(image);
+        image = {};
+        image.image = m_ctx->createStorageImage(pixelSize, uint32_t(m_viewCount), VK_FORMAT_R8G8B8A8_UNORM,
+                                                VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                                                a.concurrent ? a.queueFamilyIndices : nullptr, dev, df);
+    }
+    a.size = pixelSize;
+
+    // the retired image stays on screen until a new one is complete
+    if (a.shownImage)
+        return;
+
+    // Nothing to show yet, have the placeholder in the first image. This
+    // is the only submission before any frame, so the pool is not reused.
+    AsyncImage &first(a.images[0]);
+    VkCommandBufferAllocateInfo cbInfo = {};
+    cbInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cbInfo.commandPool = a.setupCmdPool;
+    cbInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cbInfo.commandBufferCount = 1;
+    VkCommandBuffer cb;
+    df->vkAllocateCommandBuffers(dev, &cbInfo, &cb);
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    df->vkBeginCommandBuffer(cb, &beginInfo);
+    clearToPlaceholder(cb, first.image.image, first.image.layout, df);
+    df->vkEndCommandBuffer(cb);
+    const quint64 value = a.lastValue + 1;
+    if (!submitAsync(cb, value, df))
+        return;
+
+    first.image.layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    first.busyValue = value;
+    first.contentValue = value;
+    first.shown = true;
+    a.shownImage = first.image.image;
+    a.shownSize = pixelSize;
+    a.shownValue = value; // Qt Quick's queue waits for it in asyncFrame()
+}
+
+void Raytracing::asyncFrame(QVulkanInstance *inst, VkPhysicalDevice physDev, VkDevice dev,
+                            QVulkanDeviceFunctions *df, QVulkanFunctions *f, VkQueue graphicsQueue)
+{
+    AsyncState &a(m_async);
+    a.uiFrame += 1;
+    m_lastFrameTraced = false;
+
+    quint64 completed = 0;
+    a.vkGetSemaphoreCounterValue(dev, a.timeline, &completed);
+
+    // show the newest complete image
+    AsyncImage *newest = nullptr;
+    for (AsyncImage &image : a.images) {
+        if (image.contentValue > a.shownValue && image.contentValue <= completed
+                && (!newest || image.contentValue > newest->contentValue))
         {
-            memIndex = i;
-            break;
+            newest = &image;
+        }
+    }
+    if (newest) {
+        for (AsyncImage &image : a.images) {
+            if (image.shown) {
+                image.shown = false;
+                image.shownUntil = a.uiFrame;
+            }
+        }
+        for (AsyncImage &image : a.retired) {
+            if (image.shown) {
+                image.shown = false;
+                image.shownUntil = a.uiFrame;
+            }
+        }
+        newest->shown = true;
+        a.shownImage = newest->image.image;
+        a.shownSize = a.size;
+        a.shownValue = newest->contentValue;
+    }
+
+    // The value is reached already (except for the very first placeholder),
+    // so this does not hold up Qt Quick, but it makes the writes on the async
+    // queue visible to its fragment shaders.
+    if (a.shownValue > a.graphicsWaitValue) {
+        const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.waitSemaphoreValueCount = 1;
+        timelineInfo.pWaitSemaphoreValues = &a.shownValue;
+        VkSubmitInfo submitInfo = {};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.pNext = &timelineInfo;
+        submitInfo.waitSemaphoreCount = 1;
+        submitInfo.pWaitSemaphores = &a.timeline;
+        submitInfo.pWaitDstStageMask = &waitStage;
+        df->vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+        a.graphicsWaitValue = a.shownValue;
+    }
+
+    for (auto it = a.retired.begin(); it != a.retired.end(); ) {
+        if (isAsyncImageFree(*it, completed)) {
+            destroyAsyncImage(*it, dev, df);
+            it = a.retired.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    if (!m_dirty && !m_ctx->isDirty() && isConverged() && !hasPendingWork())
+        return;
+
+    // never wait: skip this UI frame when the slot or all images are busy
+    const uint slot = uint(a.submitCount % FRAMES_IN_FLIGHT);
+    if (a.slotValues[slot] > completed)
+        return;
+    AsyncImage *target = nullptr;
+    for (AsyncImage &image : a.images) {
+        if (isAsyncImageFree(image, completed) && (!target || image.contentValue < target->contentValue))
+            target = &image;
+    }
+    if (!target)
+        return;
+
+    VkCommandBuffer cb = a.cbs[slot];
+    df->vkResetCommandPool(dev, a.cmdPools[slot], 0);
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    df->vkBeginCommandBuffer(cb, &beginInfo);
+    target->image.layout = doIt(inst, physDev, dev, df, f, cb,
+                                target->image.image, target->image.layout, target->image.view,
+                                slot, a.size);
+    df->vkEndCommandBuffer(cb);
+
+    const quint64 value = a.lastValue + 1;
+    if (!submitAsync(cb, value, df))
+        return;
+    a.slotValues[slot] = value;
+    a.submitCount += 1;
+    target->busyValue = value;
+    if (m_lastFrameWroteOutput)
+        target->contentValue = value;
+}
+
+VkImageLayout Raytracing::doItCpu(VkDevice dev, QVulkanDeviceFunctions *df, VkCommandBuffer cb,
+                                  VkImage outputImage, VkImageLayout currentOutputImageLayout,
+                                  uint currentFrameSlot, const QSize &pixelSize)
+{
+    m_ctx->beginFrame(currentFrameSlot, &m_ctxFrame, dev, df);
+    m_lastFrameTraced = false;
+    m_lastFrameWroteOutput = false;
+
+    if (pixelSize != m_lastPixelSize) {
+        m_lastPixelSize = pixelSize;
+        m_dirty |= RaytracingContext::CameraStage;
+        m_cpuAccum.assign(size_t(pixelSize.width()) * pixelSize.height() * 4 * m_viewCount, 0.0f);
+    }
+
+    double blasTime = 0;
+    double tlasTime = 0;
+    const int stages = m_ctx->updateCpuScene(&blasTime, &tlasTime);
+
+    if (m_ctxSceneRevision != m_ctx->sceneRevision()) {
+        m_ctxSceneRevision = m_ctx->sceneRevision();
+        m_dirty |= RaytracingContext::CameraStage;
+    }
+
+    if (m_dirty || m_ctxRevision != m_ctx->revision()) {
+        m_ctxRevision = m_ctx->revision();
+        restartAccumulation();
+    }
+
+    if (m_dirty & RaytracingContext::CameraStage)
+        updateCamera(pixelSize);
+
+    m_gpuTimings = {};
+    m_gpuTimings.frame = m_ctxFrame;
+    m_gpuTimings.stages = stages | m_dirty;
+    m_gpuTimings.blas = blasTime;
+    m_gpuTimings.tlas = tlasTime;
+    m_gpuTimings.total = blasTime + tlasTime;
+    m_dirty = 0;
+
+    // the output image has the final result already, leave it as it is
+    if (isConverged())
+        return currentOutputImageLayout;
+
+    // this slot's previous frame is done, so is the copy from its staging buffer
+    Buffer &staging(m_cpuStaging[currentFrameSlot]);
+    // the layers one after the other, as the copy expects them
+    const size_t layerPixels = size_t(pixelSize.width()) * pixelSize.height();
+    const VkDeviceSize stagingSize = VkDeviceSize(layerPixels) * 4 * m_viewCount;
+    if (staging.size != stagingSize) {
+        m_ctx->releaseLater(staging);
+        staging = m_ctx->createHostVisibleBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, dev, df, stagingSize);
+    }
+
+    CpuTracer::Params params;
+    params.projInverse = m_projInv;
+    params.sampleIndex = m_sampleCount;
+    params.samplesPerFrame = m_samplesPerFrame;
+    params.maxBounces = m_maxBounces;
+    params.frameSeed = uint32_t(m_ctxFrame);
+    params.rayEpsilon = m_ctx->sceneRadius() * 1.0e-4f;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < m_viewCount; ++i) {
+        params.viewInverse = m_cameras[i].viewInv;
+        m_ctx->cpuTracer()->render(params, pixelSize, m_cpuAccum.data() + layerPixels * 4 * i,
+                                   static_cast<uchar *>(staging.alloc.p) + layerPixels * 4 * i);
+    }
+    const double traceTime = timer.nsecsElapsed() / 1000000.0;
+
+    m_sampleCount += m_samplesPerFrame;
+    m_lastFrameTraced = true;
+    m_lastFrameWroteOutput = true;
+    m_gpuTimings.traced = true;
+    m_gpuTimings.rays = quint64(layerPixels) * m_samplesPerFrame * m_viewCount;
+    m_gpuTimings.trace = traceTime;
+    m_gpuTimings.total += traceTime;
+
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+    barrier.oldLayout = currentOutputImageLayout;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.image = outputImage;
+    df->vkCmdPipelineBarrier(cb,
+                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             0, 0, nullptr, 0, nullptr,
+                             1, &barrier);
+
+    VkBufferImageCopy copyInfo = {};
+    copyInfo.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    copyInfo.imageSubresource.layerCount = uint32_t(m_viewCount);
+    copyInfo.imageExtent.width = uint32_t(pixelSize.width());
+    copyInfo.imageExtent.height = uint32_t(pixelSize.height());
+    copyInfo.imageExtent.depth = 1;
+    df->vkCmdCopyBufferToImage(cb, staging.buf, outputImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyInfo);
+
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    df->vkCmdPipelineBarrier(cb,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                             0, 0, nullptr, 0, nullptr,
+                             1, &barrier);
+
+    return VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+}
+
+void Raytracing::beginTimestamps(VkCommandBuffer cb, uint currentFrameSlot, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    m_nextTimestamp = TimestampCount;
+    if (!m_timestampPool)
+        return;
+
+    // Qt Quick waited for the slot's previous frame already, so its results are there
+    TimestampSlot &slot(m_timestampSlots[currentFrameSlot]);
+    const uint32_t firstQuery = currentFrameSlot * TimestampCount;
+    if (slot.frame) {
+        quint64 ts[TimestampCount];
+        VkResult err = df->vkGetQueryPoolResults(dev, m_timestampPool, firstQuery, TimestampCount,
+                                                 sizeof(ts), ts, sizeof(quint64), VK_QUERY_RESULT_64_BIT);
+        if (err == VK_SUCCESS) {
+            auto ms = [this, &ts](Timestamp from, Timestamp to) {
+                return (ts[to] - ts[from]) * double(m_timestampPeriod) / 1000000.0;
+            };
+            m_gpuTimings.frame = slot.frame;
+            m_gpuTimings.stages = slot.stages;
+            m_gpuTimings.traced = slot.traced;
+            m_gpuTimings.rays = slot.rays;
+            m_gpuTimings.blas = ms(FrameStartTimestamp, BlasDoneTimestamp);
+            m_gpuTimings.tlas = ms(BlasDoneTimestamp, TlasDoneTimestamp);
+            m_gpuTimings.trace = ms(TraceStartTimestamp, TraceDoneTimestamp);
+            m_gpuTimings.denoise = ms(TraceDoneTimestamp, DenoiseDoneTimestamp);
+            m_gpuTimings.total = ms(FrameStartTimestamp, DenoiseDoneTimestamp);
+
+            // how many rays fit in the trace time budget at the measured rate
+            if (m_traceTimeBudget > 0 && slot.rays && m_gpuTimings.trace > 0) {
+                const double rays = slot.rays / m_gpuTimings.trace * m_traceTimeBudget;
+                m_measuredRayBudget = m_measuredRayBudget ? quint64(0.5 * m_measuredRayBudget + 0.5 * rays) : quint64(rays);
+            }
         }
     }
-    if (memIndex == UINT_MAX)
-        qFatal("No suitable memory type");
 
-    memoryAllocateInfo.memoryTypeIndex = memIndex;
-    VkDeviceMemory bufMem = VK_NULL_HANDLE;
-    df->vkAllocateMemory(dev, &memoryAllocateInfo, nullptr, &bufMem);
-    df->vkBindBufferMemory(dev, buf, bufMem, 0);
+    slot = {};
+    if (!m_gpuTimingsEnabled)
+        return;
 
-    Buffer result { buf, bufMem, 0, size };
-    result.addr = getBufferDeviceAddress(dev, result);
-    return result;
+    slot.frame = m_ctxFrame;
+    df->vkCmdResetQueryPool(cb, m_timestampPool, firstQuery, TimestampCount);
+    m_timestampSlot = currentFrameSlot;
+    m_nextTimestamp = FrameStartTimestamp;
+    writeTimestamp(cb, FrameStartTimestamp, df);
 }
 
-void Raytracing::updateHostData(const Buffer &b, VkDevice dev, QVulkanDeviceFunctions *df, const void *data, size_t dataLen)
+void Raytracing::writeTimestamp(VkCommandBuffer cb, Timestamp ts, QVulkanDeviceFunctions *df)
 {
-    void *p = nullptr;
-    df->vkMapMemory(dev, b.mem, 0, b.size, 0, &p);
-    memcpy(p, data, dataLen);
-    df->vkUnmapMemory(dev, b.mem);
+    // the ones skipped (e.g. no trace) get the same value, so their phase takes no time
+    for (; m_nextTimestamp <= ts; ++m_nextTimestamp) {
+        const VkPipelineStageFlagBits stage = m_nextTimestamp == FrameStartTimestamp
+                ? VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT : VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+        df->vkCmdWriteTimestamp(cb, stage, m_timestampPool, m_timestampSlot * TimestampCount + m_nextTimestamp);
+    }
 }
 
-void Raytracing::freeBuffer(const Buffer &b, VkDevice dev, QVulkanDeviceFunctions *df)
+void Raytracing::createAccumImage(const QSize &pixelSize, VkDevice dev, QVulkanDeviceFunctions *df)
 {
-    df->vkDestroyBuffer(dev, b.buf, nullptr);
-    df->vkFreeMemory(dev, b.mem, nullptr);
+    m_ctx->releaseLater(m_accumImage);
+    m_accumImage = m_ctx->createStorageImage(pixelSize, uint32_t(m_viewCount), VK_FORMAT_R32G32B32A32_SFLOAT, 0, nullptr, dev, df);
+    m_accumImageSize = pixelSize;
+    invalidateDescriptorSets();
 }
 
-VkDeviceAddress Raytracing::getBufferDeviceAddress(VkDevice dev, const Buffer &b)
+void Raytracing::createDenoiseImages(const QSize &pixelSize, VkDevice dev, QVulkanDeviceFunctions *df)
 {
-    VkBufferDeviceAddressInfoKHR info = {};
-    info.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
-    info.buffer = b.buf;
-    return vkGetBufferDeviceAddressKHR(dev, &info);
+    for (Image &image : m_denoiseImages) {
+        m_ctx->releaseLater(image);
+        image = m_ctx->createStorageImage(pixelSize, uint32_t(m_viewCount), VK_FORMAT_R16G16B16A16_SFLOAT, 0, nullptr, dev, df);
+    }
+    m_denoiseImageSize = pixelSize;
+    m_denoiseHistoryValid = false;
+    invalidateDescriptorSets();
+}
+
+void Raytracing::releaseOutputImage()
+{
+    m_lastOutputImageView = VK_NULL_HANDLE;
+    invalidateDescriptorSets();
+}
+
+void Raytracing::invalidateDescriptorSets()
+{
+    // images are compared by handle, and a destroyed one's may be reused
+    for (int i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+        m_descSetState[i] = {};
+        m_denoiseDescSetState[i] = {};
+    }
 }
@@ -1,14 +1,146 @@
 #ifndef RT_H
 #define RT_H
 
-#include <QVulkanFunctions>
 #include <QSize>
 #include <QMatrix4x4>
+#include "rtcontext.h"
 
+// A view of a scene: the camera, the progressive accumulation, the
+// denoiser and async mode of one item. The scene with its acceleration
+// structures and the pipelines are in a RaytracingContext, of its own or
+// shared with other views, see RaytracingContext::get().
 class Raytracing
 {
 public:
-    void init(VkPhysicalDevice physDev, VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df);
+    typedef RaytracingContext::Buffer Buffer;
+    typedef RaytracingContext::Image Image;
+    typedef RaytracingContext::StreamAlloc StreamAlloc;
+    typedef RaytracingContext::CompactionStats CompactionStats;
+
+    // With a context of its own. Without VK_KHR_ray_tracing_pipeline and
+    // VK_KHR_acceleration_structure on the device, or with
+    // QVKRT_CPU_TRACE=1, the rays are traced by CpuTracer and doIt() only
+    // uploads the result into the output image. Deformable meshes stay in
+    // their rest pose then, and the denoiser, ray budgets and async mode
+    // are not available. hostCommandsEnabled is for host BLAS builds, see
+    // RaytracingContext::get().
+    void init(VkPhysicalDevice physDev, VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df,
+              bool hostCommandsEnabled);
+    // with the given context, possibly shared
+    void init(std::shared_ptr<RaytracingContext> context, VkDevice dev, QVulkanDeviceFunctions *df);
+    // also drops the reference to the context
+    void releaseResources(VkDevice dev, QVulkanDeviceFunctions *df);
+    RaytracingContext *context() const { return m_ctx.get(); }
+    bool isCpuTracing() const { return m_ctx && m_ctx->isCpuTracing(); }
+
+    // the scene is the context's, these affect all the views sharing it
+    void setScene(const Scene &scene) { m_ctx->setScene(scene); }
+    void setInstanceTransforms(const std::vector<QMatrix4x4> &transforms) { m_ctx->setInstanceTransforms(transforms); }
+    void setDeformPhase(float phase) { m_ctx->setDeformPhase(phase); }
+
+    // Progressive rendering: every frame (or pass, see setRayBudget()) adds
+    // samplesPerFrame jittered path traced samples per pixel to an
+    // accumulation image, until maxSamples is reached. After that nothing
+    // is traced until something changes. Changing the samples per frame or
+    // the maximum keeps what has been accumulated so far, changing the
+    // number of bounces does not.
+    void setSamplesPerFrame(int n) { m_samplesPerFrame = uint32_t(qMax(1, n)); }
+    void setMaxSamples(int n) { m_maxSamples = uint32_t(qMax(1, n)); }
+    void setMaxBounces(int n);
+    bool isConverged() const { return m_sampleCount >= m_maxSamples; }
+    uint32_t sampleCount() const { return m_sampleCount; }
+
+    // Splitting the trace over frames: each frame traces only a part of the
+    // image, at most rayBudget camera rays (pixels x samples per frame x
+    // views), so the frame time stays bounded however expensive the scene
+    // is. The parts of one pass over the image add samplesPerFrame samples
+    // to every pixel.
+    // They are horizontal bands, or with Interleaved every Nth pixel of each
+    // row, shifted by one from row to row, so the whole image refines evenly
+    // (a checkerboard with two parts). With a trace time budget the ray
+    // budget follows the measured GPU trace time instead. 0 disables either.
+    // The number of parts is decided at the start of each pass.
+    enum TraceSplit {
+        Bands,
+        Interleaved
+    };
+    void setRayBudget(quint64 rays) { m_rayBudget = rays; }
+    void setTraceTimeBudget(double ms) { m_traceTimeBudget = ms; }
+    void setTraceSplit(TraceSplit split) { m_traceSplit = split; }
+    // parts in the current pass, and how many of them are done
+    uint32_t passParts() const { return m_passParts; }
+    uint32_t passPart() const { return m_passPart; }
+
+    // Spatio-temporal denoiser: compute passes after the trace that write
+    // the output image instead of the ray generation shader. While the
+    // accumulation restarts every frame the previous frames are reprojected
+    // and blended in, then a-trous passes filter along the G-buffer edges.
+    // There are fewer of those as the samples add up, none once there are
+    // DENOISE_LAST_SAMPLES, so a converged image is the same as without.
+    // Toggling restarts the accumulation.
+    void setDenoiserEnabled(bool enable);
+    bool isDenoiserEnabled() const { return m_denoise; }
+
+    // The rays are traced either by the ray tracing pipeline (raygen.rgen
+    // etc. through a shader binding table) or by a compute shader with
+    // inline ray queries (rayquery.comp, needs VK_KHR_ray_query), over the
+    // same TLAS and with the same result. Which one is faster depends on the
+    // device and the scene. Can be switched at any time; RayQuery falls back
+    // to the pipeline when the device does not support it.
+    enum TraceBackend {
+        RayTracingPipeline,
+        RayQuery
+    };
+    void setTraceBackend(TraceBackend backend);
+    TraceBackend traceBackend() const { return m_traceBackend; }
+    bool hasRayQuery() const { return m_ctx->hasRayQuery(); } // after init()
+    bool usesRayQuery() const { return m_traceBackend == RayQuery && m_ctx->hasRayQuery(); }
+
+    // Multi-view: the cameras of up to MAX_VIEWS views of the scene (a grid
+    // of thumbnails, several viewports) are traced by one dispatch, its
+    // depth selecting the camera and the layer of the images, which are 2D
+    // arrays with a layer per view. The output image must have viewCount
+    // layers and outputImageView must be a 2D array view of all of them,
+    // also with a single view. The views share the projection, the samples,
+    // the pass parts and the denoiser's dispatches. Changing the count
+    // restarts the accumulation; in async mode it is picked up by the next
+    // createAsyncImages().
+    static const int MAX_VIEWS = 16; // see common.glsl
+    void setViewCount(int n);
+    int viewCount() const { return m_viewCount; }
+
+    // orbits the camera of a view around the center of the scene, in degrees
+    void setCameraOrbit(float yaw, float pitch) { setCameraOrbit(0, yaw, pitch); }
+    void setCameraOrbit(int view, float yaw, float pitch);
+
+    // false when the last doIt() recorded nothing since there was nothing new to render
+    bool lastFrameTraced() const { return m_lastFrameTraced; }
+
+    // see RaytracingContext::hasPendingWork()
+    bool hasPendingWork() const { return m_ctx->hasPendingWork(); }
+
+    // GPU time of the phases of a frame, from timestamps that are read back
+    // without waiting, FRAMES_IN_FLIGHT frames later. In milliseconds. When
+    // tracing on the CPU, trace and total are the CPU time of the frame.
+    // With a shared context the BLAS and TLAS work is measured by the
+    // first view rendering in a frame.
+    struct GpuTimings {
+        quint64 frame = 0; // the frame measured, 0 when there is nothing yet
+        int stages = 0; // what was (re)done in that frame
+        bool traced = false;
+        quint64 rays = 0; // camera rays traced
+        double blas = 0; // deform pass, BLAS builds and refits, compaction copies
+        double tlas = 0;
+        double trace = 0;
+        double denoise = 0;
+        double total = 0;
+    };
+    void setGpuTimingsEnabled(bool enable) { m_gpuTimingsEnabled = enable; }
+    bool hasGpuTimings() const { return m_timestampPool != VK_NULL_HANDLE || isCpuTracing(); } // after init()
+    const GpuTimings &gpuTimings() const { return m_gpuTimings; }
+
+    CompactionStats compactionStats() const { return m_ctx->compactionStats(); }
+    double lastHostBuildTime() const { return m_ctx->lastHostBuildTime(); }
 
     VkImageLayout doIt(QVulkanInstance *inst,
                        VkPhysicalDevice physDev,
@@ -22,61 +154,240 @@ public:
                        uint currentFrameSlot,
                        const QSize &pixelSize);
 
+    // To be called when the output image view given to doIt() is destroyed.
+    // Its replacement may well get the same handle value, so the descriptor
+    // sets could not tell them apart otherwise.
+    void releaseOutputImage();
+
+    MemoryAllocator *memoryAllocator() { return m_ctx->memoryAllocator(); }
+
+    // rgba32f, rgb is the sum of the samples and a is their number, a layer
+    // per view; in GENERAL layout after a traced frame (for reading back the
+    // HDR result)
+    VkImage accumulationImage() const { return m_accumImage.image; }
+
+    // Async mode, after init(): instead of doIt() recording into Qt Quick's
+    // command buffer, asyncFrame() records into command buffers of its own
+    // and submits them to a separate queue (ideally from a compute only
+    // family), each frame rendering into one of ASYNC_IMAGE_COUNT output
+    // images. A timeline semaphore tells which ones are complete and the
+    // newest of those is shown, so a UI frame never waits for a trace. The
+    // device must have the queue and timeline semaphores enabled. Traces are
+    // not split over frames in this mode (see setRayBudget()), and the
+    // context cannot be shared since it is updated on the async queue.
+    bool initAsync(uint32_t queueFamilyIndex, uint32_t queueIndex, uint32_t graphicsQueueFamilyIndex,
+                   VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df);
+    bool isAsync() const { return m_async.queue != VK_NULL_HANDLE; }
+    // new output images, the previous ones are shown until one of these is
+    // complete; the very first time the placeholder is shown right away
+    void createAsyncImages(const QSize &pixelSize, VkDevice dev, QVulkanDeviceFunctions *df);
+    // Once per UI frame, before Qt Quick submits to graphicsQueue: switches
+    // to the newest complete image, and starts a new frame when the slot's
+    // previous one is done and an image is free. Never blocks.
+    void asyncFrame(QVulkanInstance *inst, VkPhysicalDevice physDev, VkDevice dev,
+                    QVulkanDeviceFunctions *df, QVulkanFunctions *f, VkQueue graphicsQueue);
+    // the image to show, in SHADER_READ_ONLY_OPTIMAL layout, and its size
+    VkImage asyncOutputImage() const { return m_async.shownImage; }
+    QSize asyncOutputSize() const { return m_async.shownSize; }
+    // there are newer images than the one shown, still in flight
+    bool hasAsyncFramesPending() const;
+
 private:
-    static const int FRAMES_IN_FLIGHT = 2;
+    static const int FRAMES_IN_FLIGHT = RaytracingContext::FRAMES_IN_FLIGHT;
+    static const int ASYNC_IMAGE_COUNT = 3;
+    static const uint32_t DENOISE_WORKGROUP_SIZE = 8; // local_size_x and _y in denoise.glsl
+    static const uint32_t RAYQUERY_WORKGROUP_SIZE = 8; // local_size_x and _y in rayquery.comp
+    static const int DENOISE_ITERATIONS = 5; // a-trous passes, at 1 sample per pixel
+    static const uint32_t DENOISE_LAST_SAMPLES = 1024; // no a-trous passes from here on
+
+    void createAccumImage(const QSize &pixelSize, VkDevice dev, QVulkanDeviceFunctions *df);
+
+    // the two G-buffers, histories and filter images alternate, see denoise.glsl
+    enum DenoiseImage {
+        GBufferImage0,
+        GBufferImage1,
+        MotionImage,
+        HistoryImage0,
+        HistoryImage1,
+        FilterImage0,
+        FilterImage1,
+        DenoiseImageCount
+    };
+    void createDenoiseImages(const QSize &pixelSize, VkDevice dev, QVulkanDeviceFunctions *df);
 
-    struct Buffer {
-        VkBuffer buf = VK_NULL_HANDLE;
-        VkDeviceMemory mem = VK_NULL_HANDLE;
-        VkDeviceAddress addr = VK_NULL_HANDLE;
-        size_t size = 0;
+    // the uniform buffer (std140), see common.glsl
+    struct CameraParams {
+        float viewInverse[16];
+        float prevViewProj[16];
+        float prevOrigin[4];
     };
-    Buffer createASBuffer(int usage, VkPhysicalDevice physDev, VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df, uint32_t size);
-    Buffer createHostVisibleBuffer(int usage, VkPhysicalDevice physDev, VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df, uint32_t size);
-    void updateHostData(const Buffer &b, VkDevice dev, QVulkanDeviceFunctions *df, const void *data, size_t dataLen);
-    void freeBuffer(const Buffer &b, VkDevice dev, QVulkanDeviceFunctions *df);
-    VkDeviceAddress getBufferDeviceAddress(VkDevice dev, const Buffer &b);
-
-    VkPhysicalDeviceRayTracingPipelinePropertiesKHR m_rtProps;
-    VkPhysicalDeviceAccelerationStructureFeaturesKHR m_asFeatures;
-
-    PFN_vkGetBufferDeviceAddressKHR vkGetBufferDeviceAddressKHR;
-    PFN_vkCreateAccelerationStructureKHR vkCreateAccelerationStructureKHR;
-    PFN_vkDestroyAccelerationStructureKHR vkDestroyAccelerationStructureKHR;
-    PFN_vkGetAccelerationStructureBuildSizesKHR vkGetAccelerationStructureBuildSizesKHR;
-    PFN_vkGetAccelerationStructureDeviceAddressKHR vkGetAccelerationStructureDeviceAddressKHR;
-    PFN_vkCmdBuildAccelerationStructuresKHR vkCmdBuildAccelerationStructuresKHR;
-    PFN_vkBuildAccelerationStructuresKHR vkBuildAccelerationStructuresKHR;
-    PFN_vkCmdTraceRaysKHR vkCmdTraceRaysKHR;
-    PFN_vkGetRayTracingShaderGroupHandlesKHR vkGetRayTracingShaderGroupHandlesKHR;
-    PFN_vkCreateRayTracingPipelinesKHR vkCreateRayTracingPipelinesKHR;
-
-    Buffer m_vertexBuffer;
-    Buffer m_indexBuffer;
-    Buffer m_transformBuffer;
-    Buffer m_blasBuffer;
-    VkAccelerationStructureKHR m_blas;
-    VkDeviceAddress m_blasAddr;
-
-    Buffer m_instanceBuffer;
-    Buffer m_tlasBuffer;
-    VkAccelerationStructureKHR m_tlas;
-    VkDeviceAddress m_tlasAddr;
-
-    Buffer m_uniformBuffers[FRAMES_IN_FLIGHT];
-    VkDescriptorSetLayout m_descSetLayout;
-    VkPipelineLayout m_pipelineLayout;
-    VkPipeline m_pipeline;
-    Buffer m_sbt;
-    VkDescriptorPool m_descPool;
+    struct FrameParams {
+        float projInverse[16];
+        CameraParams cameras[MAX_VIEWS];
+        VkDeviceAddress geometries;
+        uint32_t sampleIndex;
+        uint32_t samplesPerFrame;
+        uint32_t maxBounces;
+        uint32_t frameSeed;
+        float rayEpsilon;
+        uint32_t denoise;
+        uint32_t gbufferIndex;
+        uint32_t interleave;
+        uint32_t splitPart;
+        uint32_t rowOffset;
+        uint32_t launchHeight;
+    };
+
+    typedef RaytracingContext::DenoiseParams DenoiseParams;
+    void denoise(VkCommandBuffer cb, uint currentFrameSlot, bool accumulating, const QSize &pixelSize,
+                 VkDevice dev, QVulkanDeviceFunctions *df);
+    void clearToPlaceholder(VkCommandBuffer cb, VkImage outputImage, VkImageLayout currentOutputImageLayout,
+                            QVulkanDeviceFunctions *df);
+    void updateCamera(const QSize &pixelSize);
+    void restartAccumulation() { m_sampleCount = 0; m_passPart = 0; }
+    void beginPass(const QSize &pixelSize);
+    void invalidateDescriptorSets(); // rewrite everything on the next update
+    void updateDescriptorSet(uint currentFrameSlot, VkImageView outputImageView, VkDevice dev, QVulkanDeviceFunctions *df);
+    void updateDenoiseDescriptorSet(uint currentFrameSlot, VkImageView outputImageView, VkDevice dev, QVulkanDeviceFunctions *df);
+
+    enum Timestamp {
+        FrameStartTimestamp,
+        BlasDoneTimestamp,
+        TlasDoneTimestamp,
+        TraceStartTimestamp,
+        TraceDoneTimestamp,
+        DenoiseDoneTimestamp,
+        TimestampCount
+    };
+    void beginTimestamps(VkCommandBuffer cb, uint currentFrameSlot, VkDevice dev, QVulkanDeviceFunctions *df);
+    void writeTimestamp(VkCommandBuffer cb, Timestamp ts, QVulkanDeviceFunctions *df);
+
+    VkImageLayout doItCpu(VkDevice dev, QVulkanDeviceFunctions *df, VkCommandBuffer cb,
+                          VkImage outputImage, VkImageLayout currentOutputImageLayout,
+                          uint currentFrameSlot, const QSize &pixelSize);
+
+    std::shared_ptr<RaytracingContext> m_ctx;
+    quint64 m_ctxFrame = 0; // the context's frame this view last rendered in
+    quint64 m_ctxRevision = 0;
+    quint64 m_ctxSceneRevision = 0;
+    int m_dirty = 0; // CameraStage only, the rest is the context's
+
+    // the CPU writes the image of each frame into the staging buffer of its
+    // frame slot, the frame's command buffer copies it to the output image;
+    // the sums of the samples are this view's, the BVHs the context's
+    Buffer m_cpuStaging[FRAMES_IN_FLIGHT];
+    std::vector<float> m_cpuAccum;
+
+    TraceBackend m_traceBackend = RayTracingPipeline;
+    VkDescriptorPool m_descPool = VK_NULL_HANDLE;
     VkDescriptorSet m_descSets[FRAMES_IN_FLIGHT];
 
+    // what each descriptor set was last written with; a set is updated
+    // only when its own frame slot comes around, so never while in use
+    struct DescSetState {
+        VkAccelerationStructureKHR tlas = VK_NULL_HANDLE;
+        VkImageView outputImageView = VK_NULL_HANDLE;
+        VkBuffer ub = VK_NULL_HANDLE;
+        VkImageView accumImageView = VK_NULL_HANDLE;
+        VkImageView denoiseImageView = VK_NULL_HANDLE; // the first one, they are all recreated together
+    };
+    DescSetState m_descSetState[FRAMES_IN_FLIGHT];
+
+    VkDescriptorSet m_denoiseDescSets[FRAMES_IN_FLIGHT];
+    DescSetState m_denoiseDescSetState[FRAMES_IN_FLIGHT]; // tlas and ub unused
+
     QMatrix4x4 m_proj;
     QMatrix4x4 m_projInv;
-    QMatrix4x4 m_view;
-    QMatrix4x4 m_viewInv;
 
-    VkImageView m_lastOutputImageView;
+    struct Camera {
+        float yaw = 0.0f;
+        float pitch = 0.0f;
+        QMatrix4x4 view;
+        QMatrix4x4 viewInv;
+        QMatrix4x4 prevViewProj; // of the last traced frame
+        QVector3D prevPos;
+    };
+    Camera m_cameras[MAX_VIEWS];
+    int m_viewCount = 1;
+
+    VkImageView m_lastOutputImageView = VK_NULL_HANDLE;
+    QSize m_lastPixelSize;
+
+    Image m_accumImage;
+    QSize m_accumImageSize;
+    uint32_t m_sampleCount = 0;
+    uint32_t m_samplesPerFrame = 1;
+    uint32_t m_maxSamples = 1024;
+    uint32_t m_maxBounces = 4;
+    bool m_lastFrameTraced = false;
+
+    quint64 m_rayBudget = 0;
+    double m_traceTimeBudget = 0;
+    quint64 m_measuredRayBudget = 0; // from the trace time budget, 0 until measured
+    TraceSplit m_traceSplit = Bands;
+    // the pass in progress, these only change between passes
+    uint32_t m_passParts = 1;
+    uint32_t m_passPart = 0; // next part to trace
+    TraceSplit m_passSplit = Bands;
+    uint32_t m_passSamples = 1; // samples per pixel added by the pass
+
+    bool m_denoise = false;
+    Image m_denoiseImages[DenoiseImageCount];
+    QSize m_denoiseImageSize; // 1x1 placeholders while disabled, the descriptors must be valid
+    uint32_t m_denoiseCurrent = 0; // G-buffer and history written by the next frame
+    bool m_denoiseHistoryValid = false;
+    bool m_lastFrameWroteOutput = false; // placeholder, or a trace that completed the image
+
+    // the output images of async mode; values are of the timeline semaphore
+    struct AsyncImage {
+        Image image; // the layout is the one after the last submission
+        quint64 busyValue = 0; // last submission using it
+        quint64 contentValue = 0; // last submission writing a complete image to it
+        bool shown = false;
+        quint64 shownUntil = 0; // UI frame, Qt Quick may read it until FRAMES_IN_FLIGHT frames later
+    };
+    bool isAsyncImageFree(const AsyncImage &image, quint64 completedValue) const;
+    void destroyAsyncImage(const AsyncImage &image, VkDevice dev, QVulkanDeviceFunctions *df);
+    void releaseAsync(VkDevice dev, QVulkanDeviceFunctions *df);
+    bool submitAsync(VkCommandBuffer cb, quint64 value, QVulkanDeviceFunctions *df);
+
+    struct AsyncState {
+        VkQueue queue = VK_NULL_HANDLE;
+        bool concurrent = false; // the queue is of another family than Qt Quick's
+        uint32_t queueFamilyIndices[2]; // async, Qt Quick's
+        VkSemaphore timeline = VK_NULL_HANDLE;
+        quint64 lastValue = 0; // signaled by the last submission
+        VkCommandPool cmdPools[FRAMES_IN_FLIGHT];
+        VkCommandBuffer cbs[FRAMES_IN_FLIGHT];
+        quint64 slotValues[FRAMES_IN_FLIGHT];
+        quint64 submitCount = 0;
+        VkCommandPool setupCmdPool = VK_NULL_HANDLE; // the first placeholder
+        quint64 uiFrame = 0;
+        QSize size;
+        AsyncImage images[ASYNC_IMAGE_COUNT];
+        std::vector<AsyncImage> retired; // from before a resize, released once unused
+        VkImage shownImage = VK_NULL_HANDLE;
+        QSize shownSize;
+        quint64 shownValue = 0;
+        quint64 graphicsWaitValue = 0; // last value Qt Quick's queue waited for
+        PFN_vkGetSemaphoreCounterValue vkGetSemaphoreCounterValue = nullptr;
+    };
+    AsyncState m_async;
+
+    // TimestampCount queries per frame slot
+    struct TimestampSlot {
+        quint64 frame = 0;
+        int stages = 0;
+        bool traced = false;
+        quint64 rays = 0;
+    };
+    VkQueryPool m_timestampPool = VK_NULL_HANDLE;
+    float m_timestampPeriod = 1.0f; // ns per tick
+    bool m_gpuTimingsEnabled = true;
+    TimestampSlot m_timestampSlots[FRAMES_IN_FLIGHT];
+    uint m_timestampSlot = 0;
+    int m_nextTimestamp = TimestampCount; // nothing to write when TimestampCount
+    GpuTimings m_gpuTimings;
 };
 
 #endif
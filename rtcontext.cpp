@@ -0,0 +1,1879 @@
+#include "rtcontext.h"
+#include <QFile>
+#include <QDir>
+#include <QFileInfo>
+#include <QStandardPaths>
+#include <QMutex>
+#include <QDebug>
+#include <QtMath>
+#include <cstring>
+#include <map>
+#include <tuple>
+
+// storage images in each binding of the denoiser's descriptor set, see denoise.glsl:
+// accumulation, output, 2 G-buffers, motion, 2 histories, 2 filter images
+const uint32_t RaytracingContext::DENOISE_IMAGE_COUNTS[] = { 1, 1, 2, 1, 2, 2 };
+
+// what may change every frame and does not need to be logged
+static const int lightweightStages = RaytracingContext::InstanceStage | RaytracingContext::DeformStage;
+
+// the contexts handed out by get(), owned by the views using them
+static QMutex contextsLock;
+static std::map<std::tuple<VkDevice, const void *, QString>, std::weak_ptr<RaytracingContext>> contexts;
+
+std::shared_ptr<RaytracingContext> RaytracingContext::get(const void *owner, const QString &key, VkPhysicalDevice physDev, VkDevice dev,
+                                                          QVulkanFunctions *f, QVulkanDeviceFunctions *df,
+                                                          bool hostCommandsEnabled)
+{
+    QMutexLocker locker(&contextsLock);
+    for (auto it = contexts.begin(); it != contexts.end(); ) {
+        if (it->second.expired())
+            it = contexts.erase(it);
+        else
+            ++it;
+    }
+
+    std::weak_ptr<RaytracingContext> &entry(contexts[std::make_tuple(dev, owner, key)]);
+    std::shared_ptr<RaytracingContext> context = entry.lock();
+    if (!context) {
+        qDebug() << "new raytracing context for" << key;
+        context = create(physDev, dev, f, df, hostCommandsEnabled);
+        entry = context;
+    }
+    return context;
+}
+
+std::shared_ptr<RaytracingContext> RaytracingContext::create(VkPhysicalDevice physDev, VkDevice dev,
+                                                             QVulkanFunctions *f, QVulkanDeviceFunctions *df,
+                                                             bool hostCommandsEnabled)
+{
+    std::shared_ptr<RaytracingContext> context(new RaytracingContext);
+    context->init(physDev, dev, f, df, hostCommandsEnabled);
+    return context;
+}
+
+RaytracingContext::~RaytracingContext()
+{
+    releaseResources(m_dev, m_df);
+}
+
+void RaytracingContext::init(VkPhysicalDevice physDev, VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df,
+                             bool hostCommandsEnabled)
+{
+    m_dev = dev;
+    m_df = df;
+
+    if (qEnvironmentVariableIntValue("QVKRT_CPU_TRACE") || !hasRayTracingSupport(physDev, f)) {
+        initCpu(physDev, dev, f, df);
+        return;
+    }
+    m_deviceAddresses = true;
+
+    VkPhysicalDeviceAccelerationStructurePropertiesKHR asProps = {};
+    asProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR;
+    VkPhysicalDeviceRayTracingPipelinePropertiesKHR rtProps = {};
+    rtProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR;
+    rtProps.pNext = &asProps;
+    VkPhysicalDeviceProperties2 deviceProperties2 = {};
+    deviceProperties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    deviceProperties2.pNext = &rtProps;
+    f->vkGetPhysicalDeviceProperties2(physDev, &deviceProperties2);
+
+    qDebug() << "shaderGroupHandleSize" << rtProps.shaderGroupHandleSize
+             << "maxRayRecursionDepth" << rtProps.maxRayRecursionDepth
+             << "maxShaderGroupStride" << rtProps.maxShaderGroupStride
+             << "shaderGroupBaseAlignment" << rtProps.shaderGroupBaseAlignment
+             << "maxRayDispatchInvocationCount" << rtProps.maxRayDispatchInvocationCount
+             << "shaderGroupHandleAlignment" << rtProps.shaderGroupHandleAlignment
+             << "maxRayHitAttributeSize" << rtProps.maxRayHitAttributeSize;
+
+    m_rtProps = rtProps;
+
+    qDebug() << "minAccelerationStructureScratchOffsetAlignment" << asProps.minAccelerationStructureScratchOffsetAlignment;
+    m_scratchAlignment = qMax(VkDeviceSize(1), VkDeviceSize(asProps.minAccelerationStructureScratchOffsetAlignment));
+
+    // instance data for TLAS builds must be 16 byte aligned
+    const VkPhysicalDeviceLimits &limits(deviceProperties2.properties.limits);
+    m_minStreamAlignment = qMax(VkDeviceSize(16), qMax(limits.minUniformBufferOffsetAlignment,
+                                                       limits.minStorageBufferOffsetAlignment));
+
+    // the ray query features may only be asked for when the extension is there
+    const bool hasRayQueryExtension = hasDeviceExtension(physDev, f, VK_KHR_RAY_QUERY_EXTENSION_NAME);
+    VkPhysicalDeviceRayQueryFeaturesKHR rqFeatures = {};
+    rqFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_QUERY_FEATURES_KHR;
+    VkPhysicalDeviceAccelerationStructureFeaturesKHR asFeatures = {};
+    asFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
+    if (hasRayQueryExtension)
+        asFeatures.pNext = &rqFeatures;
+    VkPhysicalDeviceFeatures2 deviceFeatures2 = {};
+    deviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    deviceFeatures2.pNext = &asFeatures;
+    f->vkGetPhysicalDeviceFeatures2(physDev, &deviceFeatures2);
+
+    qDebug() << "features: accelerationStructure" << asFeatures.accelerationStructure
+             << "accelerationStructureIndirectBuild" << asFeatures.accelerationStructureIndirectBuild
+             << "accelerationStructureHostCommands" << asFeatures.accelerationStructureHostCommands
+             << "descriptorBindingAccelerationStructureUpdateAfterBind" << asFeatures.descriptorBindingAccelerationStructureUpdateAfterBind;
+
+    m_asFeatures = asFeatures;
+
+    // the device must have been created with it enabled, see README
+    m_rayQuerySupported = hasRayQueryExtension && rqFeatures.rayQuery;
+    qDebug() << "ray query" << m_rayQuerySupported;
+
+    vkGetBufferDeviceAddressKHR = reinterpret_cast<PFN_vkGetBufferDeviceAddressKHR>(f->vkGetDeviceProcAddr(dev, "vkGetBufferDeviceAddressKHR"));
+    vkCmdBuildAccelerationStructuresKHR = reinterpret_cast<PFN_vkCmdBuildAccelerationStructuresKHR>(f->vkGetDeviceProcAddr(dev, "vkCmdBuildAccelerationStructuresKHR"));
+    vkCmdWriteAccelerationStructuresPropertiesKHR = reinterpret_cast<PFN_vkCmdWriteAccelerationStructuresPropertiesKHR>(f->vkGetDeviceProcAddr(dev, "vkCmdWriteAccelerationStructuresPropertiesKHR"));
+    vkCmdCopyAccelerationStructureKHR = reinterpret_cast<PFN_vkCmdCopyAccelerationStructureKHR>(f->vkGetDeviceProcAddr(dev, "vkCmdCopyAccelerationStructureKHR"));
+    vkBuildAccelerationStructuresKHR = reinterpret_cast<PFN_vkBuildAccelerationStructuresKHR>(f->vkGetDeviceProcAddr(dev, "vkBuildAccelerationStructuresKHR"));
+    vkCreateAccelerationStructureKHR = reinterpret_cast<PFN_vkCreateAccelerationStructureKHR>(f->vkGetDeviceProcAddr(dev, "vkCreateAccelerationStructureKHR"));
+    vkDestroyAccelerationStructureKHR = reinterpret_cast<PFN_vkDestroyAccelerationStructureKHR>(f->vkGetDeviceProcAddr(dev, "vkDestroyAccelerationStructureKHR"));
+    vkGetAccelerationStructureBuildSizesKHR = reinterpret_cast<PFN_vkGetAccelerationStructureBuildSizesKHR>(f->vkGetDeviceProcAddr(dev, "vkGetAccelerationStructureBuildSizesKHR"));
+    vkGetAccelerationStructureDeviceAddressKHR = reinterpret_cast<PFN_vkGetAccelerationStructureDeviceAddressKHR>(f->vkGetDeviceProcAddr(dev, "vkGetAccelerationStructureDeviceAddressKHR"));
+    vkCmdTraceRaysKHR = reinterpret_cast<PFN_vkCmdTraceRaysKHR>(f->vkGetDeviceProcAddr(dev, "vkCmdTraceRaysKHR"));
+    vkGetRayTracingShaderGroupHandlesKHR = reinterpret_cast<PFN_vkGetRayTracingShaderGroupHandlesKHR>(f->vkGetDeviceProcAddr(dev, "vkGetRayTracingShaderGroupHandlesKHR"));
+
+    // Host builds need the feature to be enabled on the device too, see README.
+    // QVKRT_NO_HOST_AS_BUILDS=1 forces building everything on the GPU.
+    if (asFeatures.accelerationStructureHostCommands && !hostCommandsEnabled)
+        qDebug("accelerationStructureHostCommands is supported but not enabled on the device");
+    m_deferredFuncs.resolve(dev, f);
+    m_hostBuilds = hostCommandsEnabled && asFeatures.accelerationStructureHostCommands && m_deferredFuncs.isValid()
+            && !qEnvironmentVariableIntValue("QVKRT_NO_HOST_AS_BUILDS");
+    qDebug() << "host acceleration structure builds" << m_hostBuilds;
+
+    m_allocator.init(physDev, dev, f, df);
+    m_pipelineCompiler.init(dev, f, df);
+    m_pipelineJob = 0;
+
+    m_deviceProps = deviceProperties2.properties;
+    createPipelineCache(dev, df);
+
+    createStreamRing(dev, df);
+
+    // the layouts are static, only the pipeline and what the sets point to
+    // may change; the compute stage is for rayquery.comp
+    VkDescriptorSetLayoutBinding asLayoutBinding = {};
+    asLayoutBinding.binding = 0;
+    asLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+    asLayoutBinding.descriptorCount = 1;
+    asLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkDescriptorSetLayoutBinding outputLayoutBinding = {};
+    outputLayoutBinding.binding = 1;
+    outputLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    outputLayoutBinding.descriptorCount = 1;
+    outputLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkDescriptorSetLayoutBinding ubLayoutBinding = {};
+    ubLayoutBinding.binding = 2;
+    ubLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    ubLayoutBinding.descriptorCount = 1;
+    ubLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkDescriptorSetLayoutBinding accumLayoutBinding = {};
+    accumLayoutBinding.binding = 3;
+    accumLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    accumLayoutBinding.descriptorCount = 1;
+    accumLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_COMPUTE_BIT;
+
+    // G-buffer for the denoiser
+    VkDescriptorSetLayoutBinding gbufferLayoutBinding = {};
+    gbufferLayoutBinding.binding = 4;
+    gbufferLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    gbufferLayoutBinding.descriptorCount = 2;
+    gbufferLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkDescriptorSetLayoutBinding motionLayoutBinding = {};
+    motionLayoutBinding.binding = 5;
+    motionLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    motionLayoutBinding.descriptorCount = 1;
+    motionLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_COMPUTE_BIT;
+
+    const VkDescriptorSetLayoutBinding bindings[6] = {
+        asLayoutBinding,
+        outputLayoutBinding,
+        ubLayoutBinding,
+        accumLayoutBinding,
+        gbufferLayoutBinding,
+        motionLayoutBinding
+    };
+
+    VkDescriptorSetLayoutCreateInfo descSetLayoutCreateInfo = {};
+    descSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descSetLayoutCreateInfo.bindingCount = 6;
+    descSetLayoutCreateInfo.pBindings = bindings;
+    df->vkCreateDescriptorSetLayout(dev, &descSetLayoutCreateInfo, nullptr, &m_descSetLayout);
+
+    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {};
+    pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutCreateInfo.setLayoutCount = 1;
+    pipelineLayoutCreateInfo.pSetLayouts = &m_descSetLayout;
+    df->vkCreatePipelineLayout(dev, &pipelineLayoutCreateInfo, nullptr, &m_pipelineLayout);
+
+    // the denoiser's passes all use the same set, push constants select the images
+    VkDescriptorSetLayoutBinding denoiseBindings[DENOISE_BINDING_COUNT];
+    for (uint32_t i = 0; i < DENOISE_BINDING_COUNT; ++i) {
+        denoiseBindings[i] = {};
+        denoiseBindings[i].binding = i;
+        denoiseBindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        denoiseBindings[i].descriptorCount = DENOISE_IMAGE_COUNTS[i];
+        denoiseBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+    descSetLayoutCreateInfo.bindingCount = DENOISE_BINDING_COUNT;
+    descSetLayoutCreateInfo.pBindings = denoiseBindings;
+    df->vkCreateDescriptorSetLayout(dev, &descSetLayoutCreateInfo, nullptr, &m_denoiseDescSetLayout);
+
+    VkPushConstantRange denoisePushConstantRange = {};
+    denoisePushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    denoisePushConstantRange.offset = 0;
+    denoisePushConstantRange.size = sizeof(DenoiseParams);
+    pipelineLayoutCreateInfo.pSetLayouts = &m_denoiseDescSetLayout;
+    pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+    pipelineLayoutCreateInfo.pPushConstantRanges = &denoisePushConstantRange;
+    df->vkCreatePipelineLayout(dev, &pipelineLayoutCreateInfo, nullptr, &m_denoisePipelineLayout);
+
+    m_dirty = AllStages & ~CameraStage;
+}
+
+void RaytracingContext::releaseResources(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    df->vkDeviceWaitIdle(dev);
+
+    if (m_cpuTracer) {
+        executeDeferredReleases(dev, df, true);
+        m_cpuTracer.reset();
+        qDebug() << "releasing, allocator state was" << m_allocator.stats();
+        m_allocator.destroy();
+        return;
+    }
+
+    releaseTlas();
+    releaseBlas();
+    releaseGeometry();
+    releaseLater(m_pipeline);
+    m_pipeline = VK_NULL_HANDLE;
+    releaseLater(m_sbt);
+    m_sbt = {};
+    releaseLater(m_stream.buf);
+    m_stream = {};
+    for (Buffer &b : m_instanceBuffers) {
+        releaseLater(b);
+        b = {};
+    }
+    releaseLater(m_scratch);
+    m_scratch = {};
+    m_scratchLastUse = 0;
+    executeDeferredReleases(dev, df, true);
+
+    // a pipeline compiling in the background uses the cache
+    m_pipelineCompiler.destroy();
+    m_pipelineJob = 0;
+    savePipelineCache(dev, df);
+    df->vkDestroyPipelineCache(dev, m_pipelineCache, nullptr);
+    m_pipelineCache = VK_NULL_HANDLE;
+
+    if (m_deformPipeline) {
+        df->vkDestroyPipeline(dev, m_deformPipeline, nullptr);
+        m_deformPipeline = VK_NULL_HANDLE;
+        df->vkDestroyPipelineLayout(dev, m_deformPipelineLayout, nullptr);
+        m_deformPipelineLayout = VK_NULL_HANDLE;
+    }
+
+    if (m_rayQueryPipeline) {
+        df->vkDestroyPipeline(dev, m_rayQueryPipeline, nullptr);
+        m_rayQueryPipeline = VK_NULL_HANDLE;
+    }
+
+    if (m_denoiseTemporalPipeline) {
+        df->vkDestroyPipeline(dev, m_denoiseTemporalPipeline, nullptr);
+        m_denoiseTemporalPipeline = VK_NULL_HANDLE;
+        df->vkDestroyPipeline(dev, m_denoiseAtrousPipeline, nullptr);
+        m_denoiseAtrousPipeline = VK_NULL_HANDLE;
+    }
+
+    df->vkDestroyPipelineLayout(dev, m_pipelineLayout, nullptr);
+    m_pipelineLayout = VK_NULL_HANDLE;
+    df->vkDestroyDescriptorSetLayout(dev, m_descSetLayout, nullptr);
+    m_descSetLayout = VK_NULL_HANDLE;
+    df->vkDestroyPipelineLayout(dev, m_denoisePipelineLayout, nullptr);
+    m_denoisePipelineLayout = VK_NULL_HANDLE;
+    df->vkDestroyDescriptorSetLayout(dev, m_denoiseDescSetLayout, nullptr);
+    m_denoiseDescSetLayout = VK_NULL_HANDLE;
+
+    qDebug() << "releasing, allocator state was" << m_allocator.stats();
+    m_allocator.destroy();
+}
+
+void RaytracingContext::initCpu(VkPhysicalDevice physDev, VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df)
+{
+    qDebug("tracing on the CPU, %d threads, %d rays per packet", CpuTracer::threadCount(), CpuTracer::packetWidth());
+    m_cpuTracer.reset(new CpuTracer);
+
+    // the only buffers are the views' staging ones, no need for device addresses
+    m_deviceAddresses = false;
+    m_allocator.init(physDev, dev, f, df, false);
+    m_dirty = AllStages & ~CameraStage;
+}
+
+void RaytracingContext::beginFrame(uint currentFrameSlot, quint64 *viewFrame, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    if (!m_frameCounter || currentFrameSlot != m_frameSlot || *viewFrame == m_frameCounter) {
+        m_frameCounter += 1;
+        m_frameSlot = currentFrameSlot;
+        executeDeferredReleases(dev, df, false);
+        if (!m_cpuTracer)
+            beginStreamFrame(currentFrameSlot);
+    }
+    *viewFrame = m_frameCounter;
+}
+
+void RaytracingContext::updateBlas(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    // anything that changes the image restarts the views' accumulation
+    if (m_dirty)
+        m_revision += 1;
+
+    // the instances must point to the compacted BLASes, so rebuild the TLAS afterwards
+    if (m_compaction.queryPool && !(m_dirty & (GeometryStage | BlasStage))
+            && m_compaction.frame + FRAMES_IN_FLIGHT <= m_frameCounter)
+    {
+        if (compactBlas(cb, dev, df))
+            m_dirty |= TlasStage;
+    }
+
+    if (m_dirty & ~lightweightStages) {
+        // dependent stages
+        if (m_dirty & GeometryStage)
+            m_dirty |= BlasStage;
+        if (m_dirty & BlasStage)
+            m_dirty |= TlasStage;
+        qDebug("setup, stages 0x%x", m_dirty);
+    }
+
+    // release in reverse dependency order, then recreate
+    if (m_dirty & TlasStage)
+        releaseTlas();
+    if (m_dirty & BlasStage)
+        releaseBlas();
+    if (m_dirty & GeometryStage)
+        releaseGeometry();
+
+    if (m_dirty & GeometryStage)
+        createGeometry(dev, df);
+
+    if (m_dirty & (GeometryStage | DeformStage))
+        deformMeshes(cb, dev, df);
+
+    if (m_dirty & BlasStage) {
+        buildBlas(cb, dev, df);
+    } else if (m_dirty & DeformStage) {
+        refitBlas(cb, dev, df);
+        // the instance bounds change with the BLASes
+        m_dirty |= InstanceStage;
+    }
+}
+
+void RaytracingContext::updateTlas(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    // host builds run while frames keep being rendered, the TLAS follows once they are all done
+    if (!m_hostBlasBuilds.empty()) {
+        if (finishHostBlasBuilds())
+            m_dirty |= TlasStage;
+        else
+            m_dirty &= ~(TlasStage | InstanceStage);
+    }
+
+    if (m_dirty & TlasStage)
+        buildTlas(cb, dev, df);
+    else if (m_dirty & InstanceStage)
+        refitTlas(cb, dev, df);
+}
+
+int RaytracingContext::updatePipelines(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    if (m_dirty & PipelineStage)
+        createPipeline(dev, df);
+
+    // the SBT has the group handles of the new pipeline, so it follows it
+    if (m_pipelineJob && finishPipeline(dev, df)) {
+        m_dirty |= SbtStage;
+        m_revision += 1;
+    }
+
+    if (m_dirty & SbtStage) {
+        releaseLater(m_sbt);
+        createSbt(dev, df);
+    }
+
+    if (m_dirty & ~lightweightStages)
+        qDebug() << m_allocator.stats();
+
+    // do not keep the scratch pool around forever once the builds are done
+    if (m_scratch.buf && m_scratchLastUse + SCRATCH_IDLE_FRAMES < m_frameCounter) {
+        releaseLater(m_scratch);
+        m_scratch = {};
+        m_scratchLastUse = 0;
+    }
+
+    const int stages = m_dirty;
+    m_dirty = 0;
+    return stages;
+}
+
+int RaytracingContext::updateCpuScene(double *blasTime, double *tlasTime)
+{
+    if (m_dirty)
+        m_revision += 1;
+
+    // the mesh BVHs stand in for the BLASes, the instance one for the TLAS;
+    // they are built in full every time (there are no refits)
+    QElapsedTimer timer;
+    timer.start();
+    if (m_dirty & (GeometryStage | BlasStage)) {
+        if (m_scene.isEmpty())
+            setScene(Scene::triangle());
+        m_cpuTracer->setScene(m_scene);
+        m_dirty |= TlasStage;
+    }
+    *blasTime = timer.nsecsElapsed() / 1000000.0;
+    if (m_dirty & (TlasStage | InstanceStage))
+        m_cpuTracer->setInstances(m_instances);
+    *tlasTime = timer.nsecsElapsed() / 1000000.0 - *blasTime;
+
+    const int stages = m_dirty;
+    m_dirty = 0;
+    return stages;
+}
+
+VkPipeline RaytracingContext::rayQueryPipeline(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    // the compute pipeline is small, it is created right away when first needed
+    if (!m_rayQueryPipeline)
+        createRayQueryPipeline(dev, df);
+    return m_rayQueryPipeline;
+}
+
+VkPipeline RaytracingContext::denoiseTemporalPipeline(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    if (!m_denoiseTemporalPipeline)
+        createDenoisePipelines(dev, df);
+    return m_denoiseTemporalPipeline;
+}
+
+void RaytracingContext::traceRays(VkCommandBuffer cb, uint32_t width, uint32_t height, uint32_t depth)
+{
+    const uint32_t handleSize = m_rtProps.shaderGroupHandleSize;
+    const uint32_t handleSizeAligned = aligned(handleSize, m_rtProps.shaderGroupHandleAlignment);
+    const uint32_t sbtBufferEntrySize = aligned(handleSizeAligned, m_rtProps.shaderGroupBaseAlignment);
+
+    VkStridedDeviceAddressRegionKHR raygenShaderSbtEntry = {};
+    raygenShaderSbtEntry.deviceAddress = m_sbt.addr;
+    raygenShaderSbtEntry.stride = handleSizeAligned;
+    raygenShaderSbtEntry.size = handleSize;
+
+    VkStridedDeviceAddressRegionKHR missShaderSbtEntry = {};
+    missShaderSbtEntry.deviceAddress = m_sbt.addr + sbtBufferEntrySize;
+    missShaderSbtEntry.stride = handleSizeAligned;
+    missShaderSbtEntry.size = handleSize;
+
+    VkStridedDeviceAddressRegionKHR hitShaderSbtEntry = {};
+    hitShaderSbtEntry.deviceAddress = m_sbt.addr + sbtBufferEntrySize * 2;
+    hitShaderSbtEntry.stride = handleSizeAligned;
+    hitShaderSbtEntry.size = handleSize;
+
+    VkStridedDeviceAddressRegionKHR callableShaderSbtEntry = {};
+
+    vkCmdTraceRaysKHR(cb,
+                      &raygenShaderSbtEntry,
+                      &missShaderSbtEntry,
+                      &hitShaderSbtEntry,
+                      &callableShaderSbtEntry,
+                      width, height, depth);
+}
+
+static const char entryPoint[] = "main";
+
+static VkPipelineShaderStageCreateInfo getShader(const QString &name, VkShaderStageFlagBits stage, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    QFile f(name);
+    if (!f.open(QIODevice::ReadOnly))
+        qFatal("Failed to open %s", qPrintable(name));
+    const QByteArray data = f.readAll();
+
+    VkShaderModuleCreateInfo shaderInfo = {};
+    shaderInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    shaderInfo.codeSize = data.size();
+    shaderInfo.pCode = reinterpret_cast<const quint32 *>(data.constData());
+    VkShaderModule module;
+    df->vkCreateShaderModule(dev, &shaderInfo, nullptr, &module);
+
+    VkPipelineShaderStageCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    info.stage = stage;
+    info.module = module;
+    info.pName = entryPoint;
+
+    return info;
+}
+
+// all of these are required to be supported for acceleration structure builds
+static VkFormat blasVertexFormat(Mesh::VertexFormat format)
+{
+    switch (format) {
+    case Mesh::Snorm16:
+        return VK_FORMAT_R16G16B16A16_SNORM;
+    case Mesh::Float16:
+        return VK_FORMAT_R16G16B16A16_SFLOAT;
+    default:
+        return VK_FORMAT_R32G32B32_SFLOAT;
+    }
+}
+
+void RaytracingContext::setScene(const Scene &scene)
+{
+    m_scene = scene;
+
+    QVector3D boundsMin, boundsMax;
+    m_scene.boundingBox(&boundsMin, &boundsMax);
+    m_sceneCenter = (boundsMin + boundsMax) * 0.5f;
+    m_sceneRadius = qMax(0.001f, (boundsMax - boundsMin).length() * 0.5f);
+
+    m_instances = m_scene.instances();
+
+    m_dirty |= GeometryStage;
+    m_sceneRevision += 1;
+}
+
+void RaytracingContext::setInstanceTransforms(const std::vector<QMatrix4x4> &transforms)
+{
+    // adding or removing instances needs a new scene, that is a full rebuild
+    if (transforms.size() != m_instances.size()) {
+        qWarning("Instance count mismatch (%d, expected %d), ignoring transforms",
+                 int(transforms.size()), int(m_instances.size()));
+        return;
+    }
+
+    for (size_t i = 0; i < transforms.size(); ++i)
+        m_instances[i].transform = transforms[i];
+
+    m_dirty |= InstanceStage;
+}
+
+void RaytracingContext::setDeformPhase(float phase)
+{
+    m_deformPhase = phase;
+    m_dirty |= DeformStage;
+}
+
+void RaytracingContext::createGeometry(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    if (m_scene.isEmpty())
+        setScene(Scene::triangle());
+
+    // one set of buffers per unique mesh, no matter how many instances refer to it
+    m_meshes.resize(m_scene.meshes.size());
+    for (size_t i = 0; i < m_scene.meshes.size(); ++i) {
+        const Mesh &mesh(m_scene.meshes[i]);
+        MeshResources &res(m_meshes[i]);
+        // in the formats chosen when loading, see Mesh::selectFormats()
+        const VkDeviceSize vertexDataSize = mesh.vertexDataSize();
+        res.vertexBuffer = createHostVisibleBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, dev, df, vertexDataSize);
+        mesh.writeVertexData(res.vertexBuffer.alloc.p);
+        const VkDeviceSize indexDataSize = mesh.indexDataSize();
+        res.indexBuffer = createHostVisibleBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, dev, df, indexDataSize);
+        mesh.writeIndexData(res.indexBuffer.alloc.p);
+        if (mesh.gpuVertexFormat() != Mesh::Float32) {
+            // the BLAS builds dequantize the positions with this, 3x4 row major
+            QVector3D scale, offset;
+            mesh.dequantization(&scale, &offset);
+            const VkTransformMatrixKHR transform = {
+                scale.x(), 0.0f, 0.0f, offset.x(),
+                0.0f, scale.y(), 0.0f, offset.y(),
+                0.0f, 0.0f, scale.z(), offset.z()
+            };
+            res.transformBuffer = createHostVisibleBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, dev, df, sizeof(transform));
+            updateHostData(res.transformBuffer, dev, df, transform.matrix, sizeof(transform.matrix));
+        }
+        if (mesh.deformable) {
+            // written by the deform compute pass, read by the BLAS builds and refits
+            res.deformedVertexBuffer = createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                                                    | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+                                                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, dev, df, vertexDataSize);
+        }
+    }
+
+    // the closest hit shader finds the vertices of the hit triangle through this
+    std::vector<GeometryDesc> geometryTable;
+    for (size_t i = 0; i < m_scene.meshes.size(); ++i) {
+        const Mesh &mesh(m_scene.meshes[i]);
+        MeshResources &res(m_meshes[i]);
+        res.firstGeometryDesc = uint32_t(geometryTable.size());
+        QVector3D scale, offset;
+        mesh.dequantization(&scale, &offset);
+        for (const Mesh::Geometry &g : mesh.geometries) {
+            GeometryDesc desc = {};
+            for (int c = 0; c < 3; ++c) {
+                desc.scale[c] = scale[c];
+                desc.offset[c] = offset[c];
+            }
+            desc.vertices = mesh.deformable ? res.deformedVertexBuffer.addr : res.vertexBuffer.addr;
+            desc.indices = res.indexBuffer.addr;
+            desc.firstIndex = g.firstIndex;
+            desc.firstVertex = g.firstVertex;
+            desc.format = uint32_t(mesh.gpuVertexFormat()) | uint32_t(mesh.indexFormat);
+            geometryTable.push_back(desc);
+        }
+    }
+    const VkDeviceSize geometryTableSize = qMax<size_t>(1, geometryTable.size()) * sizeof(GeometryDesc);
+    m_geometryTable = createHostVisibleBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, dev, df, geometryTableSize);
+    updateHostData(m_geometryTable, dev, df, geometryTable.data(), geometryTable.size() * sizeof(GeometryDesc));
+}
+
+void RaytracingContext::releaseGeometry()
+{
+    // the BLASes are expected to be released already
+    for (MeshResources &res : m_meshes) {
+        releaseLater(res.vertexBuffer);
+        releaseLater(res.indexBuffer);
+        releaseLater(res.transformBuffer);
+        releaseLater(res.deformedVertexBuffer);
+    }
+    m_meshes.clear();
+    releaseLater(m_geometryTable);
+    m_geometryTable = {};
+}
+
+void RaytracingContext::fillBlasGeometry(const Mesh &mesh, const MeshResources &res, bool hostAddresses,
+                                         std::vector<VkAccelerationStructureGeometryKHR> *asGeoms,
+                                         std::vector<VkAccelerationStructureBuildRangeInfoKHR> *ranges,
+                                         std::vector<uint32_t> *primitiveCounts)
+{
+    VkDeviceOrHostAddressConstKHR vertexBufferDeviceAddress = {};
+    VkDeviceOrHostAddressConstKHR indexBufferDeviceAddress = {};
+    VkDeviceOrHostAddressConstKHR transformBufferDeviceAddress = {};
+    if (hostAddresses) {
+        // the (persistently mapped) host visible buffers, valid as long as the BLAS
+        vertexBufferDeviceAddress.hostAddress = res.vertexBuffer.alloc.p;
+        indexBufferDeviceAddress.hostAddress = res.indexBuffer.alloc.p;
+        if (res.transformBuffer.buf)
+            transformBufferDeviceAddress.hostAddress = res.transformBuffer.alloc.p;
+    } else {
+        vertexBufferDeviceAddress.deviceAddress = mesh.deformable ? res.deformedVertexBuffer.addr : res.vertexBuffer.addr;
+        indexBufferDeviceAddress.deviceAddress = res.indexBuffer.addr;
+        transformBufferDeviceAddress.deviceAddress = res.transformBuffer.addr;
+    }
+
+    // all geometries of a mesh share the vertex and index buffers, the
+    // ranges select the indices (primitiveOffset) and the base vertex
+    // (firstVertex) of each
+    for (const Mesh::Geometry &g : mesh.geometries) {
+        VkAccelerationStructureGeometryKHR asGeom = {};
+        asGeom.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+        asGeom.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+        asGeom.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+        asGeom.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
+        asGeom.geometry.triangles.vertexFormat = blasVertexFormat(mesh.gpuVertexFormat());
+        asGeom.geometry.triangles.vertexData = vertexBufferDeviceAddress;
+        asGeom.geometry.triangles.vertexStride = mesh.vertexStride();
+        asGeom.geometry.triangles.maxVertex = mesh.vertexCount() - 1;
+        asGeom.geometry.triangles.indexType = mesh.indexFormat == Mesh::Uint16 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+        asGeom.geometry.triangles.indexData = indexBufferDeviceAddress;
+        // null (no transform) unless the positions are quantized
+        asGeom.geometry.triangles.transformData = transformBufferDeviceAddress;
+        asGeoms->push_back(asGeom);
+
+        VkAccelerationStructureBuildRangeInfoKHR asBuildRangeInfo = {};
+        asBuildRangeInfo.primitiveCount = g.indexCount / 3;
+        asBuildRangeInfo.primitiveOffset = g.firstIndex * mesh.indexSize();
+        asBuildRangeInfo.firstVertex = g.firstVertex;
+        asBuildRangeInfo.transformOffset = 0;
+        ranges->push_back(asBuildRangeInfo);
+
+        primitiveCounts->push_back(asBuildRangeInfo.primitiveCount);
+    }
+}
+
+void RaytracingContext::buildBlas(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    std::vector<uint32_t> deviceMeshes;
+    for (uint32_t meshIndex = 0; meshIndex < uint32_t(m_meshes.size()); ++meshIndex) {
+        if (isHostBuilt(m_scene.meshes[meshIndex])) {
+            if (m_hostBlasBuilds.empty())
+                m_hostBuildTimer.start();
+            startHostBlasBuild(meshIndex, dev, df);
+        } else {
+            deviceMeshes.push_back(meshIndex);
+        }
+    }
+
+    // gather everything first: the geometry arrays must stay put while the
+    // build infos point to them
+    const size_t buildCount = deviceMeshes.size();
+    std::vector<std::vector<VkAccelerationStructureGeometryKHR>> asGeoms(buildCount);
+    std::vector<std::vector<VkAccelerationStructureBuildRangeInfoKHR>> ranges(buildCount);
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildInfos(buildCount);
+    std::vector<VkDeviceSize> scratchSizes(buildCount);
+    std::vector<uint32_t> primitiveCounts;
+
+    for (size_t i = 0; i < buildCount; ++i) {
+        const uint32_t meshIndex = deviceMeshes[i];
+        const Mesh &mesh(m_scene.meshes[meshIndex]);
+        MeshResources &res(m_meshes[meshIndex]);
+        primitiveCounts.clear();
+        fillBlasGeometry(mesh, res, false, &asGeoms[i], &ranges[i], &primitiveCounts);
+
+        VkAccelerationStructureBuildGeometryInfoKHR &asBuildGeomInfo(buildInfos[i]);
+        asBuildGeomInfo = {};
+        asBuildGeomInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        asBuildGeomInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        asBuildGeomInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+        if (mesh.deformable)
+            asBuildGeomInfo.flags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+        else if (m_compactionEnabled)
+            asBuildGeomInfo.flags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+        asBuildGeomInfo.geometryCount = uint32_t(asGeoms[i].size());
+        asBuildGeomInfo.pGeometries = asGeoms[i].data();
+        VkAccelerationStructureBuildSizesInfoKHR sizeInfo = {};
+        sizeInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+        vkGetAccelerationStructureBuildSizesKHR(dev,
+                                                VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+                                                &asBuildGeomInfo,
+                                                primitiveCounts.data(),
+                                                &sizeInfo);
+
+        qDebug() << "blas" << meshIndex << mesh.name << "geometries" << asGeoms[i].size()
+                 << "buffer size" << sizeInfo.accelerationStructureSize
+                 << "scratch size" << sizeInfo.buildScratchSize;
+        res.blasBuffer = createASBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR, dev, df,
+                                        sizeInfo.accelerationStructureSize);
+
+        VkAccelerationStructureCreateInfoKHR asCreateInfo = {};
+        asCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+        asCreateInfo.buffer = res.blasBuffer.buf;
+        asCreateInfo.size = sizeInfo.accelerationStructureSize;
+        asCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        vkCreateAccelerationStructureKHR(dev, &asCreateInfo, nullptr, &res.blas);
+
+        VkAccelerationStructureDeviceAddressInfoKHR asAddrInfo = {};
+        asAddrInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+        asAddrInfo.accelerationStructure = res.blas;
+        res.blasAddr = vkGetAccelerationStructureDeviceAddressKHR(dev, &asAddrInfo);
+
+        asBuildGeomInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+        asBuildGeomInfo.dstAccelerationStructure = res.blas;
+        scratchSizes[i] = aligned(sizeInfo.buildScratchSize, m_scratchAlignment);
+        res.buildScratchSize = sizeInfo.buildScratchSize;
+        res.updateScratchSize = sizeInfo.updateScratchSize;
+        res.refitCount = 0;
+    }
+
+    // Split into batches whose scratch fits the budget. A build that is
+    // larger than the budget on its own still gets a batch of its own.
+    std::vector<size_t> batchEnds;
+    VkDeviceSize batchScratchSize = 0;
+    VkDeviceSize maxBatchScratchSize = 0;
+    for (size_t i = 0; i < buildCount; ++i) {
+        if (batchScratchSize && batchScratchSize + scratchSizes[i] > m_scratchBudget) {
+            batchEnds.push_back(i);
+            batchScratchSize = 0;
+        }
+        batchScratchSize += scratchSizes[i];
+        maxBatchScratchSize = qMax(maxBatchScratchSize, batchScratchSize);
+    }
+    if (buildCount)
+        batchEnds.push_back(buildCount);
+
+    std::vector<const VkAccelerationStructureBuildRangeInfoKHR *> rangeInfos(buildCount);
+    size_t batchStart = 0;
+    for (size_t batchEnd : batchEnds) {
+        // each batch reuses the pool from the start, acquireScratch()
+        // orders this against the previous user
+        VkDeviceAddress scratchAddr = acquireScratch(maxBatchScratchSize, cb, dev, df);
+        for (size_t i = batchStart; i < batchEnd; ++i) {
+            buildInfos[i].scratchData.deviceAddress = scratchAddr;
+            scratchAddr += scratchSizes[i];
+            rangeInfos[i] = ranges[i].data();
+        }
+
+        vkCmdBuildAccelerationStructuresKHR(cb, uint32_t(batchEnd - batchStart),
+                                            buildInfos.data() + batchStart, rangeInfos.data() + batchStart);
+        batchStart = batchEnd;
+    }
+
+    if (buildCount)
+        qDebug() << "blas builds" << buildCount << "batches" << batchEnds.size() << "scratch pool size" << m_scratch.size;
+
+    VkMemoryBarrier memoryBarrier = {};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    const VkAccessFlags accelAccess = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    memoryBarrier.srcAccessMask = accelAccess;
+    memoryBarrier.dstAccessMask = accelAccess;
+    df->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                             0, 1, &memoryBarrier, 0, 0, 0, 0);
+
+    if (m_compactionEnabled)
+        queryCompactedSizes(cb, dev, df);
+}
+
+void RaytracingContext::startHostBlasBuild(uint32_t meshIndex, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    const Mesh &mesh(m_scene.meshes[meshIndex]);
+    MeshResources &res(m_meshes[meshIndex]);
+
+    // everything the build info points to must stay valid until the operation completes
+    std::unique_ptr<HostBlasBuild> build(new HostBlasBuild);
+    build->meshIndex = meshIndex;
+    std::vector<uint32_t> primitiveCounts;
+    fillBlasGeometry(mesh, res, true, &build->asGeoms, &build->ranges, &primitiveCounts);
+    build->rangeInfos = build->ranges.data();
+
+    // no compaction, the queries and copies for that are device commands
+    VkAccelerationStructureBuildGeometryInfoKHR &asBuildGeomInfo(build->buildInfo);
+    asBuildGeomInfo = {};
+    asBuildGeomInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+    asBuildGeomInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+    asBuildGeomInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+    asBuildGeomInfo.geometryCount = uint32_t(build->asGeoms.size());
+    asBuildGeomInfo.pGeometries = build->asGeoms.data();
+    VkAccelerationStructureBuildSizesInfoKHR sizeInfo = {};
+    sizeInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+    vkGetAccelerationStructureBuildSizesKHR(dev,
+                                            VK_ACCELERATION_STRUCTURE_BUILD_TYPE_HOST_KHR,
+                                            &asBuildGeomInfo,
+                                            primitiveCounts.data(),
+                                            &sizeInfo);
+
+    qDebug() << "blas" << meshIndex << mesh.name << "host build, geometries" << build->asGeoms.size()
+             << "buffer size" << sizeInfo.accelerationStructureSize
+             << "scratch size" << sizeInfo.buildScratchSize;
+
+    // the CPU writes the acceleration structure, so it must live in host visible memory
+    res.blasBuffer = createHostVisibleBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR, dev, df,
+                                             sizeInfo.accelerationStructureSize);
+
+    VkAccelerationStructureCreateInfoKHR asCreateInfo = {};
+    asCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+    asCreateInfo.buffer = res.blasBuffer.buf;
+    asCreateInfo.size = sizeInfo.accelerationStructureSize;
+    asCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+    vkCreateAccelerationStructureKHR(dev, &asCreateInfo, nullptr, &res.blas);
+
+    VkAccelerationStructureDeviceAddressInfoKHR asAddrInfo = {};
+    asAddrInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+    asAddrInfo.accelerationStructure = res.blas;
+    res.blasAddr = vkGetAccelerationStructureDeviceAddressKHR(dev, &asAddrInfo);
+
+    build->scratch.resize(sizeInfo.buildScratchSize);
+    asBuildGeomInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+    asBuildGeomInfo.dstAccelerationStructure = res.blas;
+    asBuildGeomInfo.scratchData.hostAddress = build->scratch.data();
+    res.buildScratchSize = sizeInfo.buildScratchSize;
+    res.updateScratchSize = sizeInfo.updateScratchSize;
+    res.refitCount = 0;
+
+    build->op.reset(new DeferredOperation(dev, &m_deferredFuncs));
+    build->timer.start();
+    VkResult err = vkBuildAccelerationStructuresKHR(dev, build->op->handle(), 1, &asBuildGeomInfo, &build->rangeInfos);
+    if (err == VK_OPERATION_DEFERRED_KHR) {
+        build->op->startJoining();
+    } else {
+        // VK_OPERATION_NOT_DEFERRED_KHR, or completed/failed synchronously
+        build->op.reset();
+        build->result = err == VK_OPERATION_NOT_DEFERRED_KHR ? VK_SUCCESS : err;
+    }
+
+    m_hostBlasBuilds.push_back(std::move(build));
+}
+
+bool RaytracingContext::finishHostBlasBuilds()
+{
+    for (auto it = m_hostBlasBuilds.begin(); it != m_hostBlasBuilds.end(); ) {
+        HostBlasBuild *build = it->get();
+        if (build->op && !build->op->isDone()) {
+            ++it;
+            continue;
+        }
+        const VkResult err = build->op ? build->op->result() : build->result;
+        if (err != VK_SUCCESS)
+            qWarning("Failed to build BLAS %u on the host: %d", build->meshIndex, err);
+        else
+            qDebug("blas %u built on the host in %.2f ms", build->meshIndex, build->timer.nsecsElapsed() / 1000000.0);
+        it = m_hostBlasBuilds.erase(it);
+    }
+
+    if (!m_hostBlasBuilds.empty())
+        return false;
+
+    m_lastHostBuildTime = m_hostBuildTimer.nsecsElapsed() / 1000000.0;
+    qDebug("host blas builds done in %.2f ms", m_lastHostBuildTime);
+    return true;
+}
+
+void RaytracingContext::refitBlas(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    std::vector<size_t> meshIndices;
+    for (size_t i = 0; i < m_meshes.size(); ++i) {
+        if (m_scene.meshes[i].deformable && m_meshes[i].blas)
+            meshIndices.push_back(i);
+    }
+    if (meshIndices.empty())
+        return;
+
+    const size_t buildCount = meshIndices.size();
+    std::vector<std::vector<VkAccelerationStructureGeometryKHR>> asGeoms(buildCount);
+    std::vector<std::vector<VkAccelerationStructureBuildRangeInfoKHR>> ranges(buildCount);
+    std::vector<const VkAccelerationStructureBuildRangeInfoKHR *> rangeInfos(buildCount);
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildInfos(buildCount);
+    std::vector<VkDeviceSize> scratchSizes(buildCount);
+    std::vector<uint32_t> primitiveCounts;
+    VkDeviceSize totalScratchSize = 0;
+
+    for (size_t b = 0; b < buildCount; ++b) {
+        const Mesh &mesh(m_scene.meshes[meshIndices[b]]);
+        MeshResources &res(m_meshes[meshIndices[b]]);
+        primitiveCounts.clear();
+        fillBlasGeometry(mesh, res, false, &asGeoms[b], &ranges[b], &primitiveCounts);
+        rangeInfos[b] = ranges[b].data();
+
+        // Refitting is cheap but the tree gets worse the more the vertices
+        // move away from where they were at the last build. How many refits
+        // are acceptable before a rebuild (into the same BLAS) is per mesh.
+        bool update = res.refitCount < mesh.maxRefits;
+        if (update)
+            res.refitCount += 1;
+        else
+            res.refitCount = 0;
+
+        VkAccelerationStructureBuildGeometryInfoKHR &asBuildGeomInfo(buildInfos[b]);
+        asBuildGeomInfo = {};
+        asBuildGeomInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        asBuildGeomInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        asBuildGeomInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+        asBuildGeomInfo.geometryCount = uint32_t(asGeoms[b].size());
+        asBuildGeomInfo.pGeometries = asGeoms[b].data();
+        asBuildGeomInfo.mode = update ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+        asBuildGeomInfo.srcAccelerationStructure = update ? res.blas : VK_NULL_HANDLE;
+        asBuildGeomInfo.dstAccelerationStructure = res.blas;
+        scratchSizes[b] = aligned(update ? res.updateScratchSize : res.buildScratchSize, m_scratchAlignment);
+        totalScratchSize += scratchSizes[b];
+    }
+
+    VkDeviceAddress scratchAddr = acquireScratch(totalScratchSize, cb, dev, df);
+    for (size_t b = 0; b < buildCount; ++b) {
+        buildInfos[b].scratchData.deviceAddress = scratchAddr;
+        scratchAddr += scratchSizes[b];
+    }
+
+    // the previous frame may still be tracing against these
+    VkMemoryBarrier memoryBarrier = {};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    df->vkCmdPipelineBarrier(cb, TRACE_STAGES, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                             0, 1, &memoryBarrier, 0, 0, 0, 0);
+
+    vkCmdBuildAccelerationStructuresKHR(cb, uint32_t(buildCount), buildInfos.data(), rangeInfos.data());
+
+    // the TLAS update that follows reads the new bounds
+    memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    df->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                             VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | TRACE_STAGES,
+                             0, 1, &memoryBarrier, 0, 0, 0, 0);
+}
+
+void RaytracingContext::createDeformPipeline(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    VkPushConstantRange pushConstantRange = {};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(DeformParams);
+
+    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {};
+    pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+    pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+    df->vkCreatePipelineLayout(dev, &pipelineLayoutCreateInfo, nullptr, &m_deformPipelineLayout);
+
+    VkComputePipelineCreateInfo pipelineCreateInfo = {};
+    pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineCreateInfo.stage = getShader(":/deform.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT, dev, df);
+    pipelineCreateInfo.layout = m_deformPipelineLayout;
+    df->vkCreateComputePipelines(dev, m_pipelineCache, 1, &pipelineCreateInfo, nullptr, &m_deformPipeline);
+
+    df->vkDestroyShaderModule(dev, pipelineCreateInfo.stage.module, nullptr);
+}
+
+void RaytracingContext::createRayQueryPipeline(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    VkComputePipelineCreateInfo pipelineCreateInfo = {};
+    pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineCreateInfo.stage = getShader(":/rayquery.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT, dev, df);
+    pipelineCreateInfo.layout = m_pipelineLayout;
+    df->vkCreateComputePipelines(dev, m_pipelineCache, 1, &pipelineCreateInfo, nullptr, &m_rayQueryPipeline);
+
+    df->vkDestroyShaderModule(dev, pipelineCreateInfo.stage.module, nullptr);
+
+    qDebug("ray query pipeline created in %.2f ms", timer.nsecsElapsed() / 1000000.0);
+}
+
+void RaytracingContext::createDenoisePipelines(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    VkComputePipelineCreateInfo pipelineCreateInfo = {};
+    pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineCreateInfo.layout = m_denoisePipelineLayout;
+
+    pipelineCreateInfo.stage = getShader(":/denoise_temporal.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT, dev, df);
+    df->vkCreateComputePipelines(dev, m_pipelineCache, 1, &pipelineCreateInfo, nullptr, &m_denoiseTemporalPipeline);
+    df->vkDestroyShaderModule(dev, pipelineCreateInfo.stage.module, nullptr);
+
+    pipelineCreateInfo.stage = getShader(":/denoise_atrous.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT, dev, df);
+    df->vkCreateComputePipelines(dev, m_pipelineCache, 1, &pipelineCreateInfo, nullptr, &m_denoiseAtrousPipeline);
+    df->vkDestroyShaderModule(dev, pipelineCreateInfo.stage.module, nullptr);
+}
+
+void RaytracingContext::deformMeshes(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    bool first = true;
+    for (size_t i = 0; i < m_meshes.size(); ++i) {
+        const Mesh &mesh(m_scene.meshes[i]);
+        const MeshResources &res(m_meshes[i]);
+        if (!mesh.deformable)
+            continue;
+
+        if (first) {
+            first = false;
+            if (!m_deformPipeline)
+                createDeformPipeline(dev, df);
+
+            // the builds and refits recorded before (also in the previous
+            // frame) read the deformed vertices, do not overwrite them early
+            VkMemoryBarrier memoryBarrier = {};
+            memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            df->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | TRACE_STAGES,
+                                     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                     0, 1, &memoryBarrier, 0, 0, 0, 0);
+
+            df->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, m_deformPipeline);
+        }
+
+        // a wave along X moving the vertices up and down, relative to the size of the mesh
+        const float extent = qMax(0.001f, mesh.boundsMax.x() - mesh.boundsMin.x());
+        DeformParams params;
+        params.restPositions = res.vertexBuffer.addr;
+        params.deformedPositions = res.deformedVertexBuffer.addr;
+        params.vertexCount = mesh.vertexCount();
+        params.phase = m_deformPhase;
+        params.amplitude = 0.05f * extent;
+        params.frequency = 4.0f * float(M_PI) / extent;
+        df->vkCmdPushConstants(cb, m_deformPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+        df->vkCmdDispatch(cb, (params.vertexCount + DEFORM_WORKGROUP_SIZE - 1) / DEFORM_WORKGROUP_SIZE, 1, 1);
+    }
+
+    if (first)
+        return;
+
+    // acceleration structure build inputs are read with SHADER_READ in the build stage
+    VkMemoryBarrier memoryBarrier = {};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    df->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | TRACE_STAGES,
+                             0, 1, &memoryBarrier, 0, 0, 0, 0);
+}
+
+void RaytracingContext::releaseBlas()
+{
+    // a compaction that has not happened yet is for the BLASes going away
+    releaseLater(m_compaction.queryPool);
+    m_compaction = {};
+
+    // waits for the host builds still in progress, they write into the buffers released below
+    m_hostBlasBuilds.clear();
+    m_compactionStats = {};
+
+    for (MeshResources &res : m_meshes) {
+        releaseLater(res.blas);
+        res.blas = VK_NULL_HANDLE;
+        res.blasAddr = 0;
+        releaseLater(res.blasBuffer);
+        res.blasBuffer = {};
+    }
+}
+
+void RaytracingContext::queryCompactedSizes(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    // deformable meshes are refitted, those are not built for compaction, and neither are the ones built on the host
+    std::vector<VkAccelerationStructureKHR> blases;
+    for (uint32_t i = 0; i < uint32_t(m_meshes.size()); ++i) {
+        if (!m_scene.meshes[i].deformable && !isHostBuilt(m_scene.meshes[i])) {
+            m_compaction.meshes.push_back(i);
+            blases.push_back(m_meshes[i].blas);
+        }
+    }
+    if (blases.empty())
+        return;
+
+    const uint32_t count = uint32_t(blases.size());
+    VkQueryPoolCreateInfo queryPoolInfo = {};
+    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolInfo.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+    queryPoolInfo.queryCount = count;
+    df->vkCreateQueryPool(dev, &queryPoolInfo, nullptr, &m_compaction.queryPool);
+    m_compaction.frame = m_frameCounter;
+
+    // the builds are complete at this point due to the barrier in buildBlas()
+    df->vkCmdResetQueryPool(cb, m_compaction.queryPool, 0, count);
+    vkCmdWriteAccelerationStructuresPropertiesKHR(cb, count, blases.data(),
+                                                  VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+                                                  m_compaction.queryPool, 0);
+}
+
+bool RaytracingContext::compactBlas(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    // The frame that wrote the queries has completed (its fence was waited
+    // for) so the results are expected to be there. Do not wait if they are
+    // not, just try again next frame.
+    const std::vector<uint32_t> meshes = m_compaction.meshes;
+    const uint32_t count = uint32_t(meshes.size());
+    std::vector<quint64> compactedSizes(count);
+    VkResult err = df->vkGetQueryPoolResults(dev, m_compaction.queryPool, 0, count,
+                                             count * sizeof(quint64), compactedSizes.data(), sizeof(quint64),
+                                             VK_QUERY_RESULT_64_BIT);
+    if (err == VK_NOT_READY)
+        return false;
+
+    releaseLater(m_compaction.queryPool);
+    m_compaction = {};
+
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to get compacted acceleration structure sizes: %d", err);
+        return false;
+    }
+
+    VkDeviceSize totalBefore = 0;
+    VkDeviceSize totalAfter = 0;
+    for (uint32_t query = 0; query < count; ++query) {
+        const uint32_t i = meshes[query];
+        MeshResources &res(m_meshes[i]);
+        const VkDeviceSize size = res.blasBuffer.size;
+        const VkDeviceSize compactedSize = compactedSizes[query];
+        totalBefore += size;
+        if (!compactedSize || compactedSize >= size) {
+            totalAfter += size;
+            continue;
+        }
+        totalAfter += compactedSize;
+        qDebug() << "compacting blas" << i << m_scene.meshes[i].name << "from" << size << "to" << compactedSize << "bytes";
+
+        Buffer compactedBuffer = createASBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR, dev, df, compactedSize);
+        VkAccelerationStructureCreateInfoKHR asCreateInfo = {};
+        asCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+        asCreateInfo.buffer = compactedBuffer.buf;
+        asCreateInfo.size = compactedSize;
+        asCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        VkAccelerationStructureKHR compactedBlas = VK_NULL_HANDLE;
+        vkCreateAccelerationStructureKHR(dev, &asCreateInfo, nullptr, &compactedBlas);
+
+        VkCopyAccelerationStructureInfoKHR copyInfo = {};
+        copyInfo.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR;
+        copyInfo.src = res.blas;
+        copyInfo.dst = compactedBlas;
+        copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+        vkCmdCopyAccelerationStructureKHR(cb, &copyInfo);
+
+        // the current TLAS still references the original, and so may the frames in flight
+        releaseLater(res.blas);
+        releaseLater(res.blasBuffer);
+        res.blas = compactedBlas;
+        res.blasBuffer = compactedBuffer;
+
+        VkAccelerationStructureDeviceAddressInfoKHR asAddrInfo = {};
+        asAddrInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+        asAddrInfo.accelerationStructure = res.blas;
+        res.blasAddr = vkGetAccelerationStructureDeviceAddressKHR(dev, &asAddrInfo);
+    }
+
+    qDebug() << "blas compaction: total" << totalBefore << "->" << totalAfter << "bytes";
+    m_compactionStats = { totalBefore, totalAfter };
+    if (totalAfter == totalBefore)
+        return false;
+
+    // the copies must be done before the TLAS build and the trace
+    VkMemoryBarrier memoryBarrier = {};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    df->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                             VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | TRACE_STAGES,
+                             0, 1, &memoryBarrier, 0, 0, 0, 0);
+    return true;
+}
+
+VkDeviceAddress RaytracingContext::writeInstances(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    // written every time the TLAS is built or updated, so per frame slot
+    const VkDeviceSize instanceDataSize = qMax<VkDeviceSize>(1, m_instanceCount) * sizeof(VkAccelerationStructureInstanceKHR);
+    StreamAlloc a;
+    if (instanceDataSize <= STREAM_SLICE_SIZE / 2)
+        a = streamAllocate(instanceDataSize);
+    if (!a.p) {
+        // too many instances for the stream ring, use the frame slot's own
+        // buffer, replaced only when the instances outgrow it
+        Buffer &b(m_instanceBuffers[m_stream.slot]);
+        if (b.size < instanceDataSize) {
+            releaseLater(b);
+            b = createHostVisibleBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, dev, df, instanceDataSize);
+        }
+        a.p = b.alloc.p;
+        a.addr = b.addr;
+    }
+
+    VkAccelerationStructureInstanceKHR *asInstances = static_cast<VkAccelerationStructureInstanceKHR *>(a.p);
+    for (uint32_t i = 0; i < m_instanceCount; ++i) {
+        VkAccelerationStructureInstanceKHR &instance(asInstances[i]);
+        // what we need is a 3x4 row major matrix
+        const QMatrix4x4 instanceTransform = m_instances[i].transform.transposed();
+        memcpy(instance.transform.matrix, instanceTransform.constData(), 12 * sizeof(float));
+
+        instance.instanceCustomIndex = m_meshes[m_instances[i].mesh].firstGeometryDesc;
+        instance.mask = 0xFF;
+        instance.instanceShaderBindingTableRecordOffset = 0;
+        instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
+        instance.accelerationStructureReference = m_meshes[m_instances[i].mesh].blasAddr;
+    }
+
+    return a.addr;
+}
+
+void RaytracingContext::buildTlas(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    m_instanceCount = uint32_t(m_instances.size());
+
+    VkAccelerationStructureGeometryKHR asGeom = {};
+    asGeom.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+    asGeom.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+    asGeom.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+    asGeom.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+    asGeom.geometry.instances.arrayOfPointers = VK_FALSE;
+
+    VkAccelerationStructureBuildGeometryInfoKHR asBuildGeomInfo = {};
+    asBuildGeomInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+    asBuildGeomInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    asBuildGeomInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+    asBuildGeomInfo.geometryCount = 1;
+    asBuildGeomInfo.pGeometries = &asGeom;
+    const uint32_t primitiveCountPerGeometry = m_instanceCount; // geometryCount elements
+    VkAccelerationStructureBuildSizesInfoKHR sizeInfo = {};
+    sizeInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+    vkGetAccelerationStructureBuildSizesKHR(dev,
+                                            VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+                                            &asBuildGeomInfo,
+                                            &primitiveCountPerGeometry,
+                                            &sizeInfo);
+
+    qDebug() << "tlas instances" << m_instanceCount
+             << "buffer size" << sizeInfo.accelerationStructureSize
+             << "scratch size" << sizeInfo.buildScratchSize
+             << "update scratch size" << sizeInfo.updateScratchSize;
+    m_tlasBuffer = createASBuffer(VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR, dev, df,
+                                  sizeInfo.accelerationStructureSize);
+    m_tlasBuildScratchSize = sizeInfo.buildScratchSize;
+    m_tlasUpdateScratchSize = sizeInfo.updateScratchSize;
+
+    VkAccelerationStructureCreateInfoKHR asCreateInfo = {};
+    asCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+    asCreateInfo.buffer = m_tlasBuffer.buf;
+    asCreateInfo.size = sizeInfo.accelerationStructureSize;
+    asCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    vkCreateAccelerationStructureKHR(dev, &asCreateInfo, nullptr, &m_tlas);
+
+    VkAccelerationStructureDeviceAddressInfoKHR asAddrInfo = {};
+    asAddrInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+    asAddrInfo.accelerationStructure = m_tlas;
+    m_tlasAddr = vkGetAccelerationStructureDeviceAddressKHR(dev, &asAddrInfo);
+
+    recordTlasBuild(cb, dev, df, VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR, false);
+}
+
+void RaytracingContext::refitTlas(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    // Refitting keeps the tree of the last full build and only moves the
+    // bounds, so trace performance degrades as instances move around. Do a
+    // full build (into the same TLAS, the instance count has not changed)
+    // every now and then.
+    if (m_tlasRefitCount < m_maxTlasRefits) {
+        m_tlasRefitCount += 1;
+        recordTlasBuild(cb, dev, df, VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR, true);
+    } else {
+        m_tlasRefitCount = 0;
+        recordTlasBuild(cb, dev, df, VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR, true);
+    }
+}
+
+void RaytracingContext::recordTlasBuild(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df,
+                                        VkBuildAccelerationStructureModeKHR mode, bool inPlace)
+{
+    VkDeviceOrHostAddressConstKHR instanceDataDeviceAddress = {};
+    instanceDataDeviceAddress.deviceAddress = writeInstances(dev, df);
+
+    VkAccelerationStructureGeometryKHR asGeom = {};
+    asGeom.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+    asGeom.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+    asGeom.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+    asGeom.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+    asGeom.geometry.instances.arrayOfPointers = VK_FALSE;
+    asGeom.geometry.instances.data = instanceDataDeviceAddress;
+
+    const bool update = mode == VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR;
+    VkAccelerationStructureBuildGeometryInfoKHR asBuildGeomInfo = {};
+    asBuildGeomInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+    asBuildGeomInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    asBuildGeomInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+    asBuildGeomInfo.geometryCount = 1;
+    asBuildGeomInfo.pGeometries = &asGeom;
+    asBuildGeomInfo.mode = mode;
+    asBuildGeomInfo.srcAccelerationStructure = update ? m_tlas : VK_NULL_HANDLE;
+    asBuildGeomInfo.dstAccelerationStructure = m_tlas;
+    asBuildGeomInfo.scratchData.deviceAddress = acquireScratch(update ? m_tlasUpdateScratchSize : m_tlasBuildScratchSize, cb, dev, df);
+
+    if (inPlace) {
+        // the previous frame may still be tracing against it
+        VkMemoryBarrier memoryBarrier = {};
+        memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+        memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+        df->vkCmdPipelineBarrier(cb, TRACE_STAGES, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                                 0, 1, &memoryBarrier, 0, 0, 0, 0);
+    }
+
+    VkAccelerationStructureBuildRangeInfoKHR asBuildRangeInfo = {};
+    asBuildRangeInfo.primitiveCount = m_instanceCount;
+    asBuildRangeInfo.primitiveOffset = 0;
+    asBuildRangeInfo.firstVertex = 0;
+    asBuildRangeInfo.transformOffset = 0;
+
+    VkAccelerationStructureBuildRangeInfoKHR *rangeInfo = &asBuildRangeInfo;
+
+    vkCmdBuildAccelerationStructuresKHR(cb, 1, &asBuildGeomInfo, &rangeInfo);
+
+    // make the build visible to the trace
+    VkMemoryBarrier memoryBarrier = {};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    df->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, TRACE_STAGES,
+                             0, 1, &memoryBarrier, 0, 0, 0, 0);
+}
+
+void RaytracingContext::releaseTlas()
+{
+    releaseLater(m_tlas);
+    m_tlas = VK_NULL_HANDLE;
+    m_tlasAddr = 0;
+    releaseLater(m_tlasBuffer);
+    m_tlasBuffer = {};
+    m_tlasRefitCount = 0;
+}
+
+void RaytracingContext::createPipeline(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    const std::vector<VkPipelineShaderStageCreateInfo> stages = {
+        getShader(":/raygen.rgen.spv", VK_SHADER_STAGE_RAYGEN_BIT_KHR, dev, df),
+        getShader(":/miss.rmiss.spv", VK_SHADER_STAGE_MISS_BIT_KHR, dev, df),
+        getShader(":/closesthit.rchit.spv", VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, dev, df)
+    };
+
+    std::vector<VkRayTracingShaderGroupCreateInfoKHR> shaderGroups(3);
+
+    VkRayTracingShaderGroupCreateInfoKHR shaderGroupCreateInfo = {};
+    shaderGroupCreateInfo.sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
+
+    shaderGroupCreateInfo.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
+    shaderGroupCreateInfo.generalShader = 0; // index in stages
+    shaderGroupCreateInfo.closestHitShader = VK_SHADER_UNUSED_KHR;
+    shaderGroupCreateInfo.anyHitShader = VK_SHADER_UNUSED_KHR;
+    shaderGroupCreateInfo.intersectionShader = VK_SHADER_UNUSED_KHR;
+    shaderGroups[0] = shaderGroupCreateInfo;
+
+    shaderGroupCreateInfo.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
+    shaderGroupCreateInfo.generalShader = 1; // index in stages
+    shaderGroupCreateInfo.closestHitShader = VK_SHADER_UNUSED_KHR;
+    shaderGroups[1] = shaderGroupCreateInfo;
+
+    shaderGroupCreateInfo.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR;
+    shaderGroupCreateInfo.generalShader = VK_SHADER_UNUSED_KHR;
+    shaderGroupCreateInfo.closestHitShader = 2; // index in stages
+    shaderGroups[2] = shaderGroupCreateInfo;
+
+    VkRayTracingPipelineCreateInfoKHR pipelineCreateInfo = {};
+    pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR;
+    pipelineCreateInfo.maxPipelineRayRecursionDepth = 1;
+
+    // compiles on worker threads, picked up by finishPipeline() in a later frame
+    if (m_pipelineJob)
+        m_pipelineCompiler.discard(m_pipelineJob);
+    m_pipelineTimer.start();
+    m_pipelineJob = m_pipelineCompiler.compile(m_pipelineCache, pipelineCreateInfo, stages, shaderGroups, m_pipelineLayout);
+}
+
+bool RaytracingContext::finishPipeline(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    switch (m_pipelineCompiler.take(m_pipelineJob, &pipeline)) {
+    case PipelineCompiler::Pending:
+        return false;
+    case PipelineCompiler::Failed:
+        m_pipelineJob = 0;
+        return false;
+    case PipelineCompiler::Ready:
+        break;
+    }
+
+    m_pipelineJob = 0;
+    qDebug("ray tracing pipeline created in %.2f ms (pipeline cache %s)",
+           m_pipelineTimer.nsecsElapsed() / 1000000.0, m_pipelineCacheLoaded ? "loaded from disk" : "empty");
+
+    // the old one (if any) was used until now
+    releaseLater(m_pipeline);
+    m_pipeline = pipeline;
+
+    // do not depend on a clean shutdown to get the cache written out
+    savePipelineCache(dev, df);
+    return true;
+}
+
+// Pipeline cache file: our own header, then the data from vkGetPipelineCacheData.
+// The data starts with a VkPipelineCacheHeaderVersionOne, which is checked too,
+// since drivers are not required to reject data from another device or driver.
+struct PipelineCacheFileHeader
+{
+    char magic[4];
+    quint32 version;
+    quint32 vendorID;
+    quint32 deviceID;
+    quint32 driverVersion;
+    quint8 pipelineCacheUUID[VK_UUID_SIZE];
+    quint64 dataSize;
+};
+
+static const char pipelineCacheMagic[4] = { 'Q', 'V', 'R', 'T' };
+static const quint32 pipelineCacheFileVersion = 1;
+
+QString RaytracingContext::pipelineCacheFileName() const
+{
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation)
+            + QString::fromLatin1("/rtpipelinecache_%1_%2.bin").arg(m_deviceProps.vendorID, 0, 16).arg(m_deviceProps.deviceID, 0, 16);
+}
+
+bool RaytracingContext::isPipelineCacheDataValid(const QByteArray &data) const
+{
+    if (size_t(data.size()) < sizeof(PipelineCacheFileHeader))
+        return false;
+
+    PipelineCacheFileHeader header;
+    memcpy(&header, data.constData(), sizeof(header));
+    if (memcmp(header.magic, pipelineCacheMagic, 4) || header.version != pipelineCacheFileVersion) {
+        qWarning("Pipeline cache file has an unknown format");
+        return false;
+    }
+    if (header.vendorID != m_deviceProps.vendorID || header.deviceID != m_deviceProps.deviceID
+            || header.driverVersion != m_deviceProps.driverVersion
+            || memcmp(header.pipelineCacheUUID, m_deviceProps.pipelineCacheUUID, VK_UUID_SIZE))
+    {
+        qDebug("Pipeline cache file is for a different device or driver");
+        return false;
+    }
+    if (header.dataSize != quint64(data.size()) - sizeof(header)
+            || header.dataSize < sizeof(VkPipelineCacheHeaderVersionOne))
+    {
+        qWarning("Pipeline cache file is truncated");
+        return false;
+    }
+
+    VkPipelineCacheHeaderVersionOne vkHeader;
+    memcpy(&vkHeader, data.constData() + sizeof(header), sizeof(vkHeader));
+    if (vkHeader.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+            || vkHeader.vendorID != m_deviceProps.vendorID || vkHeader.deviceID != m_deviceProps.deviceID
+            || memcmp(vkHeader.pipelineCacheUUID, m_deviceProps.pipelineCacheUUID, VK_UUID_SIZE))
+    {
+        qWarning("Pipeline cache data header does not match the device");
+        return false;
+    }
+
+    return true;
+}
+
+void RaytracingContext::createPipelineCache(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    QByteArray data;
+    QFile f(pipelineCacheFileName());
+    if (f.open(QIODevice::ReadOnly)) {
+        data = f.readAll();
+        f.close();
+        if (!isPipelineCacheDataValid(data))
+            data.clear();
+    }
+
+    VkPipelineCacheCreateInfo pipelineCacheInfo = {};
+    pipelineCacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    if (!data.isEmpty()) {
+        pipelineCacheInfo.initialDataSize = size_t(data.size()) - sizeof(PipelineCacheFileHeader);
+        pipelineCacheInfo.pInitialData = data.constData() + sizeof(PipelineCacheFileHeader);
+    }
+    VkResult err = df->vkCreatePipelineCache(dev, &pipelineCacheInfo, nullptr, &m_pipelineCache);
+    if (err != VK_SUCCESS && !data.isEmpty()) {
+        qWarning("Failed to create pipeline cache with the data from %s, starting with an empty one",
+                 qPrintable(f.fileName()));
+        data.clear();
+        pipelineCacheInfo.initialDataSize = 0;
+        pipelineCacheInfo.pInitialData = nullptr;
+        err = df->vkCreatePipelineCache(dev, &pipelineCacheInfo, nullptr, &m_pipelineCache);
+    }
+    if (err != VK_SUCCESS) {
+        qWarning("Failed to create pipeline cache: %d", err);
+        m_pipelineCache = VK_NULL_HANDLE;
+    }
+
+    m_pipelineCacheLoaded = m_pipelineCache && !data.isEmpty();
+    m_savedPipelineCacheSize = m_pipelineCacheLoaded ? pipelineCacheInfo.initialDataSize : 0;
+    if (m_pipelineCacheLoaded)
+        qDebug("Loaded %d bytes of pipeline cache data from %s", int(pipelineCacheInfo.initialDataSize), qPrintable(f.fileName()));
+}
+
+void RaytracingContext::savePipelineCache(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    if (!m_pipelineCache)
+        return;
+
+    size_t dataSize = 0;
+    if (df->vkGetPipelineCacheData(dev, m_pipelineCache, &dataSize, nullptr) != VK_SUCCESS || !dataSize)
+        return;
+
+    // nothing new since the last save (or the load)
+    if (dataSize == m_savedPipelineCacheSize)
+        return;
+
+    QByteArray data(int(sizeof(PipelineCacheFileHeader) + dataSize), Qt::Uninitialized);
+    if (df->vkGetPipelineCacheData(dev, m_pipelineCache, &dataSize, data.data() + sizeof(PipelineCacheFileHeader)) != VK_SUCCESS)
+        return;
+    data.resize(int(sizeof(PipelineCacheFileHeader) + dataSize));
+
+    PipelineCacheFileHeader header;
+    memcpy(header.magic, pipelineCacheMagic, 4);
+    header.version = pipelineCacheFileVersion;
+    header.vendorID = m_deviceProps.vendorID;
+    header.deviceID = m_deviceProps.deviceID;
+    header.driverVersion = m_deviceProps.driverVersion;
+    memcpy(header.pipelineCacheUUID, m_deviceProps.pipelineCacheUUID, VK_UUID_SIZE);
+    header.dataSize = dataSize;
+    memcpy(data.data(), &header, sizeof(header));
+
+    const QString fileName = pipelineCacheFileName();
+    QDir().mkpath(QFileInfo(fileName).absolutePath());
+    QFile f(fileName);
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning("Failed to write pipeline cache to %s", qPrintable(fileName));
+        return;
+    }
+    f.write(data);
+    m_savedPipelineCacheSize = dataSize;
+    qDebug("Saved %d bytes of pipeline cache data to %s", int(dataSize), qPrintable(fileName));
+}
+
+void RaytracingContext::createSbt(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    const uint32_t handleSize = m_rtProps.shaderGroupHandleSize;
+    const uint32_t handleSizeAligned = aligned(handleSize, m_rtProps.shaderGroupHandleAlignment);
+    const uint32_t groupSize = 3; // shaderGroups elem count
+    const uint32_t handleListByteSize = groupSize * handleSize;
+
+    std::vector<uint8_t> handles(handleListByteSize);
+    vkGetRayTracingShaderGroupHandlesKHR(dev, m_pipeline, 0, groupSize, handleListByteSize, handles.data());
+
+    // with NVIDIA handleSize == handleSizeAligned == 32 but the baseAlignment is 64, take both alignments into account
+    const uint32_t sbtBufferEntrySize = aligned(handleSizeAligned, m_rtProps.shaderGroupBaseAlignment);
+    const uint32_t sbtBufferSize = groupSize * sbtBufferEntrySize;
+    m_sbt = createHostVisibleBuffer(VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR, dev, df, sbtBufferSize);
+    std::vector<uint8_t> sbtBufData(sbtBufferSize);
+    for (uint32_t i = 0; i < groupSize; ++i)
+        memcpy(sbtBufData.data() + i * sbtBufferEntrySize, handles.data() + i * handleSize, handleSize);
+    updateHostData(m_sbt, dev, df, sbtBufData.data(), sbtBufferSize);
+}
+
+bool RaytracingContext::hasDeviceExtension(VkPhysicalDevice physDev, QVulkanFunctions *f, const char *name)
+{
+    uint32_t extensionCount = 0;
+    f->vkEnumerateDeviceExtensionProperties(physDev, nullptr, &extensionCount, nullptr);
+    std::vector<VkExtensionProperties> extensions(extensionCount);
+    f->vkEnumerateDeviceExtensionProperties(physDev, nullptr, &extensionCount, extensions.data());
+    for (const VkExtensionProperties &e : extensions) {
+        if (!strcmp(e.extensionName, name))
+            return true;
+    }
+    return false;
+}
+
+bool RaytracingContext::hasRayTracingSupport(VkPhysicalDevice physDev, QVulkanFunctions *f)
+{
+    if (!hasDeviceExtension(physDev, f, VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME)
+            || !hasDeviceExtension(physDev, f, VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME))
+    {
+        return false;
+    }
+
+    VkPhysicalDeviceBufferDeviceAddressFeatures bdaFeatures = {};
+    bdaFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
+    VkPhysicalDeviceAccelerationStructureFeaturesKHR asFeatures = {};
+    asFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
+    asFeatures.pNext = &bdaFeatures;
+    VkPhysicalDeviceRayTracingPipelineFeaturesKHR rtFeatures = {};
+    rtFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR;
+    rtFeatures.pNext = &asFeatures;
+    VkPhysicalDeviceFeatures2 deviceFeatures2 = {};
+    deviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    deviceFeatures2.pNext = &rtFeatures;
+    f->vkGetPhysicalDeviceFeatures2(physDev, &deviceFeatures2);
+
+    return rtFeatures.rayTracingPipeline && asFeatures.accelerationStructure && bdaFeatures.bufferDeviceAddress;
+}
+
+RaytracingContext::Buffer RaytracingContext::createBuffer(int usage, VkMemoryPropertyFlags memFlags, VkDevice dev, QVulkanDeviceFunctions *df, VkDeviceSize size)
+{
+    VkBufferCreateInfo bufferCreateInfo = {};
+    bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferCreateInfo.size = size;
+    bufferCreateInfo.usage = usage;
+    if (m_deviceAddresses)
+        bufferCreateInfo.usage |= VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+    VkBuffer buf = VK_NULL_HANDLE;
+    df->vkCreateBuffer(dev, &bufferCreateInfo, nullptr, &buf);
+
+    VkMemoryRequirements memReq = {};
+    df->vkGetBufferMemoryRequirements(dev, buf, &memReq);
+
+    Buffer result { buf, m_allocator.allocate(memReq, memFlags, MemoryAllocator::LinearResource), 0, size };
+    df->vkBindBufferMemory(dev, buf, result.alloc.mem, result.alloc.offset);
+    if (m_deviceAddresses)
+        result.addr = getBufferDeviceAddress(dev, result);
+    return result;
+}
+
+RaytracingContext::Buffer RaytracingContext::createASBuffer(int usage, VkDevice dev, QVulkanDeviceFunctions *df, VkDeviceSize size)
+{
+    // usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT or VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR
+    return createBuffer(usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, dev, df, size);
+}
+
+RaytracingContext::Buffer RaytracingContext::createHostVisibleBuffer(int usage, VkDevice dev, QVulkanDeviceFunctions *df, VkDeviceSize size)
+{
+    // usage = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR or VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR or VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT
+    return createBuffer(usage, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, dev, df, size);
+}
+
+void RaytracingContext::updateHostData(const Buffer &b, VkDevice dev, QVulkanDeviceFunctions *df, const void *data, size_t dataLen)
+{
+    Q_UNUSED(dev);
+    Q_UNUSED(df);
+    // host visible blocks are persistently mapped by the allocator
+    memcpy(b.alloc.p, data, dataLen);
+}
+
+void RaytracingContext::freeBuffer(const Buffer &b, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    df->vkDestroyBuffer(dev, b.buf, nullptr);
+    m_allocator.free(b.alloc);
+}
+
+RaytracingContext::Image RaytracingContext::createStorageImage(const QSize &pixelSize, uint32_t layers, VkFormat format, VkImageUsageFlags extraUsage,
+                                                              const uint32_t *queueFamilyIndices,
+                                                              VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    Image image;
+
+    VkImageCreateInfo imageInfo = {};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = format;
+    imageInfo.extent.width = uint32_t(pixelSize.width());
+    imageInfo.extent.height = uint32_t(pixelSize.height());
+    imageInfo.extent.depth = 1;
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = layers;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | extraUsage;
+    if (queueFamilyIndices) {
+        imageInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        imageInfo.queueFamilyIndexCount = 2;
+        imageInfo.pQueueFamilyIndices = queueFamilyIndices;
+    }
+    df->vkCreateImage(dev, &imageInfo, nullptr, &image.image);
+
+    VkMemoryRequirements memReq;
+    df->vkGetImageMemoryRequirements(dev, image.image, &memReq);
+    image.alloc = m_allocator.allocate(memReq, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MemoryAllocator::OptimalResource);
+    df->vkBindImageMemory(dev, image.image, image.alloc.mem, image.alloc.offset);
+
+    VkImageViewCreateInfo viewInfo = {};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = image.image;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+    viewInfo.format = format;
+    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    viewInfo.subresourceRange.baseMipLevel = 0;
+    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.baseArrayLayer = 0;
+    viewInfo.subresourceRange.layerCount = layers;
+    df->vkCreateImageView(dev, &viewInfo, nullptr, &image.view);
+
+    image.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    return image;
+}
+
+void RaytracingContext::createStreamRing(VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    m_stream.alignment = m_minStreamAlignment;
+    m_stream.sliceSize = aligned(STREAM_SLICE_SIZE, m_stream.alignment);
+    m_stream.buf = createHostVisibleBuffer(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT
+                                           | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                                           | VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+                                           | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+                                           dev, df, FRAMES_IN_FLIGHT * m_stream.sliceSize);
+}
+
+void RaytracingContext::beginStreamFrame(uint currentFrameSlot)
+{
+    // the frame that used this slice last time has completed by now
+    m_stream.slot = currentFrameSlot;
+    m_stream.head = 0;
+}
+
+RaytracingContext::StreamAlloc RaytracingContext::streamAllocate(VkDeviceSize size)
+{
+    StreamAlloc a;
+    const VkDeviceSize offset = aligned(m_stream.head, m_stream.alignment);
+    if (offset + size > m_stream.sliceSize) {
+        qWarning("Stream ring slice exhausted (%llu bytes requested, %llu used)",
+                 (unsigned long long) size, (unsigned long long) m_stream.head);
+        return a;
+    }
+    m_stream.head = offset + size;
+    a.offset = m_stream.slot * m_stream.sliceSize + offset;
+    a.p = static_cast<char *>(m_stream.buf.alloc.p) + a.offset;
+    a.addr = m_stream.buf.addr + a.offset;
+    return a;
+}
+
+VkDeviceAddress RaytracingContext::acquireScratch(VkDeviceSize size, VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df)
+{
+    // the buffer address is only aligned to what vkGetBufferMemoryRequirements
+    // asked for, leave room to align it to the scratch offset alignment
+    const VkDeviceSize requiredSize = size + m_scratchAlignment;
+    if (m_scratch.size < requiredSize) {
+        // builds recorded earlier may still use the old one
+        releaseLater(m_scratch);
+        m_scratch = createASBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, dev, df, requiredSize);
+        m_scratchLastUse = 0;
+    } else if (m_scratchLastUse && m_scratchLastUse + FRAMES_IN_FLIGHT > m_frameCounter) {
+        // a build recorded earlier (this or a previous frame still in flight)
+        // used the same range, do not let the next build overwrite it too early
+        VkMemoryBarrier memoryBarrier = {};
+        memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        const VkAccessFlags accelAccess = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+        memoryBarrier.srcAccessMask = accelAccess;
+        memoryBarrier.dstAccessMask = accelAccess;
+        df->vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                                 0, 1, &memoryBarrier, 0, 0, 0, 0);
+    }
+    m_scratchLastUse = m_frameCounter;
+    return aligned(m_scratch.addr, VkDeviceAddress(m_scratchAlignment));
+}
+
+VkDeviceAddress RaytracingContext::getBufferDeviceAddress(VkDevice dev, const Buffer &b)
+{
+    VkBufferDeviceAddressInfoKHR info = {};
+    info.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
+    info.buffer = b.buf;
+    return vkGetBufferDeviceAddressKHR(dev, &info);
+}
+
+void RaytracingContext::releaseLater(const Buffer &b)
+{
+    if (!b.buf)
+        return;
+    DeferredRelease e;
+    e.frame = m_frameCounter;
+    e.buf = b;
+    m_releaseQueue.push_back(e);
+}
+
+void RaytracingContext::releaseLater(VkAccelerationStructureKHR as)
+{
+    if (!as)
+        return;
+    DeferredRelease e;
+    e.frame = m_frameCounter;
+    e.as = as;
+    m_releaseQueue.push_back(e);
+}
+
+void RaytracingContext::releaseLater(VkPipeline pipeline)
+{
+    if (!pipeline)
+        return;
+    DeferredRelease e;
+    e.frame = m_frameCounter;
+    e.pipeline = pipeline;
+    m_releaseQueue.push_back(e);
+}
+
+void RaytracingContext::releaseLater(const Image &image)
+{
+    if (!image.image)
+        return;
+    DeferredRelease e;
+    e.frame = m_frameCounter;
+    e.image = image;
+    m_releaseQueue.push_back(e);
+}
+
+void RaytracingContext::releaseLater(VkQueryPool queryPool)
+{
+    if (!queryPool)
+        return;
+    DeferredRelease e;
+    e.frame = m_frameCounter;
+    e.queryPool = queryPool;
+    m_releaseQueue.push_back(e);
+}
+
+void RaytracingContext::executeDeferredReleases(VkDevice dev, QVulkanDeviceFunctions *df, bool forced)
+{
+    for (auto it = m_releaseQueue.begin(); it != m_releaseQueue.end(); ) {
+        if (forced || it->frame + FRAMES_IN_FLIGHT <= m_frameCounter) {
+            if (it->as)
+                vkDestroyAccelerationStructureKHR(dev, it->as, nullptr);
+            if (it->buf.buf)
+                freeBuffer(it->buf, dev, df);
+            if (it->pipeline)
+                df->vkDestroyPipeline(dev, it->pipeline, nullptr);
+            if (it->queryPool)
+                df->vkDestroyQueryPool(dev, it->queryPool, nullptr);
+            if (it->image.image) {
+                df->vkDestroyImageView(dev, it->image.view, nullptr);
+                df->vkDestroyImage(dev, it->image.image, nullptr);
+                m_allocator.free(it->image.alloc);
+            }
+            it = m_releaseQueue.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
@@ -0,0 +1,445 @@
+#ifndef RTCONTEXT_H
+#define RTCONTEXT_H
+
+#include <QVulkanFunctions>
+#include <QMatrix4x4>
+#include "memalloc.h"
+#include "scene.h"
+#include "pipelinecompiler.h"
+#include "deferredop.h"
+#include "cputracer.h"
+#include <QElapsedTimer>
+#include <memory>
+
+// What views of the same scene on the same device have in common: the
+// geometry, the acceleration structures, the pipelines with their layouts
+// and the shader binding table, plus the memory allocator, the stream ring
+// and the deferred release queue. Raytracing is a view into it, owning only
+// the camera, the accumulation and denoiser images and its descriptor sets,
+// so N items showing a scene cost the memory of one scene and N images.
+//
+// A context lives on the thread rendering the views (Qt Quick's render
+// thread) and is destroyed with the last Raytracing using it. The views
+// must render into the same command buffer per frame (that is, into the
+// same window): the first of them in a frame brings the scene up to date,
+// the others find nothing left to do.
+class RaytracingContext
+{
+public:
+    // Setup is split into stages that are (re)done only when invalidated.
+    // Invalidating a stage implicitly invalidates the ones depending on it.
+    // A change of the output image is not a stage: it only leads to
+    // rewriting the storage image descriptor and the projection.
+    // CameraStage is per view, the others are of the context.
+    enum Stage {
+        GeometryStage = 0x01,
+        BlasStage = 0x02,
+        TlasStage = 0x04,
+        PipelineStage = 0x08,
+        SbtStage = 0x10,
+        CameraStage = 0x20,
+        InstanceStage = 0x40, // transforms changed: TLAS update, no new resources
+        DeformStage = 0x80, // deformable meshes animated: compute pass, BLAS and TLAS update
+        AllStages = 0xFF
+    };
+
+    static const int FRAMES_IN_FLIGHT = 2;
+
+    // where the TLAS is read and the trace's images are written: the ray tracing
+    // pipeline, or rayquery.comp; a frame in flight may have used either
+    static const VkPipelineStageFlags TRACE_STAGES = VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+    // storage images in each binding of the denoiser's descriptor set, see denoise.glsl
+    static const uint32_t DENOISE_BINDING_COUNT = 6;
+    static const uint32_t DENOISE_IMAGE_COUNTS[DENOISE_BINDING_COUNT];
+
+    // The context for key (a description of the scene) on dev, created when
+    // there is none. Views getting the same one share everything above.
+    // owner is what renders the frames (the window): frames of different
+    // owners are not ordered, so each has its own contexts and their frame
+    // counters, deferred releases and stream slices never mix.
+    // hostCommandsEnabled tells if dev was created with the
+    // accelerationStructureHostCommands feature enabled, being supported
+    // is not enough.
+    static std::shared_ptr<RaytracingContext> get(const void *owner, const QString &key, VkPhysicalDevice physDev, VkDevice dev,
+                                                  QVulkanFunctions *f, QVulkanDeviceFunctions *df,
+                                                  bool hostCommandsEnabled);
+    // a context of its own, never returned by get()
+    static std::shared_ptr<RaytracingContext> create(VkPhysicalDevice physDev, VkDevice dev,
+                                                     QVulkanFunctions *f, QVulkanDeviceFunctions *df,
+                                                     bool hostCommandsEnabled);
+    ~RaytracingContext();
+
+    // Without VK_KHR_ray_tracing_pipeline and VK_KHR_acceleration_structure
+    // on the device, or with QVKRT_CPU_TRACE=1, the scene is only kept as
+    // BVHs for CpuTracer.
+    bool isCpuTracing() const { return m_cpuTracer != nullptr; }
+
+    void invalidate(int stages) { m_dirty |= stages & ~CameraStage; }
+
+    // upper limit for the scratch memory of one batch of BLAS builds
+    void setScratchBudget(VkDeviceSize bytes) { m_scratchBudget = bytes; }
+
+    // BLASes built with compaction enabled are copied into right-sized
+    // buffers once their compacted size is known (a few frames later)
+    void setCompactionEnabled(bool enable) { m_compactionEnabled = enable; }
+
+    void setScene(const Scene &scene);
+    const Scene &scene() const { return m_scene; }
+    QVector3D sceneCenter() const { return m_sceneCenter; }
+    float sceneRadius() const { return m_sceneRadius; }
+
+    // Moves the instances of the current scene (in the order of
+    // Scene::instances()). The TLAS is refitted, with a full rebuild after
+    // every maxRefits updates to restore trace performance.
+    void setInstanceTransforms(const std::vector<QMatrix4x4> &transforms);
+    void setMaxTlasRefits(int maxRefits) { m_maxTlasRefits = maxRefits; }
+
+    // Runs the deform compute pass for the meshes marked deformable and
+    // refits their BLASes (see Mesh::maxRefits).
+    void setDeformPhase(float phase);
+
+    bool hasRayQuery() const { return m_rayQuerySupported; }
+
+    // true while a pipeline is compiling, host BLAS builds are running or a
+    // compaction is due, i.e. the coming frames will not all be like the last
+    bool hasPendingWork() const { return m_pipelineJob || !m_hostBlasBuilds.empty() || m_compaction.queryPool; }
+
+    // BLAS memory before and after the last compaction
+    struct CompactionStats {
+        quint64 bytesBefore = 0;
+        quint64 bytesAfter = 0;
+    };
+    CompactionStats compactionStats() const { return m_compactionStats; }
+
+    // wall clock time of the last set of host BLAS builds in milliseconds, 0 if none
+    double lastHostBuildTime() const { return m_lastHostBuildTime; }
+
+    // Called by every view at the start of its frame. A new frame starts
+    // with the first view rendering in another frame slot, or one that has
+    // rendered in the current frame already; viewFrame is the view's own
+    // record of the last frame it rendered in.
+    void beginFrame(uint currentFrameSlot, quint64 *viewFrame, VkDevice dev, QVulkanDeviceFunctions *df);
+    quint64 frameCounter() const { return m_frameCounter; }
+
+    // The per-frame setup, in this order, between the views' timestamps.
+    // updatePipelines() returns the stages done in the frame, nothing for
+    // all but the first view in a frame.
+    void updateBlas(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df);
+    void updateTlas(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df);
+    int updatePipelines(VkDevice dev, QVulkanDeviceFunctions *df);
+    // the same for CpuTracer, with the time taken by the BVH builds in ms
+    int updateCpuScene(double *blasTime, double *tlasTime);
+    bool isDirty() const { return m_dirty != 0; }
+
+    // Changes whenever something that is in the image changes, the views
+    // restart their accumulation then. sceneRevision() changes with
+    // setScene() only, which also invalidates the views' cameras.
+    quint64 revision() const { return m_revision; }
+    quint64 sceneRevision() const { return m_sceneRevision; }
+
+    // what the views trace with
+    VkDescriptorSetLayout descriptorSetLayout() const { return m_descSetLayout; }
+    VkPipelineLayout pipelineLayout() const { return m_pipelineLayout; }
+    VkPipeline pipeline() const { return m_pipeline; }
+    // created the first time it is asked for
+    VkPipeline rayQueryPipeline(VkDevice dev, QVulkanDeviceFunctions *df);
+    VkAccelerationStructureKHR tlas() const { return m_tlas; }
+    VkDeviceAddress geometryTable() const { return m_geometryTable.addr; }
+    // vkCmdTraceRaysKHR with the shader binding table, after binding pipeline();
+    // depth is the number of views, see Raytracing::setViewCount()
+    void traceRays(VkCommandBuffer cb, uint32_t width, uint32_t height, uint32_t depth);
+    CpuTracer *cpuTracer() const { return m_cpuTracer.get(); }
+    const VkPhysicalDeviceProperties &deviceProperties() const { return m_deviceProps; }
+
+    // push constants of the denoiser's passes, see denoise.glsl
+    struct DenoiseParams {
+        uint32_t current;
+        uint32_t flags;
+        uint32_t stepSize;
+        uint32_t source;
+    };
+    enum DenoiseFlag {
+        HistoryValid = 0x01,
+        Accumulating = 0x02,
+        FinalPass = 0x04
+    };
+    VkDescriptorSetLayout denoiseDescriptorSetLayout() const { return m_denoiseDescSetLayout; }
+    VkPipelineLayout denoisePipelineLayout() const { return m_denoisePipelineLayout; }
+    // the two are created together, the first time they are asked for
+    VkPipeline denoiseTemporalPipeline(VkDevice dev, QVulkanDeviceFunctions *df);
+    VkPipeline denoiseAtrousPipeline() const { return m_denoiseAtrousPipeline; }
+
+    MemoryAllocator *memoryAllocator() { return &m_allocator; }
+
+    struct Buffer {
+        VkBuffer buf = VK_NULL_HANDLE;
+        MemoryAllocator::Allocation alloc;
+        VkDeviceAddress addr = VK_NULL_HANDLE;
+        size_t size = 0;
+    };
+    Buffer createHostVisibleBuffer(int usage, VkDevice dev, QVulkanDeviceFunctions *df, VkDeviceSize size);
+
+    struct Image {
+        VkImage image = VK_NULL_HANDLE;
+        VkImageView view = VK_NULL_HANDLE;
+        MemoryAllocator::Allocation alloc;
+        VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    };
+    // A 2D array of layers, the view is a 2D array view of all of them.
+    // queueFamilyIndices: the two families sharing the image concurrently, or null
+    Image createStorageImage(const QSize &pixelSize, uint32_t layers, VkFormat format, VkImageUsageFlags extraUsage,
+                             const uint32_t *queueFamilyIndices, VkDevice dev, QVulkanDeviceFunctions *df);
+
+    // Persistently mapped host visible buffer with one fixed size slice per
+    // frame slot. Everything the CPU writes per frame (uniforms, staging
+    // data, instance data) is sub-allocated from the current slice and
+    // referenced with a dynamic offset (or device address + offset), so
+    // there are no driver calls on the per-frame path.
+    struct StreamAlloc {
+        VkDeviceSize offset = 0; // from the start of the buffer, usable as a dynamic offset
+        void *p = nullptr;
+        VkDeviceAddress addr = 0;
+    };
+    StreamAlloc streamAllocate(VkDeviceSize size);
+    VkBuffer streamBuffer() const { return m_stream.buf.buf; }
+
+    // Resources that may still be used by frames in flight are queued and
+    // released FRAMES_IN_FLIGHT frames later, once Qt Quick has waited for
+    // the fence of the frame that last used them. The views' go here too.
+    void releaseLater(const Buffer &b);
+    void releaseLater(VkAccelerationStructureKHR as);
+    void releaseLater(VkPipeline pipeline);
+    void releaseLater(VkQueryPool queryPool);
+    void releaseLater(const Image &image);
+
+    static bool hasDeviceExtension(VkPhysicalDevice physDev, QVulkanFunctions *f, const char *name);
+
+private:
+    RaytracingContext() = default;
+
+    static const VkDeviceSize STREAM_SLICE_SIZE = 4 * 1024 * 1024;
+    static const VkDeviceSize DEFAULT_SCRATCH_BUDGET = 64 * 1024 * 1024;
+    static const quint64 SCRATCH_IDLE_FRAMES = 120;
+    static const int DEFAULT_MAX_TLAS_REFITS = 64;
+    static const uint32_t DEFORM_WORKGROUP_SIZE = 64; // local_size_x in deform.comp
+
+    void init(VkPhysicalDevice physDev, VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df,
+              bool hostCommandsEnabled);
+    void releaseResources(VkDevice dev, QVulkanDeviceFunctions *df);
+
+    Buffer createBuffer(int usage, VkMemoryPropertyFlags memFlags, VkDevice dev, QVulkanDeviceFunctions *df, VkDeviceSize size);
+    Buffer createASBuffer(int usage, VkDevice dev, QVulkanDeviceFunctions *df, VkDeviceSize size);
+    void updateHostData(const Buffer &b, VkDevice dev, QVulkanDeviceFunctions *df, const void *data, size_t dataLen);
+    void freeBuffer(const Buffer &b, VkDevice dev, QVulkanDeviceFunctions *df);
+
+    struct StreamRing {
+        Buffer buf;
+        VkDeviceSize sliceSize = 0;
+        VkDeviceSize alignment = 0;
+        VkDeviceSize head = 0;
+        uint slot = 0;
+    };
+    void createStreamRing(VkDevice dev, QVulkanDeviceFunctions *df);
+    void beginStreamFrame(uint currentFrameSlot);
+    VkDeviceAddress getBufferDeviceAddress(VkDevice dev, const Buffer &b);
+
+    // geometry table entry (std430), see common.glsl
+    struct GeometryDesc {
+        float scale[4]; // see Mesh::dequantization()
+        float offset[4];
+        VkDeviceAddress vertices;
+        VkDeviceAddress indices;
+        uint32_t firstIndex;
+        uint32_t firstVertex;
+        uint32_t format; // Mesh::VertexFormat | Mesh::IndexFormat
+        uint32_t padding; // to the array stride of 64
+    };
+
+    struct DeferredRelease {
+        quint64 frame = 0;
+        Buffer buf;
+        Image image;
+        VkAccelerationStructureKHR as = VK_NULL_HANDLE;
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        VkQueryPool queryPool = VK_NULL_HANDLE;
+    };
+    void executeDeferredReleases(VkDevice dev, QVulkanDeviceFunctions *df, bool forced);
+
+    // Scratch memory for acceleration structure builds comes from one device
+    // local buffer that is grown when needed and reused by all builds. It is
+    // released (through the queue above) after not being used for a while.
+    VkDeviceAddress acquireScratch(VkDeviceSize size, VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df);
+
+    struct MeshResources {
+        Buffer vertexBuffer;
+        Buffer indexBuffer;
+        Buffer transformBuffer; // only for quantized positions
+        Buffer deformedVertexBuffer; // only for deformable meshes
+        Buffer blasBuffer;
+        VkAccelerationStructureKHR blas = VK_NULL_HANDLE;
+        VkDeviceAddress blasAddr = 0;
+        VkDeviceSize buildScratchSize = 0;
+        VkDeviceSize updateScratchSize = 0;
+        int refitCount = 0;
+        uint32_t firstGeometryDesc = 0; // index in the geometry table
+    };
+
+    // push constants of deform.comp
+    struct DeformParams {
+        VkDeviceAddress restPositions;
+        VkDeviceAddress deformedPositions;
+        uint32_t vertexCount;
+        float phase;
+        float amplitude;
+        float frequency;
+    };
+
+    void createGeometry(VkDevice dev, QVulkanDeviceFunctions *df);
+    void releaseGeometry();
+    void fillBlasGeometry(const Mesh &mesh, const MeshResources &res, bool hostAddresses,
+                          std::vector<VkAccelerationStructureGeometryKHR> *asGeoms,
+                          std::vector<VkAccelerationStructureBuildRangeInfoKHR> *ranges,
+                          std::vector<uint32_t> *primitiveCounts);
+    void buildBlas(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df);
+
+    // When the device has accelerationStructureHostCommands enabled, the BLASes of
+    // the meshes that are not deformable are built by the CPU instead
+    // (VK_ACCELERATION_STRUCTURE_BUILD_TYPE_HOST_KHR), each with a deferred
+    // operation joined from worker threads. Frames keep being rendered in
+    // the meantime and the TLAS is built once all of them are done.
+    struct HostBlasBuild {
+        uint32_t meshIndex = 0;
+        std::vector<VkAccelerationStructureGeometryKHR> asGeoms;
+        std::vector<VkAccelerationStructureBuildRangeInfoKHR> ranges;
+        const VkAccelerationStructureBuildRangeInfoKHR *rangeInfos = nullptr;
+        VkAccelerationStructureBuildGeometryInfoKHR buildInfo;
+        std::vector<char> scratch;
+        VkResult result = VK_SUCCESS; // when not deferred
+        QElapsedTimer timer;
+        std::unique_ptr<DeferredOperation> op; // last, so destroyed (waited for) first
+    };
+    bool isHostBuilt(const Mesh &mesh) const { return m_hostBuilds && !mesh.deformable; }
+    void startHostBlasBuild(uint32_t meshIndex, VkDevice dev, QVulkanDeviceFunctions *df);
+    bool finishHostBlasBuilds();
+    void refitBlas(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df);
+    void releaseBlas();
+    void createDeformPipeline(VkDevice dev, QVulkanDeviceFunctions *df);
+    void createRayQueryPipeline(VkDevice dev, QVulkanDeviceFunctions *df);
+    void createDenoisePipelines(VkDevice dev, QVulkanDeviceFunctions *df);
+    void deformMeshes(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df);
+    void queryCompactedSizes(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df);
+    bool compactBlas(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df);
+    void buildTlas(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df);
+    void refitTlas(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df);
+    void recordTlasBuild(VkCommandBuffer cb, VkDevice dev, QVulkanDeviceFunctions *df,
+                         VkBuildAccelerationStructureModeKHR mode, bool inPlace);
+    VkDeviceAddress writeInstances(VkDevice dev, QVulkanDeviceFunctions *df);
+    void releaseTlas();
+    void createPipeline(VkDevice dev, QVulkanDeviceFunctions *df);
+    bool finishPipeline(VkDevice dev, QVulkanDeviceFunctions *df);
+    QString pipelineCacheFileName() const;
+    bool isPipelineCacheDataValid(const QByteArray &data) const;
+    void createPipelineCache(VkDevice dev, QVulkanDeviceFunctions *df);
+    void savePipelineCache(VkDevice dev, QVulkanDeviceFunctions *df);
+    void createSbt(VkDevice dev, QVulkanDeviceFunctions *df);
+
+    static bool hasRayTracingSupport(VkPhysicalDevice physDev, QVulkanFunctions *f);
+    void initCpu(VkPhysicalDevice physDev, VkDevice dev, QVulkanFunctions *f, QVulkanDeviceFunctions *df);
+
+    // for releasing everything in the destructor
+    VkDevice m_dev = VK_NULL_HANDLE;
+    QVulkanDeviceFunctions *m_df = nullptr;
+
+    MemoryAllocator m_allocator;
+    bool m_deviceAddresses = true; // not when tracing on the CPU
+
+    // the mesh BVHs and the instance BVH, the views keep their own accumulation
+    std::unique_ptr<CpuTracer> m_cpuTracer;
+
+    VkPhysicalDeviceRayTracingPipelinePropertiesKHR m_rtProps;
+    VkPhysicalDeviceAccelerationStructureFeaturesKHR m_asFeatures;
+
+    PFN_vkGetBufferDeviceAddressKHR vkGetBufferDeviceAddressKHR;
+    PFN_vkCreateAccelerationStructureKHR vkCreateAccelerationStructureKHR;
+    PFN_vkDestroyAccelerationStructureKHR vkDestroyAccelerationStructureKHR;
+    PFN_vkGetAccelerationStructureBuildSizesKHR vkGetAccelerationStructureBuildSizesKHR;
+    PFN_vkGetAccelerationStructureDeviceAddressKHR vkGetAccelerationStructureDeviceAddressKHR;
+    PFN_vkCmdBuildAccelerationStructuresKHR vkCmdBuildAccelerationStructuresKHR;
+    PFN_vkCmdWriteAccelerationStructuresPropertiesKHR vkCmdWriteAccelerationStructuresPropertiesKHR;
+    PFN_vkCmdCopyAccelerationStructureKHR vkCmdCopyAccelerationStructureKHR;
+    PFN_vkBuildAccelerationStructuresKHR vkBuildAccelerationStructuresKHR;
+    PFN_vkCmdTraceRaysKHR vkCmdTraceRaysKHR;
+    PFN_vkGetRayTracingShaderGroupHandlesKHR vkGetRayTracingShaderGroupHandlesKHR;
+
+    int m_dirty = AllStages & ~CameraStage;
+    quint64 m_frameCounter = 0;
+    uint m_frameSlot = 0;
+    quint64 m_revision = 0;
+    quint64 m_sceneRevision = 0;
+    std::vector<DeferredRelease> m_releaseQueue;
+
+    Buffer m_scratch;
+    quint64 m_scratchLastUse = 0;
+    VkDeviceSize m_scratchAlignment = 1;
+    VkDeviceSize m_scratchBudget = DEFAULT_SCRATCH_BUDGET;
+
+    bool m_hostBuilds = false;
+    DeferredOperation::Functions m_deferredFuncs;
+    std::vector<std::unique_ptr<HostBlasBuild>> m_hostBlasBuilds; // in progress
+    QElapsedTimer m_hostBuildTimer;
+    double m_lastHostBuildTime = 0;
+
+    Scene m_scene;
+    QVector3D m_sceneCenter;
+    float m_sceneRadius = 1.0f;
+    std::vector<MeshResources> m_meshes; // parallel to m_scene.meshes
+    Buffer m_geometryTable;
+
+    // compacted sizes of the BLASes built in frame, one query per mesh
+    struct PendingCompaction {
+        VkQueryPool queryPool = VK_NULL_HANDLE;
+        quint64 frame = 0;
+        std::vector<uint32_t> meshes; // mesh index for each query
+    };
+    bool m_compactionEnabled = true;
+    PendingCompaction m_compaction;
+    CompactionStats m_compactionStats;
+
+    std::vector<Scene::Instance> m_instances; // with the current transforms
+    uint32_t m_instanceCount = 0; // in the TLAS
+    VkDeviceSize m_tlasBuildScratchSize = 0;
+    VkDeviceSize m_tlasUpdateScratchSize = 0;
+    int m_tlasRefitCount = 0;
+    int m_maxTlasRefits = DEFAULT_MAX_TLAS_REFITS;
+    Buffer m_tlasBuffer;
+    VkAccelerationStructureKHR m_tlas = VK_NULL_HANDLE;
+    VkDeviceAddress m_tlasAddr = 0;
+
+    VkDeviceSize m_minStreamAlignment;
+    StreamRing m_stream;
+    Buffer m_instanceBuffers[FRAMES_IN_FLIGHT]; // when too large for the stream ring
+    VkDescriptorSetLayout m_descSetLayout = VK_NULL_HANDLE;
+    VkPipelineLayout m_pipelineLayout = VK_NULL_HANDLE;
+    VkPipeline m_pipeline = VK_NULL_HANDLE;
+    PipelineCompiler m_pipelineCompiler;
+    int m_pipelineJob = 0; // compiling the next m_pipeline when non-zero
+    QElapsedTimer m_pipelineTimer;
+    VkPhysicalDeviceProperties m_deviceProps;
+    VkPipelineCache m_pipelineCache = VK_NULL_HANDLE;
+    bool m_pipelineCacheLoaded = false;
+    size_t m_savedPipelineCacheSize = 0;
+    VkPipelineLayout m_deformPipelineLayout = VK_NULL_HANDLE;
+    VkPipeline m_deformPipeline = VK_NULL_HANDLE;
+    bool m_rayQuerySupported = false;
+    VkPipeline m_rayQueryPipeline = VK_NULL_HANDLE;
+    float m_deformPhase = 0.0f;
+    Buffer m_sbt;
+
+    VkDescriptorSetLayout m_denoiseDescSetLayout = VK_NULL_HANDLE;
+    VkPipelineLayout m_denoisePipelineLayout = VK_NULL_HANDLE;
+    VkPipeline m_denoiseTemporalPipeline = VK_NULL_HANDLE;
+    VkPipeline m_denoiseAtrousPipeline = VK_NULL_HANDLE;
+};
+
+#endif
@@ -0,0 +1,756 @@
+#include "scene.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QUrl>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QQuaternion>
+#include <QtEndian>
+#include <QtMath>
+#include <QFloat16>
+#include <QDebug>
+#include <cfloat>
+#include <cstring>
+
+void Mesh::updateBounds()
+{
+    boundsMin = QVector3D(FLT_MAX, FLT_MAX, FLT_MAX);
+    boundsMax = QVector3D(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (size_t i = 0; i + 2 < positions.size(); i += 3) {
+        const QVector3D v(positions[i], positions[i + 1], positions[i + 2]);
+        boundsMin = QVector3D(qMin(boundsMin.x(), v.x()), qMin(boundsMin.y(), v.y()), qMin(boundsMin.z(), v.z()));
+        boundsMax = QVector3D(qMax(boundsMax.x(), v.x()), qMax(boundsMax.y(), v.y()), qMax(boundsMax.z(), v.z()));
+    }
+}
+
+// rounding to Snorm16 may move a vertex by at most this much of the
+// shortest edge, so that no triangle collapses or flips over
+static const float quantizationTolerance = 1.0f / 16.0f;
+
+void Mesh::selectFormats()
+{
+    uint32_t maxIndex = 0;
+    for (uint32_t index : indices)
+        maxIndex = qMax(maxIndex, index);
+    indexFormat = maxIndex <= 0xFFFF ? Uint16 : Uint32;
+
+    auto position = [this](uint32_t v) {
+        return QVector3D(positions[v * 3], positions[v * 3 + 1], positions[v * 3 + 2]);
+    };
+    float minEdge = FLT_MAX;
+    for (const Geometry &g : geometries) {
+        for (uint32_t i = g.firstIndex; i + 3 <= g.firstIndex + g.indexCount; i += 3) {
+            for (uint32_t e = 0; e < 3; ++e) {
+                const float length = (position(g.firstVertex + indices[i + e])
+                                      - position(g.firstVertex + indices[i + (e + 1) % 3])).length();
+                if (length > 0.0f)
+                    minEdge = qMin(minEdge, length);
+            }
+        }
+    }
+
+    // half a step of 32767 over the half extent, on each axis
+    const QVector3D halfExtent = (boundsMax - boundsMin) * 0.5f;
+    const float maxError = (halfExtent / (2.0f * 32767.0f)).length();
+    vertexFormat = maxError <= minEdge * quantizationTolerance ? Snorm16 : Float32;
+}
+
+void Mesh::dequantization(QVector3D *scale, QVector3D *offset) const
+{
+    if (gpuVertexFormat() == Float32) {
+        *scale = QVector3D(1.0f, 1.0f, 1.0f);
+        *offset = QVector3D();
+        return;
+    }
+
+    // any scale does for a flat axis, everything is at the center there
+    const QVector3D halfExtent = (boundsMax - boundsMin) * 0.5f;
+    *scale = QVector3D(halfExtent.x() > 0.0f ? halfExtent.x() : 1.0f,
+                       halfExtent.y() > 0.0f ? halfExtent.y() : 1.0f,
+                       halfExtent.z() > 0.0f ? halfExtent.z() : 1.0f);
+    *offset = (boundsMin + boundsMax) * 0.5f;
+}
+
+void Mesh::writeVertexData(void *dst) const
+{
+    const VertexFormat format = gpuVertexFormat();
+    if (format == Float32) {
+        memcpy(dst, positions.data(), vertexDataSize());
+        return;
+    }
+
+    QVector3D scale, offset;
+    dequantization(&scale, &offset);
+    quint16 *p = static_cast<quint16 *>(dst);
+    for (size_t i = 0; i + 2 < positions.size(); i += 3) {
+        for (int c = 0; c < 3; ++c) {
+            const float v = qBound(-1.0f, (positions[i + c] - offset[c]) / scale[c], 1.0f);
+            if (format == Snorm16) {
+                p[c] = quint16(qint16(qRound(v * 32767.0f)));
+            } else {
+                const qfloat16 h(v);
+                memcpy(&p[c], &h, sizeof(h));
+            }
+        }
+        p[3] = 0;
+        p += 4;
+    }
+}
+
+void Mesh::writeIndexData(void *dst) const
+{
+    if (indexFormat == Uint32) {
+        memcpy(dst, indices.data(), indices.size() * sizeof(uint32_t));
+        return;
+    }
+
+    quint16 *p = static_cast<quint16 *>(dst);
+    for (size_t i = 0; i < indices.size(); ++i)
+        p[i] = quint16(indices[i]);
+    if (indices.size() & 1)
+        p[indices.size()] = 0;
+}
+
+std::vector<Scene::Instance> Scene::instances() const
+{
+    std::vector<Instance> result;
+    std::vector<std::pair<int, QMatrix4x4>> stack;
+    for (int root : roots)
+        stack.push_back({ root, QMatrix4x4() });
+
+    // nodes may be shared (see replicate()), but there are no cycles
+    while (!stack.empty()) {
+        const std::pair<int, QMatrix4x4> e = stack.back();
+        stack.pop_back();
+        const SceneNode &node(nodes[e.first]);
+        const QMatrix4x4 transform = e.second * node.transform;
+        if (node.mesh >= 0)
+            result.push_back({ node.mesh, transform });
+        for (int child : node.children)
+            stack.push_back({ child, transform });
+    }
+
+    return result;
+}
+
+void Scene::boundingBox(QVector3D *boundsMin, QVector3D *boundsMax) const
+{
+    QVector3D bMin(FLT_MAX, FLT_MAX, FLT_MAX);
+    QVector3D bMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (const Instance &instance : instances()) {
+        const Mesh &mesh(meshes[instance.mesh]);
+        for (int corner = 0; corner < 8; ++corner) {
+            const QVector3D p(corner & 1 ? mesh.boundsMax.x() : mesh.boundsMin.x(),
+                              corner & 2 ? mesh.boundsMax.y() : mesh.boundsMin.y(),
+                              corner & 4 ? mesh.boundsMax.z() : mesh.boundsMin.z());
+            const QVector3D v = instance.transform.map(p);
+            bMin = QVector3D(qMin(bMin.x(), v.x()), qMin(bMin.y(), v.y()), qMin(bMin.z(), v.z()));
+            bMax = QVector3D(qMax(bMax.x(), v.x()), qMax(bMax.y(), v.y()), qMax(bMax.z(), v.z()));
+        }
+    }
+    if (bMin.x() > bMax.x()) {
+        bMin = QVector3D();
+        bMax = QVector3D();
+    }
+    *boundsMin = bMin;
+    *boundsMax = bMax;
+}
+
+void Scene::replicate(int gridSize)
+{
+    if (gridSize <= 1 || roots.empty())
+        return;
+
+    QVector3D bMin, bMax;
+    boundingBox(&bMin, &bMax);
+    const QVector3D extent = bMax - bMin;
+    float spacing = qMax(extent.x(), extent.y()) * 1.25f;
+    if (spacing <= 0.0f)
+        spacing = 1.0f;
+
+    const std::vector<int> oldRoots = roots;
+    roots.clear();
+    const float center = (gridSize - 1) * 0.5f;
+    for (int y = 0; y < gridSize; ++y) {
+        for (int x = 0; x < gridSize; ++x) {
+            SceneNode node;
+            node.transform.translate((x - center) * spacing, (y - center) * spacing, 0.0f);
+            node.children = oldRoots;
+            roots.push_back(int(nodes.size()));
+            nodes.push_back(node);
+        }
+    }
+}
+
+void Scene::selectFormats()
+{
+    const QByteArray forced = qgetenv("QVKRT_VERTEX_FORMAT");
+    size_t unquantizedSize = 0;
+    size_t size = 0;
+    int quantizedMeshes = 0;
+    for (Mesh &mesh : meshes) {
+        mesh.selectFormats();
+        if (forced == "float32")
+            mesh.vertexFormat = Mesh::Float32;
+        else if (forced == "snorm16")
+            mesh.vertexFormat = Mesh::Snorm16;
+        else if (forced == "float16")
+            mesh.vertexFormat = Mesh::Float16;
+        unquantizedSize += mesh.positions.size() * sizeof(float) + mesh.indices.size() * sizeof(uint32_t);
+        size += mesh.vertexDataSize() + mesh.indexDataSize();
+        if (mesh.vertexFormat != Mesh::Float32)
+            quantizedMeshes += 1;
+    }
+
+    if (!unquantizedSize)
+        return;
+    qDebug("Vertex and index data: %.2f MB instead of %.2f MB, %.1f%% saved (%d of %d meshes with 16-bit positions)",
+           size / 1048576.0, unquantizedSize / 1048576.0, 100.0 * (unquantizedSize - size) / unquantizedSize,
+           quantizedMeshes, int(meshes.size()));
+}
+
+Scene Scene::triangle()
+{
+    Scene scene;
+    Mesh mesh;
+    mesh.name = QLatin1String("triangle");
+    mesh.positions = {
+        1.0f, 1.0f, 0.0f,
+        -1.0f, 1.0f, 0.0f,
+        0.0f, -1.0f, 0.0f
+    };
+    mesh.indices = { 0, 1, 2 };
+    mesh.geometries.push_back({ 0, 3, 0 });
+    mesh.updateBounds();
+    scene.meshes.push_back(mesh);
+    SceneNode node;
+    node.mesh = 0;
+    scene.nodes.push_back(node);
+    scene.roots.push_back(0);
+    return scene;
+}
+
+Scene Scene::sphere(int triangleCount)
+{
+    // rings x 2 * rings quads, two triangles each (the ones at the poles are degenerate)
+    const int rings = qMax(2, int(qCeil(qSqrt(triangleCount / 4.0))));
+    const int segments = 2 * rings;
+
+    Scene scene;
+    Mesh mesh;
+    mesh.name = QLatin1String("sphere");
+    mesh.positions.reserve(size_t(rings + 1) * (segments + 1) * 3);
+    for (int r = 0; r <= rings; ++r) {
+        const float theta = float(M_PI) * r / rings;
+        for (int s = 0; s <= segments; ++s) {
+            const float phi = 2.0f * float(M_PI) * s / segments;
+            mesh.positions.push_back(qSin(theta) * qCos(phi));
+            mesh.positions.push_back(qCos(theta));
+            mesh.positions.push_back(qSin(theta) * qSin(phi));
+        }
+    }
+    mesh.indices.reserve(size_t(rings) * segments * 6);
+    for (int r = 0; r < rings; ++r) {
+        for (int s = 0; s < segments; ++s) {
+            const uint32_t a = uint32_t(r * (segments + 1) + s);
+            const uint32_t b = a + uint32_t(segments + 1);
+            mesh.indices.insert(mesh.indices.end(), { a, b, a + 1, a + 1, b, b + 1 });
+        }
+    }
+    mesh.geometries.push_back({ 0, uint32_t(mesh.indices.size()), 0 });
+    mesh.updateBounds();
+    scene.meshes.push_back(mesh);
+    SceneNode node;
+    node.mesh = 0;
+    scene.nodes.push_back(node);
+    scene.roots.push_back(0);
+    return scene;
+}
+
+bool Scene::load(const QString &fileName, Scene *scene)
+{
+    const QString suffix = QFileInfo(fileName).suffix().toLower();
+    bool ok = false;
+    Scene s;
+    if (suffix == QLatin1String("obj"))
+        ok = loadObj(fileName, &s);
+    else if (suffix == QLatin1String("glb") || suffix == QLatin1String("gltf"))
+        ok = loadGltf(fileName, &s);
+    else
+        qWarning("Unsupported scene file format: %s", qPrintable(fileName));
+
+    if (!ok)
+        return false;
+
+    if (s.isEmpty()) {
+        qWarning("No triangles in %s", qPrintable(fileName));
+        return false;
+    }
+
+    s.selectFormats();
+
+    size_t triangleCount = 0;
+    for (const Mesh &mesh : s.meshes)
+        triangleCount += mesh.indices.size() / 3;
+    qDebug() << "loaded" << fileName << "meshes" << s.meshes.size() << "triangles" << triangleCount
+             << "nodes" << s.nodes.size();
+
+    *scene = std::move(s);
+    return true;
+}
+
+bool Scene::loadObj(const QString &fileName, Scene *scene)
+{
+    QFile f(fileName);
+    if (!f.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qWarning("Failed to open %s", qPrintable(fileName));
+        return false;
+    }
+
+    // all groups index into the same vertex list, so there is one mesh with
+    // a geometry per group/object/material
+    Mesh mesh;
+    mesh.name = QFileInfo(fileName).baseName();
+    Mesh::Geometry current;
+    auto finishGeometry = [&mesh, &current]() {
+        current.indexCount = uint32_t(mesh.indices.size()) - current.firstIndex;
+        if (current.indexCount)
+            mesh.geometries.push_back(current);
+        current = {};
+        current.firstIndex = uint32_t(mesh.indices.size());
+    };
+
+    std::vector<int64_t> face;
+    while (!f.atEnd()) {
+        const QByteArray line = f.readLine().simplified();
+        if (line.isEmpty() || line.startsWith('#'))
+            continue;
+        const QList<QByteArray> tokens = line.split(' ');
+        const QByteArray &cmd(tokens[0]);
+        if (cmd == "v") {
+            if (tokens.size() < 4)
+                continue;
+            for (int i = 1; i <= 3; ++i)
+                mesh.positions.push_back(tokens[i].toFloat());
+        } else if (cmd == "f") {
+            const int64_t vertexCount = int64_t(mesh.positions.size() / 3);
+            face.clear();
+            for (int i = 1; i < tokens.size(); ++i) {
+                bool ok = false;
+                int64_t v = tokens[i].split('/').first().toLongLong(&ok);
+                if (!ok || v == 0) {
+                    face.clear();
+                    break;
+                }
+                // negative indices are relative to the vertices read so far
+                v = v < 0 ? vertexCount + v : v - 1;
+                if (v < 0 || v > UINT32_MAX) {
+                    qWarning("Invalid face in %s", qPrintable(fileName));
+                    return false;
+                }
+                face.push_back(v);
+            }
+            for (size_t i = 2; i < face.size(); ++i) {
+                mesh.indices.push_back(uint32_t(face[0]));
+                mesh.indices.push_back(uint32_t(face[i - 1]));
+                mesh.indices.push_back(uint32_t(face[i]));
+            }
+        } else if (cmd == "o" || cmd == "g" || cmd == "usemtl") {
+            finishGeometry();
+        }
+    }
+    finishGeometry();
+
+    const uint32_t vertexCount = mesh.vertexCount();
+    for (uint32_t index : mesh.indices) {
+        if (index >= vertexCount) {
+            qWarning("Vertex index out of range in %s", qPrintable(fileName));
+            return false;
+        }
+    }
+
+    if (mesh.geometries.empty())
+        return true;
+
+    mesh.updateBounds();
+    scene->meshes.push_back(mesh);
+    SceneNode node;
+    node.mesh = 0;
+    scene->nodes.push_back(node);
+    scene->roots.push_back(0);
+    return true;
+}
+
+namespace {
+
+struct GltfBufferView {
+    int buffer = -1;
+    qint64 offset = 0;
+    qint64 length = 0;
+    int stride = 0;
+};
+
+struct GltfAccessor {
+    int view = -1;
+    qint64 offset = 0;
+    int componentType = 0;
+    qint64 count = 0;
+    int components = 0;
+    bool normalized = false;
+};
+
+enum GltfComponentType {
+    GltfByte = 5120,
+    GltfUnsignedByte = 5121,
+    GltfShort = 5122,
+    GltfUnsignedShort = 5123,
+    GltfUnsignedInt = 5125,
+    GltfFloat = 5126
+};
+
+int gltfComponentSize(int componentType)
+{
+    switch (componentType) {
+    case GltfByte:
+    case GltfUnsignedByte:
+        return 1;
+    case GltfShort:
+    case GltfUnsignedShort:
+        return 2;
+    case GltfUnsignedInt:
+    case GltfFloat:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+int gltfComponentCount(const QString &type)
+{
+    if (type == QLatin1String("SCALAR"))
+        return 1;
+    if (type == QLatin1String("VEC2"))
+        return 2;
+    if (type == QLatin1String("VEC3"))
+        return 3;
+    if (type == QLatin1String("VEC4"))
+        return 4;
+    if (type == QLatin1String("MAT4"))
+        return 16;
+    return 0;
+}
+
+struct GltfData {
+    std::vector<QByteArray> buffers;
+    std::vector<GltfBufferView> views;
+    std::vector<GltfAccessor> accessors;
+
+    // returns the first element and the stride, after validating that all
+    // elements are within the buffer
+    const char *elements(int accessorIndex, qint64 *stride) const
+    {
+        if (accessorIndex < 0 || accessorIndex >= int(accessors.size()))
+            return nullptr;
+        const GltfAccessor &a(accessors[accessorIndex]);
+        if (a.view < 0 || a.view >= int(views.size()))
+            return nullptr;
+        const GltfBufferView &v(views[a.view]);
+        if (v.buffer < 0 || v.buffer >= int(buffers.size()))
+            return nullptr;
+        const QByteArray &buf(buffers[v.buffer]);
+        const qint64 elemSize = gltfComponentSize(a.componentType) * a.components;
+        if (!elemSize || a.count <= 0)
+            return nullptr;
+        const qint64 s = v.stride ? v.stride : elemSize;
+        if (v.offset < 0 || v.length < 0 || v.offset + v.length > buf.size())
+            return nullptr;
+        if (a.offset < 0 || a.offset + s * (a.count - 1) + elemSize > v.length)
+            return nullptr;
+        *stride = s;
+        return buf.constData() + v.offset + a.offset;
+    }
+};
+
+bool readGltfPositions(const GltfData &data, int accessorIndex, std::vector<float> *dst)
+{
+    qint64 stride = 0;
+    const char *p = data.elements(accessorIndex, &stride);
+    if (!p)
+        return false;
+    const GltfAccessor &a(data.accessors[accessorIndex]);
+    if (a.components != 3 || a.componentType != GltfFloat) {
+        qWarning("Unsupported glTF position format (component type %d)", a.componentType);
+        return false;
+    }
+    for (qint64 i = 0; i < a.count; ++i) {
+        float v[3];
+        memcpy(v, p + i * stride, sizeof(v));
+        dst->insert(dst->end(), v, v + 3);
+    }
+    return true;
+}
+
+bool readGltfIndices(const GltfData &data, int accessorIndex, std::vector<uint32_t> *dst)
+{
+    qint64 stride = 0;
+    const char *p = data.elements(accessorIndex, &stride);
+    if (!p)
+        return false;
+    const GltfAccessor &a(data.accessors[accessorIndex]);
+    if (a.components != 1)
+        return false;
+    for (qint64 i = 0; i < a.count; ++i) {
+        const char *e = p + i * stride;
+        switch (a.componentType) {
+        case GltfUnsignedByte:
+            dst->push_back(*reinterpret_cast<const uchar *>(e));
+            break;
+        case GltfUnsignedShort:
+            dst->push_back(qFromLittleEndian<quint16>(e));
+            break;
+        case GltfUnsignedInt:
+            dst->push_back(qFromLittleEndian<quint32>(e));
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+QMatrix4x4 gltfNodeTransform(const QJsonObject &node)
+{
+    QMatrix4x4 m;
+    const QJsonArray matrix = node.value(QLatin1String("matrix")).toArray();
+    if (matrix.size() == 16) {
+        float v[16];
+        for (int i = 0; i < 16; ++i)
+            v[i] = float(matrix[i].toDouble());
+        // glTF is column major, the QMatrix4x4 constructor wants row major
+        return QMatrix4x4(v).transposed();
+    }
+    const QJsonArray t = node.value(QLatin1String("translation")).toArray();
+    if (t.size() == 3)
+        m.translate(float(t[0].toDouble()), float(t[1].toDouble()), float(t[2].toDouble()));
+    const QJsonArray r = node.value(QLatin1String("rotation")).toArray();
+    if (r.size() == 4) // xyzw
+        m.rotate(QQuaternion(float(r[3].toDouble()), float(r[0].toDouble()), float(r[1].toDouble()), float(r[2].toDouble())));
+    const QJsonArray s = node.value(QLatin1String("scale")).toArray();
+    if (s.size() == 3)
+        m.scale(float(s[0].toDouble()), float(s[1].toDouble()), float(s[2].toDouble()));
+    return m;
+}
+
+} // namespace
+
+bool Scene::loadGltf(const QString &fileName, Scene *scene)
+{
+    QFile f(fileName);
+    if (!f.open(QIODevice::ReadOnly)) {
+        qWarning("Failed to open %s", qPrintable(fileName));
+        return false;
+    }
+    const QByteArray fileData = f.readAll();
+    f.close();
+
+    QByteArray json;
+    QByteArray bin;
+    static const quint32 GLB_MAGIC = 0x46546C67; // "glTF"
+    static const quint32 GLB_CHUNK_JSON = 0x4E4F534A;
+    static const quint32 GLB_CHUNK_BIN = 0x004E4942;
+    if (fileData.size() >= 12 && qFromLittleEndian<quint32>(fileData.constData()) == GLB_MAGIC) {
+        const quint32 version = qFromLittleEndian<quint32>(fileData.constData() + 4);
+        if (version != 2) {
+            qWarning("Unsupported glTF binary version %u in %s", version, qPrintable(fileName));
+            return false;
+        }
+        const qint64 length = qMin<qint64>(qFromLittleEndian<quint32>(fileData.constData() + 8), fileData.size());
+        qint64 offset = 12;
+        while (offset + 8 <= length) {
+            const qint64 chunkLength = qFromLittleEndian<quint32>(fileData.constData() + offset);
+            const quint32 chunkType = qFromLittleEndian<quint32>(fileData.constData() + offset + 4);
+            offset += 8;
+            if (offset + chunkLength > length) {
+                qWarning("Truncated chunk in %s", qPrintable(fileName));
+                return false;
+            }
+            if (chunkType == GLB_CHUNK_JSON && json.isEmpty())
+                json = fileData.mid(offset, chunkLength);
+            else if (chunkType == GLB_CHUNK_BIN && bin.isEmpty())
+                bin = fileData.mid(offset, chunkLength);
+            offset += (chunkLength + 3) & ~qint64(3);
+        }
+    } else {
+        json = fileData;
+    }
+
+    QJsonParseError err;
+    const QJsonDocument doc = QJsonDocument::fromJson(json, &err);
+    if (doc.isNull() || !doc.isObject()) {
+        qWarning("Failed to parse glTF JSON in %s: %s", qPrintable(fileName), qPrintable(err.errorString()));
+        return false;
+    }
+    const QJsonObject root = doc.object();
+    if (!root.value(QLatin1String("asset")).toObject().value(QLatin1String("version")).toString().startsWith(QLatin1Char('2'))) {
+        qWarning("%s is not glTF 2.0", qPrintable(fileName));
+        return false;
+    }
+
+    GltfData data;
+    const QDir baseDir = QFileInfo(fileName).absoluteDir();
+    for (const QJsonValue &v : root.value(QLatin1String("buffers")).toArray()) {
+        const QJsonObject o = v.toObject();
+        QByteArray buf;
+        if (!o.contains(QLatin1String("uri"))) {
+            buf = bin;
+        } else {
+            const QString uri = o.value(QLatin1String("uri")).toString();
+            if (uri.startsWith(QLatin1String("data:"))) {
+                const int comma = uri.indexOf(QLatin1Char(','));
+                if (comma < 0 || !uri.left(comma).endsWith(QLatin1String(";base64"))) {
+                    qWarning("Unsupported data URI in %s", qPrintable(fileName));
+                    return false;
+                }
+                buf = QByteArray::fromBase64(uri.mid(comma + 1).toLatin1());
+            } else {
+                QFile bf(baseDir.filePath(QUrl::fromPercentEncoding(uri.toUtf8())));
+                if (!bf.open(QIODevice::ReadOnly)) {
+                    qWarning("Failed to open %s", qPrintable(bf.fileName()));
+                    return false;
+                }
+                buf = bf.readAll();
+            }
+        }
+        if (buf.size() < qint64(o.value(QLatin1String("byteLength")).toDouble())) {
+            qWarning("glTF buffer too small in %s", qPrintable(fileName));
+            return false;
+        }
+        data.buffers.push_back(buf);
+    }
+
+    for (const QJsonValue &v : root.value(QLatin1String("bufferViews")).toArray()) {
+        const QJsonObject o = v.toObject();
+        GltfBufferView view;
+        view.buffer = o.value(QLatin1String("buffer")).toInt(-1);
+        view.offset = qint64(o.value(QLatin1String("byteOffset")).toDouble());
+        view.length = qint64(o.value(QLatin1String("byteLength")).toDouble());
+        view.stride = o.value(QLatin1String("byteStride")).toInt();
+        data.views.push_back(view);
+    }
+
+    for (const QJsonValue &v : root.value(QLatin1String("accessors")).toArray()) {
+        const QJsonObject o = v.toObject();
+        GltfAccessor accessor;
+        accessor.view = o.value(QLatin1String("bufferView")).toInt(-1);
+        accessor.offset = qint64(o.value(QLatin1String("byteOffset")).toDouble());
+        accessor.componentType = o.value(QLatin1String("componentType")).toInt();
+        accessor.count = qint64(o.value(QLatin1String("count")).toDouble());
+        accessor.components = gltfComponentCount(o.value(QLatin1String("type")).toString());
+        accessor.normalized = o.value(QLatin1String("normalized")).toBool();
+        if (o.contains(QLatin1String("sparse")))
+            qWarning("Sparse glTF accessors are not supported, ignoring sparse data");
+        data.accessors.push_back(accessor);
+    }
+
+    // glTF mesh -> Mesh, primitive -> Geometry
+    const QJsonArray gltfMeshes = root.value(QLatin1String("meshes")).toArray();
+    std::vector<int> meshMap(gltfMeshes.size(), -1);
+    for (int meshIndex = 0; meshIndex < gltfMeshes.size(); ++meshIndex) {
+        const QJsonObject gltfMesh = gltfMeshes[meshIndex].toObject();
+        Mesh mesh;
+        mesh.name = gltfMesh.value(QLatin1String("name")).toString();
+        for (const QJsonValue &pv : gltfMesh.value(QLatin1String("primitives")).toArray()) {
+            const QJsonObject prim = pv.toObject();
+            const int mode = prim.value(QLatin1String("mode")).toInt(4);
+            if (mode != 4) { // TRIANGLES
+                qWarning("Skipping glTF primitive with mode %d", mode);
+                continue;
+            }
+            const int positionAccessor = prim.value(QLatin1String("attributes")).toObject().value(QLatin1String("POSITION")).toInt(-1);
+            Mesh::Geometry geom;
+            geom.firstVertex = mesh.vertexCount();
+            geom.firstIndex = uint32_t(mesh.indices.size());
+            if (!readGltfPositions(data, positionAccessor, &mesh.positions)) {
+                qWarning("Invalid POSITION accessor in %s", qPrintable(fileName));
+                return false;
+            }
+            const uint32_t primVertexCount = mesh.vertexCount() - geom.firstVertex;
+            if (prim.contains(QLatin1String("indices"))) {
+                if (!readGltfIndices(data, prim.value(QLatin1String("indices")).toInt(-1), &mesh.indices)) {
+                    qWarning("Invalid index accessor in %s", qPrintable(fileName));
+                    return false;
+                }
+            } else {
+                for (uint32_t i = 0; i < primVertexCount; ++i)
+                    mesh.indices.push_back(i);
+            }
+            // drop incomplete triangles so that the next geometry starts at a triangle boundary
+            mesh.indices.resize(geom.firstIndex + (mesh.indices.size() - geom.firstIndex) / 3 * 3);
+            for (size_t i = geom.firstIndex; i < mesh.indices.size(); ++i) {
+                if (mesh.indices[i] >= primVertexCount) {
+                    qWarning("Vertex index out of range in %s", qPrintable(fileName));
+                    return false;
+                }
+            }
+            geom.indexCount = uint32_t(mesh.indices.size()) - geom.firstIndex;
+            if (geom.indexCount)
+                mesh.geometries.push_back(geom);
+        }
+        if (mesh.geometries.empty())
+            continue;
+        mesh.updateBounds();
+        meshMap[meshIndex] = int(scene->meshes.size());
+        scene->meshes.push_back(mesh);
+    }
+
+    const QJsonArray gltfNodes = root.value(QLatin1String("nodes")).toArray();
+    std::vector<int> parentCount(gltfNodes.size(), 0);
+    for (const QJsonValue &nv : gltfNodes) {
+        const QJsonObject o = nv.toObject();
+        SceneNode node;
+        node.transform = gltfNodeTransform(o);
+        const int meshIndex = o.value(QLatin1String("mesh")).toInt(-1);
+        if (meshIndex >= 0 && meshIndex < int(meshMap.size()))
+            node.mesh = meshMap[meshIndex];
+        for (const QJsonValue &c : o.value(QLatin1String("children")).toArray()) {
+            const int child = c.toInt(-1);
+            if (child < 0 || child >= gltfNodes.size()) {
+                qWarning("Invalid child node in %s", qPrintable(fileName));
+                return false;
+            }
+            parentCount[child] += 1;
+            node.children.push_back(child);
+        }
+        scene->nodes.push_back(node);
+    }
+
+    // the node hierarchy must be a set of disjoint trees (this also rules out cycles)
+    for (int count : parentCount) {
+        if (count > 1) {
+            qWarning("Node with multiple parents in %s", qPrintable(fileName));
+            return false;
+        }
+    }
+
+    const QJsonArray scenes = root.value(QLatin1String("scenes")).toArray();
+    if (!scenes.isEmpty()) {
+        const int sceneIndex = qBound(0, root.value(QLatin1String("scene")).toInt(0), int(scenes.size()) - 1);
+        for (const QJsonValue &nv : scenes[sceneIndex].toObject().value(QLatin1String("nodes")).toArray()) {
+            const int n = nv.toInt(-1);
+            if (n < 0 || n >= gltfNodes.size() || parentCount[n]) {
+                qWarning("Invalid root node in %s", qPrintable(fileName));
+                return false;
+            }
+            scene->roots.push_back(n);
+        }
+    } else {
+        for (int n = 0; n < gltfNodes.size(); ++n) {
+            if (!parentCount[n])
+                scene->roots.push_back(n);
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,112 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <QString>
+#include <QMatrix4x4>
+#include <QVector3D>
+#include <vector>
+
+// One mesh becomes one bottom level acceleration structure. Its geometries
+// (OBJ groups, glTF primitives) share the vertex and index data, each
+// geometry is just a range in it.
+struct Mesh
+{
+    struct Geometry {
+        uint32_t firstIndex = 0;
+        uint32_t indexCount = 0;
+        uint32_t firstVertex = 0; // added to every index of the geometry
+    };
+
+    QString name;
+    std::vector<float> positions; // xyz
+    std::vector<uint32_t> indices;
+    std::vector<Geometry> geometries;
+    QVector3D boundsMin;
+    QVector3D boundsMax;
+
+    // Deformable meshes get their vertices animated on the GPU and their
+    // BLAS refitted every frame. A refit is cheaper than a build but the
+    // result traces slower the further the vertices move, so the BLAS is
+    // rebuilt after every maxRefits refits (0 = always rebuild).
+    bool deformable = false;
+    int maxRefits = 16;
+
+    // How the vertex and index data is stored on the GPU, positions and
+    // indices here stay as they are. Quantized positions are relative to
+    // the bounding box, mapped to [-1, 1] on each axis; the BLAS builds
+    // and the shaders scale them back, see dequantization(). Deformable
+    // meshes are always Float32, deform.comp works on floats. The values
+    // must match the GeometryDesc formats in common.glsl.
+    enum VertexFormat {
+        Float32 = 0, // xyz
+        Snorm16 = 1, // xyzw, w unused
+        Float16 = 2 // xyzw, w unused
+    };
+    enum IndexFormat {
+        Uint32 = 0,
+        Uint16 = 4
+    };
+    VertexFormat vertexFormat = Float32;
+    IndexFormat indexFormat = Uint32;
+
+    // the smallest formats that keep the precision, see scene.cpp
+    void selectFormats();
+    VertexFormat gpuVertexFormat() const { return deformable ? Float32 : vertexFormat; }
+    uint32_t vertexStride() const { return gpuVertexFormat() == Float32 ? 3 * sizeof(float) : 4 * sizeof(quint16); }
+    uint32_t indexSize() const { return indexFormat == Uint16 ? sizeof(quint16) : sizeof(uint32_t); }
+    // in bytes, the indices padded to 4 bytes
+    size_t vertexDataSize() const { return size_t(vertexCount()) * vertexStride(); }
+    size_t indexDataSize() const { return (indices.size() * indexSize() + 3) / 4 * 4; }
+    // the stored positions times scale plus offset are the positions
+    void dequantization(QVector3D *scale, QVector3D *offset) const;
+    void writeVertexData(void *dst) const;
+    void writeIndexData(void *dst) const;
+
+    uint32_t vertexCount() const { return uint32_t(positions.size() / 3); }
+    void updateBounds();
+};
+
+struct SceneNode
+{
+    QMatrix4x4 transform; // relative to the parent
+    int mesh = -1;
+    std::vector<int> children;
+};
+
+// Meshes are stored once and referenced by any number of nodes, the node
+// hierarchy is flattened into TLAS instances.
+class Scene
+{
+public:
+    struct Instance {
+        int mesh;
+        QMatrix4x4 transform;
+    };
+
+    std::vector<Mesh> meshes;
+    std::vector<SceneNode> nodes;
+    std::vector<int> roots;
+
+    bool isEmpty() const { return meshes.empty() || roots.empty(); }
+    std::vector<Instance> instances() const;
+    void boundingBox(QVector3D *boundsMin, QVector3D *boundsMax) const;
+
+    // copies the root nodes (not the meshes) gridSize x gridSize times
+    void replicate(int gridSize);
+
+    // Mesh::selectFormats() for every mesh, done by load(); reports the
+    // GPU memory saved. QVKRT_VERTEX_FORMAT=float32, snorm16 or float16
+    // forces a vertex format instead.
+    void selectFormats();
+
+    static Scene triangle();
+    // UV sphere with at least triangleCount triangles, for benchmarks
+    static Scene sphere(int triangleCount);
+    static bool load(const QString &fileName, Scene *scene);
+
+private:
+    static bool loadObj(const QString &fileName, Scene *scene);
+    static bool loadGltf(const QString &fileName, Scene *scene);
+};
+
+#endif
@@ -4,7 +4,51 @@
 #include <QtQuick/QSGTextureProvider>
 #include <QtQuick/QSGSimpleTextureNode>
 #include <QtGui/QVulkanFunctions>
-//#include <QtGui/private/qrhi_p.h>
+#include <QtQml/QQmlFile>
+#include <QElapsedTimer>
+#include <QtMath>
+#include <QFile>
+#include <QTextStream>
+#include <algorithm>
+#include <QtGui/private/qrhi_p.h>
+
+// min/avg/99th percentile of the last WINDOW values
+class RollingStats
+{
+public:
+    static const int WINDOW = 240;
+
+    void add(double v)
+    {
+        if (m_values.size() < size_t(WINDOW))
+            m_values.push_back(v);
+        else
+            m_values[m_next] = v;
+        m_next = (m_next + 1) % WINDOW;
+    }
+
+    QVariantMap toMap() const
+    {
+        QVariantMap m;
+        if (m_values.empty())
+            return m;
+        std::vector<double> sorted = m_values;
+        std::sort(sorted.begin(), sorted.end());
+        double sum = 0;
+        for (double v : sorted)
+            sum += v;
+        m[QLatin1String("min")] = sorted.front();
+        m[QLatin1String("avg")] = sum / sorted.size();
+        m[QLatin1String("p99")] = sorted[qMin(sorted.size() - 1, size_t(sorted.size() * 0.99))];
+        return m;
+    }
+
+    int count() const { return int(m_values.size()); }
+
+private:
+    std::vector<double> m_values;
+    int m_next = 0;
+};
 
 class CustomTextureNode : public QSGTextureProvider, public QSGSimpleTextureNode
 {
@@ -25,6 +69,10 @@ private:
     void createNativeTexture();
     void releaseNativeTexture();
     void initialize();
+    bool loadScene();
+    void updateInstanceTransforms();
+    void collectGpuTimings();
+    void updateDynamicScale(double traceTime);
 
     QQuickItem *m_item;
     QQuickWindow *m_window;
@@ -33,15 +81,46 @@ private:
 
     bool m_initialized = false;
 
+    QUrl m_source;
+    int m_instanceGrid = 1;
+    qreal m_instanceRotation = 0;
+    bool m_deformable = false;
+    qreal m_deformPhase = 0;
+    bool m_wasActive = false;
+    std::vector<Scene::Instance> m_baseInstances;
+
+    quint64 m_lastTimingsFrame = 0;
+    RollingStats m_blasTimes;
+    RollingStats m_tlasTimes;
+    RollingStats m_traceTimes;
+    RollingStats m_denoiseTimes;
+    RollingStats m_totalTimes;
+    QElapsedTimer m_timingsReportTimer;
+    QFile m_timingsCsv;
+
+    // resolution scaling, see CustomTextureItem::renderScale
+    qreal m_scale = 1.0; // what m_pixelSize is based on
+    qreal m_renderScale = 1.0; // the item's, the upper limit for dynamic resolution
+    bool m_dynamicResolution = false;
+    qreal m_targetFrameTime = 0;
+    qreal m_dynamicScale = 1.0;
+    double m_scaleTraceTimeSum = 0;
+    int m_scaleTraceTimeCount = 0;
+
     QVulkanInstance *m_inst = nullptr;
     VkPhysicalDevice m_physDev = VK_NULL_HANDLE;
     VkDevice m_dev = VK_NULL_HANDLE;
     QVulkanDeviceFunctions *m_devFuncs = nullptr;
     QVulkanFunctions *m_funcs = nullptr;
 
+    // async mode: the output images are Raytracing's, the texture is
+    // pointed to the one shown
+    bool m_async = false;
+    VkImage m_asyncImage = VK_NULL_HANDLE;
+
     VkImage m_output = VK_NULL_HANDLE;
     VkImageLayout m_outputLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    VkDeviceMemory m_outputMemory = VK_NULL_HANDLE;
+    MemoryAllocator::Allocation m_outputAlloc;
     VkImageView m_outputView = VK_NULL_HANDLE;
     QSGTexture *m_sgWrapperTexture = nullptr;
 
@@ -53,6 +132,227 @@ CustomTextureItem::CustomTextureItem()
     setFlag(ItemHasContents, true);
 }
 
+void CustomTextureItem::setSource(const QUrl &url)
+{
+    if (m_source == url)
+        return;
+
+    m_source = url;
+    emit sourceChanged();
+    update();
+}
+
+void CustomTextureItem::setInstanceGrid(int n)
+{
+    if (m_instanceGrid == n)
+        return;
+
+    m_instanceGrid = n;
+    emit instanceGridChanged();
+    update();
+}
+
+void CustomTextureItem::setInstanceRotation(qreal degrees)
+{
+    if (m_instanceRotation == degrees)
+        return;
+
+    m_instanceRotation = degrees;
+    emit instanceRotationChanged();
+    update();
+}
+
+void CustomTextureItem::setDeformable(bool enable)
+{
+    if (m_deformable == enable)
+        return;
+
+    m_deformable = enable;
+    emit deformableChanged();
+    update();
+}
+
+void CustomTextureItem::setDeformPhase(qreal phase)
+{
+    if (m_deformPhase == phase)
+        return;
+
+    m_deformPhase = phase;
+    emit deformPhaseChanged();
+    update();
+}
+
+void CustomTextureItem::setCameraYaw(qreal degrees)
+{
+    if (m_cameraYaw == degrees)
+        return;
+
+    m_cameraYaw = degrees;
+    emit cameraYawChanged();
+    update();
+}
+
+void CustomTextureItem::setCameraPitch(qreal degrees)
+{
+    if (m_cameraPitch == degrees)
+        return;
+
+    m_cameraPitch = degrees;
+    emit cameraPitchChanged();
+    update();
+}
+
+void CustomTextureItem::setSamplesPerFrame(int n)
+{
+    if (m_samplesPerFrame == n)
+        return;
+
+    m_samplesPerFrame = n;
+    emit samplesPerFrameChanged();
+    update();
+}
+
+void CustomTextureItem::setMaxSamples(int n)
+{
+    if (m_maxSamples == n)
+        return;
+
+    m_maxSamples = n;
+    emit maxSamplesChanged();
+    update();
+}
+
+void CustomTextureItem::setMaxBounces(int n)
+{
+    if (m_maxBounces == n)
+        return;
+
+    m_maxBounces = n;
+    emit maxBouncesChanged();
+    update();
+}
+
+void CustomTextureItem::setDenoise(bool enable)
+{
+    if (m_denoise == enable)
+        return;
+
+    m_denoise = enable;
+    emit denoiseChanged();
+    update();
+}
+
+void CustomTextureItem::setRenderScale(qreal scale)
+{
+    scale = qBound(0.1, scale, 4.0);
+    if (m_renderScale == scale)
+        return;
+
+    m_renderScale = scale;
+    emit renderScaleChanged();
+    update();
+}
+
+void CustomTextureItem::setDynamicResolution(bool enable)
+{
+    if (m_dynamicResolution == enable)
+        return;
+
+    m_dynamicResolution = enable;
+    emit dynamicResolutionChanged();
+    update();
+}
+
+void CustomTextureItem::setTargetFrameTime(qreal ms)
+{
+    if (m_targetFrameTime == ms)
+        return;
+
+    m_targetFrameTime = ms;
+    emit targetFrameTimeChanged();
+    update();
+}
+
+void CustomTextureItem::setTraceTimeBudget(qreal ms)
+{
+    ms = qMax(0.0, ms);
+    if (m_traceTimeBudget == ms)
+        return;
+
+    m_traceTimeBudget = ms;
+    emit traceTimeBudgetChanged();
+    update();
+}
+
+void CustomTextureItem::setInterleavedTrace(bool enable)
+{
+    if (m_interleavedTrace == enable)
+        return;
+
+    m_interleavedTrace = enable;
+    emit interleavedTraceChanged();
+    update();
+}
+
+void CustomTextureItem::setRayQuery(bool enable)
+{
+    if (m_rayQuery == enable)
+        return;
+
+    m_rayQuery = enable;
+    emit rayQueryChanged();
+    update();
+}
+
+void CustomTextureItem::setAsyncQueueFamily(int index)
+{
+    if (m_asyncQueueFamily == index)
+        return;
+
+    m_asyncQueueFamily = index;
+    emit asyncQueueFamilyChanged();
+}
+
+void CustomTextureItem::setAsyncQueueIndex(int index)
+{
+    if (m_asyncQueueIndex == index)
+        return;
+
+    m_asyncQueueIndex = index;
+    emit asyncQueueIndexChanged();
+}
+
+void CustomTextureItem::setEffectiveRenderScale(qreal scale) // called on the gui thread
+{
+    if (m_effectiveRenderScale == scale)
+        return;
+
+    m_effectiveRenderScale = scale;
+    emit effectiveRenderScaleChanged();
+    // have the node pick up the new size in sync()
+    update();
+}
+
+void CustomTextureItem::setRenderState(bool traced, bool active, int sampleCount) // called on the gui thread
+{
+    if (m_active != active) {
+        m_active = active;
+        emit activeChanged();
+    }
+    if (m_sampleCount != sampleCount) {
+        m_sampleCount = sampleCount;
+        emit sampleCountChanged();
+    }
+    if (traced)
+        emit rendered();
+}
+
+void CustomTextureItem::setGpuTimings(const QVariantMap &timings) // called on the gui thread
+{
+    m_gpuTimings = timings;
+    emit gpuTimingsChanged();
+}
+
 void CustomTextureItem::invalidateSceneGraph() // called on the render thread when the scenegraph is invalidated
 {
     m_node = nullptr;
@@ -81,8 +381,6 @@ QSGNode *CustomTextureItem::updatePaintNode(QSGNode *node, UpdatePaintNodeData *
     n->setFiltering(QSGTexture::Linear);
     n->setRect(0, 0, width(), height());
 
-    window()->update(); // ensure getting to beforeRendering() at some point
-
     return n;
 }
 
@@ -109,6 +407,8 @@ CustomTextureNode::~CustomTextureNode()
 {
     delete texture();
     releaseNativeTexture();
+    if (m_initialized)
+        raytracing.releaseResources(m_dev, m_devFuncs);
 }
 
 QSGTexture *CustomTextureNode::texture() const
@@ -135,38 +435,23 @@ void CustomTextureNode::createNativeTexture()
     imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
     imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
     imageInfo.initialLayout = m_outputLayout;
-    imageInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
+    imageInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
 
     m_devFuncs->vkCreateImage(m_dev, &imageInfo, nullptr, &m_output);
 
     VkMemoryRequirements memReq;
     m_devFuncs->vkGetImageMemoryRequirements(m_dev, m_output, &memReq);
-    quint32 memIndex = 0;
-    VkPhysicalDeviceMemoryProperties physDevMemProps;
-    m_funcs->vkGetPhysicalDeviceMemoryProperties(m_physDev, &physDevMemProps);
-    for (uint32_t i = 0; i < physDevMemProps.memoryTypeCount; ++i) {
-        if (!(memReq.memoryTypeBits & (1 << i)))
-            continue;
-        if (physDevMemProps.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) {
-            memIndex = i;
-            break;
-        }
-    }
-
-    VkMemoryAllocateInfo allocInfo = {
-        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-        nullptr,
-        memReq.size,
-        memIndex
-    };
-
-    m_devFuncs->vkAllocateMemory(m_dev, &allocInfo, nullptr, &m_outputMemory);
-    m_devFuncs->vkBindImageMemory(m_dev, m_output, m_outputMemory, 0);
+    m_outputAlloc = raytracing.memoryAllocator()->allocate(memReq, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                                           MemoryAllocator::OptimalResource);
+    m_devFuncs->vkBindImageMemory(m_dev, m_output, m_outputAlloc.mem, m_outputAlloc.offset);
 
+    // for the storage image writes, which go through a 2D array view (one
+    // layer per view of Raytracing, the item shows a single one); Qt Quick
+    // samples through a view of its own
     VkImageViewCreateInfo viewInfo = {};
     viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
     viewInfo.image = m_output;
-    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
     viewInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
     viewInfo.components.r = VK_COMPONENT_SWIZZLE_R;
     viewInfo.components.g = VK_COMPONENT_SWIZZLE_G;
@@ -191,18 +476,34 @@ void CustomTextureNode::releaseNativeTexture()
 
     m_devFuncs->vkDestroyImageView(m_dev, m_outputView, nullptr);
     m_outputView = VK_NULL_HANDLE;
+    raytracing.releaseOutputImage();
 
     m_devFuncs->vkDestroyImage(m_dev, m_output, nullptr);
     m_output = VK_NULL_HANDLE;
 
-    m_devFuncs->vkFreeMemory(m_dev, m_outputMemory, nullptr);
-    m_outputMemory = VK_NULL_HANDLE;
+    raytracing.memoryAllocator()->free(m_outputAlloc);
+    m_outputAlloc = {};
 }
 
 void CustomTextureNode::sync()
 {
+    CustomTextureItem *item = static_cast<CustomTextureItem *>(m_item);
+
+    m_dynamicResolution = item->dynamicResolution();
+    m_targetFrameTime = item->targetFrameTime();
+    m_renderScale = item->renderScale();
+    const qreal scale = m_dynamicResolution ? qMin(m_dynamicScale, m_renderScale) : m_renderScale;
+    if (scale != m_scale) {
+        m_scale = scale;
+        m_scaleTraceTimeSum = 0;
+        m_scaleTraceTimeCount = 0;
+        QMetaObject::invokeMethod(item, [item, scale] {
+            item->setEffectiveRenderScale(scale);
+        }, Qt::QueuedConnection);
+    }
+
     m_dpr = m_window->effectiveDevicePixelRatio();
-    const QSize newSize = m_item->size().toSize() * m_dpr;
+    const QSize newSize = (m_item->size() * m_dpr * m_scale).toSize().expandedTo(QSize(1, 1));
     bool needsNew = false;
 
     if (!texture())
@@ -213,12 +514,61 @@ void CustomTextureNode::sync()
         m_pixelSize = newSize;
     }
 
+    // the scene is loaded (and, except in async mode, Raytracing initialized
+    // with its context) on the first sync, even when the item has the defaults
+    bool sceneChanged = false;
     if (!m_initialized) {
         initialize();
         m_initialized = true;
+        sceneChanged = true;
+    }
+
+    if (sceneChanged || item->source() != m_source || item->instanceGrid() != m_instanceGrid
+            || item->isDeformable() != m_deformable)
+    {
+        m_source = item->source();
+        m_instanceGrid = item->instanceGrid();
+        m_deformable = item->isDeformable();
+        if (loadScene())
+            needsNew = true;
+        if (m_instanceRotation != 0)
+            updateInstanceTransforms();
+        if (m_deformPhase != 0)
+            raytracing.setDeformPhase(float(m_deformPhase));
+    }
+
+    if (item->instanceRotation() != m_instanceRotation) {
+        m_instanceRotation = item->instanceRotation();
+        updateInstanceTransforms();
+    }
+
+    if (item->deformPhase() != m_deformPhase) {
+        m_deformPhase = item->deformPhase();
+        raytracing.setDeformPhase(float(m_deformPhase));
     }
 
-    if (needsNew) {
+    // these do nothing when the value is the same
+    raytracing.setCameraOrbit(float(item->cameraYaw()), float(item->cameraPitch()));
+    raytracing.setSamplesPerFrame(item->samplesPerFrame());
+    raytracing.setMaxSamples(item->maxSamples());
+    raytracing.setMaxBounces(item->maxBounces());
+    raytracing.setDenoiserEnabled(item->denoise());
+    raytracing.setTraceTimeBudget(item->traceTimeBudget());
+    raytracing.setTraceSplit(item->interleavedTrace() ? Raytracing::Interleaved : Raytracing::Bands);
+    raytracing.setTraceBackend(item->rayQuery() ? Raytracing::RayQuery : Raytracing::RayTracingPipeline);
+
+    if (needsNew && m_async) {
+        // the previous image stays on screen until one of the new size is rendered
+        raytracing.createAsyncImages(m_pixelSize, m_dev, m_devFuncs);
+        if (!texture()) {
+            m_asyncImage = raytracing.asyncOutputImage();
+            m_sgWrapperTexture = QNativeInterface::QSGVulkanTexture::fromNative(m_asyncImage,
+                                                                                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                                                                m_window,
+                                                                                raytracing.asyncOutputSize());
+            setTexture(m_sgWrapperTexture);
+        }
+    } else if (needsNew) {
         delete texture();
         releaseNativeTexture();
         createNativeTexture();
@@ -230,6 +580,62 @@ void CustomTextureNode::sync()
     }
 }
 
+static Scene createScene(const QUrl &source, int instanceGrid, bool deformable)
+{
+    Scene scene;
+    const QString fileName = QQmlFile::urlToLocalFileOrQrc(source);
+    if (fileName.isEmpty() || !Scene::load(fileName, &scene))
+        scene = Scene::triangle();
+
+    for (Mesh &mesh : scene.meshes)
+        mesh.deformable = deformable;
+
+    scene.replicate(instanceGrid);
+    return scene;
+}
+
+// Items showing the same scene in a window share a RaytracingContext, so
+// the file is loaded and the acceleration structures are built only once.
+// Returns true when the output image has to be recreated, since it is
+// allocated from the context's allocator.
+bool CustomTextureNode::loadScene() // called on the render thread with the gui thread blocked
+{
+    // async mode keeps the context of its own, it is updated on the async queue
+    if (m_async) {
+        raytracing.setScene(createScene(m_source, m_instanceGrid, m_deformable));
+        m_baseInstances = raytracing.context()->scene().instances();
+        return false;
+    }
+
+    const QString key = m_source.toString() + QLatin1Char('|') + QString::number(m_instanceGrid)
+            + QLatin1Char('|') + QString::number(int(m_deformable));
+    // Qt Quick does not tell which features its device has enabled
+    std::shared_ptr<RaytracingContext> context = RaytracingContext::get(m_window, key, m_physDev, m_dev, m_funcs, m_devFuncs, false);
+    if (context->scene().isEmpty())
+        context->setScene(createScene(m_source, m_instanceGrid, m_deformable));
+    m_baseInstances = context->scene().instances();
+
+    if (raytracing.context() == context.get())
+        return false;
+
+    releaseNativeTexture();
+    raytracing.releaseResources(m_dev, m_devFuncs);
+    raytracing.init(std::move(context), m_dev, m_devFuncs);
+    return true;
+}
+
+void CustomTextureNode::updateInstanceTransforms()
+{
+    // spin each instance around its own Y axis
+    std::vector<QMatrix4x4> transforms(m_baseInstances.size());
+    QMatrix4x4 rotation;
+    rotation.rotate(float(m_instanceRotation), 0.0f, 1.0f, 0.0f);
+    for (size_t i = 0; i < m_baseInstances.size(); ++i)
+        transforms[i] = m_baseInstances[i].transform * rotation;
+
+    raytracing.setInstanceTransforms(transforms);
+}
+
 void CustomTextureNode::initialize()
 {
     m_initialized = true;
@@ -247,7 +653,28 @@ void CustomTextureNode::initialize()
     m_funcs = m_inst->functions();
     Q_ASSERT(m_devFuncs && m_funcs);
 
-    raytracing.init(m_physDev, m_dev, m_funcs, m_devFuncs);
+    // Async mode keeps a context of its own. Otherwise the first sync's
+    // loadScene() initializes Raytracing with the context shared for the
+    // scene, creating a private one here would only be thrown away.
+    CustomTextureItem *item = static_cast<CustomTextureItem *>(m_item);
+    if (item->asyncQueueFamily() >= 0 && item->asyncQueueIndex() >= 0) {
+        const uint32_t graphicsQueueFamilyIndex = *static_cast<uint32_t *>(
+            rif->getResource(m_window, QSGRendererInterface::GraphicsQueueFamilyIndexResource));
+        // Qt Quick does not tell which features its device has enabled
+        raytracing.init(m_physDev, m_dev, m_funcs, m_devFuncs, false);
+        m_async = raytracing.initAsync(uint32_t(item->asyncQueueFamily()), uint32_t(item->asyncQueueIndex()),
+                                       graphicsQueueFamilyIndex, m_dev, m_funcs, m_devFuncs);
+    }
+
+    // QVKRT_GPU_TIMINGS_CSV=file.csv dumps the timings of every frame
+    const QString csvFileName = qEnvironmentVariable("QVKRT_GPU_TIMINGS_CSV");
+    if (!csvFileName.isEmpty() && !m_timingsCsv.isOpen()) {
+        m_timingsCsv.setFileName(csvFileName);
+        if (m_timingsCsv.open(QIODevice::WriteOnly | QIODevice::Text))
+            m_timingsCsv.write("frame,stages,traced,blas_ms,tlas_ms,trace_ms,denoise_ms,total_ms\n");
+        else
+            qWarning("Failed to open %s for writing", qPrintable(csvFileName));
+    }
 }
 
 void CustomTextureNode::render() // called before Qt Quick starts recording its main render pass
@@ -257,16 +684,129 @@ void CustomTextureNode::render() // called before Qt Quick starts recording its
 
     QSGRendererInterface *rif = m_window->rendererInterface();
 
-    const uint currentFrameSlot = m_window->graphicsStateInfo().currentFrameSlot;
+    if (m_async) {
+        VkQueue queue = *static_cast<VkQueue *>(rif->getResource(m_window, QSGRendererInterface::CommandQueueResource));
+        raytracing.asyncFrame(m_inst, m_physDev, m_dev, m_devFuncs, m_funcs, queue);
+
+        // the node's texture cannot be replaced at this point, but the
+        // QRhiTexture under it can be pointed to another VkImage
+        if (raytracing.asyncOutputImage() != m_asyncImage) {
+            m_asyncImage = raytracing.asyncOutputImage();
+            QRhiTexture *t = m_sgWrapperTexture->rhiTexture();
+            t->setPixelSize(raytracing.asyncOutputSize());
+            t->createFrom({ quint64(m_asyncImage), VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL });
+        }
+    } else {
+        const uint currentFrameSlot = m_window->graphicsStateInfo().currentFrameSlot;
 
-    VkCommandBuffer cmdBuf = *reinterpret_cast<VkCommandBuffer *>(
-        rif->getResource(m_window, QSGRendererInterface::CommandListResource));
+        VkCommandBuffer cmdBuf = *reinterpret_cast<VkCommandBuffer *>(
+            rif->getResource(m_window, QSGRendererInterface::CommandListResource));
 
-    m_outputLayout = raytracing.doIt(m_inst, m_physDev, m_dev, m_devFuncs, m_funcs,
-                                     cmdBuf, m_output, m_outputLayout, m_outputView,
-                                     currentFrameSlot, m_pixelSize);
+        m_outputLayout = raytracing.doIt(m_inst, m_physDev, m_dev, m_devFuncs, m_funcs,
+                                         cmdBuf, m_output, m_outputLayout, m_outputView,
+                                         currentFrameSlot, m_pixelSize);
+    }
+
+    // keep adding samples until the image converges, and in async mode
+    // until the frames in flight are shown
+    const bool active = !raytracing.isConverged() || (m_async && raytracing.hasAsyncFramesPending());
+    if (active)
+        m_window->update();
+
+    // report to the item, but not for every frame where nothing happens
+    const bool traced = raytracing.lastFrameTraced();
+    if (traced || active != m_wasActive) {
+        m_wasActive = active;
+        const int sampleCount = int(raytracing.sampleCount());
+        CustomTextureItem *item = static_cast<CustomTextureItem *>(m_item);
+        // the item is the context, so this is dropped if the item is gone by then
+        QMetaObject::invokeMethod(item, [item, traced, active, sampleCount] {
+            item->setRenderState(traced, active, sampleCount);
+        }, Qt::QueuedConnection);
+    }
+
+    collectGpuTimings();
 
     //m_sgWrapperTexture->rhiTexture()->setNativeLayout(m_outputLayout);
 }
 
+void CustomTextureNode::collectGpuTimings()
+{
+    const Raytracing::GpuTimings &t(raytracing.gpuTimings());
+    if (t.frame == m_lastTimingsFrame)
+        return;
+    m_lastTimingsFrame = t.frame;
+
+    m_blasTimes.add(t.blas);
+    m_tlasTimes.add(t.tlas);
+    if (t.traced) {
+        m_traceTimes.add(t.trace);
+        m_denoiseTimes.add(t.denoise);
+        // both scale with the pixel count
+        if (m_dynamicResolution)
+            updateDynamicScale(t.trace + t.denoise);
+    }
+    m_totalTimes.add(t.total);
+
+    if (m_timingsCsv.isOpen()) {
+        QTextStream s(&m_timingsCsv);
+        s << t.frame << ',' << t.stages << ',' << int(t.traced) << ','
+          << t.blas << ',' << t.tlas << ',' << t.trace << ',' << t.denoise << ',' << t.total << '\n';
+    }
+
+    // no need to update the item for every frame
+    if (m_timingsReportTimer.isValid() && m_timingsReportTimer.elapsed() < 250)
+        return;
+    m_timingsReportTimer.start();
+
+    QVariantMap timings;
+    timings[QLatin1String("blas")] = m_blasTimes.toMap();
+    timings[QLatin1String("tlas")] = m_tlasTimes.toMap();
+    timings[QLatin1String("trace")] = m_traceTimes.toMap();
+    timings[QLatin1String("denoise")] = m_denoiseTimes.toMap();
+    timings[QLatin1String("total")] = m_totalTimes.toMap();
+    timings[QLatin1String("frames")] = m_totalTimes.count();
+    timings[QLatin1String("rayQuery")] = raytracing.usesRayQuery();
+    CustomTextureItem *item = static_cast<CustomTextureItem *>(m_item);
+    QMetaObject::invokeMethod(item, [item, timings] {
+        item->setGpuTimings(timings);
+    }, Qt::QueuedConnection);
+}
+
+void CustomTextureNode::updateDynamicScale(double traceTime) // called on the render thread, the gui thread is not blocked
+{
+    // decide on the average of a number of frames, not on every spike
+    static const int FRAMES_PER_DECISION = 16;
+    static const qreal SCALE_STEP = 1.0 / 16; // changing the size is not free, so be coarse
+    static const qreal MIN_SCALE = 0.25;
+
+    m_scaleTraceTimeSum += traceTime;
+    m_scaleTraceTimeCount += 1;
+    if (m_scaleTraceTimeCount < FRAMES_PER_DECISION)
+        return;
+
+    const double avg = m_scaleTraceTimeSum / m_scaleTraceTimeCount;
+    m_scaleTraceTimeSum = 0;
+    m_scaleTraceTimeCount = 0;
+    if (avg <= 0.0)
+        return;
+
+    // the cost is proportional to the pixel count, i.e. the scale squared;
+    // move only halfway there to avoid oscillating
+    CustomTextureItem *item = static_cast<CustomTextureItem *>(m_item);
+    const qreal ideal = m_scale * qSqrt(m_targetFrameTime / avg);
+    qreal scale = m_scale + (ideal - m_scale) * 0.5;
+    // the item's scale may be below MIN_SCALE already
+    scale = qBound(qMin(MIN_SCALE, m_renderScale), qRound(scale / SCALE_STEP) * SCALE_STEP, m_renderScale);
+    if (qAbs(scale - m_dynamicScale) < SCALE_STEP * 0.5)
+        return;
+
+    qDebug("dynamic resolution: trace %.2f ms (target %.2f ms), scale %.3f -> %.3f",
+           avg, m_targetFrameTime, m_scale, scale);
+    m_dynamicScale = scale;
+    QMetaObject::invokeMethod(item, [item, scale] {
+        item->setEffectiveRenderScale(scale);
+    }, Qt::QueuedConnection);
+}
+
 #include "vktexitem.moc"
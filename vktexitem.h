@@ -2,17 +2,156 @@
 #define VKTEXITEM_H
 
 #include <QtQuick/QQuickItem>
+#include <QUrl>
+#include <QVariantMap>
 
 class CustomTextureNode;
 
 class CustomTextureItem : public QQuickItem
 {
     Q_OBJECT
+    Q_PROPERTY(QUrl source READ source WRITE setSource NOTIFY sourceChanged)
+    Q_PROPERTY(int instanceGrid READ instanceGrid WRITE setInstanceGrid NOTIFY instanceGridChanged)
+    Q_PROPERTY(qreal instanceRotation READ instanceRotation WRITE setInstanceRotation NOTIFY instanceRotationChanged)
+    Q_PROPERTY(bool deformable READ isDeformable WRITE setDeformable NOTIFY deformableChanged)
+    Q_PROPERTY(qreal deformPhase READ deformPhase WRITE setDeformPhase NOTIFY deformPhaseChanged)
+    Q_PROPERTY(qreal cameraYaw READ cameraYaw WRITE setCameraYaw NOTIFY cameraYawChanged)
+    Q_PROPERTY(qreal cameraPitch READ cameraPitch WRITE setCameraPitch NOTIFY cameraPitchChanged)
+    Q_PROPERTY(int samplesPerFrame READ samplesPerFrame WRITE setSamplesPerFrame NOTIFY samplesPerFrameChanged)
+    Q_PROPERTY(int maxSamples READ maxSamples WRITE setMaxSamples NOTIFY maxSamplesChanged)
+    Q_PROPERTY(int maxBounces READ maxBounces WRITE setMaxBounces NOTIFY maxBouncesChanged)
+    Q_PROPERTY(bool denoise READ denoise WRITE setDenoise NOTIFY denoiseChanged)
+    Q_PROPERTY(bool active READ isActive NOTIFY activeChanged)
+    Q_PROPERTY(int sampleCount READ sampleCount NOTIFY sampleCountChanged)
+    Q_PROPERTY(QVariantMap gpuTimings READ gpuTimings NOTIFY gpuTimingsChanged)
+    Q_PROPERTY(qreal renderScale READ renderScale WRITE setRenderScale NOTIFY renderScaleChanged)
+    Q_PROPERTY(bool dynamicResolution READ dynamicResolution WRITE setDynamicResolution NOTIFY dynamicResolutionChanged)
+    Q_PROPERTY(qreal targetFrameTime READ targetFrameTime WRITE setTargetFrameTime NOTIFY targetFrameTimeChanged)
+    Q_PROPERTY(qreal effectiveRenderScale READ effectiveRenderScale NOTIFY effectiveRenderScaleChanged)
+    Q_PROPERTY(qreal traceTimeBudget READ traceTimeBudget WRITE setTraceTimeBudget NOTIFY traceTimeBudgetChanged)
+    Q_PROPERTY(bool interleavedTrace READ interleavedTrace WRITE setInterleavedTrace NOTIFY interleavedTraceChanged)
+    Q_PROPERTY(bool rayQuery READ rayQuery WRITE setRayQuery NOTIFY rayQueryChanged)
+    Q_PROPERTY(int asyncQueueFamily READ asyncQueueFamily WRITE setAsyncQueueFamily NOTIFY asyncQueueFamilyChanged)
+    Q_PROPERTY(int asyncQueueIndex READ asyncQueueIndex WRITE setAsyncQueueIndex NOTIFY asyncQueueIndexChanged)
     QML_ELEMENT
 
 public:
     CustomTextureItem();
 
+    QUrl source() const { return m_source; }
+    void setSource(const QUrl &url);
+
+    int instanceGrid() const { return m_instanceGrid; }
+    void setInstanceGrid(int n);
+
+    qreal instanceRotation() const { return m_instanceRotation; }
+    void setInstanceRotation(qreal degrees);
+
+    bool isDeformable() const { return m_deformable; }
+    void setDeformable(bool enable);
+
+    qreal deformPhase() const { return m_deformPhase; }
+    void setDeformPhase(qreal phase);
+
+    qreal cameraYaw() const { return m_cameraYaw; }
+    void setCameraYaw(qreal degrees);
+
+    qreal cameraPitch() const { return m_cameraPitch; }
+    void setCameraPitch(qreal degrees);
+
+    int samplesPerFrame() const { return m_samplesPerFrame; }
+    void setSamplesPerFrame(int n);
+
+    int maxSamples() const { return m_maxSamples; }
+    void setMaxSamples(int n);
+
+    int maxBounces() const { return m_maxBounces; }
+    void setMaxBounces(int n);
+
+    // spatio-temporal denoising of the low sample count frames
+    bool denoise() const { return m_denoise; }
+    void setDenoise(bool enable);
+
+    // true while rays are being traced, false once the image is converged
+    // and nothing changes, the GPU is then left alone
+    bool isActive() const { return m_active; }
+    int sampleCount() const { return m_sampleCount; }
+
+    // GPU time of the recent frames in milliseconds: "blas", "tlas",
+    // "trace", "denoise" and "total", each a map with "min", "avg" and
+    // "p99", plus the number of frames in "frames". Updated a few times
+    // per second.
+    QVariantMap gpuTimings() const { return m_gpuTimings; }
+
+    // The rays are traced at the item's size in pixels times renderScale,
+    // the result is upscaled (linear filtering) when drawn. With
+    // dynamicResolution the scale is lowered (never above renderScale) to
+    // keep the GPU trace (and denoise) time of a frame near targetFrameTime
+    // milliseconds.
+    qreal renderScale() const { return m_renderScale; }
+    void setRenderScale(qreal scale);
+
+    bool dynamicResolution() const { return m_dynamicResolution; }
+    void setDynamicResolution(bool enable);
+
+    qreal targetFrameTime() const { return m_targetFrameTime; }
+    void setTargetFrameTime(qreal ms);
+
+    qreal effectiveRenderScale() const { return m_effectiveRenderScale; }
+
+    // With a traceTimeBudget (milliseconds, 0 = off) every frame traces only
+    // as much of the image as fits in that much GPU time, so expensive
+    // scenes do not hold up the rest of the scene. The image is refined in
+    // passes over a number of frames, in bands of rows, or with
+    // interleavedTrace in interleaved pixels spread over the whole image.
+    qreal traceTimeBudget() const { return m_traceTimeBudget; }
+    void setTraceTimeBudget(qreal ms);
+
+    bool interleavedTrace() const { return m_interleavedTrace; }
+    void setInterleavedTrace(bool enable);
+
+    // Traces with inline ray queries from a compute shader instead of the
+    // ray tracing pipeline, where the device supports VK_KHR_ray_query.
+    bool rayQuery() const { return m_rayQuery; }
+    void setRayQuery(bool enable);
+
+    // With a queue (family and index, -1 = none) the rays are traced on it
+    // instead of Qt Quick's queue, into a set of images of which the newest
+    // complete one is shown, so UI frames never wait for the trace. The
+    // device must have been created with the queue, see main.cpp. Only
+    // taken into account when the item is first rendered.
+    int asyncQueueFamily() const { return m_asyncQueueFamily; }
+    void setAsyncQueueFamily(int index);
+
+    int asyncQueueIndex() const { return m_asyncQueueIndex; }
+    void setAsyncQueueIndex(int index);
+
+signals:
+    void sourceChanged();
+    void instanceGridChanged();
+    void instanceRotationChanged();
+    void deformableChanged();
+    void deformPhaseChanged();
+    void cameraYawChanged();
+    void cameraPitchChanged();
+    void samplesPerFrameChanged();
+    void maxSamplesChanged();
+    void maxBouncesChanged();
+    void denoiseChanged();
+    void activeChanged();
+    void sampleCountChanged();
+    void gpuTimingsChanged();
+    void renderScaleChanged();
+    void dynamicResolutionChanged();
+    void targetFrameTimeChanged();
+    void effectiveRenderScaleChanged();
+    void traceTimeBudgetChanged();
+    void interleavedTraceChanged();
+    void rayQueryChanged();
+    void asyncQueueFamilyChanged();
+    void asyncQueueIndexChanged();
+    void rendered(); // emitted for every frame that actually traced rays
+
 protected:
     QSGNode *updatePaintNode(QSGNode *, UpdatePaintNodeData *) override;
     void geometryChange(const QRectF &newGeometry, const QRectF &oldGeometry) override;
@@ -22,8 +161,36 @@ private slots:
 
 private:
     void releaseResources() override;
+    void setRenderState(bool traced, bool active, int sampleCount);
+    void setGpuTimings(const QVariantMap &timings);
+    void setEffectiveRenderScale(qreal scale);
+
+    friend class CustomTextureNode;
 
     CustomTextureNode *m_node = nullptr;
+    QUrl m_source;
+    int m_instanceGrid = 1;
+    qreal m_instanceRotation = 0;
+    bool m_deformable = false;
+    qreal m_deformPhase = 0;
+    qreal m_cameraYaw = 0;
+    qreal m_cameraPitch = 0;
+    int m_samplesPerFrame = 1;
+    int m_maxSamples = 1024;
+    int m_maxBounces = 4;
+    bool m_denoise = false;
+    bool m_active = false;
+    int m_sampleCount = 0;
+    QVariantMap m_gpuTimings;
+    qreal m_renderScale = 1.0;
+    bool m_dynamicResolution = false;
+    qreal m_targetFrameTime = 8.0;
+    qreal m_effectiveRenderScale = 1.0;
+    qreal m_traceTimeBudget = 0;
+    bool m_interleavedTrace = false;
+    bool m_rayQuery = false;
+    int m_asyncQueueFamily = -1;
+    int m_asyncQueueIndex = -1;
 };
 
 #endif